@@ -42,3 +42,5 @@
 %VULKAN_SDK%/Bin/glslc.exe resources/shaders/hybridGBuffer.frag -o resources/shaders/spv/hybridGBuffer.frag.spv --target-spv=spv1.4  --target-env=vulkan1.2 
 
 %VULKAN_SDK%/Bin/glslc.exe resources/shaders/pathTracePreview.comp -o resources/shaders/spv/pathTracePreview.comp.spv --target-spv=spv1.4  --target-env=vulkan1.2 
+%VULKAN_SDK%/Bin/glslc.exe resources/shaders/pathTracePreview.comp -o resources/shaders/spv/pathTracePreviewCompressed.comp.spv -DCOMPRESSED_BVH --target-spv=spv1.4  --target-env=vulkan1.2 
+%VULKAN_SDK%/Bin/glslc.exe resources/shaders/pathTraceResolve.comp -o resources/shaders/spv/pathTraceResolve.comp.spv --target-spv=spv1.4  --target-env=vulkan1.2 
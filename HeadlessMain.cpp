@@ -0,0 +1,391 @@
+#include "src/App.h"
+#include "src/Scene.h"
+#include "src/Renderers/PathTraceCPURenderer.h"
+
+#include <stb_image_write.h>
+
+#include <chrono>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+
+//Offline rendering with the cpu path tracer, for render farms and performance regression runs.
+//No window and no vulkan device : the scene only keeps the data the cpu path tracer reads.
+
+static void PrintUsage()
+{
+    std::cout << "HeadlessRenderer <model> [options]" << std::endl
+              << "  --size <float>           scale of the model, 1 by default" << std::endl
+              << "  --width <int>            1920 by default" << std::endl
+              << "  --height <int>           1080 by default" << std::endl
+              << "  --spp <int>              samples per pixel, 64 by default" << std::endl
+              << "  --spf <int>              samples per pixel of each pass, 1 by default" << std::endl
+              << "  --time <seconds>         stops after that time even if the samples are not all rendered" << std::endl
+              << "  --camera <x,y,z>         camera position" << std::endl
+              << "  --target <x,y,z>         point the camera looks at" << std::endl
+              << "  --fov <degrees>" << std::endl
+              << "  --exposure <float>" << std::endl
+              << "  --integrator <megakernel|wavefront>" << std::endl
+              << "  --sampler <random|sobol|bluenoise>" << std::endl
+              << "  --output <file>          .png (tonemapped) or .exr (linear), can be repeated" << std::endl
+              << "  --texture-compression <on|off>  stores the scene textures in bc formats as the gpu renderers do, on by default" << std::endl
+              << "  --check <name>           runs a benchmark or check on the view instead of rendering, exits with 1 if it fails" << std::endl
+              << "HeadlessRenderer --check <name>" << std::endl
+              << "  runs the checks that need no model" << std::endl
+              << "Checks :" << std::endl
+              << "  watertight               rays at the shared edges of a closed mesh must all hit it, no model" << std::endl
+              << "  samplers                 sobol and blue noise must have less error than random, no model" << std::endl
+              << "  compression              bc textures must decode close to their source, and load back from the cache, no model" << std::endl
+              << "  traversal                all the bvh layouts and packet sizes must find the same hits" << std::endl
+              << "  occlusion                any hit and closest hit traversals must agree" << std::endl
+              << "  builds                   binned and spatial bvh builds must find the same hits" << std::endl
+              << "  wavefront                megakernel and wavefront integrators must render the same mean luminance" << std::endl
+              << "  textures                 texture rows and blocks must return the same texels" << std::endl
+              << "  all                      all the above, the ones on the view only with a model" << std::endl;
+}
+
+static const char *SceneFreeChecks[] = {"watertight", "samplers", "compression"};
+static const char *SceneChecks[] = {"traversal", "occlusion", "builds", "wavefront", "textures"};
+
+static bool IsCheck(const std::string &Name, const char **Checks, size_t Count)
+{
+    for(size_t i=0; i<Count; i++)
+    {
+        if(Name == Checks[i]) return true;
+    }
+    return false;
+}
+
+static bool RunCheck(const std::string &Name, pathTraceCPURenderer *Renderer)
+{
+    std::cout << "check " << Name << std::endl;
+    bool Passed = false;
+    if(Name == "watertight") Passed = pathTraceCPURenderer::CheckWatertight();
+    else if(Name == "samplers") Passed = pathTraceCPURenderer::CheckSamplers();
+    else if(Name == "compression") Passed = pathTraceCPURenderer::CheckTextureCompression();
+    else if(Name == "traversal") Passed = Renderer->BenchmarkTraversal();
+    else if(Name == "occlusion") Passed = Renderer->BenchmarkOcclusion();
+    else if(Name == "builds") Passed = Renderer->BenchmarkBuildModes();
+    else if(Name == "wavefront") Passed = Renderer->BenchmarkWavefront();
+    else if(Name == "textures") Passed = Renderer->BenchmarkTextures();
+    std::cout << "check " << Name << (Passed ? " passed" : " FAILED") << std::endl;
+    return Passed;
+}
+
+//Runs the checks of that name, or all of them, the ones on the view only when there is a Renderer. Returns the exit code.
+static int RunChecks(const std::string &Check, pathTraceCPURenderer *Renderer)
+{
+    int Result = 0;
+    for(const char *Name : SceneFreeChecks)
+    {
+        if((Check == "all" || Check == Name) && !RunCheck(Name, Renderer)) Result = 1;
+    }
+    if(Renderer)
+    {
+        for(const char *Name : SceneChecks)
+        {
+            if((Check == "all" || Check == Name) && !RunCheck(Name, Renderer)) Result = 1;
+        }
+    }
+    return Result;
+}
+
+static bool ParseVec3(const char *String, glm::vec3 &Value)
+{
+    return sscanf(String, "%f,%f,%f", &Value.x, &Value.y, &Value.z) == 3;
+}
+
+//False if the whole string is not a number
+static bool ParseFloat(const char *String, float &Value)
+{
+    char *End = nullptr;
+    errno = 0;
+    float Result = strtof(String, &End);
+    if(End == String || *End != '\0' || errno != 0 || !std::isfinite(Result)) return false;
+    Value = Result;
+    return true;
+}
+
+static bool ParseUInt(const char *String, uint32_t &Value)
+{
+    char *End = nullptr;
+    errno = 0;
+    unsigned long Result = strtoul(String, &End, 10);
+    if(End == String || *End != '\0' || errno != 0 || String[0] == '-' || Result > UINT32_MAX) return false;
+    Value = (uint32_t)Result;
+    return true;
+}
+
+static bool EndsWith(const std::string &String, const std::string &End)
+{
+    return String.size() >= End.size() && String.compare(String.size() - End.size(), End.size(), End) == 0;
+}
+
+template<typename T>
+static void Write(std::ofstream &File, const T &Value)
+{
+    File.write((const char*)&Value, sizeof(T));
+}
+
+static void WriteAttribute(std::ofstream &File, const char *Name, const char *Type, uint32_t Size)
+{
+    File.write(Name, strlen(Name) + 1);
+    File.write(Type, strlen(Type) + 1);
+    Write(File, Size);
+}
+
+//Uncompressed scanline OpenEXR with 32 bit float RGB channels
+static bool WriteEXR(const std::string &FileName, const std::vector<glm::vec3> &Pixels, uint32_t Width, uint32_t Height)
+{
+    std::ofstream File(FileName, std::ios::binary);
+    if(!File) return false;
+
+    Write(File, (uint32_t)20000630);
+    Write(File, (uint32_t)2);
+
+    //Channels are sorted by name
+    const char *Channels[] = {"B", "G", "R"};
+    WriteAttribute(File, "channels", "chlist", 3 * 18 + 1);
+    for(int i=0; i<3; i++)
+    {
+        File.write(Channels[i], 2);
+        Write(File, (int32_t)2); //FLOAT
+        Write(File, (uint32_t)0); //pLinear and reserved
+        Write(File, (int32_t)1);
+        Write(File, (int32_t)1);
+    }
+    Write(File, (uint8_t)0);
+
+    WriteAttribute(File, "compression", "compression", 1);
+    Write(File, (uint8_t)0);
+    int32_t Window[4] = {0, 0, (int32_t)Width - 1, (int32_t)Height - 1};
+    WriteAttribute(File, "dataWindow", "box2i", 16);
+    File.write((const char*)Window, 16);
+    WriteAttribute(File, "displayWindow", "box2i", 16);
+    File.write((const char*)Window, 16);
+    WriteAttribute(File, "lineOrder", "lineOrder", 1);
+    Write(File, (uint8_t)0);
+    WriteAttribute(File, "pixelAspectRatio", "float", 4);
+    Write(File, 1.0f);
+    WriteAttribute(File, "screenWindowCenter", "v2f", 8);
+    Write(File, 0.0f);
+    Write(File, 0.0f);
+    WriteAttribute(File, "screenWindowWidth", "float", 4);
+    Write(File, 1.0f);
+    Write(File, (uint8_t)0);
+
+    //Offset table, then one block per scanline : y, size, and each channel of the line
+    uint32_t LineSize = Width * 3 * sizeof(float);
+    uint64_t Offset = (uint64_t)File.tellp() + (uint64_t)Height * sizeof(uint64_t);
+    for(uint32_t y=0; y<Height; y++)
+    {
+        Write(File, Offset);
+        Offset += 8 + LineSize;
+    }
+
+    std::vector<float> Line(Width * 3);
+    for(uint32_t y=0; y<Height; y++)
+    {
+        for(uint32_t x=0; x<Width; x++)
+        {
+            const glm::vec3 &Pixel = Pixels[y * Width + x];
+            Line[x] = Pixel.b;
+            Line[Width + x] = Pixel.g;
+            Line[Width * 2 + x] = Pixel.r;
+        }
+        Write(File, (int32_t)y);
+        Write(File, LineSize);
+        File.write((const char*)Line.data(), LineSize);
+    }
+    return (bool)File;
+}
+
+static bool WritePNG(const std::string &FileName, const std::vector<pathTraceCPURenderer::rgba8> &Pixels, uint32_t Width, uint32_t Height)
+{
+    std::vector<uint8_t> RGBA(Pixels.size() * 4);
+    for(size_t i=0; i<Pixels.size(); i++)
+    {
+        RGBA[i * 4 + 0] = Pixels[i].r;
+        RGBA[i * 4 + 1] = Pixels[i].g;
+        RGBA[i * 4 + 2] = Pixels[i].b;
+        RGBA[i * 4 + 3] = 255;
+    }
+    return stbi_write_png(FileName.c_str(), (int)Width, (int)Height, 4, RGBA.data(), (int)Width * 4) != 0;
+}
+
+int main(int argc, char* argv[])
+{
+    if(argc < 2)
+    {
+        PrintUsage();
+        return 1;
+    }
+
+    //The model can only be left out by the checks
+    bool HasModel = strncmp(argv[1], "--", 2) != 0;
+    std::string ModelFile = HasModel ? argv[1] : "";
+    std::string Check;
+    float ModelSize = 1.0f;
+    uint32_t Width = 1920;
+    uint32_t Height = 1080;
+    uint32_t Samples = 64;
+    uint32_t SamplesPerPass = 1;
+    float TimeBudget = 0;
+    bool HasCamera=false, HasTarget=false;
+    glm::vec3 CameraPosition(0, 0, 5), CameraTarget(0);
+    float Fov = 0;
+    float Exposure = 1;
+    int Integrator = 0;
+    int SamplerType = (int)samplerType::Sobol;
+    std::vector<std::string> Outputs;
+    bool CompressTextures = true;
+
+    for(int i=HasModel ? 2 : 1; i<argc; i++)
+    {
+        std::string Argument = argv[i];
+        if(i + 1 >= argc)
+        {
+            std::cout << "Missing value for " << Argument << std::endl;
+            PrintUsage();
+            return 1;
+        }
+        const char *Value = argv[++i];
+
+        bool Valid = true;
+        if(Argument == "--size") Valid = ParseFloat(Value, ModelSize) && ModelSize > 0;
+        else if(Argument == "--width") Valid = ParseUInt(Value, Width);
+        else if(Argument == "--height") Valid = ParseUInt(Value, Height);
+        else if(Argument == "--spp") Valid = ParseUInt(Value, Samples);
+        else if(Argument == "--spf") Valid = ParseUInt(Value, SamplesPerPass);
+        else if(Argument == "--time") Valid = ParseFloat(Value, TimeBudget) && TimeBudget >= 0;
+        else if(Argument == "--camera") Valid = HasCamera = ParseVec3(Value, CameraPosition);
+        else if(Argument == "--target") Valid = HasTarget = ParseVec3(Value, CameraTarget);
+        else if(Argument == "--fov") Valid = ParseFloat(Value, Fov) && Fov > 0 && Fov < 180;
+        else if(Argument == "--exposure") Valid = ParseFloat(Value, Exposure);
+        else if(Argument == "--integrator")
+        {
+            std::string Name = Value;
+            Valid = Name == "megakernel" || Name == "wavefront";
+            Integrator = Name == "wavefront" ? 1 : 0;
+        }
+        else if(Argument == "--sampler")
+        {
+            std::string Name = Value;
+            if(Name == "random") SamplerType = (int)samplerType::Random;
+            else if(Name == "sobol") SamplerType = (int)samplerType::Sobol;
+            else if(Name == "bluenoise") SamplerType = (int)samplerType::BlueNoise;
+            else Valid = false;
+        }
+        else if(Argument == "--output") Outputs.push_back(Value);
+        else if(Argument == "--texture-compression")
+        {
+            std::string Name = Value;
+            Valid = Name == "on" || Name == "off";
+            CompressTextures = Name == "on";
+        }
+        else if(Argument == "--check")
+        {
+            Check = Value;
+            Valid = Check == "all" || IsCheck(Check, SceneFreeChecks, std::size(SceneFreeChecks)) || IsCheck(Check, SceneChecks, std::size(SceneChecks));
+        }
+        else Valid = false;
+
+        if(!Valid || Width == 0 || Height == 0 || Samples == 0 || SamplesPerPass == 0)
+        {
+            std::cout << "Invalid argument " << Argument << " " << Value << std::endl;
+            PrintUsage();
+            return 1;
+        }
+    }
+    if(!HasModel)
+    {
+        if(Check.empty() || IsCheck(Check, SceneChecks, std::size(SceneChecks)))
+        {
+            std::cout << (Check.empty() ? "Missing model" : "The check " + Check + " needs a model") << std::endl;
+            PrintUsage();
+            return 1;
+        }
+        return RunChecks(Check, nullptr);
+    }
+    if(Outputs.empty()) Outputs.push_back("render.png");
+
+    //The vulkan handles stay null, the texture loader then only keeps the cpu copies
+    vulkanApp App;
+    App.Width = Width;
+    App.Height = Height;
+    App.RayTracing = false;
+    App.CompressTextures = CompressTextures;
+    App.VulkanObjects.VulkanDevice = nullptr;
+    App.VulkanObjects.Device = VK_NULL_HANDLE;
+    App.VulkanObjects.Queue = VK_NULL_HANDLE;
+    App.VulkanObjects.CommandPool = VK_NULL_HANDLE;
+    App.VulkanObjects.TextureLoader = new textureLoader(nullptr, VK_NULL_HANDLE, VK_NULL_HANDLE);
+    //Outside of the viewport, so the tiles start from the center
+    App.Mouse.PosX = -1;
+    App.Mouse.PosY = -1;
+
+    auto LoadStart = std::chrono::high_resolution_clock::now();
+    App.Scene = new scene(&App);
+    App.Scene->LoadHeadless(ModelFile, ModelSize);
+    if(App.Scene->InstancesPointers.empty())
+    {
+        std::cout << "No mesh loaded from " << ModelFile << std::endl;
+        return 1;
+    }
+
+    camera &Camera = App.Scene->Camera;
+    if(HasCamera || HasTarget) Camera.SetLookAt(CameraPosition, CameraTarget);
+    if(Fov > 0) Camera.SetFov(Fov);
+    Camera.SetAspectRatio((float)Width / (float)Height);
+    App.Scene->UBOSceneMatrices.Exposure = Exposure;
+
+    pathTraceCPURenderer Renderer(&App);
+    Renderer.TotalSamples = Samples;
+    Renderer.SamplesPerFrame = SamplesPerPass;
+    Renderer.Integrator = Integrator;
+    Renderer.SamplerType = SamplerType;
+    Renderer.SetupScene();
+    float LoadSeconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - LoadStart).count();
+
+    if(!Check.empty())
+    {
+        int Result = RunChecks(Check, &Renderer);
+        Renderer.DestroyScene();
+        return Result;
+    }
+
+    auto RenderStart = std::chrono::high_resolution_clock::now();
+    uint32_t SamplesRendered = Renderer.RenderOffline(TimeBudget);
+    float RenderSeconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - RenderStart).count();
+
+    //Single line, easy to parse for the regression runs
+    double PixelSamples = (double)Width * Height * SamplesRendered;
+    std::cout << "scene " << ModelFile << " resolution " << Width << "x" << Height << " spp " << SamplesRendered
+              << " load_s " << LoadSeconds << " render_s " << RenderSeconds
+              << " msamples_per_s " << (RenderSeconds > 0 ? PixelSamples / RenderSeconds / 1e6 : 0) << std::endl;
+
+    int Result = 0;
+    std::vector<glm::vec3> Radiance;
+    Renderer.GetRadiance(Radiance);
+    for(size_t i=0; i<Outputs.size(); i++)
+    {
+        bool Written = false;
+        if(EndsWith(Outputs[i], ".exr")) Written = WriteEXR(Outputs[i], Radiance, Width, Height);
+        else if(EndsWith(Outputs[i], ".png")) Written = WritePNG(Outputs[i], Renderer.Image, Width, Height);
+        else std::cout << "Unknown output format " << Outputs[i] << ", use .png or .exr" << std::endl;
+
+        if(!Written)
+        {
+            std::cout << "Could not write " << Outputs[i] << std::endl;
+            Result = 1;
+        }
+    }
+
+    Renderer.DestroyScene();
+    return Result;
+}
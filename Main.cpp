@@ -46,7 +46,11 @@ int main(int argc, char* argv[])
     if(argc == 1) return 0;
     std::string ModelFile = argv[1];
     float ModelSize = 1.0f;
-    if(argc>=3) ModelSize = std::stof(argv[2]);
+    for(int i=2; i<argc; i++)
+    {
+        if(std::string(argv[i]) == "--no-texture-compression") App.CompressTextures=false;
+        else ModelSize = std::stof(argv[i]);
+    }
     
 
     int Width = 1920;
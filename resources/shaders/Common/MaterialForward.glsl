@@ -47,6 +47,9 @@ struct normalInfo {
 };
 
 // Get normal, tangent and bitangent vectors.
+//Read from the spv by textureList, see NORMAL_MAP_VERSION_TWO_CHANNELS in Resources.cpp
+layout (constant_id = 100) const uint SHADER_VERSION = 1;
+
 normalInfo getNormalInfo()
 {
     vec3 n, t, b, ng;
@@ -59,10 +62,12 @@ normalInfo getNormalInfo()
     info.ng = ng;
     info.n = ng;
 
-    if(HAS_NORMAL_MAP>0 && MaterialUBO.Material.UseNormalMap >0)
+    //The version test is always true, it keeps the constant in optimized binaries
+    if(HAS_NORMAL_MAP>0 && MaterialUBO.Material.UseNormalMap >0 && SHADER_VERSION > 0)
     {
-        info.ntex = texture(samplerNormal, FragUv).rgb * 2.0 - vec3(1.0);
-        info.ntex = normalize(info.ntex);
+        //Normal maps can be BC5 : only x and y are stored
+        vec2 NormalXY = texture(samplerNormal, FragUv).rg * 2.0 - vec2(1.0);
+        info.ntex = normalize(vec3(NormalXY, sqrt(max(1.0 - dot(NormalXY, NormalXY), 0.0))));
         info.n = normalize(mat3(t, b, ng) * info.ntex);
     }
 
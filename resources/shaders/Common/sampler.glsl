@@ -0,0 +1,134 @@
+// Same code as pathSampler in src/Sampler.cpp, see there for the details. Needs random.glsl.
+
+#define SAMPLER_RANDOM 0
+#define SAMPLER_SOBOL 1
+#define SAMPLER_BLUE_NOISE 2
+
+//Dimensions of a sample : the camera, then SAMPLER_BOUNCE_DIMENSIONS for each bounce
+#define SAMPLER_CAMERA 0
+#define SAMPLER_LIGHT_PICK 0
+#define SAMPLER_LIGHT_POINT 1
+#define SAMPLER_LIGHT_TREE 2
+#define SAMPLER_SUN 3
+#define SAMPLER_ROULETTE 4
+#define SAMPLER_LOBE 5
+#define SAMPLER_BRDF 6
+#define SAMPLER_BOUNCE_DIMENSIONS 7
+
+struct pathSampler
+{
+    uint Type;
+    uvec2 Pixel;
+    uint SampleIndex;
+    uint PixelSeed;
+    uint BaseDimension;
+    uint RandomState;
+};
+
+uint SamplerHash(uint Value)
+{
+    Value ^= Value >> 16;
+    Value *= 0x7feb352du;
+    Value ^= Value >> 15;
+    Value *= 0x846ca68bu;
+    Value ^= Value >> 16;
+    return Value;
+}
+
+uint HashCombine(uint Seed, uint Value)
+{
+    return Seed ^ (Value + (Seed << 6) + (Seed >> 2));
+}
+
+//24 bits, so the float is always below 1
+float ToUnitFloat(uint Value)
+{
+    return float(Value >> 8) * (1.0f / 16777216.0f);
+}
+
+uint NestedUniformScramble(uint Value, uint Seed)
+{
+    Value = bitfieldReverse(Value);
+    Value += Seed;
+    Value ^= Value * 0x6c50b47cu;
+    Value ^= Value * 0xb82f1e52u;
+    Value ^= Value * 0xc7afe638u;
+    Value ^= Value * 0x8d22f6e6u;
+    return bitfieldReverse(Value);
+}
+
+uint SobolDimension1(uint Index)
+{
+    uint Result = 0;
+    uint Direction = 0x80000000u;
+    for(; Index != 0; Index >>= 1)
+    {
+        if((Index & 1u) != 0) Result ^= Direction;
+        Direction ^= Direction >> 1;
+    }
+    return Result;
+}
+
+void SamplerStart(inout pathSampler Sampler, uint Type, uvec2 Pixel, uint SampleIndex)
+{
+    Sampler.Type = Type;
+    Sampler.Pixel = Pixel;
+    Sampler.SampleIndex = SampleIndex;
+    Sampler.BaseDimension = 0;
+    Sampler.PixelSeed = Type == SAMPLER_BLUE_NOISE ? 0x9e3779b9u : SamplerHash(Pixel.x + SamplerHash(Pixel.y));
+    Sampler.RandomState = (Pixel.x * 1973u + Pixel.y * 9277u + SampleIndex * 26699u) | 1u;
+}
+
+void SamplerStartBounce(inout pathSampler Sampler, uint Bounce)
+{
+    Sampler.BaseDimension = SAMPLER_CAMERA + 1 + Bounce * SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+uint SobolIndex(pathSampler Sampler, uint Dimension, out uint Seed)
+{
+    Seed = HashCombine(Sampler.PixelSeed, SamplerHash(Dimension));
+    return NestedUniformScramble(Sampler.SampleIndex, Seed);
+}
+
+uint BlueNoiseShift(pathSampler Sampler, uint Dimension)
+{
+    float PixelX = float(Sampler.Pixel.x) + 5.588238f * float(Dimension);
+    float PixelY = float(Sampler.Pixel.y) + 5.588238f * float(Dimension);
+    float Gradient = fract(0.06711056f * PixelX + 0.00583715f * PixelY);
+    float Noise = fract(52.9829189f * Gradient);
+    return uint(Noise * 16777216.0f) << 8;
+}
+
+float Sample1D(inout pathSampler Sampler, uint Dimension)
+{
+    if(Sampler.Type == SAMPLER_RANDOM) return ToUnitFloat(wang_hash(Sampler.RandomState));
+
+    Dimension += Sampler.BaseDimension;
+    uint Seed;
+    uint Index = SobolIndex(Sampler, Dimension, Seed);
+    uint SampleX = NestedUniformScramble(bitfieldReverse(Index), HashCombine(Seed, 0));
+    if(Sampler.Type == SAMPLER_BLUE_NOISE) SampleX += BlueNoiseShift(Sampler, Dimension * 2);
+    return ToUnitFloat(SampleX);
+}
+
+vec2 Sample2D(inout pathSampler Sampler, uint Dimension)
+{
+    if(Sampler.Type == SAMPLER_RANDOM)
+    {
+        float Random0 = ToUnitFloat(wang_hash(Sampler.RandomState));
+        float Random1 = ToUnitFloat(wang_hash(Sampler.RandomState));
+        return vec2(Random0, Random1);
+    }
+
+    Dimension += Sampler.BaseDimension;
+    uint Seed;
+    uint Index = SobolIndex(Sampler, Dimension, Seed);
+    uint SampleX = NestedUniformScramble(bitfieldReverse(Index), HashCombine(Seed, 0));
+    uint SampleY = NestedUniformScramble(SobolDimension1(Index), HashCombine(Seed, 1));
+    if(Sampler.Type == SAMPLER_BLUE_NOISE)
+    {
+        SampleX += BlueNoiseShift(Sampler, Dimension * 2);
+        SampleY += BlueNoiseShift(Sampler, Dimension * 2 + 1);
+    }
+    return vec2(ToUnitFloat(SampleX), ToUnitFloat(SampleY));
+}
@@ -6,5 +6,12 @@ struct Ubo {
 
 	int MaxSamples;
 	int ShouldAccumulate;
-	ivec2 Padding;
+	int AdaptiveSampling;
+	float NoiseThreshold;
+
+	//SAMPLER_* in sampler.glsl
+	int SamplerType;
+	int Padding0;
+	int Padding1;
+	int Padding2;
 };
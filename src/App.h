@@ -98,6 +98,8 @@ public:
     float GuiWidth=200;
 
     bool RayTracing=true;
+    //Block compresses the scene textures when the device supports it. Off with --no-texture-compression.
+    bool CompressTextures=true;
 
     std::string ModelFile = "";
     float ModelSize = 1.0f;
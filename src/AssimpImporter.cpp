@@ -54,6 +54,7 @@ void Load(std::string FileName,  std::unordered_map<int, std::vector<instance>>
 				{
 					Materials[i].Diffuse = Textures->Get(TextureFileName);
 				}
+				Materials[i].Diffuse.SetColorSpace(colorSpace::SRGB);
 			}
 			else
 			{
@@ -0,0 +1,216 @@
+#include "BVHCache.h"
+#include "bvh.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <filesystem>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define BVH_CACHE_MAGIC 0x43485642 //"BVHC"
+//Bump when the file format or the build changes the nodes it writes
+#define BVH_CACHE_VERSION 2
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+//Followed by the nodes, the triangle indices and the triangles
+struct bvhCacheHeader
+{
+    uint32_t Magic;
+    uint32_t Version;
+    uint64_t Hash;
+    uint32_t TriangleCount;
+    uint32_t NodeCount;
+    uint32_t IndexCount;
+    float BuildSAHCost;
+};
+
+//Read only mapping of a whole file
+struct mappedFile
+{
+    const uint8_t *Data=nullptr;
+    size_t Size=0;
+#ifdef _WIN32
+    HANDLE File=INVALID_HANDLE_VALUE;
+    HANDLE Mapping=nullptr;
+#else
+    int File=-1;
+#endif
+
+    bool Open(const std::string &FileName);
+    void Close();
+    ~mappedFile() { Close(); }
+};
+
+bool mappedFile::Open(const std::string &FileName)
+{
+#ifdef _WIN32
+    File = CreateFileA(FileName.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if(File == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER FileSize;
+    if(!GetFileSizeEx(File, &FileSize) || FileSize.QuadPart == 0) return false;
+    Size = (size_t)FileSize.QuadPart;
+    Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if(Mapping == nullptr) return false;
+    Data = (const uint8_t*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+    File = open(FileName.c_str(), O_RDONLY);
+    if(File < 0) return false;
+    struct stat Stat;
+    if(fstat(File, &Stat) != 0 || Stat.st_size == 0) return false;
+    Size = (size_t)Stat.st_size;
+    void *Mapped = mmap(nullptr, Size, PROT_READ, MAP_PRIVATE, File, 0);
+    if(Mapped == MAP_FAILED) return false;
+    Data = (const uint8_t*)Mapped;
+#endif
+    return Data != nullptr;
+}
+
+void mappedFile::Close()
+{
+#ifdef _WIN32
+    if(Data) UnmapViewOfFile(Data);
+    if(Mapping) CloseHandle(Mapping);
+    if(File != INVALID_HANDLE_VALUE) CloseHandle(File);
+    Mapping = nullptr;
+    File = INVALID_HANDLE_VALUE;
+#else
+    if(Data) munmap((void*)Data, Size);
+    if(File >= 0) close(File);
+    File = -1;
+#endif
+    Data = nullptr;
+    Size = 0;
+}
+
+static std::string CacheFileName(uint64_t Hash)
+{
+    char Name[32];
+    snprintf(Name, sizeof(Name), "%016llx.bvh", (unsigned long long)Hash);
+    return std::string(BVH_CACHE_DIRECTORY) + Name;
+}
+
+//FNV-1a, one 32 bit word at a time
+static uint64_t HashWords(uint64_t Hash, const void *Data, size_t Size)
+{
+    const uint8_t *Bytes = (const uint8_t*)Data;
+    for(size_t i=0; i + 4 <= Size; i+=4)
+    {
+        uint32_t Word;
+        memcpy(&Word, Bytes + i, 4);
+        Hash ^= Word;
+        Hash *= FNV_PRIME;
+    }
+    return Hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+uint64_t bvhCache::HashIndices(const std::vector<uint32_t> &Indices)
+{
+    return HashWords(FNV_OFFSET_BASIS, Indices.data(), Indices.size() * sizeof(uint32_t));
+}
+
+uint64_t bvhCache::Hash(bvh *BVH)
+{
+    //Layout of the file content, so a change in the structs never reads an old file with the wrong size
+    uint32_t Layout[] = {BVH_CACHE_MAGIC, BVH_CACHE_VERSION, (uint32_t)sizeof(bvhNode), (uint32_t)sizeof(triangle)};
+    uint64_t Result = HashWords(FNV_OFFSET_BASIS, Layout, sizeof(Layout));
+    Result = HashWords(Result, &BVH->Mesh->IndicesHash, sizeof(uint64_t));
+
+    std::vector<triangle> &Triangles = BVH->Mesh->Triangles;
+    for(size_t i=0; i<Triangles.size(); i++)
+    {
+        Result = HashWords(Result, &Triangles[i].v0, sizeof(glm::vec3));
+        Result = HashWords(Result, &Triangles[i].v1, sizeof(glm::vec3));
+        Result = HashWords(Result, &Triangles[i].v2, sizeof(glm::vec3));
+    }
+
+    uint32_t BuildMode = (uint32_t)BVH->BuildMode;
+    Result = HashWords(Result, &BuildMode, sizeof(uint32_t));
+    if(BVH->BuildMode == bvhBuildMode::Spatial)
+    {
+        Result = HashWords(Result, &BVH->SpatialSplitBudget, sizeof(float));
+        Result = HashWords(Result, &BVH->SpatialSplitAlpha, sizeof(float));
+    }
+    return Result;
+}
+
+bool bvhCache::Load(bvh *BVH, uint64_t Hash)
+{
+    mappedFile File;
+    if(!File.Open(CacheFileName(Hash))) return false;
+    if(File.Size < sizeof(bvhCacheHeader)) return false;
+
+    bvhCacheHeader Header;
+    memcpy(&Header, File.Data, sizeof(bvhCacheHeader));
+    std::vector<triangle> &Triangles = BVH->Mesh->Triangles;
+    if(Header.Magic != BVH_CACHE_MAGIC || Header.Version != BVH_CACHE_VERSION || Header.Hash != Hash) return false;
+    if(Header.TriangleCount != Triangles.size() || Header.NodeCount == 0) return false;
+
+    size_t NodesSize = (size_t)Header.NodeCount * sizeof(bvhNode);
+    size_t IndicesSize = (size_t)Header.IndexCount * sizeof(uint32_t);
+    size_t TrianglesSize = (size_t)Header.TriangleCount * sizeof(triangle);
+    if(File.Size != sizeof(bvhCacheHeader) + NodesSize + IndicesSize + TrianglesSize) return false;
+
+    const uint8_t *Data = File.Data + sizeof(bvhCacheHeader);
+    BVH->BVHNodes.resize(Header.NodeCount);
+    memcpy((void*)BVH->BVHNodes.data(), Data, NodesSize);
+    Data += NodesSize;
+    BVH->TriangleIndices.resize(Header.IndexCount);
+    memcpy(BVH->TriangleIndices.data(), Data, IndicesSize);
+    Data += IndicesSize;
+    //Same vertices as the hash matched, but with the centroids computed by the build
+    memcpy((void*)Triangles.data(), Data, TrianglesSize);
+
+    BVH->NodesUsed = Header.NodeCount;
+    BVH->BuildSAHCost = Header.BuildSAHCost;
+    return true;
+}
+
+void bvhCache::Save(bvh *BVH, uint64_t Hash)
+{
+    std::error_code Error;
+    std::filesystem::create_directories(BVH_CACHE_DIRECTORY, Error);
+
+    bvhCacheHeader Header = {};
+    Header.Magic = BVH_CACHE_MAGIC;
+    Header.Version = BVH_CACHE_VERSION;
+    Header.Hash = Hash;
+    Header.TriangleCount = (uint32_t)BVH->Mesh->Triangles.size();
+    Header.NodeCount = BVH->NodesUsed;
+    Header.IndexCount = (uint32_t)BVH->TriangleIndices.size();
+    Header.BuildSAHCost = BVH->BuildSAHCost;
+
+    //Written next to the final file and renamed, so a crash never leaves a truncated cache
+    std::string FileName = CacheFileName(Hash);
+    std::string TempFileName = FileName + ".tmp";
+    FILE *FP = fopen(TempFileName.c_str(), "wb");
+    if(!FP) return;
+    bool Written = fwrite(&Header, sizeof(bvhCacheHeader), 1, FP) == 1;
+    Written &= fwrite(BVH->BVHNodes.data(), sizeof(bvhNode), Header.NodeCount, FP) == Header.NodeCount;
+    Written &= fwrite(BVH->TriangleIndices.data(), sizeof(uint32_t), Header.IndexCount, FP) == Header.IndexCount;
+    Written &= fwrite(BVH->Mesh->Triangles.data(), sizeof(triangle), Header.TriangleCount, FP) == Header.TriangleCount;
+    fclose(FP);
+
+    if(Written)
+    {
+        std::filesystem::rename(TempFileName, FileName, Error);
+    }
+    if(!Written || Error)
+    {
+        std::filesystem::remove(TempFileName, Error);
+    }
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+struct bvh;
+
+//Built bvhs are saved in that folder, one file per mesh content
+#define BVH_CACHE_DIRECTORY "cache/bvh/"
+
+//Binary cache of the bvh nodes, triangle indices and triangles of a mesh.
+//Files are named after a hash of the mesh triangles, its indices, the build settings and the file layout, 
+//so any change in the model, in the settings or in the node and triangle structs misses the cache.
+namespace bvhCache
+{
+    //FNV-1a over the triangle vertices, mesh::IndicesHash, the build settings and the file layout
+    uint64_t Hash(bvh *BVH);
+    //FNV-1a of the index buffer of a mesh, kept in mesh::IndicesHash
+    uint64_t HashIndices(const std::vector<uint32_t> &Indices);
+
+    //Memory maps the cache file and copies it into the bvh and its mesh. Returns false if there is no valid file.
+    bool Load(bvh *BVH, uint64_t Hash);
+    void Save(bvh *BVH, uint64_t Hash);
+}
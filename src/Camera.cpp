@@ -8,6 +8,12 @@ void camera::RecalculateLookat() {
 }
 
 
+void camera::SetLookAt(glm::vec3 Position, glm::vec3 Target) {
+    target = Target;
+    distance = glm::length(Position - Target);
+    SetSphericalPosition((Position - Target) / distance);
+}
+
 void camera::mousePressEvent(int button) {
     if(Locked) return;
     if(button==0) {
@@ -30,6 +30,8 @@ public:
     void SetFarPlane(float _farPlane) {this->farPlane = _farPlane; RecalculateProjectionMatrix();}
     void SetAspectRatio(float _aspectRatio) {this->aspectRatio = _aspectRatio; RecalculateProjectionMatrix();}
     void SetDistance(float _distance) {this->distance = _distance; RecalculateLookat();}
+    //Orbits around Target, from Position
+    void SetLookAt(glm::vec3 Position, glm::vec3 Target);
     void SetSphericalPosition(glm::vec3 _position) {
         this->sphericalPosition = _position; 
         theta =  atan2(sqrt(sphericalPosition.x * sphericalPosition.x  + sphericalPosition.z * sphericalPosition.z), sphericalPosition.y);
@@ -0,0 +1,190 @@
+#include "CompressedBVH.h"
+#include "bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+//Float with that biased exponent and a zero mantissa. Exact, and the same as uintBitsToFloat(Exponent << 23) in the shader.
+static float StepSize(uint32_t Exponent)
+{
+    uint32_t Bits = Exponent << 23;
+    float Result;
+    memcpy(&Result, &Bits, sizeof(float));
+    return Result;
+}
+
+void compressedBvhNode::DecodeChildBounds(uint32_t Child, glm::vec3 &AABBMin, glm::vec3 &AABBMax) const
+{
+    const uint8_t *Bounds = &ChildBounds[Child * 6];
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        float Step = StepSize((Info >> (Axis * 8)) & 0xff);
+        AABBMin[Axis] = Origin[Axis] + (float)Bounds[Axis] * Step;
+        AABBMax[Axis] = Origin[Axis] + (float)Bounds[3 + Axis] * Step;
+    }
+}
+
+//Smallest power of 2 step so that 255 steps from Min cover Max
+static uint32_t FindStepExponent(float Min, float Max)
+{
+    int Exponent;
+    std::frexp(std::max(Max - Min, 1e-30f) / 255.0f, &Exponent);
+    uint32_t Biased = (uint32_t)std::max(1, std::min(254, Exponent + 127 - 1));
+    while(Biased < 254 && Min + 255.0f * StepSize(Biased) < Max) Biased++;
+    return Biased;
+}
+
+//Rounds outwards, so the decoded child always contains the full precision one
+static void QuantizeChild(float Origin, float Step, float Min, float Max, uint8_t &QuantizedMin, uint8_t &QuantizedMax)
+{
+    int QMin = std::max(0, std::min(255, (int)std::floor((Min - Origin) / Step)));
+    int QMax = std::max(0, std::min(255, (int)std::ceil((Max - Origin) / Step)));
+    while(QMin > 0 && Origin + QMin * Step > Min) QMin--;
+    while(QMax < 255 && Origin + QMax * Step < Max) QMax++;
+    QuantizedMin = (uint8_t)QMin;
+    QuantizedMax = (uint8_t)QMax;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+void compressedBvh::Build(bvh *_BVH)
+{
+    this->BVH = _BVH;
+    std::vector<bvhNode> &BinaryNodes = BVH->BVHNodes;
+
+    Nodes.resize(BVH->NodesUsed);
+    for(uint32_t i=0; i<BVH->NodesUsed; i++)
+    {
+        bvhNode &Node = BinaryNodes[i];
+        compressedBvhNode &CompressedNode = Nodes[i];
+        CompressedNode = {};
+        CompressedNode.Origin = Node.AABBMin;
+        CompressedNode.LeftChildOrFirst = Node.LeftChildOrFirst;
+        if(Node.IsLeaf())
+        {
+            CompressedNode.Info = Node.TriangleCount | COMPRESSED_LEAF_BIT;
+            continue;
+        }
+
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            uint32_t Exponent = FindStepExponent(Node.AABBMin[Axis], Node.AABBMax[Axis]);
+            CompressedNode.Info |= Exponent << (Axis * 8);
+            float Step = StepSize(Exponent);
+            for(uint32_t Child=0; Child<2; Child++)
+            {
+                bvhNode &ChildNode = BinaryNodes[Node.LeftChildOrFirst + Child];
+                QuantizeChild(Node.AABBMin[Axis], Step, ChildNode.AABBMin[Axis], ChildNode.AABBMax[Axis],
+                              CompressedNode.ChildBounds[Child * 6 + Axis], CompressedNode.ChildBounds[Child * 6 + 3 + Axis]);
+            }
+        }
+    }
+
+    std::vector<triangle> &MeshTriangles = BVH->Mesh->Triangles;
+    Triangles.resize(MeshTriangles.size());
+    for(size_t i=0; i<MeshTriangles.size(); i++)
+    {
+        Triangles[i].v0 = MeshTriangles[i].v0;
+        Triangles[i].v1 = MeshTriangles[i].v1;
+        Triangles[i].v2 = MeshTriangles[i].v2;
+    }
+}
+
+bool compressedBvh::Occluded(ray Ray, float MaxDistance)
+{
+    watertightRay WatertightRay(Ray);
+    rayPayload RayPayload {};
+    RayPayload.Distance = MaxDistance;
+    compressedBvhNode *Node = &Nodes[BVH->RootNodeIndex];
+    compressedBvhNode *Stack[64];
+    uint32_t StackPointer=0;
+    while(true)
+    {
+        if(Node->IsLeaf())
+        {
+            uint32_t TriangleCount = Node->Info & ~COMPRESSED_LEAF_BIT;
+            for(uint32_t i=0; i<TriangleCount; i++)
+            {
+                uint32_t TriangleIndex = BVH->TriangleIndices[Node->LeftChildOrFirst + i];
+                compactTriangle &Triangle = Triangles[TriangleIndex];
+                if(BVH->TriangleKernel == triangleKernel::MollerTrumbore) RayTriangleInteresection(Ray, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, 0, TriangleIndex);
+                else RayTriangleIntersectionWatertight(WatertightRay, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, 0, TriangleIndex);
+                if(RayPayload.Distance < MaxDistance) return true;
+            }
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+            continue;
+        }
+
+        glm::vec3 Min1, Max1, Min2, Max2;
+        Node->DecodeChildBounds(0, Min1, Max1);
+        Node->DecodeChildBounds(1, Min2, Max2);
+        compressedBvhNode *Child1 = &Nodes[Node->LeftChildOrFirst];
+        compressedBvhNode *Child2 = &Nodes[Node->LeftChildOrFirst+1];
+        bool Hit1 = RayAABBIntersection(Ray, Min1, Max1, MaxDistance) != 1e30f;
+        bool Hit2 = RayAABBIntersection(Ray, Min2, Max2, MaxDistance) != 1e30f;
+        if(Hit1 && Hit2)
+        {
+            Node = Child1;
+            Stack[StackPointer++] = Child2;
+        }
+        else if(Hit1) Node = Child1;
+        else if(Hit2) Node = Child2;
+        else if(StackPointer==0) break;
+        else Node = Stack[--StackPointer];
+    }
+    return false;
+}
+
+void compressedBvh::Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex)
+{
+    //The compact triangles are not copied as SoA, Watertight4 uses the scalar watertight test
+    watertightRay WatertightRay(Ray);
+    compressedBvhNode *Node = &Nodes[BVH->RootNodeIndex];
+    compressedBvhNode *Stack[64];
+    uint32_t StackPointer=0;
+    while(true)
+    {
+        if(Node->IsLeaf())
+        {
+            uint32_t TriangleCount = Node->Info & ~COMPRESSED_LEAF_BIT;
+            for(uint32_t i=0; i<TriangleCount; i++)
+            {
+                uint32_t TriangleIndex = BVH->TriangleIndices[Node->LeftChildOrFirst + i];
+                compactTriangle &Triangle = Triangles[TriangleIndex];
+                if(BVH->TriangleKernel == triangleKernel::MollerTrumbore) RayTriangleInteresection(Ray, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, InstanceIndex, TriangleIndex);
+                else RayTriangleIntersectionWatertight(WatertightRay, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, InstanceIndex, TriangleIndex);
+            }
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+            continue;
+        }
+
+        glm::vec3 Min1, Max1, Min2, Max2;
+        Node->DecodeChildBounds(0, Min1, Max1);
+        Node->DecodeChildBounds(1, Min2, Max2);
+        compressedBvhNode *Child1 = &Nodes[Node->LeftChildOrFirst];
+        compressedBvhNode *Child2 = &Nodes[Node->LeftChildOrFirst+1];
+
+        float Dist1 = RayAABBIntersection(Ray, Min1, Max1, RayPayload);
+        float Dist2 = RayAABBIntersection(Ray, Min2, Max2, RayPayload);
+        if(Dist1 > Dist2) {
+            std::swap(Dist1, Dist2);
+            std::swap(Child1, Child2);
+        }
+
+        if(Dist1 == 1e30f)
+        {
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+        }
+        else
+        {
+            Node = Child1;
+            if(Dist2 != 1e30f) Stack[StackPointer++] = Child2;
+        }
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+struct ray;
+struct rayPayload;
+struct bvh;
+
+#define COMPRESSED_LEAF_BIT 0x80000000u
+
+//32 byte bvh node, with the same indices as the binary bvhNode it comes from.
+//The bounds of both children are stored on 8 bits per plane, in steps of a power of 2 from the min corner of this node.
+struct compressedBvhNode
+{
+    //Min corner of this node
+    glm::vec3 Origin;
+    //Interior : biased exponent of the step on each axis in the 3 low bytes, so the step is the float with that exponent.
+    //Leaf : triangle count with COMPRESSED_LEAF_BIT set.
+    uint32_t Info;
+    //Left min xyz, left max xyz, right min xyz, right max xyz
+    uint8_t ChildBounds[12];
+    //Interior : left child, the right child is LeftChildOrFirst+1. Leaf : first index in bvh::TriangleIndices.
+    uint32_t LeftChildOrFirst;
+
+    bool IsLeaf() const {return (Info & COMPRESSED_LEAF_BIT) != 0;}
+    void DecodeChildBounds(uint32_t Child, glm::vec3 &AABBMin, glm::vec3 &AABBMax) const;
+};
+
+//36 byte triangle : no padding, and no centroid as it is only needed by the build
+struct compactTriangle
+{
+    glm::vec3 v0;
+    glm::vec3 v1;
+    glm::vec3 v2;
+};
+
+//Compressed copy of a binary bvh, and of its mesh triangles. Also the format the compute renderer uploads when the -DCOMPRESSED_BVH shader is compiled.
+struct compressedBvh
+{
+    void Build(bvh *BVH);
+    void Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex);
+    bool Occluded(ray Ray, float MaxDistance);
+
+    bvh *BVH=nullptr;
+    std::vector<compressedBvhNode> Nodes;
+    std::vector<compactTriangle> Triangles;
+};
@@ -122,6 +122,20 @@ VkResult vulkanDevice::CreateDevice(VkPhysicalDeviceFeatures EnabledFeatures, bo
         DeviceExtensions.push_back(VK_AMD_RASTERIZATION_ORDER_EXTENSION_NAME);
     }
 
+    //Block compressed scene textures, the importers fall back to rgba8 without them
+    if(Features.textureCompressionBC)
+    {
+        TextureCompressionBC=true;
+        VkFormat BCFormats[] = {VK_FORMAT_BC1_RGBA_UNORM_BLOCK, VK_FORMAT_BC3_UNORM_BLOCK, VK_FORMAT_BC5_UNORM_BLOCK};
+        for(VkFormat Format : BCFormats)
+        {
+            VkFormatProperties FormatProperties;
+            vkGetPhysicalDeviceFormatProperties(PhysicalDevice, Format, &FormatProperties);
+            if(!(FormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT)) TextureCompressionBC=false;
+        }
+        if(TextureCompressionBC) EnabledFeatures.textureCompressionBC=VK_TRUE;
+    }
+
 
     if(RayTracing)
     {
@@ -30,6 +30,8 @@ public:
 
     bool EnableDebugMarkers=false;
     bool EnableNVDedicatedAllocation=false;
+    //The bc1, bc3 and bc5 formats of the compressed textures can be sampled, set by CreateDevice()
+    bool TextureCompressionBC=false;
 
     vulkanDevice(VkPhysicalDevice PhysicalDevice, VkInstance Instance);
     
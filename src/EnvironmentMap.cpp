@@ -0,0 +1,149 @@
+#include "EnvironmentMap.h"
+
+#include <glm/geometric.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#define ENVIRONMENT_PI 3.14159265359f
+
+//Index of the segment of a CDF that contains Random, and the position of Random inside of it
+static uint32_t SampleCDF(const float *CDF, uint32_t Count, float Random, float &Offset)
+{
+    uint32_t Index = (uint32_t)(std::upper_bound(CDF, CDF + Count + 1, Random) - CDF);
+    Index = std::min(std::max(Index, 1u), Count) - 1;
+    float Size = CDF[Index + 1] - CDF[Index];
+    Offset = Size > 0 ? std::min((Random - CDF[Index]) / Size, 1.0f) : 0.5f;
+    return Index;
+}
+
+static void ToEquirectangular(glm::vec3 Direction, float &U, float &V)
+{
+    U = std::atan2(Direction.z, Direction.x) / (2.0f * ENVIRONMENT_PI) + 0.5f;
+    V = std::acos(std::min(std::max(Direction.y, -1.0f), 1.0f)) / ENVIRONMENT_PI;
+}
+
+void environmentMap::Clear()
+{
+    Width = Height = 0;
+    Radiance.clear();
+    MarginalCDF.clear();
+    ConditionalCDFs.clear();
+}
+
+void environmentMap::Build(const float *Pixels, uint32_t PanoramaWidth, uint32_t PanoramaHeight)
+{
+    Clear();
+    if(Pixels == nullptr || PanoramaWidth == 0 || PanoramaHeight == 0) return;
+
+    uint32_t Factor = (PanoramaWidth + ENVIRONMENT_MAP_MAX_WIDTH - 1) / ENVIRONMENT_MAP_MAX_WIDTH;
+    Width = PanoramaWidth / Factor;
+    Height = std::max(PanoramaHeight / Factor, 1u);
+
+    Radiance.assign(Width * Height, glm::vec3(0));
+    float TexelWeight = 1.0f / (float)(Factor * Factor);
+    for(uint32_t y=0; y<Height; y++)
+    {
+        for(uint32_t x=0; x<Width; x++)
+        {
+            glm::vec3 Sum(0);
+            for(uint32_t sy=0; sy<Factor; sy++)
+            {
+                const float *Row = Pixels + ((size_t)std::min(y * Factor + sy, PanoramaHeight-1) * PanoramaWidth + x * Factor) * 4;
+                for(uint32_t sx=0; sx<Factor; sx++) Sum += glm::vec3(Row[sx * 4], Row[sx * 4 + 1], Row[sx * 4 + 2]);
+            }
+            Radiance[y * Width + x] = Sum * TexelWeight;
+        }
+    }
+
+    //Luminance weighted by the solid angle of the texels, which shrinks towards the poles
+    ConditionalCDFs.resize(Height * (Width + 1));
+    MarginalCDF.resize(Height + 1);
+    MarginalCDF[0] = 0;
+    for(uint32_t y=0; y<Height; y++)
+    {
+        float SinTheta = std::sin(ENVIRONMENT_PI * ((float)y + 0.5f) / (float)Height);
+        float *CDF = &ConditionalCDFs[y * (Width + 1)];
+        CDF[0] = 0;
+        for(uint32_t x=0; x<Width; x++)
+        {
+            glm::vec3 Texel = Radiance[y * Width + x];
+            float Luminance = std::max(glm::dot(Texel, glm::vec3(0.2126f, 0.7152f, 0.0722f)), 0.0f);
+            CDF[x+1] = CDF[x] + Luminance * SinTheta;
+        }
+
+        float RowSum = CDF[Width];
+        MarginalCDF[y+1] = MarginalCDF[y] + RowSum;
+        for(uint32_t x=1; x<=Width; x++) CDF[x] = RowSum > 0 ? CDF[x] / RowSum : (float)x / (float)Width;
+        CDF[Width] = 1.0f;
+    }
+
+    float Total = MarginalCDF[Height];
+    if(!(Total > 0) || !std::isfinite(Total))
+    {
+        Clear();
+        return;
+    }
+    for(uint32_t y=1; y<=Height; y++) MarginalCDF[y] /= Total;
+    MarginalCDF[Height] = 1.0f;
+}
+
+float environmentMap::TexelPdf(uint32_t x, uint32_t y) const
+{
+    const float *CDF = &ConditionalCDFs[y * (Width + 1)];
+    return (MarginalCDF[y+1] - MarginalCDF[y]) * (float)Height * (CDF[x+1] - CDF[x]) * (float)Width;
+}
+
+glm::vec3 environmentMap::Eval(glm::vec3 Direction) const
+{
+    if(Empty()) return glm::vec3(0);
+    float U, V;
+    ToEquirectangular(Direction, U, V);
+    uint32_t x = std::min((uint32_t)(U * (float)Width), Width - 1);
+    uint32_t y = std::min((uint32_t)(V * (float)Height), Height - 1);
+    return Radiance[y * Width + x];
+}
+
+glm::vec3 environmentMap::Sample(float Random0, float Random1, float &Pdf) const
+{
+    float OffsetY, OffsetX;
+    uint32_t y = SampleCDF(MarginalCDF.data(), Height, Random0, OffsetY);
+    uint32_t x = SampleCDF(&ConditionalCDFs[y * (Width + 1)], Width, Random1, OffsetX);
+
+    float Theta = ENVIRONMENT_PI * ((float)y + OffsetY) / (float)Height;
+    float Phi = 2.0f * ENVIRONMENT_PI * (((float)x + OffsetX) / (float)Width - 0.5f);
+    float SinTheta = std::sin(Theta);
+
+    //Jacobian of the (u, v) to direction mapping : 2 * PI * PI * sin(theta)
+    Pdf = SinTheta > 0 ? TexelPdf(x, y) / (2.0f * ENVIRONMENT_PI * ENVIRONMENT_PI * SinTheta) : 0;
+    return glm::vec3(std::cos(Phi) * SinTheta, std::cos(Theta), std::sin(Phi) * SinTheta);
+}
+
+float environmentMap::Pdf(glm::vec3 Direction) const
+{
+    if(Empty()) return 0;
+    float U, V;
+    ToEquirectangular(Direction, U, V);
+    uint32_t x = std::min((uint32_t)(U * (float)Width), Width - 1);
+    uint32_t y = std::min((uint32_t)(V * (float)Height), Height - 1);
+
+    float SinTheta = std::sqrt(std::max(1.0f - Direction.y * Direction.y, 0.0f));
+    if(SinTheta == 0) return 0;
+    return TexelPdf(x, y) / (2.0f * ENVIRONMENT_PI * ENVIRONMENT_PI * SinTheta);
+}
+
+std::vector<uint32_t> environmentMap::GetGPUData() const
+{
+    size_t FloatCount = Radiance.size() * 3 + MarginalCDF.size() + ConditionalCDFs.size();
+    std::vector<uint32_t> Data(2 + FloatCount);
+    Data[0] = Width;
+    Data[1] = Height;
+    uint32_t *Output = Data.data() + 2;
+    if(Radiance.size()) memcpy(Output, Radiance.data(), Radiance.size() * sizeof(glm::vec3));
+    Output += Radiance.size() * 3;
+    if(MarginalCDF.size()) memcpy(Output, MarginalCDF.data(), MarginalCDF.size() * sizeof(float));
+    Output += MarginalCDF.size();
+    if(ConditionalCDFs.size()) memcpy(Output, ConditionalCDFs.data(), ConditionalCDFs.size() * sizeof(float));
+    return Data;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+//The distribution is built on a box filtered copy of the panorama at most that wide, the radiance lookups use the same copy
+#define ENVIRONMENT_MAP_MAX_WIDTH 1024
+
+//Equirectangular environment with the 2D distribution of its luminance, for importance sampling of the sky.
+//Piecewise constant pdf over the texels (PBRT 13.6.7) : a marginal CDF picks the row, the conditional CDF of that row picks the column.
+//Row 0 is the top of the panorama, looking up (+Y).
+struct environmentMap
+{
+    //Pixels : RGBA floats, as loaded by stbi_loadf
+    void Build(const float *Pixels, uint32_t PanoramaWidth, uint32_t PanoramaHeight);
+    void Clear();
+    bool Empty() const { return Width == 0; }
+
+    glm::vec3 Eval(glm::vec3 Direction) const;
+    //Picks a direction proportionally to the luminance. Pdf is per solid angle.
+    glm::vec3 Sample(float Random0, float Random1, float &Pdf) const;
+    //Solid angle pdf of Sample() returning that direction
+    float Pdf(glm::vec3 Direction) const;
+
+    //Width and Height as uints, followed by the radiance as rgb floats, the marginal CDF and the conditional CDFs.
+    //Layout of environmentBuffer in pathTracePreview.comp.
+    std::vector<uint32_t> GetGPUData() const;
+
+    uint32_t Width=0, Height=0;
+    std::vector<glm::vec3> Radiance;
+    //Height + 1 entries, from 0 to 1
+    std::vector<float> MarginalCDF;
+    //Width + 1 entries per row, from 0 to 1
+    std::vector<float> ConditionalCDFs;
+
+private:
+    float TexelPdf(uint32_t x, uint32_t y) const;
+};
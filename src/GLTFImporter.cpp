@@ -21,6 +21,9 @@
 #include <tiny_gltf.h>
 
 #include "Util.h"
+#include "ThreadPool.h"
+#include "TextureCompression.h"
+#include <algorithm>
 
 namespace GLTFImporter
 {
@@ -74,24 +77,125 @@ namespace GLTFImporter
         }
     }
 
+    //Image loader of tinygltf that only keeps the encoded file, LoadTextures() decodes the images on all the cores
+    bool KeepEncodedImage(tinygltf::Image *Image, const int ImageIndex, std::string *Error, std::string *Warning, int RequestedWidth, int RequestedHeight, 
+                          const unsigned char *Bytes, int Size, void *UserData)
+    {
+        Image->image.assign(Bytes, Bytes + Size);
+        return true;
+    }
+
     void LoadTextures(tinygltf::Model &GLTFModel, textureList *Textures)
     {
-		
+        //Textures without a name are named after their image, so several textures can end up with the same name and image
+        std::vector<std::string> Names;
+        std::vector<int> Sources;
         for (size_t i = 0; i < GLTFModel.textures.size(); i++)
         {
             tinygltf::Texture& GLTFTex = GLTFModel.textures[i];
-            tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
             std::string TexName = GLTFTex.name;
             if(strcmp(GLTFTex.name.c_str(), "") == 0)
             {
-                TexName = GLTFImage.uri;
+                TexName = GLTFModel.images[GLTFTex.source].uri;
             }
-            
-            VkFormat Format = VK_FORMAT_R8G8B8A8_UNORM;
-            assert(GLTFImage.component==4);
-            assert(GLTFImage.bits==8);
+            if(Textures->Present(TexName) || std::find(Names.begin(), Names.end(), TexName) != Names.end()) continue;
+            Names.push_back(TexName);
+            Sources.push_back(GLTFTex.source);
+        }
 
-            Textures->AddTexture2D(TexName, GLTFImage.image.data(), GLTFImage.image.size(), GLTFImage.width, GLTFImage.height, Format, true);
+        //Normal maps go in two channels, the other maps keep their colors. An image used for both stays uncompressed.
+        std::vector<uint8_t> NormalUse(GLTFModel.images.size(), 0);
+        std::vector<uint8_t> ColorUse(GLTFModel.images.size(), 0);
+        for(size_t i=0; i<GLTFModel.materials.size(); i++)
+        {
+            const tinygltf::Material &GLTFMaterial = GLTFModel.materials[i];
+            int ColorTextures[] = {GLTFMaterial.pbrMetallicRoughness.baseColorTexture.index, GLTFMaterial.pbrMetallicRoughness.metallicRoughnessTexture.index,
+                                   GLTFMaterial.occlusionTexture.index, GLTFMaterial.emissiveTexture.index};
+            for(int TexIndex : ColorTextures)
+            {
+                if(TexIndex > -1) ColorUse[GLTFModel.textures[TexIndex].source] = 1;
+            }
+            if(GLTFMaterial.normalTexture.index > -1) NormalUse[GLTFModel.textures[GLTFMaterial.normalTexture.index].source] = 1;
+        }
+
+        //Each image is decoded once, even if several textures use it
+        std::vector<int> Images = Sources;
+        std::sort(Images.begin(), Images.end());
+        Images.erase(std::unique(Images.begin(), Images.end()), Images.end());
+        std::vector<uint8_t*> Pixels(GLTFModel.images.size(), nullptr);
+        std::vector<glm::ivec2> Sizes(GLTFModel.images.size(), glm::ivec2(0));
+        std::vector<compressedImage> CompressedImages(GLTFModel.images.size());
+        std::vector<uint8_t> IsCompressed(GLTFModel.images.size(), 0);
+
+        threadPool ThreadPool;
+        ThreadPool.Start();
+        ThreadPool.ParallelFor((uint32_t)Images.size(), 1, [&](uint32_t Start, uint32_t End)
+        {
+            for(uint32_t i=Start; i<End; i++)
+            {
+                int Image = Images[i];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[Image];
+                //Without two channel normals, normal maps are compressed like the colors, which the shaders read in rgb
+                bool NormalMap = NormalUse[Image] && Textures->TwoChannelNormals;
+                bool Compress = Textures->CompressTextures && !(NormalMap && ColorUse[Image]);
+                uint64_t Hash = 0;
+                if(Compress)
+                {
+                    //Only the first load of a model encodes its textures
+                    Hash = textureCache::Hash(GLTFImage.image.data(), GLTFImage.image.size(), NormalMap);
+                    if(textureCache::Load(Hash, CompressedImages[Image]))
+                    {
+                        IsCompressed[Image] = 1;
+                        continue;
+                    }
+                }
+
+                Pixels[Image] = stbi_load_from_memory(GLTFImage.image.data(), (int)GLTFImage.image.size(), &Sizes[Image].x, &Sizes[Image].y, nullptr, 4);
+                if(!Compress || Pixels[Image] == nullptr) continue;
+
+                blockFormat Format = blockFormat::BC5;
+                if(!NormalMap)
+                {
+                    bool Opaque = true;
+                    size_t TexelCount = (size_t)Sizes[Image].x * Sizes[Image].y;
+                    for(size_t j=0; j<TexelCount && Opaque; j++) Opaque = Pixels[Image][j * 4 + 3] == 255;
+                    Format = Opaque ? blockFormat::BC1 : blockFormat::BC3;
+                }
+                textureCompression::Compress(Pixels[Image], (uint32_t)Sizes[Image].x, (uint32_t)Sizes[Image].y, Format, CompressedImages[Image]);
+                textureCache::Save(Hash, CompressedImages[Image]);
+                IsCompressed[Image] = 1;
+                stbi_image_free(Pixels[Image]);
+                Pixels[Image] = nullptr;
+            }
+        });
+
+        std::vector<vulkanTexture> CreatedTextures(Names.size());
+        std::vector<std::string> CreatedNames;
+        std::vector<textureUpload> Uploads;
+        for(size_t i=0; i<Names.size(); i++)
+        {
+            if(IsCompressed[Sources[i]])
+            {
+                compressedImage &Compressed = CompressedImages[Sources[i]];
+                CreatedNames.push_back(Names[i]);
+                Uploads.push_back({Compressed.Data.data(), (VkDeviceSize)Compressed.Data.size(), textureCompression::GetVulkanFormat(Compressed.Format), Compressed.Width, Compressed.Height, &CreatedTextures[i], &Compressed});
+                continue;
+            }
+            if(Pixels[Sources[i]] == nullptr)
+            {
+                std::cout << "Could not decode texture " << Names[i] << std::endl;
+                continue;
+            }
+            glm::ivec2 Size = Sizes[Sources[i]];
+            CreatedNames.push_back(Names[i]);
+            Uploads.push_back({Pixels[Sources[i]], (VkDeviceSize)Size.x * Size.y * 4, VK_FORMAT_R8G8B8A8_UNORM, (uint32_t)Size.x, (uint32_t)Size.y, &CreatedTextures[i]});
+        }
+        Textures->AddTextures2D(CreatedNames, Uploads, ThreadPool);
+
+        ThreadPool.Stop();
+        for(size_t i=0; i<Pixels.size(); i++)
+        {
+            if(Pixels[i] != nullptr) stbi_image_free(Pixels[i]);
         }
     }
     void LoadMaterials(tinygltf::Model &GLTFModel, std::vector<sceneMaterial> &Materials, textureList *Textures)
@@ -112,12 +216,14 @@ namespace GLTFImporter
                 int TexIndex = PBR.baseColorTexture.index;
 
                 tinygltf::Texture& GLTFTex = GLTFModel.textures[TexIndex];
-                tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[GLTFTex.source];
                 std::string TexName = GLTFTex.name;
                 if(strcmp(GLTFTex.name.c_str(), "") == 0)
                 {
                     TexName = GLTFImage.uri;
                     Materials[i].Diffuse = Textures->Get(TexName);
+                    //glTF base colors are sRGB, the cpu copy of the material is decoded by Sample()
+                    Materials[i].Diffuse.SetColorSpace(colorSpace::SRGB);
                 }
                 else
                 {
@@ -145,7 +251,7 @@ namespace GLTFImporter
                 int TexIndex = PBR.metallicRoughnessTexture.index;
 
                 tinygltf::Texture& GLTFTex = GLTFModel.textures[TexIndex];
-                tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[GLTFTex.source];
                 std::string TexName = GLTFTex.name;
                 if(strcmp(GLTFTex.name.c_str(), "") == 0)
                 {
@@ -170,7 +276,7 @@ namespace GLTFImporter
                 int TexIndex = GLTFMaterial.normalTexture.index;
 
                 tinygltf::Texture& GLTFTex = GLTFModel.textures[TexIndex];
-                tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[GLTFTex.source];
                 std::string TexName = GLTFTex.name;
                 if(strcmp(GLTFTex.name.c_str(), "") == 0)
                 {
@@ -195,7 +301,7 @@ namespace GLTFImporter
                 int TexIndex = GLTFMaterial.occlusionTexture.index;
 
                 tinygltf::Texture& GLTFTex = GLTFModel.textures[TexIndex];
-                tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[GLTFTex.source];
                 std::string TexName = GLTFTex.name;
                 if(strcmp(GLTFTex.name.c_str(), "") == 0)
                 {
@@ -221,7 +327,7 @@ namespace GLTFImporter
                 int TexIndex = GLTFMaterial.emissiveTexture.index;
 
                 tinygltf::Texture& GLTFTex = GLTFModel.textures[TexIndex];
-                tinygltf::Image GLTFImage = GLTFModel.images[GLTFTex.source];
+                const tinygltf::Image &GLTFImage = GLTFModel.images[GLTFTex.source];
                 std::string TexName = GLTFTex.name;
                 if(strcmp(GLTFTex.name.c_str(), "") == 0)
                 {
@@ -787,6 +893,8 @@ namespace GLTFImporter
 
         std::string Error, Warning;
 
+        ModelLoader.SetImageLoader(KeepEncodedImage, nullptr);
+
         //TODO(Jacques): 
         //  Handle binary gltf
         std::string Extension = FileName.substr(FileName.find_last_of(".") + 1);
@@ -824,6 +932,8 @@ namespace GLTFImporter
 
         std::string Error, Warning;
 
+        ModelLoader.SetImageLoader(KeepEncodedImage, nullptr);
+
         //TODO(Jacques): 
         //  Handle binary gltf
         std::string Extension = FileName.substr(FileName.find_last_of(".") + 1);
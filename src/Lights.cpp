@@ -0,0 +1,270 @@
+#include "Lights.h"
+#include "bvh.h"
+#include "Scene.h"
+
+#include <algorithm>
+#include <cmath>
+
+static float Luminance(const glm::vec3 &Color)
+{
+    return glm::dot(Color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+glm::vec3 GetTriangleEmission(instance *Instance, mesh *Mesh, uint32_t PrimitiveIndex, float U, float V)
+{
+    sceneMaterial *Material = Instance->Mesh->Material;
+    materialData *MatData = &Material->MaterialData;
+
+    glm::vec3 Emission = MatData->Emission * MatData->EmissiveStrength;
+    if(MatData->EmissionMapTextureID >=0 && MatData->UseEmissionMap>0)
+    {
+        triangleExtraData &ExtraData = Mesh->TrianglesExtraData[PrimitiveIndex];
+        glm::vec2 UV = ExtraData.UV1 * U + ExtraData.UV2 * V + ExtraData.UV0 * (1 - U - V);
+        Emission *= glm::vec3(Material->Emission.Sample(UV));
+    }
+    return Emission;
+}
+
+void lightList::Build(scene *Scene, const std::vector<mesh*> &Meshes)
+{
+    Clear((uint32_t)Scene->InstancesPointers.size());
+
+    std::vector<glm::vec3> Emissions;
+    for(uint32_t i=0; i<(uint32_t)Scene->InstancesPointers.size(); i++)
+    {
+        instance *Instance = Scene->InstancesPointers[i];
+        materialData *MatData = &Instance->Mesh->Material->MaterialData;
+        if(Luminance(MatData->Emission * MatData->EmissiveStrength) <= 0) continue;
+
+        //Emission maps are estimated at the corners and the center of each triangle.
+        //Triangles found black are left out, the brdf sampling still finds them.
+        mesh *Mesh = Meshes[Instance->MeshIndex];
+        Emissions.resize(Mesh->GetTriangleCount());
+        for(uint32_t j=0; j<Mesh->GetTriangleCount(); j++)
+        {
+            Emissions[j] = (GetTriangleEmission(Instance, Mesh, j, 0, 0) + GetTriangleEmission(Instance, Mesh, j, 1, 0) +
+                            GetTriangleEmission(Instance, Mesh, j, 0, 1) + GetTriangleEmission(Instance, Mesh, j, 1.0f/3.0f, 1.0f/3.0f)) * 0.25f;
+        }
+        AddInstance(i, Mesh, Instance->InstanceData.Transform, Emissions);
+    }
+    Finish();
+}
+
+void lightList::Clear(uint32_t InstanceCount)
+{
+    Triangles.clear();
+    Nodes.clear();
+    Powers.clear();
+    TriangleLights.clear();
+    InstanceOffsets.assign(InstanceCount, NO_LIGHT);
+}
+
+void lightList::AddInstance(uint32_t InstanceIndex, mesh *Mesh, const glm::mat4 &Transform, const std::vector<glm::vec3> &Emissions)
+{
+    uint32_t Offset = (uint32_t)TriangleLights.size();
+    bool HasLight=false;
+    TriangleLights.resize(Offset + Mesh->GetTriangleCount(), NO_LIGHT);
+    for(uint32_t i=0; i<Mesh->GetTriangleCount(); i++)
+    {
+        float Radiance = Luminance(Emissions[i]);
+        if(Radiance <= 0) continue;
+
+        glm::vec3 v0, v1, v2;
+        Mesh->GetTriangle(i, v0, v1, v2);
+        emissiveTriangle Light;
+        Light.v0 = glm::vec3(Transform * glm::vec4(v0, 1));
+        Light.v1 = glm::vec3(Transform * glm::vec4(v1, 1));
+        Light.v2 = glm::vec3(Transform * glm::vec4(v2, 1));
+        glm::vec3 Cross = glm::cross(Light.v1 - Light.v0, Light.v2 - Light.v0);
+        float Length = glm::length(Cross);
+        if(Length == 0) continue;
+        Light.Normal = Cross / Length;
+        Light.Area = 0.5f * Length;
+        Light.InstanceIndex = InstanceIndex;
+        Light.PrimitiveIndex = i;
+        Light.LeafNode = NO_LIGHT;
+
+        TriangleLights[Offset + i] = (uint32_t)Triangles.size();
+        Triangles.push_back(Light);
+        Powers.push_back(Radiance * Light.Area);
+        HasLight=true;
+    }
+
+    if(HasLight) InstanceOffsets[InstanceIndex] = Offset;
+    else TriangleLights.resize(Offset);
+}
+
+void lightList::Finish()
+{
+    Nodes.clear();
+    if(Triangles.empty()) return;
+
+    //One light per leaf, so the tree has exactly 2n - 1 nodes
+    Nodes.reserve(Triangles.size() * 2 - 1);
+    Nodes.push_back({});
+    Nodes[0].Parent = NO_LIGHT;
+
+    std::vector<uint32_t> LightIndices(Triangles.size());
+    for(uint32_t i=0; i<(uint32_t)LightIndices.size(); i++) LightIndices[i] = i;
+    Subdivide(0, 0, (uint32_t)LightIndices.size(), LightIndices);
+}
+
+void lightList::Subdivide(uint32_t NodeIndex, uint32_t First, uint32_t Count, std::vector<uint32_t> &LightIndices)
+{
+    glm::vec3 AABBMin(1e30f), AABBMax(-1e30f);
+    glm::vec3 CentroidMin(1e30f), CentroidMax(-1e30f);
+    float Power=0;
+    for(uint32_t i=First; i<First + Count; i++)
+    {
+        const emissiveTriangle &Light = Triangles[LightIndices[i]];
+        AABBMin = glm::min(AABBMin, glm::min(Light.v0, glm::min(Light.v1, Light.v2)));
+        AABBMax = glm::max(AABBMax, glm::max(Light.v0, glm::max(Light.v1, Light.v2)));
+        glm::vec3 Centroid = (Light.v0 + Light.v1 + Light.v2) * (1.0f / 3.0f);
+        CentroidMin = glm::min(CentroidMin, Centroid);
+        CentroidMax = glm::max(CentroidMax, Centroid);
+        Power += Powers[LightIndices[i]];
+    }
+    Nodes[NodeIndex].AABBMin = AABBMin;
+    Nodes[NodeIndex].AABBMax = AABBMax;
+    Nodes[NodeIndex].Power = Power;
+
+    if(Count == 1)
+    {
+        Nodes[NodeIndex].ChildOrLight = LightIndices[First] | LIGHT_BVH_LEAF_BIT;
+        Triangles[LightIndices[First]].LeafNode = NodeIndex;
+        return;
+    }
+
+    //Median split on the longest axis of the centroids
+    glm::vec3 Extent = CentroidMax - CentroidMin;
+    int Axis = 0;
+    if(Extent.y > Extent.x) Axis = 1;
+    if(Extent.z > Extent[Axis]) Axis = 2;
+    uint32_t LeftCount = Count / 2;
+    std::nth_element(LightIndices.begin() + First, LightIndices.begin() + First + LeftCount, LightIndices.begin() + First + Count,
+        [this, Axis](uint32_t A, uint32_t B)
+        {
+            return Triangles[A].v0[Axis] + Triangles[A].v1[Axis] + Triangles[A].v2[Axis] < Triangles[B].v0[Axis] + Triangles[B].v1[Axis] + Triangles[B].v2[Axis];
+        });
+
+    uint32_t LeftChild = (uint32_t)Nodes.size();
+    Nodes.push_back({});
+    Nodes.push_back({});
+    Nodes[NodeIndex].ChildOrLight = LeftChild;
+    Nodes[LeftChild].Parent = NodeIndex;
+    Nodes[LeftChild+1].Parent = NodeIndex;
+    Subdivide(LeftChild, First, LeftCount, LightIndices);
+    Subdivide(LeftChild+1, First + LeftCount, Count - LeftCount, LightIndices);
+}
+
+float lightList::Importance(const lightBvhNode &Node, const glm::vec3 &Position, const glm::vec3 &Normal) const
+{
+    //Bounding sphere of the node
+    glm::vec3 ToCenter = (Node.AABBMin + Node.AABBMax) * 0.5f - Position;
+    glm::vec3 Diagonal = Node.AABBMax - Node.AABBMin;
+    float RadiusSquared = 0.25f * glm::dot(Diagonal, Diagonal);
+    float DistanceSquared = glm::dot(ToCenter, ToCenter);
+
+    //Largest cosine at the receiver of a direction inside the cone of the sphere : cos(max(Angle - SpreadAngle, 0))
+    float CosineBound = 1.0f;
+    if(DistanceSquared > RadiusSquared)
+    {
+        float SinSpreadSquared = RadiusSquared / DistanceSquared;
+        float CosSpread = std::sqrt(1.0f - SinSpreadSquared);
+        float Cosine = glm::dot(Normal, ToCenter) / std::sqrt(DistanceSquared);
+        if(Cosine < CosSpread)
+        {
+            float Sine = std::sqrt(std::max(1.0f - Cosine * Cosine, 0.0f));
+            CosineBound = Cosine * CosSpread + Sine * std::sqrt(SinSpreadSquared);
+        }
+    }
+    if(CosineBound <= 0) return 0;
+
+    //The distance is clamped to the radius, so the lights around the point are not all given to the closest node
+    return Node.Power * CosineBound / std::max(DistanceSquared, std::max(RadiusSquared, 1e-12f));
+}
+
+float lightList::LeftProbability(const lightBvhNode &Node, const glm::vec3 &Position, const glm::vec3 &Normal) const
+{
+    float LeftImportance = Importance(Nodes[Node.ChildOrLight], Position, Normal);
+    float RightImportance = Importance(Nodes[Node.ChildOrLight + 1], Position, Normal);
+    float Sum = LeftImportance + RightImportance;
+    if(!(Sum > 0)) return -1.0f;
+    return LeftImportance / Sum;
+}
+
+lightSample lightList::Sample(const glm::vec3 &Position, const glm::vec3 &Normal, float Random0, float Random1, float Random2) const
+{
+    lightSample Sample = {};
+    if(Nodes.empty()) return Sample;
+
+    //Random0 is rescaled at each level, to pick the next child
+    uint32_t NodeIndex = 0;
+    float Probability = 1.0f;
+    while((Nodes[NodeIndex].ChildOrLight & LIGHT_BVH_LEAF_BIT) == 0)
+    {
+        float Left = LeftProbability(Nodes[NodeIndex], Position, Normal);
+        if(Left < 0) return Sample;
+        if(Random0 < Left)
+        {
+            Random0 /= Left;
+            Probability *= Left;
+            NodeIndex = Nodes[NodeIndex].ChildOrLight;
+        }
+        else
+        {
+            Random0 = (Random0 - Left) / (1.0f - Left);
+            Probability *= 1.0f - Left;
+            NodeIndex = Nodes[NodeIndex].ChildOrLight + 1;
+        }
+        Random0 = std::min(Random0, 0.99999994f);
+    }
+    const emissiveTriangle &Light = Triangles[Nodes[NodeIndex].ChildOrLight & ~LIGHT_BVH_LEAF_BIT];
+
+    //Uniform on the triangle
+    float SqrtRandom1 = std::sqrt(Random1);
+    Sample.U = SqrtRandom1 * (1.0f - Random2);
+    Sample.V = SqrtRandom1 * Random2;
+    Sample.Position = Light.v0 * (1.0f - Sample.U - Sample.V) + Light.v1 * Sample.U + Light.v2 * Sample.V;
+    Sample.Normal = Light.Normal;
+    Sample.InstanceIndex = Light.InstanceIndex;
+    Sample.PrimitiveIndex = Light.PrimitiveIndex;
+    Sample.Pdf = Probability / Light.Area;
+    return Sample;
+}
+
+float lightList::Pdf(const glm::vec3 &Position, const glm::vec3 &Normal, uint32_t InstanceIndex, uint32_t PrimitiveIndex, const glm::vec3 &Direction, float Distance) const
+{
+    if(InstanceIndex >= InstanceOffsets.size() || InstanceOffsets[InstanceIndex] == NO_LIGHT) return 0;
+    uint32_t Index = TriangleLights[InstanceOffsets[InstanceIndex] + PrimitiveIndex];
+    if(Index == NO_LIGHT) return 0;
+
+    const emissiveTriangle &Light = Triangles[Index];
+    float Cosine = std::abs(glm::dot(Light.Normal, Direction));
+    if(Cosine == 0) return 0;
+
+    //Same choices as Sample(), from the leaf up to the root
+    float Probability = 1.0f;
+    uint32_t NodeIndex = Light.LeafNode;
+    while(Nodes[NodeIndex].Parent != NO_LIGHT)
+    {
+        const lightBvhNode &Parent = Nodes[Nodes[NodeIndex].Parent];
+        float Left = LeftProbability(Parent, Position, Normal);
+        if(Left < 0) return 0;
+        Probability *= NodeIndex == Parent.ChildOrLight ? Left : 1.0f - Left;
+        NodeIndex = Nodes[NodeIndex].Parent;
+    }
+    return Probability / Light.Area * Distance * Distance / Cosine;
+}
+
+std::vector<uint32_t> lightList::GetGPUIndices() const
+{
+    uint32_t InstanceCount = (uint32_t)InstanceOffsets.size();
+    std::vector<uint32_t> Indices(InstanceCount + TriangleLights.size());
+    for(uint32_t i=0; i<InstanceCount; i++)
+    {
+        Indices[i] = InstanceOffsets[i] == NO_LIGHT ? NO_LIGHT : InstanceCount + InstanceOffsets[i];
+    }
+    std::copy(TriangleLights.begin(), TriangleLights.end(), Indices.begin() + InstanceCount);
+    return Indices;
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+#include <glm/mat4x4.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+struct mesh;
+struct instance;
+class scene;
+
+#define NO_LIGHT 0xffffffffu
+//Set in lightBvhNode::ChildOrLight for the leaves
+#define LIGHT_BVH_LEAF_BIT 0x80000000u
+
+//Emissive triangle in world space. Laid out for std430, as emissiveTriangle in pathTracePreview.comp.
+struct emissiveTriangle
+{
+    glm::vec3 v0;
+    float Area;
+    glm::vec3 v1;
+    uint32_t InstanceIndex;
+    glm::vec3 v2;
+    uint32_t PrimitiveIndex;
+    //Unit geometric normal. Lights emit on both sides.
+    glm::vec3 Normal;
+    //Leaf of the light bvh that holds the triangle
+    uint32_t LeafNode;
+};
+
+//Node of the light bvh, with the bounds and the summed power of the triangles below it. std430 layout, as in pathTracePreview.comp.
+struct lightBvhNode
+{
+    glm::vec3 AABBMin;
+    float Power;
+    glm::vec3 AABBMax;
+    //Leaves : index of the light with LIGHT_BVH_LEAF_BIT set. Inner nodes : left child, the right child follows it.
+    uint32_t ChildOrLight;
+    //NO_LIGHT for the root
+    uint32_t Parent;
+    uint32_t Padding[3];
+};
+
+//Point picked by lightList::Sample()
+struct lightSample
+{
+    glm::vec3 Position;
+    glm::vec3 Normal;
+    //Barycentrics of the point, same convention as rayPayload : U weights v1, V weights v2
+    float U, V;
+    uint32_t InstanceIndex;
+    uint32_t PrimitiveIndex;
+    //Per unit area, including the probability of picking the triangle. 0 when no light can be seen from the shading point.
+    float Pdf;
+};
+
+//Emission of the material of an instance at a point of one of its triangles, with its emission map
+glm::vec3 GetTriangleEmission(instance *Instance, mesh *Mesh, uint32_t PrimitiveIndex, float U, float V);
+
+//Emissive triangles of the scene in a bvh, for next event estimation with many lights.
+//A light is picked by walking down the tree, choosing each child with the probability of its importance to the shading point :
+//the power of the node, over the squared distance to it, times a bound of the cosine at the receiver.
+//Near and bright lights in front of the surface get most of the samples, in O(log n) per sample.
+struct lightList
+{
+    //Gathers the emissive triangles of all the instances, Meshes indexed by instance::MeshIndex, and builds the bvh
+    void Build(scene *Scene, const std::vector<mesh*> &Meshes);
+
+    void Clear(uint32_t InstanceCount);
+    //Adds the triangles of an instance. Emissions : estimated radiance of each triangle of the mesh, triangles at 0 are left out.
+    void AddInstance(uint32_t InstanceIndex, mesh *Mesh, const glm::mat4 &Transform, const std::vector<glm::vec3> &Emissions);
+    //Builds the bvh once all the instances are added
+    void Finish();
+    bool Empty() const { return Triangles.empty(); }
+
+    //Walks down the bvh from the shading point with Random0, and picks a uniform point on the triangle with Random1 and Random2
+    lightSample Sample(const glm::vec3 &Position, const glm::vec3 &Normal, float Random0, float Random1, float Random2) const;
+    //Solid angle pdf of Sample() from that shading point picking that point of the triangle, seen along Direction at Distance. 0 if the triangle is not a light.
+    float Pdf(const glm::vec3 &Position, const glm::vec3 &Normal, uint32_t InstanceIndex, uint32_t PrimitiveIndex, const glm::vec3 &Direction, float Distance) const;
+
+    //InstanceOffsets as indices in the same array, followed by TriangleLights. Layout of lightIndicesBuffer in pathTracePreview.comp.
+    std::vector<uint32_t> GetGPUIndices() const;
+
+    std::vector<emissiveTriangle> Triangles;
+    std::vector<lightBvhNode> Nodes;
+
+    //Light of each triangle of the emissive instances, or NO_LIGHT
+    std::vector<uint32_t> TriangleLights;
+    //Start of each instance in TriangleLights, or NO_LIGHT when the instance has no emissive triangle
+    std::vector<uint32_t> InstanceOffsets;
+
+private:
+    float Importance(const lightBvhNode &Node, const glm::vec3 &Position, const glm::vec3 &Normal) const;
+    //Probability of going down the left child of an inner node, or -1 when neither child can light the point
+    float LeftProbability(const lightBvhNode &Node, const glm::vec3 &Position, const glm::vec3 &Normal) const;
+    void Subdivide(uint32_t NodeIndex, uint32_t First, uint32_t Count, std::vector<uint32_t> &LightIndices);
+
+    //Power of each triangle, used by the build
+    std::vector<float> Powers;
+};
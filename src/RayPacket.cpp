@@ -0,0 +1,265 @@
+#include "RayPacket.h"
+
+#include <immintrin.h>
+#include <cmath>
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+void rayPacket::Set(uint32_t Lane, const ray &Ray, const rayPayload &RayPayload)
+{
+    Rays[Lane] = Ray;
+    Rays[Lane].InverseDirection = 1.0f / Ray.Direction;
+    Payloads[Lane] = RayPayload;
+
+    OriginX[Lane] = Ray.Origin.x;
+    OriginY[Lane] = Ray.Origin.y;
+    OriginZ[Lane] = Ray.Origin.z;
+    //Finite, so the SSE slab test never computes 0 * inf
+    InverseDirectionX[Lane] = glm::clamp(Rays[Lane].InverseDirection.x, -1e30f, 1e30f);
+    InverseDirectionY[Lane] = glm::clamp(Rays[Lane].InverseDirection.y, -1e30f, 1e30f);
+    InverseDirectionZ[Lane] = glm::clamp(Rays[Lane].InverseDirection.z, -1e30f, 1e30f);
+    Distance[Lane] = RayPayload.Distance;
+}
+
+void rayPacket::Finalize()
+{
+    for(uint32_t Lane=Count; Lane < ((Count + 3) & ~3u); Lane++)
+    {
+        OriginX[Lane] = OriginX[0];
+        OriginY[Lane] = OriginY[0];
+        OriginZ[Lane] = OriginZ[0];
+        InverseDirectionX[Lane] = InverseDirectionX[0];
+        InverseDirectionY[Lane] = InverseDirectionY[0];
+        InverseDirectionZ[Lane] = InverseDirectionZ[0];
+        Distance[Lane] = -1;
+    }
+
+    OriginMin = OriginMax = Rays[0].Origin;
+    InverseDirectionMin = InverseDirectionMax = Rays[0].InverseDirection;
+    Direction = glm::vec3(0);
+    Coherent = true;
+    for(uint32_t Lane=0; Lane<Count; Lane++)
+    {
+        ray &Ray = Rays[Lane];
+        OriginMin = glm::min(OriginMin, Ray.Origin);
+        OriginMax = glm::max(OriginMax, Ray.Origin);
+        InverseDirectionMin = glm::min(InverseDirectionMin, Ray.InverseDirection);
+        InverseDirectionMax = glm::max(InverseDirectionMax, Ray.InverseDirection);
+        Direction += Ray.Direction;
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            if(!std::isfinite(Ray.InverseDirection[Axis]) || ((Ray.InverseDirection[Axis] < 0) != (Rays[0].InverseDirection[Axis] < 0)))
+            {
+                Coherent = false;
+            }
+        }
+    }
+}
+
+uint32_t rayPacket::ActiveMask() const
+{
+    return (1u << Count) - 1;
+}
+
+//Interval product [ALow, AHigh] * [BLow, BHigh]
+static inline void IntervalMul(float ALow, float AHigh, float BLow, float BHigh, float &Low, float &High)
+{
+    float p0 = ALow * BLow, p1 = ALow * BHigh, p2 = AHigh * BLow, p3 = AHigh * BHigh;
+    Low = std::min(std::min(p0, p1), std::min(p2, p3));
+    High = std::max(std::max(p0, p1), std::max(p2, p3));
+}
+
+bool rayPacket::FrustumOverlaps(const glm::vec3 &AABBMin, const glm::vec3 &AABBMax) const
+{
+    if(!Coherent) return true;
+
+    //Lower bound of the entry distance, and upper bound of the exit distance, over all the rays
+    float TNear = -1e30f;
+    float TFar = 1e30f;
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        bool Positive = InverseDirectionMin[Axis] >= 0;
+        float NearPlane = Positive ? AABBMin[Axis] : AABBMax[Axis];
+        float FarPlane = Positive ? AABBMax[Axis] : AABBMin[Axis];
+
+        float Low, High;
+        IntervalMul(NearPlane - OriginMax[Axis], NearPlane - OriginMin[Axis], InverseDirectionMin[Axis], InverseDirectionMax[Axis], Low, High);
+        TNear = std::max(TNear, Low);
+        IntervalMul(FarPlane - OriginMax[Axis], FarPlane - OriginMin[Axis], InverseDirectionMin[Axis], InverseDirectionMax[Axis], Low, High);
+        TFar = std::min(TFar, High);
+    }
+    return TNear <= TFar && TFar > 0;
+}
+
+uint32_t rayPacket::IntersectAABB(const glm::vec3 &AABBMin, const glm::vec3 &AABBMax, uint32_t Mask) const
+{
+    if(!FrustumOverlaps(AABBMin, AABBMax)) return 0;
+
+    __m128 MinX = _mm_set1_ps(AABBMin.x), MaxX = _mm_set1_ps(AABBMax.x);
+    __m128 MinY = _mm_set1_ps(AABBMin.y), MaxY = _mm_set1_ps(AABBMax.y);
+    __m128 MinZ = _mm_set1_ps(AABBMin.z), MaxZ = _mm_set1_ps(AABBMax.z);
+
+    uint32_t Result=0;
+    for(uint32_t Lane=0; Lane<Count; Lane+=4)
+    {
+        if(((Mask >> Lane) & 0xf) == 0) continue;
+
+        __m128 OX = _mm_load_ps(OriginX + Lane), IX = _mm_load_ps(InverseDirectionX + Lane);
+        __m128 OY = _mm_load_ps(OriginY + Lane), IY = _mm_load_ps(InverseDirectionY + Lane);
+        __m128 OZ = _mm_load_ps(OriginZ + Lane), IZ = _mm_load_ps(InverseDirectionZ + Lane);
+
+        __m128 tx1 = _mm_mul_ps(_mm_sub_ps(MinX, OX), IX), tx2 = _mm_mul_ps(_mm_sub_ps(MaxX, OX), IX);
+        __m128 tmin = _mm_min_ps(tx1, tx2), tmax = _mm_max_ps(tx1, tx2);
+        __m128 ty1 = _mm_mul_ps(_mm_sub_ps(MinY, OY), IY), ty2 = _mm_mul_ps(_mm_sub_ps(MaxY, OY), IY);
+        tmin = _mm_max_ps(tmin, _mm_min_ps(ty1, ty2)), tmax = _mm_min_ps(tmax, _mm_max_ps(ty1, ty2));
+        __m128 tz1 = _mm_mul_ps(_mm_sub_ps(MinZ, OZ), IZ), tz2 = _mm_mul_ps(_mm_sub_ps(MaxZ, OZ), IZ);
+        tmin = _mm_max_ps(tmin, _mm_min_ps(tz1, tz2)), tmax = _mm_min_ps(tmax, _mm_max_ps(tz1, tz2));
+        tmax = _mm_mul_ps(tmax, _mm_set1_ps(RAY_AABB_FAR_SCALE));
+
+        __m128 Hit = _mm_and_ps(_mm_cmpge_ps(tmax, tmin),
+                     _mm_and_ps(_mm_cmplt_ps(tmin, _mm_load_ps(Distance + Lane)), _mm_cmpgt_ps(tmax, _mm_setzero_ps())));
+        Result |= (uint32_t)_mm_movemask_ps(Hit) << Lane;
+    }
+    return Result & Mask;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+void bvh::IntersectPacket(rayPacket &Packet, uint32_t Mask, uint32_t InstanceIndex)
+{
+    bvhNode *Node = &BVHNodes[RootNodeIndex];
+    Mask = Packet.IntersectAABB(Node->AABBMin, Node->AABBMax, Mask);
+    if(Mask==0) return;
+
+    bvhNode *Stack[64];
+    uint32_t MaskStack[64];
+    uint32_t StackPointer=0;
+    while(true)
+    {
+        if(Node->IsLeaf())
+        {
+            for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+            {
+                if(!(Mask & (1u << Lane))) continue;
+                IntersectLeaf(Packet.Rays[Lane], watertightRay(Packet.Rays[Lane]), Node->LeftChildOrFirst, Node->TriangleCount, Packet.Payloads[Lane], InstanceIndex);
+                Packet.Distance[Lane] = Packet.Payloads[Lane].Distance;
+            }
+            if(StackPointer==0) break;
+            Node = Stack[--StackPointer];
+            Mask = MaskStack[StackPointer];
+            continue;
+        }
+
+        bvhNode *Child1 = &BVHNodes[Node->LeftChildOrFirst];
+        bvhNode *Child2 = &BVHNodes[Node->LeftChildOrFirst+1];
+        //Visit first the child that is nearest along the packet direction
+        if(glm::dot((Child2->AABBMin + Child2->AABBMax) - (Child1->AABBMin + Child1->AABBMax), Packet.Direction) < 0)
+        {
+            std::swap(Child1, Child2);
+        }
+        uint32_t Mask1 = Packet.IntersectAABB(Child1->AABBMin, Child1->AABBMax, Mask);
+        uint32_t Mask2 = Packet.IntersectAABB(Child2->AABBMin, Child2->AABBMax, Mask);
+
+        if(Mask1 != 0)
+        {
+            if(Mask2 != 0)
+            {
+                Stack[StackPointer] = Child2;
+                MaskStack[StackPointer++] = Mask2;
+            }
+            Node = Child1;
+            Mask = Mask1;
+        }
+        else if(Mask2 != 0)
+        {
+            Node = Child2;
+            Mask = Mask2;
+        }
+        else
+        {
+            if(StackPointer==0) break;
+            Node = Stack[--StackPointer];
+            Mask = MaskStack[StackPointer];
+        }
+    }
+}
+
+void bvhInstance::IntersectPacket(rayPacket &Packet, uint32_t Mask)
+{
+    //Rays in object space. The transform is affine so the packet stays coherent.
+    rayPacket LocalPacket;
+    LocalPacket.Count = Packet.Count;
+    for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+    {
+        ray Ray = Packet.Rays[Lane];
+        Ray.Origin = InverseTransform * glm::vec4(Ray.Origin, 1);
+        Ray.Direction = InverseTransform * glm::vec4(Ray.Direction, 0);
+        LocalPacket.Set(Lane, Ray, Packet.Payloads[Lane]);
+    }
+    LocalPacket.Finalize();
+
+    bvh *BVH = Meshes->at(MeshIndex)->BVH;
+    BVH->IntersectPacket(LocalPacket, Mask, Index);
+
+    for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+    {
+        if(!(Mask & (1u << Lane))) continue;
+        Packet.Payloads[Lane] = LocalPacket.Payloads[Lane];
+        Packet.Distance[Lane] = LocalPacket.Distance[Lane];
+    }
+}
+
+void tlas::IntersectPacket(rayPacket &Packet)
+{
+    Packet.Finalize();
+
+    tlasNode *Node = &Nodes[0];
+    uint32_t Mask = Packet.IntersectAABB(Node->AABBMin, Node->AABBMax, Packet.ActiveMask());
+    if(Mask==0) return;
+
+    tlasNode *Stack[64];
+    uint32_t MaskStack[64];
+    uint32_t StackPtr=0;
+    while(1)
+    {
+        if(Node->IsLeaf())
+        {
+            (*BLAS)[Node->BLAS].IntersectPacket(Packet, Mask);
+            if(StackPtr == 0) break;
+            Node = Stack[--StackPtr];
+            Mask = MaskStack[StackPtr];
+            continue;
+        }
+
+        tlasNode *Child1 = &Nodes[Node->LeftChild];
+        tlasNode *Child2 = &Nodes[Node->LeftChild + 1];
+        if(glm::dot((Child2->AABBMin + Child2->AABBMax) - (Child1->AABBMin + Child1->AABBMax), Packet.Direction) < 0)
+        {
+            std::swap(Child1, Child2);
+        }
+        uint32_t Mask1 = Packet.IntersectAABB(Child1->AABBMin, Child1->AABBMax, Mask);
+        uint32_t Mask2 = Packet.IntersectAABB(Child2->AABBMin, Child2->AABBMax, Mask);
+
+        if(Mask1 != 0)
+        {
+            if(Mask2 != 0)
+            {
+                Stack[StackPtr] = Child2;
+                MaskStack[StackPtr++] = Mask2;
+            }
+            Node = Child1;
+            Mask = Mask1;
+        }
+        else if(Mask2 != 0)
+        {
+            Node = Child2;
+            Mask = Mask2;
+        }
+        else
+        {
+            if(StackPtr == 0) break;
+            Node = Stack[--StackPtr];
+            Mask = MaskStack[StackPtr];
+        }
+    }
+}
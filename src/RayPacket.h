@@ -0,0 +1,40 @@
+#pragma once
+
+#include "bvh.h"
+
+#define MAX_PACKET_SIZE 16
+
+//Up to 16 coherent rays traced together through the binary bvhNode / tlasNode trees.
+//Ray data is stored as SoA so a box is tested against 4 rays at once, and lanes are padded to a multiple of 4.
+struct alignas(16) rayPacket
+{
+    float OriginX[MAX_PACKET_SIZE];
+    float OriginY[MAX_PACKET_SIZE];
+    float OriginZ[MAX_PACKET_SIZE];
+    float InverseDirectionX[MAX_PACKET_SIZE];
+    float InverseDirectionY[MAX_PACKET_SIZE];
+    float InverseDirectionZ[MAX_PACKET_SIZE];
+    //Mirrors Payloads[i].Distance, -1 for padding lanes so they never hit
+    float Distance[MAX_PACKET_SIZE];
+
+    ray Rays[MAX_PACKET_SIZE];
+    rayPayload Payloads[MAX_PACKET_SIZE];
+    uint32_t Count=0;
+
+    //Interval of the origins and inverse directions. When all the rays have the same direction signs,
+    //it bounds the packet frustum and lets us cull whole nodes with one test.
+    glm::vec3 OriginMin, OriginMax;
+    glm::vec3 InverseDirectionMin, InverseDirectionMax;
+    bool Coherent=false;
+    //Sum of the directions, used to visit the nearest child first
+    glm::vec3 Direction;
+
+    void Set(uint32_t Lane, const ray &Ray, const rayPayload &RayPayload);
+    //Pads the lanes and computes the frustum. Must be called after the rays are set.
+    void Finalize();
+    uint32_t ActiveMask() const;
+
+    bool FrustumOverlaps(const glm::vec3 &AABBMin, const glm::vec3 &AABBMax) const;
+    //Returns the lanes of Mask whose ray hits the box before their current distance
+    uint32_t IntersectAABB(const glm::vec3 &AABBMin, const glm::vec3 &AABBMax, uint32_t Mask) const;
+};
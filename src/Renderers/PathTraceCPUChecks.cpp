@@ -0,0 +1,670 @@
+#include "PathTraceCPURenderer.h"
+#include "App.h"
+
+#include "../TextureCompression.h"
+
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+//Benchmarks and correctness checks of the cpu path tracer, run by HeadlessRenderer --check.
+//Each one prints its measures and returns false when the results are wrong.
+
+//Same as PathTraceCPURenderer.cpp
+#define INTEGRATOR_WAVEFRONT 1
+
+//Relative difference of the mean luminance of the two integrators in BenchmarkWavefront()
+#define WAVEFRONT_LUMINANCE_TOLERANCE 0.02f
+
+//Largest rmse of the encoders on the smooth images of CheckTextureCompression(), in 8 bit steps
+#define TEXTURE_COMPRESSION_MAX_ERROR_BC1 4.0f
+#define TEXTURE_COMPRESSION_MAX_ERROR_BC3 4.0f
+#define TEXTURE_COMPRESSION_MAX_ERROR_BC5 1.5f
+
+//Defined in PathTraceCPURenderer.cpp
+float RandomUnilateral(uint32_t &State);
+float RandomBilateral(uint32_t &State);
+
+//Closest hits found by two traversals : both miss, or both hit at the same distance up to the rounding of a different box and triangle order
+static bool SameHitDistance(float a, float b)
+{
+    if(a == 1e30f || b == 1e30f) return a == b;
+    return std::abs(a - b) <= 1e-4f * std::max(1.0f, std::abs(a));
+}
+
+bool pathTraceCPURenderer::CheckWatertight()
+{
+    //UV sphere, closed at the poles, so every ray from the center has to hit it
+    uint32_t Rings=64, Segments=128;
+    std::vector<vertex> Vertices;
+    std::vector<uint32_t> Indices;
+    for(uint32_t Ring=0; Ring<=Rings; Ring++)
+    {
+        float Theta = PI * (float)Ring / (float)Rings;
+        for(uint32_t Segment=0; Segment<Segments; Segment++)
+        {
+            float Phi = TWO_PI * (float)Segment / (float)Segments;
+            vertex Vertex = {};
+            Vertex.Position = glm::vec4(std::sin(Theta) * std::cos(Phi), std::cos(Theta), std::sin(Theta) * std::sin(Phi), 1);
+            Vertices.push_back(Vertex);
+        }
+    }
+    for(uint32_t Ring=0; Ring<Rings; Ring++)
+    {
+        for(uint32_t Segment=0; Segment<Segments; Segment++)
+        {
+            uint32_t i0 = Ring * Segments + Segment;
+            uint32_t i1 = Ring * Segments + (Segment + 1) % Segments;
+            uint32_t i2 = (Ring + 1) * Segments + Segment;
+            uint32_t i3 = (Ring + 1) * Segments + (Segment + 1) % Segments;
+            Indices.insert(Indices.end(), {i0, i2, i1, i1, i2, i3});
+        }
+    }
+    //Built every time, so the check leaves nothing in the bvh cache
+    mesh *Sphere = new mesh(Indices, Vertices, 0, false);
+
+    //Targets on every edge and vertex, shared by 2 or more triangles
+    std::vector<glm::vec3> Targets;
+    for(size_t i=0; i<Indices.size(); i+=3)
+    {
+        for(uint32_t Edge=0; Edge<3; Edge++)
+        {
+            glm::vec3 a = Vertices[Indices[i + Edge]].Position;
+            glm::vec3 b = Vertices[Indices[i + (Edge + 1) % 3]].Position;
+            Targets.push_back(a);
+            Targets.push_back(glm::mix(a, b, 0.5f));
+            Targets.push_back(glm::mix(a, b, 0.1f));
+        }
+    }
+
+    //Moller-Trumbore is only reported, the watertight kernels must not miss any ray
+    bool Passed = true;
+    const char *KernelNames[] = {"Moller-Trumbore", "Watertight", "Watertight x4"};
+    for(int Kernel=0; Kernel<3; Kernel++)
+    {
+        Sphere->BVH->SetTriangleKernel((triangleKernel)Kernel);
+        uint32_t Misses[2] = {};
+        for(size_t i=0; i<Targets.size(); i++)
+        {
+            //From the center outwards, and from outside towards the center
+            ray Rays[2];
+            Rays[0].Origin = glm::vec3(0);
+            Rays[0].Direction = Targets[i];
+            Rays[1].Origin = Targets[i] * 3.0f;
+            Rays[1].Direction = -Targets[i];
+            for(int Side=0; Side<2; Side++)
+            {
+                Rays[Side].InverseDirection = 1.0f / Rays[Side].Direction;
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                Sphere->BVH->Intersect(Rays[Side], RayPayload, 0);
+                if(RayPayload.Distance == 1e30f) Misses[Side]++;
+            }
+        }
+        std::cout << KernelNames[Kernel] << " : " << Misses[0] << " misses from inside, " << Misses[1] << " misses from outside, out of " << Targets.size() << " rays each" << std::endl;
+        if((triangleKernel)Kernel != triangleKernel::MollerTrumbore && Misses[0] + Misses[1] > 0) Passed = false;
+    }
+
+    delete Sphere->BVH;
+    delete Sphere;
+    return Passed;
+}
+
+bool pathTraceCPURenderer::CheckSamplers()
+{
+    //Integrands with an exact value : a quarter disk, with an edge like a light or a shadow, and a smooth function
+    const float DiskRadiusSquared = 0.6f;
+    auto Disk = [DiskRadiusSquared](glm::vec2 Xi) { return Xi.x * Xi.x + Xi.y * Xi.y < DiskRadiusSquared ? 1.0f : 0.0f; };
+    auto Smooth = [](glm::vec2 Xi) { return std::exp(-Xi.x) * std::sin(3.0f * Xi.y) + Xi.x * Xi.y; };
+    double DiskReference = PI * DiskRadiusSquared / 4.0;
+    double SmoothReference = (1.0 - std::exp(-1.0)) * (1.0 - std::cos(3.0)) / 3.0 + 0.25;
+
+    //Each pixel estimates the integral from the dimensions of a bounce, as ShadeHit() would read them
+    const uint32_t Size = 64;
+    const char *SamplerNames[] = {"Random", "Sobol", "Blue Noise"};
+    double SmoothErrors[3] = {};
+    for(uint32_t SampleCount=4; SampleCount<=256; SampleCount*=4)
+    {
+        for(int Type=0; Type<3; Type++)
+        {
+            std::vector<double> DiskErrors(Size * Size);
+            double DiskSquaredError=0, SmoothSquaredError=0;
+            for(uint32_t y=0; y<Size; y++)
+            {
+                for(uint32_t x=0; x<Size; x++)
+                {
+                    double DiskSum=0, SmoothSum=0;
+                    pathSampler Sampler;
+                    for(uint32_t i=0; i<SampleCount; i++)
+                    {
+                        Sampler.Start((samplerType)Type, x, y, i);
+                        Sampler.StartBounce(1);
+                        glm::vec2 Xi = Sampler.Get2D(SAMPLER_BRDF);
+                        DiskSum += Disk(Xi);
+                        SmoothSum += Smooth(Xi);
+                    }
+                    double DiskError = DiskSum / SampleCount - DiskReference;
+                    double SmoothError = SmoothSum / SampleCount - SmoothReference;
+                    DiskErrors[y * Size + x] = DiskError;
+                    DiskSquaredError += DiskError * DiskError;
+                    SmoothSquaredError += SmoothError * SmoothError;
+                }
+            }
+
+            //Correlation of the errors of neighbour pixels : 0 for white noise, negative when the error is spread as blue noise
+            double Covariance=0;
+            for(uint32_t y=0; y<Size; y++)
+            {
+                for(uint32_t x=0; x+1<Size; x++) Covariance += DiskErrors[y * Size + x] * DiskErrors[y * Size + x + 1];
+            }
+            Covariance /= (double)(Size - 1) * Size;
+            double DiskVariance = DiskSquaredError / (Size * Size);
+
+            SmoothErrors[Type] = std::sqrt(SmoothSquaredError / (Size * Size));
+            std::cout << SamplerNames[Type] << ", " << SampleCount << " spp : rmse " << std::sqrt(DiskVariance) << " on the disk, " 
+                      << SmoothErrors[Type] << " on the smooth function, neighbour correlation " << Covariance / std::max(DiskVariance, 1e-12) << std::endl;
+        }
+    }
+
+    //At 256 spp the low discrepancy samplers must beat the random one on the smooth function
+    return SmoothErrors[(int)samplerType::Sobol] < SmoothErrors[(int)samplerType::Random] && 
+           SmoothErrors[(int)samplerType::BlueNoise] < SmoothErrors[(int)samplerType::Random];
+}
+
+bool pathTraceCPURenderer::CheckTextureCompression()
+{
+    //Smooth colors with an alpha ramp, and a normal map of bumps, encoded as the importers would find them
+    const uint32_t Size = 64;
+    std::vector<uint8_t> Colors(Size * Size * 4), OpaqueColors(Size * Size * 4), Normals(Size * Size * 4);
+    for(uint32_t y=0; y<Size; y++)
+    {
+        for(uint32_t x=0; x<Size; x++)
+        {
+            uint8_t *Color = &Colors[(y * Size + x) * 4];
+            Color[0] = (uint8_t)(x * 4);
+            Color[1] = (uint8_t)(y * 4);
+            Color[2] = (uint8_t)((x + y) * 2);
+            Color[3] = (uint8_t)(255 - y * 2);
+            memcpy(&OpaqueColors[(y * Size + x) * 4], Color, 3);
+            OpaqueColors[(y * Size + x) * 4 + 3] = 255;
+
+            glm::vec3 Normal(0.4f * std::sin(TWO_PI * x / 32.0f), 0.4f * std::cos(TWO_PI * y / 32.0f), 0);
+            Normal.z = std::sqrt(1 - Normal.x * Normal.x - Normal.y * Normal.y);
+            for(int c=0; c<3; c++) Normals[(y * Size + x) * 4 + c] = (uint8_t)((Normal[c] * 0.5f + 0.5f) * 255.0f + 0.5f);
+            Normals[(y * Size + x) * 4 + 3] = 255;
+        }
+    }
+
+    struct test
+    {
+        const char *Name;
+        blockFormat Format;
+        const std::vector<uint8_t> *Pixels;
+        //Largest rmse of the first level, in 8 bit steps over the channels the format stores
+        float MaxError;
+    };
+    test Tests[] =
+    {
+        {"BC1", blockFormat::BC1, &OpaqueColors, TEXTURE_COMPRESSION_MAX_ERROR_BC1},
+        {"BC3", blockFormat::BC3, &Colors, TEXTURE_COMPRESSION_MAX_ERROR_BC3},
+        {"BC5", blockFormat::BC5, &Normals, TEXTURE_COMPRESSION_MAX_ERROR_BC5},
+    };
+
+    bool Passed = true;
+    for(const test &Test : Tests)
+    {
+        auto Start = std::chrono::high_resolution_clock::now();
+        compressedImage Image;
+        textureCompression::Compress(Test.Pixels->data(), Size, Size, Test.Format, Image);
+        float Milliseconds = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - Start).count();
+
+        //BC5 decodes with z rebuilt from x and y, it's compared to the z of the source normal
+        std::vector<uint8_t> Decoded(Size * Size * 4);
+        textureCompression::Decompress(Image.Data.data(), Size, Size, Test.Format, Decoded.data());
+        int Channels = Test.Format == blockFormat::BC3 ? 4 : 3;
+        double SquaredError = 0;
+        for(uint32_t i=0; i<Size * Size; i++)
+        {
+            for(int c=0; c<Channels; c++)
+            {
+                double Difference = (double)Decoded[i * 4 + c] - (double)(*Test.Pixels)[i * 4 + c];
+                SquaredError += Difference * Difference;
+            }
+        }
+        float Error = (float)std::sqrt(SquaredError / ((double)Size * Size * Channels));
+
+        //The cache must give back the same blocks and mips
+        uint64_t Hash = textureCache::Hash(Test.Pixels->data(), Test.Pixels->size(), Test.Format == blockFormat::BC5);
+        textureCache::Save(Hash, Image);
+        compressedImage Cached;
+        bool CacheMatches = textureCache::Load(Hash, Cached) && Cached.Format == Image.Format && Cached.Width == Image.Width &&
+                            Cached.Height == Image.Height && Cached.Data == Image.Data && Cached.MipOffsets == Image.MipOffsets;
+
+        std::cout << Test.Name << " : " << Image.MipOffsets.size() << " mips encoded in " << Milliseconds << "ms, rmse " << Error 
+                  << " (max " << Test.MaxError << "), cache " << (CacheMatches ? "matches" : "DIFFERS") << std::endl;
+        Passed &= Error <= Test.MaxError && CacheMatches;
+    }
+    return Passed;
+}
+
+void pathTraceCPURenderer::GenerateBenchmarkRays(uint32_t Width, uint32_t Height, std::vector<ray> &PrimaryRays, std::vector<ray> &SecondaryRays)
+{
+    glm::mat4 ModelMatrix = App->Scene->Camera.GetModelMatrix();
+    glm::mat4 InverseProjection = glm::inverse(App->Scene->Camera.GetProjectionMatrix());
+    glm::vec3 Origin(ModelMatrix[3][0],ModelMatrix[3][1],ModelMatrix[3][2]);
+
+    PrimaryRays.resize(Width * Height);
+    for(uint32_t y=0; y<Height; y++)
+    {
+        for(uint32_t x=0; x<Width; x++)
+        {
+            glm::vec4 Target = InverseProjection * glm::vec4(((float)x / (float)Width) * 2.0f - 1.0f, ((float)y / (float)Height) * 2.0f - 1.0f, 0.0f, 1.0f);
+            PrimaryRays[y * Width + x].Origin = Origin;
+            PrimaryRays[y * Width + x].Direction = glm::vec3(ModelMatrix * glm::normalize(glm::vec4(Target.x, Target.y, Target.z, 0.0f)));
+        }
+    }
+
+    //Incoherent rays : random directions from the primary hits
+    SecondaryRays.clear();
+    uint32_t RandomState=1;
+    for(size_t i=0; i<PrimaryRays.size(); i++)
+    {
+        rayPayload RayPayload = {};
+        RayPayload.Distance = 1e30f;
+        TLAS.Intersect(PrimaryRays[i], RayPayload);
+        if(RayPayload.Distance == 1e30f) continue;
+
+        ray Ray = {};
+        Ray.Origin = PrimaryRays[i].Origin + PrimaryRays[i].Direction * (RayPayload.Distance - 0.001f);
+        Ray.Direction = glm::normalize(glm::vec3(RandomBilateral(RandomState), RandomBilateral(RandomState), RandomBilateral(RandomState)) + glm::vec3(1e-4f));
+        SecondaryRays.push_back(Ray);
+    }
+}
+
+bool pathTraceCPURenderer::BenchmarkTraversal()
+{
+    uint32_t Width = 512;
+    uint32_t Height = 512;
+    std::vector<ray> PrimaryRays, SecondaryRays;
+    SetBVHLayout(bvhLayout::Binary);
+    GenerateBenchmarkRays(Width, Height, PrimaryRays, SecondaryRays);
+
+    //Every layout and packet size must find the hits of the binary layout
+    std::vector<ray> *RaySets[] = {&PrimaryRays, &SecondaryRays};
+    std::vector<float> ReferenceDistances[2];
+    uint32_t Mismatches=0;
+
+    const char *LayoutNames[] = {"Binary", "BVH4", "BVH8", "Compressed"};
+    for(int Layout=0; Layout<4; Layout++)
+    {
+        SetBVHLayout((bvhLayout)Layout);
+
+        float RaysPerSecond[2] = {};
+        uint32_t LayoutMismatches=0;
+        for(int Set=0; Set<2; Set++)
+        {
+            std::vector<ray> &Rays = *RaySets[Set];
+            std::vector<float> Distances(Rays.size());
+            auto Start = std::chrono::high_resolution_clock::now();
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                TLAS.Intersect(Rays[i], RayPayload);
+                Distances[i] = RayPayload.Distance;
+            }
+            auto Stop = std::chrono::high_resolution_clock::now();
+            float Seconds = std::chrono::duration<float>(Stop - Start).count();
+            RaysPerSecond[Set] = Seconds > 0 ? (float)Rays.size() / Seconds : 0;
+
+            if(Layout == 0) ReferenceDistances[Set] = Distances;
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                if(!SameHitDistance(Distances[i], ReferenceDistances[Set][i])) LayoutMismatches++;
+            }
+        }
+        std::cout << LayoutNames[Layout] << " : primary " << RaysPerSecond[0] / 1e6f << " MRays/s, secondary " << RaysPerSecond[1] / 1e6f << " MRays/s, " 
+                  << LayoutMismatches << " mismatches" << std::endl;
+        Mismatches += LayoutMismatches;
+    }
+
+    //Packets use the binary nodes. Primary packets are square blocks of pixels, secondary packets are sorted by octant like the stream mode.
+    SetBVHLayout(bvhLayout::Binary);
+    std::vector<pathState> SecondaryStates(SecondaryRays.size());
+    std::vector<uint32_t> SecondaryActive(SecondaryRays.size()), Sorted;
+    for(uint32_t i=0; i<(uint32_t)SecondaryRays.size(); i++)
+    {
+        SecondaryStates[i].Ray = SecondaryRays[i];
+        SecondaryActive[i] = i;
+    }
+    SortByOctant(SecondaryStates, SecondaryActive, Sorted);
+    //States keep the index of their ray, for the comparison with the binary layout
+    std::vector<uint32_t> PrimaryRayIndices;
+
+    int PreviousPacketSizeIndex = PacketSizeIndex;
+    for(PacketSizeIndex=0; PacketSizeIndex<3; PacketSizeIndex++)
+    {
+        uint32_t PacketSize = 4u << PacketSizeIndex;
+        uint32_t BlockWidth = PacketSize == 4 ? 2 : 4;
+        uint32_t BlockHeight = PacketSize / BlockWidth;
+
+        std::vector<pathState> PrimaryStates;
+        PrimaryStates.reserve(PrimaryRays.size());
+        PrimaryRayIndices.clear();
+        for(uint32_t by=0; by<Height; by+=BlockHeight)
+            for(uint32_t bx=0; bx<Width; bx+=BlockWidth)
+                for(uint32_t y=by; y<by+BlockHeight; y++)
+                    for(uint32_t x=bx; x<bx+BlockWidth; x++)
+                    {
+                        pathState State = {};
+                        State.Ray = PrimaryRays[y * Width + x];
+                        PrimaryStates.push_back(State);
+                        PrimaryRayIndices.push_back(y * Width + x);
+                    }
+        std::vector<uint32_t> PrimaryActive(PrimaryStates.size());
+        for(uint32_t i=0; i<(uint32_t)PrimaryActive.size(); i++) PrimaryActive[i] = i;
+
+        std::vector<pathState> *StateSets[] = {&PrimaryStates, &SecondaryStates};
+        std::vector<uint32_t> *ActiveSets[] = {&PrimaryActive, &SecondaryActive};
+        float RaysPerSecond[2] = {};
+        uint32_t PacketMismatches=0;
+        for(int Set=0; Set<2; Set++)
+        {
+            for(size_t i=0; i<StateSets[Set]->size(); i++) (*StateSets[Set])[i].RayPayload.Distance = 1e30f;
+
+            auto Start = std::chrono::high_resolution_clock::now();
+            TraceRays(*StateSets[Set], *ActiveSets[Set], true);
+            auto Stop = std::chrono::high_resolution_clock::now();
+            float Seconds = std::chrono::duration<float>(Stop - Start).count();
+            RaysPerSecond[Set] = Seconds > 0 ? (float)ActiveSets[Set]->size() / Seconds : 0;
+
+            for(uint32_t i=0; i<(uint32_t)StateSets[Set]->size(); i++)
+            {
+                uint32_t RayIndex = Set == 0 ? PrimaryRayIndices[i] : i;
+                if(!SameHitDistance((*StateSets[Set])[i].RayPayload.Distance, ReferenceDistances[Set][RayIndex])) PacketMismatches++;
+            }
+        }
+        std::cout << "Packet " << PacketSize << " : primary " << RaysPerSecond[0] / 1e6f << " MRays/s, secondary (octant sorted) " << RaysPerSecond[1] / 1e6f << " MRays/s, " 
+                  << PacketMismatches << " mismatches" << std::endl;
+        Mismatches += PacketMismatches;
+    }
+    PacketSizeIndex = PreviousPacketSizeIndex;
+
+    SetBVHLayout((bvhLayout)BVHLayout);
+    return Mismatches == 0;
+}
+
+bool pathTraceCPURenderer::BenchmarkOcclusion()
+{
+    std::vector<ray> PrimaryRays, SecondaryRays;
+    SetBVHLayout(bvhLayout::Binary);
+    GenerateBenchmarkRays(512, 512, PrimaryRays, SecondaryRays);
+
+    uint32_t TotalMismatches=0;
+    const char *LayoutNames[] = {"Binary", "BVH4", "BVH8", "Compressed"};
+    for(int Layout=0; Layout<4; Layout++)
+    {
+        SetBVHLayout((bvhLayout)Layout);
+
+        std::vector<ray> *RaySets[] = {&PrimaryRays, &SecondaryRays};
+        for(int Set=0; Set<2; Set++)
+        {
+            std::vector<ray> &Rays = *RaySets[Set];
+            std::vector<uint8_t> Hits(Rays.size());
+            auto Start = std::chrono::high_resolution_clock::now();
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                TLAS.Intersect(Rays[i], RayPayload);
+                Hits[i] = RayPayload.Distance != 1e30f;
+            }
+            auto Middle = std::chrono::high_resolution_clock::now();
+            uint32_t Mismatches=0;
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                if(TLAS.Occluded(Rays[i], 1e30f) != (bool)Hits[i]) Mismatches++;
+            }
+            auto Stop = std::chrono::high_resolution_clock::now();
+
+            float ClosestSeconds = std::chrono::duration<float>(Middle - Start).count();
+            float AnySeconds = std::chrono::duration<float>(Stop - Middle).count();
+            std::cout << LayoutNames[Layout] << (Set == 0 ? " primary" : " secondary") << " : closest hit " << (ClosestSeconds > 0 ? (float)Rays.size() / ClosestSeconds / 1e6f : 0) << " MRays/s"
+                      << ", any hit " << (AnySeconds > 0 ? (float)Rays.size() / AnySeconds / 1e6f : 0) << " MRays/s"
+                      << ", " << Mismatches << " mismatches" << std::endl;
+            TotalMismatches += Mismatches;
+        }
+    }
+
+    SetBVHLayout((bvhLayout)BVHLayout);
+    //Occluded() has to agree with Intersect() on every ray
+    return TotalMismatches == 0;
+}
+
+bool pathTraceCPURenderer::BenchmarkBuildModes()
+{
+    std::vector<ray> PrimaryRays, SecondaryRays;
+    SetBVHLayout(bvhLayout::Binary);
+    SetBVHBuildMode(bvhBuildMode::Binned);
+    GenerateBenchmarkRays(512, 512, PrimaryRays, SecondaryRays);
+
+    //Both builds hold the same triangles, so they must find the same hits
+    std::vector<float> ReferenceDistances[2];
+    uint32_t Mismatches=0;
+    const char *ModeNames[] = {"Binned", "Spatial"};
+    for(int Mode=0; Mode<2; Mode++)
+    {
+        auto Start = std::chrono::high_resolution_clock::now();
+        SetBVHBuildMode((bvhBuildMode)Mode, false);
+        auto Stop = std::chrono::high_resolution_clock::now();
+        float BuildTime = std::chrono::duration<float, std::milli>(Stop - Start).count();
+
+        size_t References=0, Triangles=0;
+        for(size_t i=0; i<Meshes.size(); i++)
+        {
+            References += Meshes[i]->BVH->TriangleIndices.size();
+            Triangles += Meshes[i]->Triangles.size();
+        }
+        std::cout << ModeNames[Mode] << " : build " << BuildTime << " ms, " << References << " references for " << Triangles << " triangles" << std::endl;
+
+        //Steps are counted in the blas of each instance whose bounds are hit, with the closest hit carried across instances
+        std::vector<ray> *RaySets[] = {&PrimaryRays, &SecondaryRays};
+        const char *SetNames[] = {"primary", "secondary"};
+        for(int Set=0; Set<2; Set++)
+        {
+            std::vector<ray> &Rays = *RaySets[Set];
+            traversalStats Stats;
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                ray Ray = Rays[i];
+                Ray.InverseDirection = 1.0f / Ray.Direction;
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                for(size_t j=0; j<Instances.size(); j++)
+                {
+                    if(RayAABBIntersection(Ray, Instances[j].Bounds.Min, Instances[j].Bounds.Max, RayPayload) == 1e30f) continue;
+                    ray LocalRay;
+                    LocalRay.Origin = Instances[j].InverseTransform * glm::vec4(Ray.Origin, 1);
+                    LocalRay.Direction = Instances[j].InverseTransform * glm::vec4(Ray.Direction, 0);
+                    LocalRay.InverseDirection = 1.0f / LocalRay.Direction;
+                    Meshes[Instances[j].MeshIndex]->BVH->IntersectStats(LocalRay, RayPayload, Instances[j].Index, Stats);
+                }
+            }
+
+            std::vector<float> Distances(Rays.size());
+            Start = std::chrono::high_resolution_clock::now();
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                TLAS.Intersect(Rays[i], RayPayload);
+                Distances[i] = RayPayload.Distance;
+            }
+            Stop = std::chrono::high_resolution_clock::now();
+            float Seconds = std::chrono::duration<float>(Stop - Start).count();
+
+            if(Mode == 0) ReferenceDistances[Set] = Distances;
+            uint32_t SetMismatches=0;
+            for(size_t i=0; i<Rays.size(); i++)
+            {
+                if(!SameHitDistance(Distances[i], ReferenceDistances[Set][i])) SetMismatches++;
+            }
+            Mismatches += SetMismatches;
+
+            float RayCount = (float)std::max((size_t)1, Rays.size());
+            std::cout << "    " << SetNames[Set] << " : " << Stats.NodeVisits / RayCount << " nodes/ray, " << Stats.TriangleTests / RayCount << " triangles/ray, "
+                      << (Seconds > 0 ? RayCount / Seconds / 1e6f : 0) << " MRays/s, " << SetMismatches << " mismatches" << std::endl;
+        }
+    }
+
+    SetBVHBuildMode((bvhBuildMode)BVHBuildMode);
+    SetBVHLayout((bvhLayout)BVHLayout);
+    return Mismatches == 0;
+}
+
+bool pathTraceCPURenderer::StartBenchmarkRenders()
+{
+    WaitForWorkers();
+    ShouldPathTrace=false;
+    ProcessingPathTrace=false;
+    PathTraceFinished=false;
+    BuildLights();
+    PathSampler = (samplerType)SamplerType;
+    bool PreviousAdaptiveSampling = AdaptiveSampling;
+    AdaptiveSampling = false;
+    return PreviousAdaptiveSampling;
+}
+
+double pathTraceCPURenderer::BenchmarkRender(uint32_t Passes)
+{
+    std::fill(AccumulationImage.begin(), AccumulationImage.end(), glm::vec3(0));
+    std::fill(SquaredLuminanceImage.begin(), SquaredLuminanceImage.end(), 0.0f);
+    ResetTiles();
+
+    auto Start = std::chrono::high_resolution_clock::now();
+    StartWorkers(Passes);
+    while(Scheduler.Running()) std::this_thread::yield();
+    auto Stop = std::chrono::high_resolution_clock::now();
+    float Seconds = std::chrono::duration<float>(Stop - Start).count();
+
+    double Samples = (double)(App->Width - (uint32_t)App->Scene->ViewportStart) * App->Height * Passes * SamplesPerFrame;
+    return Seconds > 0 ? Samples / Seconds : 0;
+}
+
+bool pathTraceCPURenderer::BenchmarkWavefront()
+{
+    //Same samples of the same view for both integrators, with the current traversal mode
+    uint32_t Passes = 4;
+    bool PreviousAdaptiveSampling = StartBenchmarkRenders();
+
+    const char *IntegratorNames[] = {"Megakernel", "Wavefront"};
+    double MeanLuminance[2] = {};
+    for(int i=0; i<2; i++)
+    {
+        Wavefront = i == INTEGRATOR_WAVEFRONT;
+        for(int Stage=0; Stage<4; Stage++) WavefrontStageTimes[Stage] = 0;
+        WavefrontRays[0] = WavefrontRays[1] = 0;
+
+        auto Start = std::chrono::high_resolution_clock::now();
+        double SamplesPerSecond = BenchmarkRender(Passes);
+        float Seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - Start).count();
+
+        double LuminanceSum=0;
+        for(size_t j=0; j<AccumulationImage.size(); j++) LuminanceSum += glm::dot(AccumulationImage[j], glm::vec3(0.2126f, 0.7152f, 0.0722f));
+        MeanLuminance[i] = LuminanceSum / std::max((size_t)1, AccumulationImage.size()) / (Passes * SamplesPerFrame);
+
+        std::cout << IntegratorNames[i] << " : " << SamplesPerSecond / 1e6 << " MSamples/s, mean luminance " << MeanLuminance[i] << std::endl;
+        if(Wavefront)
+        {
+            std::cout << "    generate " << WavefrontStageTimes[0] << " ms, extend " << WavefrontStageTimes[1] << " ms, shade " << WavefrontStageTimes[2] << " ms, connect " << WavefrontStageTimes[3] << " ms" << std::endl;
+            std::cout << "    " << (Seconds > 0 ? (double)(WavefrontRays[0] + WavefrontRays[1]) / Seconds / 1e6 : 0) << " MRays/s, " 
+                      << WavefrontRays[0] << " extension rays, " << WavefrontRays[1] << " shadow rays" << std::endl;
+        }
+    }
+
+    AdaptiveSampling = PreviousAdaptiveSampling;
+    Wavefront = Integrator == INTEGRATOR_WAVEFRONT;
+
+    //Both integrators estimate the same image, the mean of a few samples per pixel over the whole view only differs by the noise
+    return std::abs(MeanLuminance[0] - MeanLuminance[1]) <= WAVEFRONT_LUMINANCE_TOLERANCE * std::max(MeanLuminance[0], 1e-3);
+}
+
+bool pathTraceCPURenderer::BenchmarkTextures()
+{
+    bool PreviousAdaptiveSampling = StartBenchmarkRenders();
+
+    //Textures the path tracer samples
+    std::vector<vulkanTexture*> Textures;
+    for(size_t i=0; i<App->Scene->Materials.size(); i++)
+    {
+        sceneMaterial &Material = App->Scene->Materials[i];
+        vulkanTexture *MaterialTextures[] = {&Material.Diffuse, &Material.Specular, &Material.Emission};
+        for(int j=0; j<3; j++)
+        {
+            if(!MaterialTextures[j]->Mips.empty()) Textures.push_back(MaterialTextures[j]);
+        }
+    }
+    if(Textures.empty())
+    {
+        std::cout << "No texture in the scene" << std::endl;
+        AdaptiveSampling = PreviousAdaptiveSampling;
+        return true;
+    }
+
+    //Walks of one texel per fetch on the full resolution image, starting at random points. The random walk jumps anywhere at each fetch.
+    const char *WalkNames[] = {"Horizontal", "Vertical", "Diagonal", "Random"};
+    const uint32_t WalkLength = 256;
+    const uint32_t Walks = 4096;
+
+    //Both layouts hold the same texels, so each walk must sum to the same value
+    const char *LayoutNames[] = {"Rows", "Blocks"};
+    glm::vec4 WalkSums[2][4];
+    double SamplesPerSecond[2];
+    for(int Layout=0; Layout<2; Layout++)
+    {
+        for(size_t i=0; i<Textures.size(); i++) Textures[i]->SetTiled(Layout == 1);
+
+        std::cout << LayoutNames[Layout] << " :" << std::endl;
+        for(int Walk=0; Walk<4; Walk++)
+        {
+            uint32_t RandomState = 1;
+            glm::vec4 Sum(0);
+            uint64_t Fetches = 0;
+            auto Start = std::chrono::high_resolution_clock::now();
+            for(size_t i=0; i<Textures.size(); i++)
+            {
+                vulkanTexture *Texture = Textures[i];
+                glm::vec2 TexelSize = 1.0f / glm::vec2(Texture->Width, Texture->Height);
+                glm::vec2 Step = Walk == 0 ? glm::vec2(TexelSize.x, 0) : Walk == 1 ? glm::vec2(0, TexelSize.y) : TexelSize;
+                for(uint32_t j=0; j<Walks; j++)
+                {
+                    glm::vec2 UV(RandomUnilateral(RandomState), RandomUnilateral(RandomState));
+                    for(uint32_t k=0; k<WalkLength; k++)
+                    {
+                        if(Walk == 3) UV = glm::vec2(RandomUnilateral(RandomState), RandomUnilateral(RandomState));
+                        else UV += Step;
+                        Sum += Texture->Sample(UV);
+                    }
+                }
+                Fetches += (uint64_t)Walks * WalkLength;
+            }
+            float Seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - Start).count();
+            WalkSums[Layout][Walk] = Sum;
+            //Printing the sum keeps the lookups from being optimized out
+            std::cout << "    " << WalkNames[Walk] << " : " << (Seconds > 0 ? (double)Fetches / Seconds / 1e6 : 0) << " MFetches/s (" << Sum.x + Sum.y + Sum.z + Sum.w << ")" << std::endl;
+        }
+
+        SamplesPerSecond[Layout] = BenchmarkRender(4);
+        std::cout << "    Path tracer : " << SamplesPerSecond[Layout] / 1e6 << " MSamples/s" << std::endl;
+    }
+    std::cout << "Blocks speedup : " << (SamplesPerSecond[0] > 0 ? SamplesPerSecond[1] / SamplesPerSecond[0] : 0) << "x on " << Textures.size() << " textures" << std::endl;
+
+    AdaptiveSampling = PreviousAdaptiveSampling;
+
+    bool Passed = true;
+    for(int Walk=0; Walk<4; Walk++)
+    {
+        if(WalkSums[0][Walk] != WalkSums[1][Walk]) Passed = false;
+    }
+    return Passed;
+}
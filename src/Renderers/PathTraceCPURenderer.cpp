@@ -7,6 +7,7 @@
 
 #include "../Swapchain.h"
 #include "../ImGuiHelper.h"
+#include "../RayPacket.h"
 #include <iostream>
 
 #define DIFFUSE_TYPE 1
@@ -16,6 +17,25 @@
 #define BACKGROUND_TYPE_COLOR 1
 #define BACKGROUND_TYPE_DIRLIGHT 2
 
+#define TRAVERSAL_SINGLE 0
+#define TRAVERSAL_PACKET 1
+#define TRAVERSAL_STREAM 2
+
+#define INTEGRATOR_MEGAKERNEL 0
+#define INTEGRATOR_WAVEFRONT 1
+
+//Paths in flight in the wavefront, and the paths of a job in each of its stages
+#define WAVEFRONT_SIZE (256 * 1024)
+#define WAVEFRONT_CHUNK 1024
+
+//Adaptive sampling : samples per pixel before a tile can be found converged, 
+//and offset of the mean luminance in the relative error, so black pixels can converge too
+#define ADAPTIVE_MIN_SAMPLES 32
+#define ADAPTIVE_ERROR_OFFSET 0.01f
+
+//Shadow rays towards emissive triangles stop at that ratio of the distance
+#define SHADOW_RAY_END_SCALE 0.999f
+
 
 float GAMMA = 2.2f;
 float INV_GAMMA = 1.0f / GAMMA;
@@ -82,13 +102,45 @@ pathTraceCPURenderer::pathTraceCPURenderer(vulkanApp *App) : renderer(App) {
 
 void pathTraceCPURenderer::StartPathTrace()
 {
-    PathTraceFinished=true;
+    WaitForWorkers();
+    BuildLights();
+    PathSampler = (samplerType)SamplerType;
+    Wavefront = Integrator == INTEGRATOR_WAVEFRONT;
+
+    PathTraceFinished=false;
     ShouldPathTrace=true;
     CurrentSampleCount=0;
     for(uint32_t i=0; i<AccumulationImage.size(); i++)
     {
         AccumulationImage[i] = glm::vec3(0);
+        SquaredLuminanceImage[i] = 0;
+    }
+
+    ResetTiles();
+    start = std::chrono::high_resolution_clock::now();
+}
+
+void pathTraceCPURenderer::ResetTiles()
+{
+    //Tiles under the cursor first, or at the center of the viewport when the cursor is on the UI
+    uint32_t ViewportStart = (uint32_t)App->Scene->ViewportStart;
+    float FocusX = (App->Scene->ViewportStart + (float)App->Width) * 0.5f;
+    float FocusY = (float)App->Height * 0.5f;
+    if(App->Mouse.PosX >= App->Scene->ViewportStart && App->Mouse.PosX < (float)App->Width && App->Mouse.PosY >= 0 && App->Mouse.PosY < (float)App->Height)
+    {
+        FocusX = App->Mouse.PosX;
+        FocusY = App->Mouse.PosY;
     }
+    //The wavefront renders the whole viewport at once : one tile, so the scheduler still counts its passes
+    uint32_t SchedulerTileSize = Wavefront ? std::max(App->Width, App->Height) : (uint32_t)TileSize;
+    Scheduler.Reset(ViewportStart, 0, App->Width - ViewportStart, App->Height, SchedulerTileSize, FocusX, FocusY);
+    UploadedTilePasses.assign(Scheduler.Tiles.size(), 0);
+}
+
+void pathTraceCPURenderer::WaitForWorkers()
+{
+    Scheduler.Stop();
+    while(ThreadPool.Busy()) std::this_thread::yield();
 }
 
 void pathTraceCPURenderer::Render()
@@ -96,20 +148,29 @@ void pathTraceCPURenderer::Render()
     if(ShouldPathTrace)
     {
         ProcessingPreview=false;
-        if(!ThreadPool.Busy()) PathTrace();    
+        //Workers are stopped when the bvhs change, they resume where they were
+        if(!Scheduler.Running() && !ThreadPool.Busy()) PathTrace();
+        CurrentSampleCount = Scheduler.CompletedPasses() * SamplesPerFrame;
     }
 
-    if(CurrentSampleCount >= TotalSamples)
+    if(ShouldPathTrace && Scheduler.Finished())
     {
         ShouldPathTrace=false;
         PathTraceFinished=true;
         ProcessingPathTrace=false;
+
+        stop = std::chrono::high_resolution_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
+        float seconds = (float)duration.count() / 1000.0f;
+        std::cout << seconds << std::endl;  
     }
 
     if(App->Scene->Camera.Changed || App->Scene->Changed)
     {
         ShouldPathTrace=false;
         ProcessingPathTrace=false;
+        //Frees the threads for the preview
+        Scheduler.Stop();
         Preview();    
     }
 
@@ -117,19 +178,22 @@ void pathTraceCPURenderer::Render()
     
     if(ProcessingPathTrace || PathTraceFinished)
     {
+        //Only the tiles that got a new pass since the last frame are uploaded
         VulkanObjects.ImageStagingBuffer.Map();
-        VulkanObjects.ImageStagingBuffer.CopyTo(Image.data(), Image.size() * sizeof(rgba8));
-        VulkanObjects.ImageStagingBuffer.Unmap();
-
-        if(!ThreadPool.Busy() && !PathTraceFinished)
+        for(uint32_t i=0; i<(uint32_t)Scheduler.Tiles.size(); i++)
         {
-            stop = std::chrono::high_resolution_clock::now();
-            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - start);
-            float seconds = (float)duration.count() / 1000.0f;
-            std::cout << seconds << std::endl;  
+            uint32_t Passes = Scheduler.TilePasses(i);
+            if(Passes == UploadedTilePasses[i]) continue;
+            UploadedTilePasses[i] = Passes;
 
-            PathTraceFinished=true; 
+            const tile &Tile = Scheduler.Tiles[i];
+            for(uint32_t y=Tile.StartY; y<Tile.StartY+Tile.Height; y++)
+            {
+                size_t Offset = (size_t)y * App->Width + Tile.StartX;
+                VulkanObjects.ImageStagingBuffer.CopyTo(&Image[Offset], Tile.Width * sizeof(rgba8), Offset * sizeof(rgba8));
+            }
         }
+        VulkanObjects.ImageStagingBuffer.Unmap();
     }
 
     if(ProcessingPreview)
@@ -298,8 +362,6 @@ void pathTraceCPURenderer::PreviewTile(uint32_t StartX, uint32_t StartY, uint32_
                 if(MatData->BaseColorTextureID >=0 && MatData->UseBaseColor>0)
                 {
                     glm::vec4 TextureColor = DiffuseTexture->Sample(UV);
-                    
-                    TextureColor *= glm::pow(TextureColor, glm::vec4(2.2f));
                     BaseColor *= glm::vec3(TextureColor);                    
                 }                
 
@@ -337,239 +399,821 @@ float RandomBilateral(uint32_t &State)
     return RandomUnilateral(State) * 2.0f - 1.0f;
 }
 
-void pathTraceCPURenderer::PathTraceTile(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, std::vector<rgba8>* ImageToWrite)
+//Power heuristic (beta = 2) weight of the technique that sampled with Pdf
+float PowerHeuristic(float Pdf, float OtherPdf)
 {
-    uint32_t RayBounces=4;
-    ray Ray = {}; 
+    float PdfSquared = Pdf * Pdf;
+    float OtherPdfSquared = OtherPdf * OtherPdf;
+    if(PdfSquared + OtherPdfSquared == 0) return 0;
+    return PdfSquared / (PdfSquared + OtherPdfSquared);
+}
+
+void pathTraceCPURenderer::GeneratePrimaryRay(pathState &State, uint32_t x, uint32_t y, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleIndex)
+{
+    State.Sampler.Start(PathSampler, x, y, SampleIndex);
+
     glm::vec2 InverseImageSize = 1.0f / glm::vec2(ImageWidth, ImageHeight);
+
+    //Origin
+    glm::mat4 ModelMatrix = App->Scene->Camera.GetModelMatrix();
+    glm::vec3 Origin(ModelMatrix[3][0],ModelMatrix[3][1],ModelMatrix[3][2]);
     
-    rayPayload RayPayload = {};
-                 
+    glm::vec2 uv((float)(x - App->Scene->ViewportStart) / (float)(ImageWidth-App->Scene->ViewportStart), (float)y / (float)ImageHeight);
+    glm::vec4 Target = glm::inverse(App->Scene->Camera.GetProjectionMatrix()) * glm::vec4(uv.x * 2.0f - 1.0f, uv.y * 2.0f - 1.0f, 0.0f, 1.0f);
+
+    //Jitter
+    glm::vec2 Jitter = (State.Sampler.Get2D(SAMPLER_CAMERA) * 2.0f - 1.0f) * InverseImageSize;
+    glm::vec3 JitteredTarget = glm::vec3(Target + glm::vec4(Jitter,0,0));
+
+    State.Ray.Origin = Origin;
+    State.Ray.Direction = glm::vec3(ModelMatrix * glm::vec4(glm::normalize(JitteredTarget), 0.0));
+    State.RayPayload.Depth=0;
+    State.RayPayload.Distance = 1e30f;
+    //Spread of one pixel
+    State.RayPayload.ConeWidth = 0;
+    State.RayPayload.ConeSpread = 2.0f * std::tan(glm::radians(App->Scene->Camera.GetFov()) * 0.5f) / (float)ImageHeight;
+    State.Attenuation = glm::vec3(1.0);
+    State.Radiance = glm::vec3(0);
+    State.BRDFPdf = 0;
+    State.EnvironmentPdf = 0;
+    State.ShadowRayCount = 0;
+}
+
+void pathTraceCPURenderer::ShadeMiss(pathState &State)
+{
+    //Sky
+    // if(SceneUbo.Data.BackgroundType ==BACKGROUND_TYPE_CUBEMAP)
+    // {
+    //     vec3 SkyDirection = Direction.xyz;
+    //     SkyDirection.y *=-1;
+    //     Radiance += Attenuation * SceneUbo.Data.BackgroundIntensity * texture(IrradianceMap, SkyDirection).rgb;
+    // }
+    float Weight = State.BRDFPdf > 0 ? PowerHeuristic(State.BRDFPdf, State.EnvironmentPdf) : 1.0f;
+    State.Radiance += State.Attenuation * GetBackground(State.Ray.Direction) * Weight;
+}
+
+glm::vec3 pathTraceCPURenderer::GetBackground(glm::vec3 Direction)
+{
+    float BackgroundType = App->Scene->UBOSceneMatrices.BackgroundType;
+    if(BackgroundType == BACKGROUND_TYPE_CUBEMAP)
+    {
+        environmentMap &EnvironmentMap = App->Scene->Cubemap.EnvironmentMap;
+        if(!EnvironmentMap.Empty()) return App->Scene->UBOSceneMatrices.BackgroundIntensity * EnvironmentMap.Eval(Direction);
+    }
+    else if(BackgroundType == BACKGROUND_TYPE_COLOR)
+    {
+        return App->Scene->UBOSceneMatrices.BackgroundIntensity * App->Scene->UBOSceneMatrices.BackgroundColor;
+    }
+    return glm::vec3(0);
+}
+
+float pathTraceCPURenderer::GetEnvironmentPdf(glm::vec3 Normal, glm::vec3 Direction)
+{
+    if(EnvironmentProbability == 0) return 0;
+    if(App->Scene->UBOSceneMatrices.BackgroundType == BACKGROUND_TYPE_CUBEMAP) return EnvironmentProbability * App->Scene->Cubemap.EnvironmentMap.Pdf(Direction);
+    return EnvironmentProbability * std::max(glm::dot(Normal, Direction), 0.0f) / PI;
+}
+
+glm::vec3 pathTraceCPURenderer::GetEmission(uint32_t InstanceIndex, uint32_t PrimitiveIndex, float U, float V)
+{
+    return GetTriangleEmission(App->Scene->InstancesPointers[InstanceIndex], Meshes[Instances[InstanceIndex].MeshIndex], PrimitiveIndex, U, V);
+}
+
+void pathTraceCPURenderer::BuildLights()
+{
+    Lights.Clear((uint32_t)Instances.size());
+    EnvironmentProbability=0;
+    if(!LightSampling) return;
+
+    Lights.Build(App->Scene, Meshes);
+
+    float BackgroundType = App->Scene->UBOSceneMatrices.BackgroundType;
+    bool HasBackground = false;
+    if(BackgroundType == BACKGROUND_TYPE_CUBEMAP) HasBackground = !App->Scene->Cubemap.EnvironmentMap.Empty() && App->Scene->UBOSceneMatrices.BackgroundIntensity > 0;
+    else if(BackgroundType == BACKGROUND_TYPE_COLOR) HasBackground = Luminance(App->Scene->UBOSceneMatrices.BackgroundIntensity * App->Scene->UBOSceneMatrices.BackgroundColor) > 0;
+    if(HasBackground)
+    {
+        EnvironmentProbability = Lights.Empty() ? 1.0f : 0.5f;
+    }
+}
+
+bool pathTraceCPURenderer::SampleLights(glm::vec3 Position, glm::vec3 Normal, glm::vec3 V, glm::vec3 BaseColor, float Roughness, float Metallic, float SpecularProbability, bool UseMIS, pathSampler &Sampler, shadowRay &ShadowRay)
+{
+    if(EnvironmentProbability == 0 && Lights.Empty()) return false;
+
+    glm::vec3 L;
+    float LightPdf;
+    float Distance;
+    glm::vec3 LightRadiance;
+    bool SampleEnvironment = Sampler.Get1D(SAMPLER_LIGHT_PICK) < EnvironmentProbability;
+    if(SampleEnvironment && App->Scene->UBOSceneMatrices.BackgroundType == BACKGROUND_TYPE_CUBEMAP)
+    {
+        glm::vec2 Xi = Sampler.Get2D(SAMPLER_LIGHT_POINT);
+        float EnvironmentPdf;
+        L = App->Scene->Cubemap.EnvironmentMap.Sample(Xi.x, Xi.y, EnvironmentPdf);
+        if(glm::dot(L, Normal) <= 0) return false;
+        LightPdf = EnvironmentProbability * EnvironmentPdf;
+        Distance = 1e30f;
+        LightRadiance = GetBackground(L);
+    }
+    else if(SampleEnvironment)
+    {
+        //Constant background : cosine weighted around the normal
+        glm::vec2 Xi = Sampler.Get2D(SAMPLER_LIGHT_POINT);
+        glm::vec3 T, B;
+        ONB(Normal, T, B);
+        glm::vec3 LocalDirection = SampleHemisphere(Xi);
+        L = LocalDirection.x * T + LocalDirection.y * B + LocalDirection.z * Normal;
+        LightPdf = EnvironmentProbability * LocalDirection.z / PI;
+        Distance = 1e30f;
+        LightRadiance = App->Scene->UBOSceneMatrices.BackgroundIntensity * App->Scene->UBOSceneMatrices.BackgroundColor;
+    }
+    else
+    {
+        float Random0 = Sampler.Get1D(SAMPLER_LIGHT_TREE);
+        glm::vec2 Xi = Sampler.Get2D(SAMPLER_LIGHT_POINT);
+        lightSample Sample = Lights.Sample(Position, Normal, Random0, Xi.x, Xi.y);
+
+        glm::vec3 ToLight = Sample.Position - Position;
+        float DistanceSquared = glm::dot(ToLight, ToLight);
+        Distance = std::sqrt(DistanceSquared);
+        if(Distance == 0) return false;
+        L = ToLight / Distance;
+        float LightCosine = std::abs(glm::dot(Sample.Normal, L));
+        if(LightCosine == 0 || Sample.Pdf == 0) return false;
+        LightPdf = (1.0f - EnvironmentProbability) * Sample.Pdf * DistanceSquared / LightCosine;
+        LightRadiance = GetEmission(Sample.InstanceIndex, Sample.PrimitiveIndex, Sample.U, Sample.V);
+    }
+    if(LightPdf <= 0) return false;
+
+    glm::vec3 BRDF = EvalBRDF(Normal, L, V, BaseColor, Roughness, Metallic);
+    if(Luminance(BRDF * LightRadiance) == 0) return false;
+
+    //Stops just before the light, so it doesn't occlude itself
+    ShadowRay.Ray = {Position, L, 1.0f / L};
+    ShadowRay.MaxDistance = Distance == 1e30f ? 1e30f : Distance * SHADOW_RAY_END_SCALE;
+
+    float Weight = UseMIS ? PowerHeuristic(LightPdf, BRDFPdf(Normal, L, V, Roughness, SpecularProbability)) : 1.0f;
+    ShadowRay.Contribution = BRDF * LightRadiance * Weight / LightPdf;
+    return true;
+}
+
+float pathTraceCPURenderer::GetConeLod(rayPayload &RayPayload, glm::vec3 Direction, bvh *BVH)
+{
+    RayPayload.ConeWidth += RayPayload.ConeSpread * RayPayload.Distance;
+
+    const triangle &Triangle = BVH->Mesh->Triangles[RayPayload.PrimitiveIndex];
+    const triangleExtraData &ExtraData = BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex];
+    glm::mat3 Transform(App->Scene->InstancesPointers[RayPayload.InstanceIndex]->InstanceData.Transform);
+    glm::vec3 GeometricNormal = glm::cross(Transform * (Triangle.v1 - Triangle.v0), Transform * (Triangle.v2 - Triangle.v0));
+    float WorldArea = glm::length(GeometricNormal);
+    glm::vec2 UVEdge1 = ExtraData.UV1 - ExtraData.UV0;
+    glm::vec2 UVEdge2 = ExtraData.UV2 - ExtraData.UV0;
+    float UVArea = std::abs(UVEdge1.x * UVEdge2.y - UVEdge1.y * UVEdge2.x);
+    if(WorldArea == 0 || UVArea == 0 || RayPayload.ConeWidth <= 0) return -1e30f;
+
+    //Clamped, grazing angles would pick the last mips
+    float Cosine = std::max(std::abs(glm::dot(GeometricNormal / WorldArea, Direction)), 0.01f);
+    return 0.5f * std::log2(UVArea / WorldArea) + std::log2(RayPayload.ConeWidth / Cosine);
+}
+
+bool pathTraceCPURenderer::ShadeHit(pathState &State, uint32_t Bounce, uint32_t RayBounces)
+{
+    ray &Ray = State.Ray;
+    rayPayload &RayPayload = State.RayPayload;
+    glm::vec3 &Attenuation = State.Attenuation;
+    glm::vec3 &Radiance = State.Radiance;
+    glm::vec3 V = -Ray.Direction;
+    glm::vec3 Position = Ray.Origin + RayPayload.Distance * Ray.Direction;
+    State.Sampler.StartBounce(Bounce);
+    State.ShadowRayCount = 0;
+
+    ////Unpack triangle data
+    sceneMaterial *Material = App->Scene->InstancesPointers[RayPayload.InstanceIndex]->Mesh->Material;
+    materialData *MatData = &Material->MaterialData;
+    vulkanTexture *DiffuseTexture = &Material->Diffuse;
+    vulkanTexture *MetallicRoughnessTexture = &Material->Specular;
+    
+    bvh *BVH =  Instances[RayPayload.InstanceIndex].Meshes->at(Instances[RayPayload.InstanceIndex].MeshIndex)->BVH;
+    
+    glm::vec2 UV = 
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV1 * RayPayload.U + 
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV2 * RayPayload.V +
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV0 * (1 - RayPayload.U - RayPayload.V);
+    
+    glm::vec3 Normal = 
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal1 * RayPayload.U + 
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal2 * RayPayload.V +
+        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal0 * (1 - RayPayload.U - RayPayload.V);
+    
+    // Emission
+    glm::vec3 Emission = GetEmission(RayPayload.InstanceIndex, RayPayload.PrimitiveIndex, RayPayload.U, RayPayload.V);
+
+    float ConeLod = GetConeLod(RayPayload, Ray.Direction, BVH);
+
+    glm::vec3 BaseColor = MatData->BaseColor;
+    if(MatData->BaseColorTextureID >=0 && MatData->UseBaseColor>0)
+    {
+        //Already in linear, the importers tag base color maps as sRGB
+        glm::vec4 TextureColor = DiffuseTexture->Sample(UV, DiffuseTexture->GetLod(ConeLod));
+        BaseColor *= glm::vec3(TextureColor);                    
+    }
+
+    float Roughness = MatData->Roughness;
+    float Metallic = MatData->Metallic;
+    if(MatData->MetallicRoughnessTextureID >=0 && MatData->UseMetallicRoughness>0)
+    {
+        glm::vec2 RoughnessMetallic = glm::vec2(MetallicRoughnessTexture->Sample(UV, MetallicRoughnessTexture->GetLod(ConeLod)));
+        Metallic *= RoughnessMetallic.r;
+        Roughness *= RoughnessMetallic.g;
+    }    
+
+    //Emission found by the brdf sampling, weighted against the light sampling of the previous bounce that could have picked it
+    float EmissionWeight = 1.0f;
+    if(State.BRDFPdf > 0 && Luminance(Emission) > 0)
+    {
+        float LightPdf = (1.0f - EnvironmentProbability) * Lights.Pdf(Ray.Origin, State.PreviousNormal, RayPayload.InstanceIndex, RayPayload.PrimitiveIndex, Ray.Direction, RayPayload.Distance);
+        EmissionWeight = PowerHeuristic(State.BRDFPdf, LightPdf);
+    }
+    Radiance += Attenuation * Emission * EmissionWeight;
+
+    if(App->Scene->UBOSceneMatrices.BackgroundType == BACKGROUND_TYPE_DIRLIGHT)
+    {
+        glm::vec3 L = normalize(-App->Scene->UBOSceneMatrices.LightDirection);
+        shadowRay &ShadowRay = State.ShadowRays[State.ShadowRayCount++];
+        ShadowRay.Ray = {
+            Position,
+            L,
+            1.0f / L
+        };
+        ShadowRay.MaxDistance = 1e30f;
+        ShadowRay.Contribution = Attenuation * EvalCombinedBRDF(Normal, L, V, BaseColor, Metallic) * App->Scene->UBOSceneMatrices.BackgroundIntensity* App->Scene->UBOSceneMatrices.BackgroundColor;
+    }
+
+    //Probability of sampling the specular brdf, 1 for pure mirrors
+    bool Mirror = Metallic == 1.0f && Roughness == 0.0f;
+    float brdfProbability = Mirror ? 1.0f : GetBrdfProbability(RayPayload, V, Normal, BaseColor, Metallic);
+
+    //Next event estimation. The brdf sampling of the last bounce is not traced, so its light samples take the full weight.
+    if(!Mirror)
+    {
+        shadowRay &ShadowRay = State.ShadowRays[State.ShadowRayCount];
+        if(SampleLights(Position, Normal, V, BaseColor, Roughness, Metallic, brdfProbability, Bounce < RayBounces-1, State.Sampler, ShadowRay))
+        {
+            ShadowRay.Contribution *= Attenuation;
+            State.ShadowRayCount++;
+        }
+    }
+
+    if(Bounce == RayBounces-1) return false;
+    
+    // Russian roulette
+    {
+        if (Bounce >= 3)
+        {
+            float q = std::min(std::max(Attenuation.x, std::max(Attenuation.y, Attenuation.z)) + 0.001f, 0.95f);
+            if (State.Sampler.Get1D(SAMPLER_ROULETTE) > q)
+                return false;
+            Attenuation /= q;
+        }
+    }
+    
+
+    //Eval brdf
+    {
+        int brdfType = DIFFUSE_TYPE;
+        if (Mirror) {
+            brdfType = SPECULAR_TYPE;
+        } else {
+            if (State.Sampler.Get1D(SAMPLER_LOBE) < brdfProbability) {
+                brdfType = SPECULAR_TYPE;
+                Attenuation /= brdfProbability;
+            } else {
+                brdfType = DIFFUSE_TYPE;
+                Attenuation /= (1.0f - brdfProbability);
+            }
+        }
+
+        glm::vec3 brdfWeight;
+        glm::vec2 Xi = State.Sampler.Get2D(SAMPLER_BRDF);
+        glm::vec3 ScatterDir = glm::vec3(0);
+        
+        if(brdfType == DIFFUSE_TYPE)
+        {
+            if (!SampleDiffuseBRDF(Xi, Normal, V,  ScatterDir, brdfWeight, BaseColor, Metallic)) {
+                return false;
+            }
+        }
+        else if(brdfType == SPECULAR_TYPE)
+        {
+            if (!SampleSpecularBRDF(Xi, Normal, V,  ScatterDir, brdfWeight, BaseColor, Roughness, Metallic)) {
+                return false;
+            }
+        }
+
+        //the weights already contains color * brdf * cosine term / pdf
+        Attenuation *= brdfWeight;						
+
+        //Mirror directions can't be picked by the light sampling
+        bool DeltaSpecular = brdfType == SPECULAR_TYPE && Roughness < DELTA_SPECULAR_ROUGHNESS;
+        State.BRDFPdf = DeltaSpecular ? 0.0f : BRDFPdf(Normal, ScatterDir, V, Roughness, brdfProbability);
+        State.EnvironmentPdf = GetEnvironmentPdf(Normal, ScatterDir);
+        State.PreviousNormal = Normal;
+
+        //No curvature term : the cone spreads with the width of the sampled lobe, a full radian for diffuse bounces
+        RayPayload.ConeSpread += brdfType == DIFFUSE_TYPE ? 1.0f : Roughness * Roughness;
+
+        Ray.Origin = Position;
+        Ray.Direction = ScatterDir;
+        RayPayload.Distance = 1e30f;
+    }
+    return true;
+}
+
+void pathTraceCPURenderer::Connect(pathState &State)
+{
+    for(uint32_t i=0; i<State.ShadowRayCount; i++)
+    {
+        const shadowRay &ShadowRay = State.ShadowRays[i];
+        if(!TLAS.Occluded(ShadowRay.Ray, ShadowRay.MaxDistance)) State.Radiance += ShadowRay.Contribution;
+    }
+    State.ShadowRayCount = 0;
+}
+
+void pathTraceCPURenderer::ResolvePixel(uint32_t PixelIndex, glm::vec3 SampleColor, float SampleSquaredLuminance, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite)
+{
+    AccumulationImage[PixelIndex] += SampleColor;
+    SquaredLuminanceImage[PixelIndex] += SampleSquaredLuminance;
+
+    glm::vec3 Color = AccumulationImage[PixelIndex] / (float)SampleCount;
+
+    Color = toneMap(Color, App->Scene->UBOSceneMatrices.Exposure);
+    Color = glm::clamp(Color, glm::vec3(0), glm::vec3(1));
+
+    uint8_t r = (uint8_t)(Color.r * 255.0f);
+    uint8_t g = (uint8_t)(Color.g * 255.0f);
+    uint8_t b = (uint8_t)(Color.b * 255.0f);
+
+    (*ImageToWrite)[PixelIndex] = {b, g, r, 255 };
+}
+
+void pathTraceCPURenderer::PathTraceTile(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite)
+{
+    uint32_t RayBounces=4;
+    pathState State = {};
 
     for(uint32_t yy=StartY; yy < StartY+TileHeight; yy++)
     {
         for(uint32_t xx=StartX; xx < StartX+TileWidth; xx++)
         {
-            RayPayload.RandomState = (xx * 1973 + yy * 9277 + CurrentSampleCount * 26699) | 1; 
-
-            if(xx >= ImageWidth-1) break;
+            if(xx >= ImageWidth) break;
             (*ImageToWrite)[yy * ImageWidth + xx] = { 0, 0, 0, 0 };
 
             glm::vec3 SampleColor(0.0f);
-
-            //Origin
-            glm::mat4 ModelMatrix = App->Scene->Camera.GetModelMatrix();
-            glm::vec3 Origin(ModelMatrix[3][0],ModelMatrix[3][1],ModelMatrix[3][2]);
-            
-            glm::vec2 uv((float)(xx - App->Scene->ViewportStart) / (float)(ImageWidth-App->Scene->ViewportStart), (float)yy / (float)ImageHeight);
-            Ray.Origin = Origin;
-            glm::vec4 Target = glm::inverse(App->Scene->Camera.GetProjectionMatrix()) * glm::vec4(uv.x * 2.0f - 1.0f, uv.y * 2.0f - 1.0f, 0.0f, 1.0f);
-        
+            float SampleSquaredLuminance=0;
             for(uint32_t Sample=0; Sample<SamplesPerFrame; Sample++)
             {   
-                RayPayload.Depth=0;
-
-                glm::vec3 V = -Ray.Direction;
-                //Jitter
-                glm::vec2 Jitter = (glm::vec2(RandomBilateral(RayPayload.RandomState), RandomBilateral(RayPayload.RandomState))) * InverseImageSize;
-                glm::vec3 JitteredTarget = glm::vec3(Target + glm::vec4(Jitter,0,0));
-                Ray.Direction = glm::vec3(App->Scene->Camera.GetModelMatrix() * glm::vec4(glm::normalize(JitteredTarget), 0.0));
-                
-                glm::vec3 Attenuation(1.0);
-                glm::vec3 Radiance(0);
-                
-                
-                RayPayload.Distance = 1e30f;
+                GeneratePrimaryRay(State, xx, yy, ImageWidth, ImageHeight, SampleCount + Sample);
                 for(uint32_t j=0; j<RayBounces; j++)
                 {
-                    TLAS.Intersect(Ray, RayPayload);
-                        
-                    //Sky
+                    TLAS.Intersect(State.Ray, State.RayPayload);
+                    if(State.RayPayload.Distance == 1e30f)
                     {
-                        if(RayPayload.Distance == 1e30f)
-                        {
-                            // if(SceneUbo.Data.BackgroundType ==BACKGROUND_TYPE_CUBEMAP)
-                            // {
-                            //     vec3 SkyDirection = Direction.xyz;
-                            //     SkyDirection.y *=-1;
-                            //     Radiance += Attenuation * SceneUbo.Data.BackgroundIntensity * texture(IrradianceMap, SkyDirection).rgb;
-                            // }
-                            if(App->Scene->UBOSceneMatrices.BackgroundType == BACKGROUND_TYPE_COLOR)
-                            {
-                                Radiance += Attenuation * App->Scene->UBOSceneMatrices.BackgroundIntensity * App->Scene->UBOSceneMatrices.BackgroundColor;
-                            }
-                            break;
-                        }
+                        ShadeMiss(State);
+                        break;
                     }
+                    bool Continue = ShadeHit(State, j, RayBounces);
+                    Connect(State);
+                    if(!Continue) break;
+                }
+                SampleColor += State.Radiance;	
+                SampleSquaredLuminance += Luminance(State.Radiance) * Luminance(State.Radiance);
+            }
 
-                    ////Unpack triangle data
-                    sceneMaterial *Material = App->Scene->InstancesPointers[RayPayload.InstanceIndex]->Mesh->Material;
-                    materialData *MatData = &Material->MaterialData;
-                    vulkanTexture *DiffuseTexture = &Material->Diffuse;
-                    vulkanTexture *MetallicRoughnessTexture = &Material->Specular;
-                    vulkanTexture *EmissionTexture = &Material->Emission;                 
-                    
-                    bvh *BVH =  Instances[RayPayload.InstanceIndex].Meshes->at(Instances[RayPayload.InstanceIndex].MeshIndex)->BVH;
-                    
-                    glm::vec2 UV = 
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV1 * RayPayload.U + 
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV2 * RayPayload.V +
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].UV0 * (1 - RayPayload.U - RayPayload.V);
-                    
-                    glm::vec3 Normal = 
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal1 * RayPayload.U + 
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal2 * RayPayload.V +
-                        BVH->Mesh->TrianglesExtraData[RayPayload.PrimitiveIndex].Normal0 * (1 - RayPayload.U - RayPayload.V);
-                    
-                    // Emission
-                    glm::vec3 Emission = MatData->Emission * MatData->EmissiveStrength;
-                    if(MatData->EmissionMapTextureID >=0 && MatData->UseEmissionMap>0)
-                    {
-                        glm::vec4 TextureEmission = EmissionTexture->Sample(UV);
-                        Emission *= glm::vec3(TextureEmission);
-                    }
+            ResolvePixel(yy * ImageWidth + xx, SampleColor, SampleSquaredLuminance, SampleCount + SamplesPerFrame, ImageToWrite);
+        }
+        if(yy >= ImageHeight-1) break;
+    }
+}
 
-                    glm::vec3 BaseColor = MatData->BaseColor;
-                    if(MatData->BaseColorTextureID >=0 && MatData->UseBaseColor>0)
-                    {
-                        glm::vec4 TextureColor = DiffuseTexture->Sample(UV);
-                        
-                        TextureColor *= glm::pow(TextureColor, glm::vec4(2.2f));
-                        BaseColor *= glm::vec3(TextureColor);                    
-                    }
+void pathTraceCPURenderer::SortByOctant(std::vector<pathState> &States, std::vector<uint32_t> &Active, std::vector<uint32_t> &Sorted)
+{
+    uint32_t Offsets[9] = {};
+    auto Octant = [&States](uint32_t Index)
+    {
+        glm::vec3 &Direction = States[Index].Ray.Direction;
+        return (Direction.x < 0 ? 1u : 0u) | (Direction.y < 0 ? 2u : 0u) | (Direction.z < 0 ? 4u : 0u);
+    };
 
-                    float Roughness = MatData->Roughness;
-                    float Metallic = MatData->Metallic;
-                    if(MatData->MetallicRoughnessTextureID >=0 && MatData->UseMetallicRoughness>0)
-                    {
-                        glm::vec2 RoughnessMetallic = glm::vec2(MetallicRoughnessTexture->Sample(UV));
-                        Metallic *= RoughnessMetallic.r;
-                        Roughness *= RoughnessMetallic.g;
-                    }    
+    for(size_t i=0; i<Active.size(); i++) Offsets[Octant(Active[i]) + 1]++;
+    for(int i=0; i<8; i++) Offsets[i+1] += Offsets[i];
+    
+    Sorted.resize(Active.size());
+    for(size_t i=0; i<Active.size(); i++) Sorted[Offsets[Octant(Active[i])]++] = Active[i];
+    std::swap(Active, Sorted);
+}
 
-                    
-                    Radiance += Attenuation * Emission;
+void pathTraceCPURenderer::TraceRays(std::vector<pathState> &States, std::vector<uint32_t> &Active, bool UsePackets)
+{
+    if(!UsePackets)
+    {
+        for(size_t i=0; i<Active.size(); i++)
+        {
+            TLAS.Intersect(States[Active[i]].Ray, States[Active[i]].RayPayload);
+        }
+        return;
+    }
 
-                    if(App->Scene->UBOSceneMatrices.BackgroundType == BACKGROUND_TYPE_DIRLIGHT)
-                    {
-                        glm::vec3 L = normalize(-App->Scene->UBOSceneMatrices.LightDirection);
-                        glm::vec3 shadowRayOrigin = Ray.Origin + RayPayload.Distance * Ray.Direction;
-                        ray ShadowRay = {
-                            shadowRayOrigin,
-                            L,
-                            1.0f / L
-                        };
-                        rayPayload ShadowRayPayLoad {};
-                        ShadowRayPayLoad.Distance = 1e30f;
-                        TLAS.Intersect(ShadowRay, ShadowRayPayLoad);
-                        
-                        if(ShadowRayPayLoad.Distance == 1e30f)
-                        {
-                            Radiance += Attenuation * EvalCombinedBRDF(Normal, L, V, BaseColor, Metallic) * App->Scene->UBOSceneMatrices.BackgroundIntensity* App->Scene->UBOSceneMatrices.BackgroundColor;
-                            // Radiance += Attenuation * App->Scene->UBOSceneMatrices.BackgroundColor * App->Scene->UBOSceneMatrices.BackgroundIntensity;
-                        }
-                    }
+    uint32_t PacketSize = 4u << PacketSizeIndex;
+    rayPacket Packet;
+    for(size_t First=0; First<Active.size(); First+=PacketSize)
+    {
+        Packet.Count = (uint32_t)std::min((size_t)PacketSize, Active.size() - First);
+        for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+        {
+            Packet.Set(Lane, States[Active[First + Lane]].Ray, States[Active[First + Lane]].RayPayload);
+        }
+        TLAS.IntersectPacket(Packet);
+        for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+        {
+            States[Active[First + Lane]].RayPayload = Packet.Payloads[Lane];
+        }
+    }
+}
 
+//Pixels of the tile ordered by blocks of PacketSize, so each primary packet covers a small square of the screen
+static void GetPacketPixels(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t PacketSize, std::vector<uint32_t> &Pixels)
+{
+    uint32_t BlockWidth = PacketSize == 4 ? 2 : 4;
+    uint32_t BlockHeight = PacketSize / BlockWidth;
 
-                    if(j == RayBounces-1) break;
-                    
-                    // Russian roulette
-                    {
-                        if (j >= 3)
-                        {
-                            float q = std::min(std::max(Attenuation.x, std::max(Attenuation.y, Attenuation.z)) + 0.001f, 0.95f);
-                            if (RandomUnilateral(RayPayload.RandomState) > q)
-                                break;
-                            Attenuation /= q;
-                        }
-                    }
-                    
+    Pixels.clear();
+    for(uint32_t by=StartY; by < StartY+TileHeight; by+=BlockHeight)
+    {
+        for(uint32_t bx=StartX; bx < StartX+TileWidth; bx+=BlockWidth)
+        {
+            for(uint32_t yy=by; yy < by+BlockHeight; yy++)
+            {
+                for(uint32_t xx=bx; xx < bx+BlockWidth; xx++)
+                {
+                    if(xx < ImageWidth && yy < ImageHeight) Pixels.push_back(yy * ImageWidth + xx);
+                }
+            }
+        }
+    }
+}
 
-                    //Eval brdf
-                    {
-                        int brdfType = DIFFUSE_TYPE;
-                        if (Metallic == 1.0f && Roughness == 0.0f) {
-                            brdfType = SPECULAR_TYPE;
-                        } else {
-                            float brdfProbability = GetBrdfProbability(RayPayload, V, Normal, BaseColor, Metallic);
-
-                            if (RandomUnilateral(RayPayload.RandomState) < brdfProbability) {
-                                brdfType = SPECULAR_TYPE;
-                                Attenuation /= brdfProbability;
-                            } else {
-                                brdfType = DIFFUSE_TYPE;
-                                Attenuation /= (1.0f - brdfProbability);
-                            }
-                        }
+void pathTraceCPURenderer::PathTraceTilePackets(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite)
+{
+    uint32_t RayBounces=4;
+    uint32_t PacketSize = 4u << PacketSizeIndex;
 
-                        glm::vec3 brdfWeight;
-                        glm::vec2 Xi = glm::vec2(RandomUnilateral(RayPayload.RandomState),RandomUnilateral(RayPayload.RandomState));
-                        glm::vec3 ScatterDir = glm::vec3(0);
-                        
-                        if(brdfType == DIFFUSE_TYPE)
-                        {
-                            if (!SampleDiffuseBRDF(Xi, Normal, V,  ScatterDir, brdfWeight, BaseColor, Metallic)) {
-                                break;
-                            }
-                        }
-                        else if(brdfType == SPECULAR_TYPE)
-                        {
-                            if (!SampleSpecularBRDF(Xi, Normal, V,  ScatterDir, brdfWeight, BaseColor, Roughness, Metallic)) {
-                                break;
-                            }
-                        }
+    std::vector<uint32_t> Pixels;
+    GetPacketPixels(StartX, StartY, TileWidth, TileHeight, ImageWidth, ImageHeight, PacketSize, Pixels);
+
+    std::vector<pathState> States(Pixels.size());
+    std::vector<glm::vec3> SampleColors(Pixels.size(), glm::vec3(0));
+    std::vector<float> SampleSquaredLuminances(Pixels.size(), 0.0f);
+    std::vector<uint32_t> Active, NextActive, Sorted;
+    for(uint32_t Sample=0; Sample<SamplesPerFrame; Sample++)
+    {
+        Active.clear();
+        for(uint32_t i=0; i<(uint32_t)Pixels.size(); i++)
+        {
+            GeneratePrimaryRay(States[i], Pixels[i] % ImageWidth, Pixels[i] / ImageWidth, ImageWidth, ImageHeight, SampleCount + Sample);
+            Active.push_back(i);
+        }
 
-                        //the weights already contains color * brdf * cosine term / pdf
-                        Attenuation *= brdfWeight;						
+        for(uint32_t j=0; j<RayBounces && Active.size()>0; j++)
+        {
+            //Secondary rays are incoherent : only the stream mode regroups them into packets
+            if(j > 0 && TraversalMode == TRAVERSAL_STREAM) SortByOctant(States, Active, Sorted);
+            TraceRays(States, Active, j==0 || TraversalMode == TRAVERSAL_STREAM);
 
-                        Ray.Origin = Ray.Origin + RayPayload.Distance * Ray.Direction;
-                        Ray.Direction = ScatterDir;
-                        RayPayload.Distance = 1e30f;
-                    }					   
+            NextActive.clear();
+            for(size_t i=0; i<Active.size(); i++)
+            {
+                pathState &State = States[Active[i]];
+                if(State.RayPayload.Distance == 1e30f)
+                {
+                    ShadeMiss(State);
+                }
+                else
+                {
+                    bool Continue = ShadeHit(State, j, RayBounces);
+                    Connect(State);
+                    if(Continue) NextActive.push_back(Active[i]);
                 }
-
-                SampleColor += Radiance;	
             }
+            std::swap(Active, NextActive);
+        }
 
-			AccumulationImage[yy * ImageWidth + xx] += SampleColor;
+        for(size_t i=0; i<Pixels.size(); i++)
+        {
+            SampleColors[i] += States[i].Radiance;
+            SampleSquaredLuminances[i] += Luminance(States[i].Radiance) * Luminance(States[i].Radiance);
+        }
+    }
 
-			glm::vec3 Color = AccumulationImage[yy * ImageWidth + xx] / (float)CurrentSampleCount;
+    for(size_t i=0; i<Pixels.size(); i++)
+    {
+        ResolvePixel(Pixels[i], SampleColors[i], SampleSquaredLuminances[i], SampleCount + SamplesPerFrame, ImageToWrite);
+    }
+}
+
+void pathTraceCPURenderer::rayQueue::Resize(uint32_t Capacity)
+{
+    PathIndices.resize(Capacity);
+    OriginX.resize(Capacity); OriginY.resize(Capacity); OriginZ.resize(Capacity);
+    DirectionX.resize(Capacity); DirectionY.resize(Capacity); DirectionZ.resize(Capacity);
+    Distance.resize(Capacity); U.resize(Capacity); V.resize(Capacity);
+    InstanceIndex.resize(Capacity); PrimitiveIndex.resize(Capacity);
+    Count = 0;
+}
 
-            Color = toneMap(Color, App->Scene->UBOSceneMatrices.Exposure);
-			Color = glm::clamp(Color, glm::vec3(0), glm::vec3(1));
-			// Color *= glm::pow(Color, glm::vec3(1.0f / 2.2f));
+void pathTraceCPURenderer::rayQueue::Push(uint32_t PathIndex, const ray &Ray)
+{
+    Set(Count.fetch_add(1), PathIndex, Ray);
+}
 
-            uint8_t r = (uint8_t)(Color.r * 255.0f);
-            uint8_t g = (uint8_t)(Color.g * 255.0f);
-            uint8_t b = (uint8_t)(Color.b * 255.0f);
+void pathTraceCPURenderer::rayQueue::Set(uint32_t Index, uint32_t PathIndex, const ray &Ray)
+{
+    PathIndices[Index] = PathIndex;
+    OriginX[Index] = Ray.Origin.x;
+    OriginY[Index] = Ray.Origin.y;
+    OriginZ[Index] = Ray.Origin.z;
+    DirectionX[Index] = Ray.Direction.x;
+    DirectionY[Index] = Ray.Direction.y;
+    DirectionZ[Index] = Ray.Direction.z;
+}
 
-            (*ImageToWrite)[yy * ImageWidth + xx] = {b, g, r, 255 };
-        }
-        if(yy >= ImageHeight-1) break;
+ray pathTraceCPURenderer::rayQueue::GetRay(uint32_t Index) const
+{
+    ray Ray;
+    Ray.Origin = glm::vec3(OriginX[Index], OriginY[Index], OriginZ[Index]);
+    Ray.Direction = glm::vec3(DirectionX[Index], DirectionY[Index], DirectionZ[Index]);
+    Ray.InverseDirection = 1.0f / Ray.Direction;
+    return Ray;
+}
+
+void pathTraceCPURenderer::rayQueue::SetHit(uint32_t Index, const rayPayload &RayPayload)
+{
+    Distance[Index] = RayPayload.Distance;
+    U[Index] = RayPayload.U;
+    V[Index] = RayPayload.V;
+    InstanceIndex[Index] = RayPayload.InstanceIndex;
+    PrimitiveIndex[Index] = RayPayload.PrimitiveIndex;
+}
+
+void pathTraceCPURenderer::rayQueue::GetHit(uint32_t Index, rayPayload &RayPayload) const
+{
+    RayPayload.Distance = Distance[Index];
+    RayPayload.U = U[Index];
+    RayPayload.V = V[Index];
+    RayPayload.InstanceIndex = InstanceIndex[Index];
+    RayPayload.PrimitiveIndex = PrimitiveIndex[Index];
+}
+
+void pathTraceCPURenderer::ExtendStage(rayQueue &Queue, bool UsePackets)
+{
+    uint32_t Count = Queue.Count;
+    ExtendOrder.resize(Count);
+
+    //Secondary packets need rays with the same direction signs next to each other, as in SortByOctant()
+    if(UsePackets && TraversalMode == TRAVERSAL_STREAM)
+    {
+        uint32_t Offsets[9] = {};
+        auto Octant = [&Queue](uint32_t Index)
+        {
+            return (Queue.DirectionX[Index] < 0 ? 1u : 0u) | (Queue.DirectionY[Index] < 0 ? 2u : 0u) | (Queue.DirectionZ[Index] < 0 ? 4u : 0u);
+        };
+        for(uint32_t i=0; i<Count; i++) Offsets[Octant(i) + 1]++;
+        for(int i=0; i<8; i++) Offsets[i+1] += Offsets[i];
+        for(uint32_t i=0; i<Count; i++) ExtendOrder[Offsets[Octant(i)]++] = i;
     }
+    else
+    {
+        for(uint32_t i=0; i<Count; i++) ExtendOrder[i] = i;
+    }
+
+    //Chunks are a multiple of the packet size
+    ThreadPool.ParallelFor(Count, WAVEFRONT_CHUNK, [this, &Queue, UsePackets](uint32_t Start, uint32_t End)
+    {
+        if(!UsePackets)
+        {
+            for(uint32_t i=Start; i<End; i++)
+            {
+                rayPayload RayPayload = {};
+                RayPayload.Distance = 1e30f;
+                TLAS.Intersect(Queue.GetRay(ExtendOrder[i]), RayPayload);
+                Queue.SetHit(ExtendOrder[i], RayPayload);
+            }
+            return;
+        }
 
+        uint32_t PacketSize = 4u << PacketSizeIndex;
+        rayPacket Packet;
+        rayPayload RayPayload = {};
+        RayPayload.Distance = 1e30f;
+        for(uint32_t First=Start; First<End; First+=PacketSize)
+        {
+            Packet.Count = std::min(PacketSize, End - First);
+            for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+            {
+                Packet.Set(Lane, Queue.GetRay(ExtendOrder[First + Lane]), RayPayload);
+            }
+            TLAS.IntersectPacket(Packet);
+            for(uint32_t Lane=0; Lane<Packet.Count; Lane++)
+            {
+                Queue.SetHit(ExtendOrder[First + Lane], Packet.Payloads[Lane]);
+            }
+        }
+    });
 }
 
-void pathTraceCPURenderer::PathTrace()
+void pathTraceCPURenderer::SortByMaterial(const rayQueue &Queue)
 {
-    start = std::chrono::high_resolution_clock::now();
-    
-    CurrentSampleCount += SamplesPerFrame;
-    for(uint32_t y=0; y<App->Height; y+=TileSize)
+    //Counting sort, misses use the key after the last material
+    uint32_t Count = Queue.Count;
+    uint32_t MissKey = (uint32_t)App->Scene->Materials.size();
+    auto Key = [this, &Queue, MissKey](uint32_t Index)
+    {
+        if(Queue.Distance[Index] == 1e30f) return MissKey;
+        return std::min(Meshes[Instances[Queue.InstanceIndex[Index]].MeshIndex]->MaterialIndex, MissKey);
+    };
+
+    std::vector<uint32_t> Offsets(MissKey + 2, 0);
+    for(uint32_t i=0; i<Count; i++) Offsets[Key(i) + 1]++;
+    for(uint32_t i=0; i<=MissKey; i++) Offsets[i+1] += Offsets[i];
+
+    ShadeOrder.resize(Count);
+    for(uint32_t i=0; i<Count; i++) ShadeOrder[Offsets[Key(i)]++] = i;
+}
+
+void pathTraceCPURenderer::PathTraceWavefront(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite)
+{
+    uint32_t RayBounces=4;
+    bool PrimaryPackets = TraversalMode != TRAVERSAL_SINGLE;
+    bool SecondaryPackets = TraversalMode == TRAVERSAL_STREAM;
+
+    //Same order as the packet tiles, so the primary rays of a packet are neighbours on the screen
+    std::vector<uint32_t> Pixels;
+    GetPacketPixels(StartX, StartY, TileWidth, TileHeight, ImageWidth, ImageHeight, 4u << PacketSizeIndex, Pixels);
+
+    uint32_t WaveSize = std::min((uint32_t)Pixels.size(), (uint32_t)WAVEFRONT_SIZE);
+    WavefrontPaths.resize(WaveSize);
+    WavefrontSampleColors.resize(WaveSize);
+    WavefrontSampleSquaredLuminances.resize(WaveSize);
+    ShadowPaths.resize(WaveSize);
+    for(int i=0; i<2; i++) 
     {
-        for(uint32_t x=(uint32_t)App->Scene->ViewportStart; x<App->Width; x+=TileSize)
+        if(RayQueues[i].PathIndices.size() < WaveSize) RayQueues[i].Resize(WaveSize);
+    }
+
+    auto Time = [](auto Start)
+    {
+        return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - Start).count();
+    };
+
+    for(uint32_t WaveStart=0; WaveStart<(uint32_t)Pixels.size(); WaveStart+=WAVEFRONT_SIZE)
+    {
+        uint32_t PathCount = std::min((uint32_t)Pixels.size() - WaveStart, (uint32_t)WAVEFRONT_SIZE);
+        const uint32_t *WavePixels = &Pixels[WaveStart];
+
+        for(uint32_t Sample=0; Sample<SamplesPerFrame; Sample++)
         {
-            ThreadPool.EnqueueJob([x, y, this]()
+            //Generate : one camera ray per path, in pixel order
+            auto StageStart = std::chrono::high_resolution_clock::now();
+            rayQueue *Queue = &RayQueues[0];
+            rayQueue *NextQueue = &RayQueues[1];
+            ThreadPool.ParallelFor(PathCount, WAVEFRONT_CHUNK, [&](uint32_t Start, uint32_t End)
+            {
+                for(uint32_t i=Start; i<End; i++)
                 {
-                PathTraceTile(x, y, TileSize, TileSize, App->Width, App->Height, &Image); 
+                    if(Sample == 0)
+                    {
+                        WavefrontSampleColors[i] = glm::vec3(0);
+                        WavefrontSampleSquaredLuminances[i] = 0;
+                    }
+                    GeneratePrimaryRay(WavefrontPaths[i], WavePixels[i] % ImageWidth, WavePixels[i] / ImageWidth, ImageWidth, ImageHeight, SampleCount + Sample);
+                    Queue->Set(i, i, WavefrontPaths[i].Ray);
                 }
-            );
+            });
+            Queue->Count = PathCount;
+            WavefrontStageTimes[0] += Time(StageStart);
+
+            for(uint32_t j=0; j<RayBounces && Queue->Count>0; j++)
+            {
+                //Extend
+                StageStart = std::chrono::high_resolution_clock::now();
+                ExtendStage(*Queue, j==0 ? PrimaryPackets : SecondaryPackets);
+                WavefrontRays[0] += Queue->Count;
+                WavefrontStageTimes[1] += Time(StageStart);
+
+                //Shade : paths with the same material are shaded together, so they read the same textures
+                StageStart = std::chrono::high_resolution_clock::now();
+                SortByMaterial(*Queue);
+                NextQueue->Count = 0;
+                ShadowPathCount = 0;
+                std::atomic<uint32_t> ShadowRayCount{0};
+                ThreadPool.ParallelFor(Queue->Count, WAVEFRONT_CHUNK, [&](uint32_t Start, uint32_t End)
+                {
+                    uint32_t ChunkShadowRays = 0;
+                    for(uint32_t i=Start; i<End; i++)
+                    {
+                        uint32_t Index = ShadeOrder[i];
+                        uint32_t PathIndex = Queue->PathIndices[Index];
+                        pathState &State = WavefrontPaths[PathIndex];
+                        Queue->GetHit(Index, State.RayPayload);
+                        if(State.RayPayload.Distance == 1e30f)
+                        {
+                            ShadeMiss(State);
+                            continue;
+                        }
+                        bool Continue = ShadeHit(State, j, RayBounces);
+                        if(State.ShadowRayCount > 0) ShadowPaths[ShadowPathCount++] = PathIndex;
+                        if(Continue) NextQueue->Push(PathIndex, State.Ray);
+                        ChunkShadowRays += State.ShadowRayCount;
+                    }
+                    ShadowRayCount += ChunkShadowRays;
+                });
+                WavefrontRays[1] += ShadowRayCount;
+                WavefrontStageTimes[2] += Time(StageStart);
+
+                //Connect : shadow rays of all the paths. Both rays of a path are traced by the same job, so they can add to its radiance.
+                StageStart = std::chrono::high_resolution_clock::now();
+                ThreadPool.ParallelFor(ShadowPathCount, WAVEFRONT_CHUNK, [&](uint32_t Start, uint32_t End)
+                {
+                    for(uint32_t i=Start; i<End; i++) Connect(WavefrontPaths[ShadowPaths[i]]);
+                });
+                WavefrontStageTimes[3] += Time(StageStart);
+
+                std::swap(Queue, NextQueue);
+            }
+
+            ThreadPool.ParallelFor(PathCount, WAVEFRONT_CHUNK, [&](uint32_t Start, uint32_t End)
+            {
+                for(uint32_t i=Start; i<End; i++)
+                {
+                    float SampleLuminance = Luminance(WavefrontPaths[i].Radiance);
+                    WavefrontSampleColors[i] += WavefrontPaths[i].Radiance;
+                    WavefrontSampleSquaredLuminances[i] += SampleLuminance * SampleLuminance;
+                }
+            });
         }
+
+        ThreadPool.ParallelFor(PathCount, WAVEFRONT_CHUNK, [&](uint32_t Start, uint32_t End)
+        {
+            for(uint32_t i=Start; i<End; i++)
+            {
+                ResolvePixel(WavePixels[i], WavefrontSampleColors[i], WavefrontSampleSquaredLuminances[i], SampleCount + SamplesPerFrame, ImageToWrite);
+            }
+        });
     }
+}
+
+void pathTraceCPURenderer::PathTrace()
+{
+    //Each pass adds SamplesPerFrame samples to a tile
+    uint32_t Passes = (TotalSamples + SamplesPerFrame - 1) / SamplesPerFrame;
+    StartWorkers(Passes);
 
     ProcessingPathTrace=true;
 }
 
+void pathTraceCPURenderer::StartWorkers(uint32_t Passes)
+{
+    //A single worker drives the wavefront, its stages spread over the other threads of the pool
+    Scheduler.Start(ThreadPool, Passes, [this](const tile &Tile, uint32_t Pass)
+    {
+        uint32_t SampleCount = Pass * SamplesPerFrame;
+        if(Wavefront) PathTraceWavefront(Tile.StartX, Tile.StartY, Tile.Width, Tile.Height, App->Width, App->Height, SampleCount, &Image);
+        else if(TraversalMode == TRAVERSAL_SINGLE) PathTraceTile(Tile.StartX, Tile.StartY, Tile.Width, Tile.Height, App->Width, App->Height, SampleCount, &Image); 
+        else PathTraceTilePackets(Tile.StartX, Tile.StartY, Tile.Width, Tile.Height, App->Width, App->Height, SampleCount, &Image); 
+        return !AdaptiveSampling || !TileConverged(Tile, SampleCount + SamplesPerFrame);
+    }, Wavefront ? 1 : 0);
+}
+
+bool pathTraceCPURenderer::TileConverged(const tile &Tile, uint32_t SampleCount)
+{
+    if(SampleCount < ADAPTIVE_MIN_SAMPLES) return false;
+
+    //Relative standard error of the mean luminance, the worst pixel decides for the whole tile
+    float InverseCount = 1.0f / (float)SampleCount;
+    for(uint32_t y=Tile.StartY; y<Tile.StartY+Tile.Height; y++)
+    {
+        for(uint32_t x=Tile.StartX; x<Tile.StartX+Tile.Width; x++)
+        {
+            uint32_t PixelIndex = y * App->Width + x;
+            float Mean = Luminance(AccumulationImage[PixelIndex]) * InverseCount;
+            float Variance = std::max(SquaredLuminanceImage[PixelIndex] * InverseCount - Mean * Mean, 0.0f);
+            float Error = std::sqrt(Variance * InverseCount) / (Mean + ADAPTIVE_ERROR_OFFSET);
+            if(Error > NoiseThreshold) return false;
+        }
+    }
+    return true;
+}
+
 void pathTraceCPURenderer::Preview()
 {
     float StartRatio = App->Scene->ViewportStart / App->Width;
@@ -595,29 +1239,18 @@ void pathTraceCPURenderer::Preview()
     ProcessingPreview=true;
 }
 
-void pathTraceCPURenderer::Setup()
+void pathTraceCPURenderer::SetupScene()
 {
     previewWidth = App->Width / 10;
     previewHeight = App->Height / 10;
 
     ThreadPool.Start();
-    CreateCommandBuffers();
 
     Image.resize(App->Width * App->Height, {0, 0, 0, 255});
     AccumulationImage.resize(App->Width * App->Height, glm::vec3(0));
+    SquaredLuminanceImage.resize(App->Width * App->Height, 0.0f);
     PreviewImage.resize(previewWidth * previewHeight);
-    
 
-    vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 
-                              &VulkanObjects.ImageStagingBuffer, Image.size() * sizeof(rgba8), Image.data());
-    
-    vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
-                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 
-                              &VulkanObjects.previewBuffer, PreviewImage.size() * sizeof(rgba8), PreviewImage.data());    
-    VulkanObjects.previewImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, VK_FORMAT_B8G8R8A8_UNORM, {previewWidth, previewHeight, 1});
-
-    
     for(size_t i=0; i<App->Scene->Meshes.size(); i++)
     {
         Meshes.push_back(new mesh(App->Scene->Meshes[i].Indices,
@@ -636,11 +1269,44 @@ void pathTraceCPURenderer::Setup()
     TLAS.Build();
 }
 
+void pathTraceCPURenderer::Setup()
+{
+    SetupScene();
+    CreateCommandBuffers();
+
+    vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 
+                              &VulkanObjects.ImageStagingBuffer, Image.size() * sizeof(rgba8), Image.data());
+    
+    vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, 
+                              VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, 
+                              &VulkanObjects.previewBuffer, PreviewImage.size() * sizeof(rgba8), PreviewImage.data());    
+    VulkanObjects.previewImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, VK_FORMAT_B8G8R8A8_UNORM, {previewWidth, previewHeight, 1});
+
+}
+
 //
 
 void pathTraceCPURenderer::UpdateTLAS(uint32_t InstanceIndex)
 {
+    WaitForWorkers();
     Instances[InstanceIndex].SetTransform(App->Scene->InstancesPointers[InstanceIndex]->InstanceData.Transform);
+    TLAS.Refit(InstanceIndex);
+}
+
+void pathTraceCPURenderer::UpdateMesh(uint32_t MeshIndex)
+{
+    WaitForWorkers();
+    Meshes[MeshIndex]->UpdateVertices(App->Scene->Meshes[MeshIndex].Indices, App->Scene->Meshes[MeshIndex].Vertices);
+
+    //Instance bounds are computed from the bvh root
+    for(size_t i=0; i<Instances.size(); i++)
+    {
+        if(Instances[i].MeshIndex == MeshIndex)
+        {
+            Instances[i].SetTransform(App->Scene->InstancesPointers[i]->InstanceData.Transform);
+        }
+    }
     TLAS.Build();
 }
 
@@ -656,20 +1322,140 @@ void pathTraceCPURenderer::RenderGUI()
     {
         StartPathTrace();
     }
+
+    //Applied by the next PathTrace
+    ImGui::Checkbox("Light Sampling", &LightSampling);
+    ImGui::Combo("Sampler", &SamplerType, "Random\0Sobol\0Blue Noise\0\0");
+    ImGui::Combo("Integrator", &Integrator, "Megakernel\0Wavefront\0\0");
+
+    //Read by the workers at the end of each tile, no need to restart
+    ImGui::Checkbox("Adaptive Sampling", &AdaptiveSampling);
+    if(AdaptiveSampling)
+    {
+        ImGui::SliderFloat("Noise Threshold", &NoiseThreshold, 0.001f, 0.1f, "%.3f");
+    }
+
+    if(ImGui::Combo("BVH Layout", &BVHLayout, "Binary\0BVH4\0BVH8\0Compressed\0\0"))
+    {
+        SetBVHLayout((bvhLayout)BVHLayout);
+    }
+    if(ImGui::Combo("BVH Build", &BVHBuildMode, "Binned\0Spatial (SBVH)\0\0"))
+    {
+        SetBVHBuildMode((bvhBuildMode)BVHBuildMode);
+    }
+    if(ImGui::Combo("Triangle Test", &TriangleKernel, "Moller-Trumbore\0Watertight\0Watertight x4\0\0"))
+    {
+        SetTriangleKernel((triangleKernel)TriangleKernel);
+    }
+    if(ImGui::Checkbox("Quantized TLAS", &QuantizedTLAS))
+    {
+        WaitForWorkers();
+        TLAS.UseQuantizedNodes = QuantizedTLAS;
+    }
+    ImGui::Combo("Traversal", &TraversalMode, "Single Ray\0Packet\0Stream\0\0");
+    if(TraversalMode != TRAVERSAL_SINGLE)
+    {
+        ImGui::Combo("Packet Size", &PacketSizeIndex, "4\0" "8\0" "16\0\0");
+    }
+}
+
+void pathTraceCPURenderer::SetBVHLayout(bvhLayout Layout)
+{
+    //Tiles may still be traversing the bvhs
+    WaitForWorkers();
+
+    for(size_t i=0; i<Meshes.size(); i++)
+    {
+        Meshes[i]->BVH->SetLayout(Layout);
+    }
+}
+
+void pathTraceCPURenderer::SetBVHBuildMode(bvhBuildMode BuildMode, bool UseCache)
+{
+    WaitForWorkers();
+
+    //The root bounds don't depend on the build mode, so the instances and the tlas stay valid
+    for(size_t i=0; i<Meshes.size(); i++)
+    {
+        Meshes[i]->BVH->BuildMode = BuildMode;
+        if(UseCache) Meshes[i]->BVH->LoadOrBuild();
+        else Meshes[i]->BVH->Build();
+        Meshes[i]->BVH->SetLayout(Meshes[i]->BVH->Layout);
+    }
+}
+
+void pathTraceCPURenderer::SetTriangleKernel(triangleKernel Kernel)
+{
+    WaitForWorkers();
+
+    for(size_t i=0; i<Meshes.size(); i++)
+    {
+        Meshes[i]->BVH->SetTriangleKernel(Kernel);
+    }
 }
 
 void pathTraceCPURenderer::Resize(uint32_t Width, uint32_t Height) 
 {
 }
 
-void pathTraceCPURenderer::Destroy()
+uint32_t pathTraceCPURenderer::RenderOffline(float TimeBudget)
+{
+    StartPathTrace();
+    //There is no Render() loop to restart or upload the tiles
+    ShouldPathTrace=false;
+    uint32_t Passes = (TotalSamples + SamplesPerFrame - 1) / SamplesPerFrame;
+    StartWorkers(Passes);
+
+    //Stopped workers finish their current tile, so the budget can be exceeded by one tile or one wavefront pass
+    while(Scheduler.Running())
+    {
+        float Seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+        if(TimeBudget > 0 && Seconds > TimeBudget) Scheduler.Stop();
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    while(ThreadPool.Busy()) std::this_thread::yield();
+
+    CurrentSampleCount = Scheduler.CompletedPasses() * SamplesPerFrame;
+    return CurrentSampleCount;
+}
+
+void pathTraceCPURenderer::GetRadiance(std::vector<glm::vec3> &Radiance)
+{
+    //Tiles can have different sample counts when the render was stopped or used adaptive sampling.
+    //Converged tiles skip their last passes, so only the rendered ones count.
+    Radiance.assign(AccumulationImage.size(), glm::vec3(0));
+    for(uint32_t i=0; i<(uint32_t)Scheduler.Tiles.size(); i++)
+    {
+        uint32_t SampleCount = Scheduler.TileRenderedPasses(i) * SamplesPerFrame;
+        if(SampleCount == 0) continue;
+
+        const tile &Tile = Scheduler.Tiles[i];
+        for(uint32_t y=Tile.StartY; y<Tile.StartY+Tile.Height; y++)
+        {
+            for(uint32_t x=Tile.StartX; x<Tile.StartX+Tile.Width; x++)
+            {
+                uint32_t PixelIndex = y * App->Width + x;
+                Radiance[PixelIndex] = AccumulationImage[PixelIndex] / (float)SampleCount;
+            }
+        }
+    }
+}
+
+void pathTraceCPURenderer::DestroyScene()
 {
+    Scheduler.Stop();
     ThreadPool.Stop();
     for(int i=0; i<Meshes.size(); i++)
     {
         delete Meshes[i]->BVH;
         delete Meshes[i];
     }
+    Meshes.clear();
+}
+
+void pathTraceCPURenderer::Destroy()
+{
+    DestroyScene();
     
     VulkanObjects.ImageStagingBuffer.Destroy();
 
@@ -6,6 +6,9 @@
 #include "../bvh.h"
 
 #include "ThreadPool.h"
+#include "TileScheduler.h"
+#include "Lights.h"
+#include "Sampler.h"
 
 class pathTraceCPURenderer : public renderer    
 {
@@ -18,6 +21,16 @@ public:
     void Resize(uint32_t Width, uint32_t Height) override;
 
     void StartPathTrace();
+    //Headless rendering : Setup() and Destroy() without the vulkan objects
+    void SetupScene();
+    void DestroyScene();
+    //Renders TotalSamples samples per pixel, or until TimeBudget seconds have passed when it's above 0, and waits for the end.
+    //Returns the samples per pixel rendered in all the tiles.
+    uint32_t RenderOffline(float TimeBudget);
+    //Average of the samples of each pixel, before tonemapping
+    void GetRadiance(std::vector<glm::vec3> &Radiance);
+    //Stops the tile workers after their current tile, and waits for all the jobs of the pool
+    void WaitForWorkers();
 
     struct
     {
@@ -37,24 +50,123 @@ public:
     std::vector<rgba8> Image; 
     std::vector<rgba8> PreviewImage; 
     std::vector<glm::vec3> AccumulationImage; 
+    //Sum of the squared luminance of the samples of each pixel, for the variance used by the adaptive sampling
+    std::vector<float> SquaredLuminanceImage;
 
     uint32_t previewWidth = 128;
     uint32_t previewHeight = 128;
 
     uint32_t SamplesPerFrame=1;
     uint32_t TotalSamples = 16000;
+    //Tiles stop being sampled once the relative error of all their pixels is below NoiseThreshold. 
+    //The render ends when all the tiles are converged, or after TotalSamples.
+    bool AdaptiveSampling=false;
+    float NoiseThreshold=0.02f;
+    //Next event estimation on the emissive triangles and the background, combined with the brdf sampling by MIS. Read when the path trace starts.
+    bool LightSampling=true;
+    //samplerType of the random numbers of the paths. Read when the path trace starts.
+    int SamplerType=(int)samplerType::Sobol;
+    //Megakernel traces each tile path by path, wavefront traces the whole viewport stage by stage. Read when the path trace starts.
+    int Integrator=0;
     uint32_t CurrentSampleCount=0;
 
     void UpdateCamera();
     void UpdateTLAS(uint32_t InstanceIndex);
+    void UpdateMesh(uint32_t MeshIndex);
+
+    void SetBVHLayout(bvhLayout Layout);
+    //Rebuilds the bvh of all the meshes, or loads them from the bvh cache
+    void SetBVHBuildMode(bvhBuildMode BuildMode, bool UseCache=true);
+    void SetTriangleKernel(triangleKernel Kernel);
+
+    //Benchmarks and checks, in PathTraceCPUChecks.cpp and run by HeadlessRenderer --check. They print their measures and return false when the results are wrong.
+    //Prints the rays/sec of each bvh layout and packet size, on primary and diffuse rays of the current view. Fails if they don't find the hits of the binary layout.
+    bool BenchmarkTraversal();
+    //Prints the rays/sec of TLAS.Intersect() and TLAS.Occluded() on the same rays for each bvh layout. Fails on the rays where they disagree.
+    bool BenchmarkOcclusion();
+    //Prints the build time, node visits and triangle tests per ray of the binned and spatial builds, on the same rays. Fails if the builds find different hits.
+    bool BenchmarkBuildModes();
+    //Fires rays at the edges and vertices of a closed sphere with each triangle test, and prints the rays that went through it.
+    //Fails if a watertight test let any ray through. Needs no scene.
+    static bool CheckWatertight();
+    //Prints the error of each sampler on integrals with a known value, and how it is spread between neighbour pixels. Deterministic, needs no scene.
+    //Fails if Sobol or blue noise is not below random at 256 spp.
+    static bool CheckSamplers();
+    //Encodes smooth colors and a normal map in each bc format, and prints the time and the error of the decoded images. Needs no scene.
+    //Fails if the error is over what the encoders reach, or if the cache does not load back the same image.
+    static bool CheckTextureCompression();
+    //Prints the samples/sec of the megakernel and wavefront integrators on the current view, and the time of each wavefront stage. Stops the current render.
+    //Fails if the mean luminance of the two images differs by more than the noise.
+    bool BenchmarkWavefront();
+    //Prints the texture fetches/sec of the scene textures in rows and in blocks along horizontal, vertical, diagonal and random walks,
+    //and the samples/sec of the path tracer with each layout. Stops the current render. Fails if the two layouts don't return the same texels.
+    bool BenchmarkTextures();
+
+    //Light sample waiting for its visibility test
+    struct shadowRay
+    {
+        ray Ray;
+        float MaxDistance;
+        //Added to the path radiance when the ray is not occluded
+        glm::vec3 Contribution;
+    };
+
+    struct pathState
+    {
+        ray Ray;
+        rayPayload RayPayload;
+        glm::vec3 Attenuation;
+        glm::vec3 Radiance;
+        //Solid angle pdfs of the ray direction with the brdf sampling and with the background light sampling, for the MIS weight of what it hits.
+        //BRDFPdf is 0 for camera rays and mirror bounces, which light sampling can't reach.
+        float BRDFPdf;
+        float EnvironmentPdf;
+        //Normal the ray was sampled from, for the light bvh pdf of what it hits
+        glm::vec3 PreviousNormal;
+        pathSampler Sampler;
+        //Shadow rays of the current bounce, traced by Connect()
+        shadowRay ShadowRays[2];
+        uint32_t ShadowRayCount;
+    };
+
+    //Rays waiting for the extend stage of the wavefront, one array per component so the traversal streams through them.
+    //The extend stage writes the closest hit of each ray next to it.
+    struct rayQueue
+    {
+        void Resize(uint32_t Capacity);
+        //Can be called from several threads
+        void Push(uint32_t PathIndex, const ray &Ray);
+        void Set(uint32_t Index, uint32_t PathIndex, const ray &Ray);
+        ray GetRay(uint32_t Index) const;
+        void SetHit(uint32_t Index, const rayPayload &RayPayload);
+        //Copies the hit into the payload of the path
+        void GetHit(uint32_t Index, rayPayload &RayPayload) const;
+
+        std::vector<uint32_t> PathIndices;
+        std::vector<float> OriginX, OriginY, OriginZ;
+        std::vector<float> DirectionX, DirectionY, DirectionZ;
+        std::vector<float> Distance, U, V;
+        std::vector<uint32_t> InstanceIndex, PrimitiveIndex;
+        std::atomic<uint32_t> Count{0};
+    };
 private:
 
     threadPool ThreadPool;
+    tileScheduler Scheduler;
+    //Passes of each scheduler tile already copied to the staging buffer
+    std::vector<uint32_t> UploadedTilePasses;
 
     std::vector<mesh*> Meshes;
     std::vector<bvhInstance> Instances;
     tlas TLAS;
 
+    lightList Lights;
+    //Probability of sampling the background rather than an emissive triangle. 
+    //The cubemap background is sampled with the luminance distribution of the panorama, the constant color with a cosine distribution.
+    float EnvironmentProbability=0;
+    samplerType PathSampler=samplerType::Sobol;
+    bool Wavefront=false;
+
     bool ShouldPathTrace=false;
     
     bool ProcessingPreview=false;
@@ -62,14 +174,84 @@ private:
     bool PathTraceFinished=false;
 
     int TileSize=64;
+    int BVHLayout=0;
+    int BVHBuildMode=0;
+    bool QuantizedTLAS=false;
+    int TriangleKernel=0;
+    int TraversalMode=0;
+    //Packets of 4, 8 or 16 rays
+    int PacketSizeIndex=2;
+
+    //Wavefront state, kept between the passes to reuse the allocations
+    std::vector<pathState> WavefrontPaths;
+    rayQueue RayQueues[2];
+    //Paths with shadow rays to connect
+    std::vector<uint32_t> ShadowPaths;
+    std::atomic<uint32_t> ShadowPathCount{0};
+    //Order of the queue for the extend and shade stages
+    std::vector<uint32_t> ExtendOrder;
+    std::vector<uint32_t> ShadeOrder;
+    std::vector<glm::vec3> WavefrontSampleColors;
+    std::vector<float> WavefrontSampleSquaredLuminances;
+    //Milliseconds spent in the generate, extend, shade and connect stages, and the rays of the extend and connect stages, since the last reset
+    double WavefrontStageTimes[4] = {};
+    uint64_t WavefrontRays[2] = {};
 
     std::chrono::steady_clock::time_point start;
     std::chrono::steady_clock::time_point stop;
     
 
     void PathTrace();
+    //Splits the viewport in scheduler tiles, a single one for the wavefront
+    void ResetTiles();
+    //Starts the scheduler workers for that many passes of SamplesPerFrame
+    void StartWorkers(uint32_t Passes);
     void Preview();
-    void PathTraceTile(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, std::vector<rgba8>* ImageToWrite);
+    //SampleCount : samples already accumulated in the tile pixels
+    void PathTraceTile(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite);
+    //Traces the whole tile one bounce at a time, so rays can be traced as packets
+    void PathTraceTilePackets(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite);
+    //Wavefront integrator : all the paths of the tile go through each stage together, and each stage is spread over the thread pool.
+    //Paths are processed in waves of WAVEFRONT_SIZE to bound the memory.
+    void PathTraceWavefront(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite);
+    //Finds the closest hit of the queued rays, as packets if UsePackets is set
+    void ExtendStage(rayQueue &Queue, bool UsePackets);
+    //Fills ShadeOrder with the queue entries sorted by material, misses last
+    void SortByMaterial(const rayQueue &Queue);
+    //SampleIndex : samples of the pixel before this one, its index in the sampler sequence
+    void GeneratePrimaryRay(pathState &State, uint32_t x, uint32_t y, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t SampleIndex);
+    void TraceRays(std::vector<pathState> &States, std::vector<uint32_t> &Active, bool UsePackets);
+    //Regroups the rays by direction octant, so consecutive rays have the same direction signs and can share a packet frustum
+    static void SortByOctant(std::vector<pathState> &States, std::vector<uint32_t> &Active, std::vector<uint32_t> &Sorted);
+    void ShadeMiss(pathState &State);
+    //Adds the emission of the hit, queues its shadow rays in State, and samples the next ray. Returns false when the path ends.
+    bool ShadeHit(pathState &State, uint32_t Bounce, uint32_t RayBounces);
+    //Traces the shadow rays of the last ShadeHit(), and adds the contribution of the visible ones
+    void Connect(pathState &State);
+    //Collects the emissive triangles of the instances with their current transform and material
+    void BuildLights();
+    //Radiance of the background in that direction, for the background types that rays can hit
+    glm::vec3 GetBackground(glm::vec3 Direction);
+    //Solid angle pdf of SampleLights() picking that background direction
+    float GetEnvironmentPdf(glm::vec3 Normal, glm::vec3 Direction);
+    //Widens the ray cone of the hit to its distance, and returns its lod in uv space, to add to vulkanTexture::GetLod().
+    //Low values are finer, -1e30 when the triangle has no uv area.
+    float GetConeLod(rayPayload &RayPayload, glm::vec3 Direction, bvh *BVH);
+    //Emitted radiance of the triangle at that point
+    glm::vec3 GetEmission(uint32_t InstanceIndex, uint32_t PrimitiveIndex, float U, float V);
+    //Samples one light, and fills the shadow ray towards it with its contribution through the brdf, MIS weighted against the brdf sampling if UseMIS is set.
+    //Returns false when the sample contributes nothing.
+    bool SampleLights(glm::vec3 Position, glm::vec3 Normal, glm::vec3 V, glm::vec3 BaseColor, float Roughness, float Metallic, float SpecularProbability, bool UseMIS, pathSampler &Sampler, shadowRay &ShadowRay);
+    //SampleCount : samples accumulated in the pixel, including SampleColor
+    void ResolvePixel(uint32_t PixelIndex, glm::vec3 SampleColor, float SampleSquaredLuminance, uint32_t SampleCount, std::vector<rgba8>* ImageToWrite);
+    //Adaptive sampling : true when the tile pixels with SampleCount samples are below the noise threshold
+    bool TileConverged(const tile &Tile, uint32_t SampleCount);
+    //Camera rays of a Width x Height image, and random direction rays from their hits
+    void GenerateBenchmarkRays(uint32_t Width, uint32_t Height, std::vector<ray> &PrimaryRays, std::vector<ray> &SecondaryRays);
+    //Stops the current render and sets up the benchmark renders of the current view, without adaptive sampling. Returns the previous AdaptiveSampling.
+    bool StartBenchmarkRenders();
+    //Renders Passes passes from scratch, returns the samples/sec
+    double BenchmarkRender(uint32_t Passes);
     void PreviewTile(uint32_t StartX, uint32_t StartY, uint32_t TileWidth, uint32_t TileHeight, uint32_t ImageWidth, uint32_t ImageHeight, uint32_t RenderWidth, uint32_t RenderHeight, std::vector<rgba8>* ImageToWrite);
     void CreateCommandBuffers();
 
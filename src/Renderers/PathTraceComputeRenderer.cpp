@@ -7,9 +7,28 @@
 
 #include "../Swapchain.h"
 #include "../ImGuiHelper.h"
+#include "../Shader.h"
 #include <iostream>
 
 
+////////////////////////////////////////////////////////////////////////////////////////
+
+#define PREVIEW_SHADER "resources/shaders/spv/pathTracePreview.comp.spv"
+//Same shader compiled with -DCOMPRESSED_BVH, which traverses the compressed bvh nodes and compact triangles
+#define PREVIEW_COMPRESSED_SHADER "resources/shaders/spv/pathTracePreviewCompressed.comp.spv"
+
+//SHADER_VERSION of pathTracePreview.comp from which each feature is there. Older binaries run without it.
+//1 : counts the pixels that are not converged in ActivePixelsBuffer, for the adaptive sampling
+#define PREVIEW_VERSION_ACTIVE_PIXELS 1
+//1 : writes the sample count in the alpha of AccumulationImage and leaves FinalImage to the resolve pass
+#define PREVIEW_VERSION_RESOLVE 1
+//2 : reads 32 bit tlas children, older binaries read both in 16 bits
+#define PREVIEW_VERSION_TLAS_32 2
+
+//Adaptive sampling : a frame uses at most that many times the samples per pixel of the ui, and at most ADAPTIVE_MAX_SAMPLES_PER_FRAME
+#define ADAPTIVE_MAX_BOOST 8
+#define ADAPTIVE_MAX_SAMPLES_PER_FRAME 32
+
 ////////////////////////////////////////////////////////////////////////////////////////
 
 pathTraceComputeRenderer::pathTraceComputeRenderer(vulkanApp *App) : renderer(App) {
@@ -25,13 +44,26 @@ void pathTraceComputeRenderer::Render()
         UniformData.ShouldAccumulate=1;
     }
 
+    uint32_t ViewportPixels = (App->Width - (uint32_t)App->Scene->ViewportStart) * App->Height;
     if(ResetAccumulation)
     {
         UniformData.CurrentSampleCount=0;
+        ActivePixels = ViewportPixels;
         ResetAccumulation=false;
     }  
 
-    if(UniformData.CurrentSampleCount < (uint32_t)UniformData.MaxSamples)
+    //The samples of the converged pixels are given to the ones that are left, so a frame takes about the same time
+    UniformData.SamplersPerFrame = SamplesPerFrame;
+    if(UniformData.AdaptiveSampling && UniformData.CurrentSampleCount > 0 && ActivePixels > 0)
+    {
+        uint32_t Boost = std::min(ViewportPixels / ActivePixels, (uint32_t)ADAPTIVE_MAX_BOOST);
+        UniformData.SamplersPerFrame = std::min(SamplesPerFrame * (int)std::max(Boost, 1u), ADAPTIVE_MAX_SAMPLES_PER_FRAME);
+        UniformData.SamplersPerFrame = std::max(std::min(UniformData.SamplersPerFrame, UniformData.MaxSamples - (int)UniformData.CurrentSampleCount), 1);
+    }
+
+    //All the pixels are converged : the count stays, and the dispatch only resolves the image
+    bool Converged = UniformData.AdaptiveSampling && ActivePixels == 0;
+    if(UniformData.CurrentSampleCount < (uint32_t)UniformData.MaxSamples && !Converged)
     {
         UniformData.CurrentSampleCount += UniformData.SamplersPerFrame;
     }
@@ -60,9 +92,22 @@ void pathTraceComputeRenderer::Render()
 
         // if(ProcessingPreview)
         {
+            if(LightsChanged)
+            {
+                UploadLights();
+                LightsChanged=false;
+            }
             FillCommandBuffer();
             vkWaitForFences(VulkanDevice->Device, 1, &Compute.Fence, VK_TRUE, UINT64_MAX);
             vkResetFences(VulkanDevice->Device, 1, &Compute.Fence);    
+
+            //Counted by the last dispatch, used to spread the samples of the next frame
+            if(PreviewShaderVersion >= PREVIEW_VERSION_ACTIVE_PIXELS)
+            {
+                uint32_t *ActivePixelsCounter = (uint32_t*)VulkanObjects.ActivePixelsBuffer.VulkanObjects.Mapped;
+                if(UniformData.AdaptiveSampling && UniformData.CurrentSampleCount > (uint32_t)UniformData.SamplersPerFrame) ActivePixels = *ActivePixelsCounter;
+                *ActivePixelsCounter = 0;
+            }
             
             VkPipelineStageFlags SubmitPipelineStages = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
             VkSubmitInfo ComputeSubmitInfo = vulkanTools::BuildSubmitInfo();
@@ -118,6 +163,33 @@ void pathTraceComputeRenderer::SetupDescriptorPool()
 }
 
 
+const char *pathTraceComputeRenderer::GetPreviewShader()
+{
+    return CompressedBVH ? PREVIEW_COMPRESSED_SHADER : PREVIEW_SHADER;
+}
+
+void *pathTraceComputeRenderer::GetGPUNodes(mesh *Mesh)
+{
+    if(CompressedBVH) return Mesh->BVH->Compressed.Nodes.data();
+    return Mesh->BVH->BVHNodes.data();
+}
+
+void *pathTraceComputeRenderer::GetGPUTriangles(mesh *Mesh)
+{
+    if(CompressedBVH) return Mesh->BVH->Compressed.Triangles.data();
+    return Mesh->Triangles.data();
+}
+
+size_t pathTraceComputeRenderer::GetGPUNodeSize()
+{
+    return CompressedBVH ? sizeof(compressedBvhNode) : sizeof(bvhNode);
+}
+
+size_t pathTraceComputeRenderer::GetGPUTriangleSize()
+{
+    return CompressedBVH ? sizeof(compactTriangle) : sizeof(triangle);
+}
+
 void pathTraceComputeRenderer::Setup()
 {
     previewWidth = App->Width;
@@ -125,6 +197,14 @@ void pathTraceComputeRenderer::Setup()
 
     SetupDescriptorPool();
     Resources.Init(VulkanDevice, VulkanObjects.DescriptorPool, App->VulkanObjects.TextureLoader);
+
+    //The compressed variant is used once CompileShaders.bat built it, unless it is older than the other one
+    uint32_t CompressedShaderVersion = GetShaderVersion(PREVIEW_COMPRESSED_SHADER);
+    CompressedBVH = CompressedShaderVersion > 0 && CompressedShaderVersion >= GetShaderVersion(PREVIEW_SHADER);
+    PreviewShaderVersion = GetShaderVersion(GetPreviewShader());
+
+    //Without the counter every pixel would look converged after the first frame
+    if(PreviewShaderVersion < PREVIEW_VERSION_ACTIVE_PIXELS) UniformData.AdaptiveSampling = 0;
     
 
     CreateCommandBuffers();
@@ -132,6 +212,9 @@ void pathTraceComputeRenderer::Setup()
     
     VulkanObjects.FinalImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, App->VulkanObjects.Swapchain->ColorFormat, {previewWidth, previewHeight, 1});    
     VulkanObjects.AccumulationImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, VK_FORMAT_R32G32B32A32_SFLOAT, {previewWidth, previewHeight, 1});
+    VulkanObjects.VarianceImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, VK_FORMAT_R32G32_SFLOAT, {previewWidth, previewHeight, 1});
+    Resolve.Create(VulkanDevice, PreviewShaderVersion >= PREVIEW_VERSION_RESOLVE);
+    Resolve.SetImages(&VulkanObjects.AccumulationImage, &VulkanObjects.FinalImage, previewWidth, previewHeight);
 
     
     for(size_t i=0; i<App->Scene->Meshes.size(); i++)
@@ -139,6 +222,11 @@ void pathTraceComputeRenderer::Setup()
         Meshes.push_back(new mesh(App->Scene->Meshes[i].Indices,
                                   App->Scene->Meshes[i].Vertices,
                                   App->Scene->Meshes[i].MaterialIndex));
+        if(CompressedBVH)
+        {
+            //Also rebuilt by bvh::Update() from now on
+            Meshes.back()->BVH->SetLayout(bvhLayout::Compressed);
+        }
     }
     for(size_t i=0; i<App->Scene->InstancesPointers.size(); i++)
     {
@@ -156,14 +244,14 @@ void pathTraceComputeRenderer::Setup()
     uint64_t TotalBVHNodes=0;
     for(int i=0; i<Meshes.size(); i++)
     {
-        TotalTriangleCount += Meshes[i]->Triangles.size();
+        TotalTriangleCount += Meshes[i]->GetTriangleCount();
         TotalIndicesCount += Meshes[i]->BVH->TriangleIndices.size();
         TotalBVHNodes += Meshes[i]->BVH->NodesUsed;
     }
-    std::vector<triangle> AllTriangles(TotalTriangleCount);
+    std::vector<uint8_t> AllTriangles(TotalTriangleCount * GetGPUTriangleSize());
     std::vector<triangleExtraData> AllTrianglesEx(TotalTriangleCount);
     std::vector<uint32_t> AllTriangleIndices(TotalIndicesCount);
-    std::vector<bvhNode> AllBVHNodes(TotalBVHNodes);
+    std::vector<uint8_t> AllBVHNodes(TotalBVHNodes * GetGPUNodeSize());
     IndexData.resize(Meshes.size());
 
     uint32_t RunningTriangleCount=0;
@@ -171,10 +259,12 @@ void pathTraceComputeRenderer::Setup()
     uint32_t RunningBVHNodeCount=0;
     for(int i=0; i<Meshes.size(); i++)
     {
-        memcpy((void*)(AllTriangles.data() + RunningTriangleCount), Meshes[i]->Triangles.data(), Meshes[i]->Triangles.size() * sizeof(triangle));
+        memcpy((void*)(AllTriangles.data() + RunningTriangleCount * GetGPUTriangleSize()), GetGPUTriangles(Meshes[i]), Meshes[i]->GetTriangleCount() * GetGPUTriangleSize());
         memcpy((void*)(AllTrianglesEx.data() + RunningTriangleCount), Meshes[i]->TrianglesExtraData.data(), Meshes[i]->TrianglesExtraData.size() * sizeof(triangleExtraData));
         memcpy((void*)(AllTriangleIndices.data() + RunningIndicesCount), Meshes[i]->BVH->TriangleIndices.data(), Meshes[i]->BVH->TriangleIndices.size() * sizeof(uint32_t));
-        memcpy((void*)(AllBVHNodes.data() + RunningBVHNodeCount), Meshes[i]->BVH->BVHNodes.data(), Meshes[i]->BVH->NodesUsed * sizeof(bvhNode));
+        memcpy((void*)(AllBVHNodes.data() + RunningBVHNodeCount * GetGPUNodeSize()), GetGPUNodes(Meshes[i]), Meshes[i]->BVH->NodesUsed * GetGPUNodeSize());
+        //The compact copy is all the compressed layout needs from now on
+        Meshes[i]->ReleaseTriangles();
 
         IndexData[i] = 
         {
@@ -184,10 +274,11 @@ void pathTraceComputeRenderer::Setup()
             Meshes[i]->MaterialIndex
         };
 
-        RunningTriangleCount += (uint32_t)Meshes[i]->Triangles.size();
+        RunningTriangleCount += Meshes[i]->GetTriangleCount();
         RunningIndicesCount += (uint32_t)Meshes[i]->BVH->TriangleIndices.size();
         RunningBVHNodeCount += (uint32_t)Meshes[i]->BVH->NodesUsed;
     }
+    TotalBVHNodes = RunningBVHNodeCount;
 
     std::vector<materialData> AllMaterials(App->Scene->Materials.size());
     for(int i=0; i<App->Scene->Materials.size(); i++)
@@ -198,20 +289,27 @@ void pathTraceComputeRenderer::Setup()
     VulkanObjects.CommandPool = vulkanTools::CreateCommandPool(VulkanDevice->Device, App->VulkanObjects.Swapchain->QueueNodeIndex);
     VulkanObjects.CopyCommand = vulkanTools::CreateCommandBuffer(VulkanDevice->Device, VulkanObjects.CommandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, false);
     
-    vulkanTools::CreateAndFillBuffer(VulkanDevice, AllTriangles.data(), AllTriangles.size() * sizeof(triangle), &VulkanObjects.TriangleBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, AllTriangles.data(), AllTriangles.size(), &VulkanObjects.TriangleBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
     vulkanTools::CreateAndFillBuffer(VulkanDevice, AllTrianglesEx.data(), AllTrianglesEx.size() * sizeof(triangleExtraData), &VulkanObjects.TriangleExBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
-    vulkanTools::CreateAndFillBuffer(VulkanDevice, AllBVHNodes.data(), AllBVHNodes.size() * sizeof(bvhNode), &VulkanObjects.BVHBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, AllBVHNodes.data(), AllBVHNodes.size(), &VulkanObjects.BVHBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
     vulkanTools::CreateAndFillBuffer(VulkanDevice, AllTriangleIndices.data(), AllTriangleIndices.size() * sizeof(uint32_t), &VulkanObjects.IndicesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
     vulkanTools::CreateAndFillBuffer(VulkanDevice, IndexData.data(), IndexData.size() * sizeof(indexData), &VulkanObjects.IndexDataBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
 
     vulkanTools::CreateAndFillBuffer(VulkanDevice, TLAS.BLAS->data(), TLAS.BLAS->size() * sizeof(bvhInstance), &VulkanObjects.TLASInstancesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
     VK_CALL(vulkanTools::CreateBuffer(VulkanDevice,  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &VulkanObjects.TLASInstancesStagingBuffer, TLAS.BLAS->size() * sizeof(bvhInstance), nullptr));
-    vulkanTools::CreateAndFillBuffer(VulkanDevice, TLAS.Nodes.data(), TLAS.Nodes.size() * sizeof(tlasNode), &VulkanObjects.TLASNodesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
-    VK_CALL(vulkanTools::CreateBuffer(VulkanDevice,  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &VulkanObjects.TLASNodesStagingBuffer, TLAS.Nodes.size() * sizeof(tlasNode), nullptr));
+    TLASTooLarge = !PackTLASNodes();
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, GPUTLASNodes.data(), GPUTLASNodes.size() * sizeof(gpuTlasNode), &VulkanObjects.TLASNodesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    VK_CALL(vulkanTools::CreateBuffer(VulkanDevice,  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &VulkanObjects.TLASNodesStagingBuffer, GPUTLASNodes.size() * sizeof(gpuTlasNode), nullptr));
 
     vulkanTools::CreateAndFillBuffer(VulkanDevice, AllMaterials.data(), AllMaterials.size() * sizeof(materialData), &VulkanObjects.MaterialBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
     VK_CALL(vulkanTools::CreateBuffer(VulkanDevice,  VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &VulkanObjects.MaterialStagingBuffer,AllMaterials.size() * sizeof(materialData), nullptr));
 
+    //Only the header when there is no panorama, the shader then falls back to the background color
+    std::vector<uint32_t> EnvironmentData = App->Scene->Cubemap.EnvironmentMap.GetGPUData();
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, EnvironmentData.data(), EnvironmentData.size() * sizeof(uint32_t), &VulkanObjects.EnvironmentBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+
+    CreateLightBuffers();
+
     
     std::vector<VkDescriptorImageInfo> ImageInfos(App->Scene->Resources.Textures->Resources.size()); 
     for(auto &Texture : App->Scene->Resources.Textures->Resources)
@@ -230,6 +328,17 @@ void pathTraceComputeRenderer::Setup()
     VK_CALL(VulkanObjects.UBO.Map());
     UpdateUniformBuffers();    
 
+    uint32_t ZeroActivePixels=0;
+    VK_CALL(vulkanTools::CreateBuffer(
+        VulkanDevice, 
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        &VulkanObjects.ActivePixelsBuffer,
+        sizeof(uint32_t),
+        &ZeroActivePixels
+    ));
+    VK_CALL(VulkanObjects.ActivePixelsBuffer.Map());
+
     
     VkDeviceQueueCreateInfo queueCreateInfo = {};
     queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
@@ -257,6 +366,12 @@ void pathTraceComputeRenderer::Setup()
             descriptor(VK_SHADER_STAGE_COMPUTE_BIT, ImageInfos),
             descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.UBO.VulkanObjects.Descriptor),
 			descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.AccumulationImage.Descriptor, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE),
+			descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.VarianceImage.Descriptor, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE),
+            descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.ActivePixelsBuffer.VulkanObjects.Descriptor, true),
+            descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.EnvironmentBuffer.VulkanObjects.Descriptor, true),
+            descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.LightNodesBuffer.VulkanObjects.Descriptor, true),
+            descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.LightTrianglesBuffer.VulkanObjects.Descriptor, true),
+            descriptor(VK_SHADER_STAGE_COMPUTE_BIT, VulkanObjects.LightIndicesBuffer.VulkanObjects.Descriptor, true),
 		};
 
 		std::vector<VkDescriptorSetLayout> AdditionalDescriptorSetLayouts =
@@ -270,7 +385,7 @@ void pathTraceComputeRenderer::Setup()
     {
         VkComputePipelineCreateInfo ComputePipelineCreateInfo = vulkanTools::BuildComputePipelineCreateInfo(Resources.PipelineLayouts->Get("Shadows"), 0);
 
-		ComputePipelineCreateInfo.stage = LoadShader(VulkanDevice->Device, "resources/shaders/spv/pathTracePreview.comp.spv", VK_SHADER_STAGE_COMPUTE_BIT);
+		ComputePipelineCreateInfo.stage = LoadShader(VulkanDevice->Device, GetPreviewShader(), VK_SHADER_STAGE_COMPUTE_BIT);
 		VK_CALL(vkCreateComputePipelines(VulkanDevice->Device, nullptr, 1, &ComputePipelineCreateInfo, nullptr, &VulkanObjects.previewPipeline));
     }
 
@@ -292,15 +407,28 @@ void pathTraceComputeRenderer::FillCommandBuffer()
     {
         VkDescriptorSet RendererDescriptorSet = App->Scene->Resources.DescriptorSets->Get("Scene");
 
-        vkCmdBindPipeline(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, VulkanObjects.previewPipeline);
-        vkCmdBindDescriptorSets(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Resources.PipelineLayouts->Get("Shadows"), 0, 1, Resources.DescriptorSets->GetPtr("Shadows"), 0, 0);
-        vkCmdBindDescriptorSets(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Resources.PipelineLayouts->Get("Shadows"), 1, 1, &RendererDescriptorSet, 0, nullptr);			
-        
-        
-        vkCmdDispatch(Compute.CommandBuffer, 
-                      (App->Width - (int)App->Scene->ViewportStart) / 16, 
-                      App->Height / 16, 
-                      1);
+        //Nothing is traced when the shader can't address the tlas, the last image stays
+        if(!TLASTooLarge)
+        {
+            vkCmdBindPipeline(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, VulkanObjects.previewPipeline);
+            vkCmdBindDescriptorSets(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Resources.PipelineLayouts->Get("Shadows"), 0, 1, Resources.DescriptorSets->GetPtr("Shadows"), 0, 0);
+            vkCmdBindDescriptorSets(Compute.CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Resources.PipelineLayouts->Get("Shadows"), 1, 1, &RendererDescriptorSet, 0, nullptr);			
+            
+            
+            vkCmdDispatch(Compute.CommandBuffer, 
+                          (App->Width - (int)App->Scene->ViewportStart) / 16, 
+                          App->Height / 16, 
+                          1);
+
+            Resolve.Record(Compute.CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, App->Width - (uint32_t)App->Scene->ViewportStart, App->Height, App->Scene->UBOSceneMatrices.Exposure, false);
+        }
+
+        //The active pixels counter is read on the host once the fence is signaled
+        VkMemoryBarrier MemoryBarrier = {};
+        MemoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        MemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        MemoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(Compute.CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &MemoryBarrier, 0, nullptr, 0, nullptr);
 
         VkImageSubresourceRange SubresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
         vulkanTools::TransitionImageLayout(VulkanObjects.DrawCommandBuffer, App->VulkanObjects.Swapchain->Images[App->VulkanObjects.CurrentBuffer],
@@ -338,8 +466,173 @@ void pathTraceComputeRenderer::FillCommandBuffer()
 void pathTraceComputeRenderer::UpdateTLAS(uint32_t InstanceIndex)
 {
     Instances[InstanceIndex].SetTransform(App->Scene->InstancesPointers[InstanceIndex]->InstanceData.Transform);
+    TLAS.Refit(InstanceIndex);
+    UploadTLAS();
+    LightsChanged=true;
+}
+
+void pathTraceComputeRenderer::UpdateMesh(uint32_t MeshIndex)
+{
+    mesh *Mesh = Meshes[MeshIndex];
+    bool Rebuilt = Mesh->UpdateVertices(App->Scene->Meshes[MeshIndex].Indices, App->Scene->Meshes[MeshIndex].Vertices);
+
+    //Instance bounds are computed from the bvh root
+    for(size_t i=0; i<Instances.size(); i++)
+    {
+        if(Instances[i].MeshIndex == MeshIndex)
+        {
+            Instances[i].SetTransform(App->Scene->InstancesPointers[i]->InstanceData.Transform);
+        }
+    }
     TLAS.Build();
 
+    //Buffers are about to be written, wait for the last dispatch to finish reading them
+    vkWaitForFences(VulkanDevice->Device, 1, &Compute.Fence, VK_TRUE, UINT64_MAX);
+
+    //A rebuilt bvh can have more nodes than the range reserved for this mesh
+    uint32_t BVHNodesEnd = (MeshIndex + 1 < IndexData.size()) ? IndexData[MeshIndex+1].BVHNodeDataStartInx : TotalBVHNodes;
+    if(Mesh->BVH->NodesUsed > BVHNodesEnd - IndexData[MeshIndex].BVHNodeDataStartInx)
+    {
+        RepackBVHBuffer();
+    }
+
+    struct upload
+    {
+        buffer *Destination;
+        void *Data;
+        VkDeviceSize Size;
+        VkDeviceSize Offset;
+    };
+    std::vector<upload> Uploads = 
+    {
+        {&VulkanObjects.TriangleBuffer, GetGPUTriangles(Mesh), Mesh->GetTriangleCount() * GetGPUTriangleSize(), IndexData[MeshIndex].triangleDataStartInx * GetGPUTriangleSize()},
+        {&VulkanObjects.TriangleExBuffer, Mesh->TrianglesExtraData.data(), Mesh->TrianglesExtraData.size() * sizeof(triangleExtraData), IndexData[MeshIndex].triangleDataStartInx * sizeof(triangleExtraData)},
+        {&VulkanObjects.BVHBuffer, GetGPUNodes(Mesh), Mesh->BVH->NodesUsed * GetGPUNodeSize(), IndexData[MeshIndex].BVHNodeDataStartInx * GetGPUNodeSize()},
+    };
+    if(Rebuilt)
+    {
+        Uploads.push_back({&VulkanObjects.IndicesBuffer, Mesh->BVH->TriangleIndices.data(), Mesh->BVH->TriangleIndices.size() * sizeof(uint32_t), IndexData[MeshIndex].IndicesDataStartInx * sizeof(uint32_t)});
+    }
+
+    std::vector<buffer> StagingBuffers(Uploads.size());
+    VkCommandBufferBeginInfo CommandBufferInfo = vulkanTools::BuildCommandBufferBeginInfo();
+    VK_CALL(vkBeginCommandBuffer(VulkanObjects.CopyCommand, &CommandBufferInfo));
+    for(size_t i=0; i<Uploads.size(); i++)
+    {
+        VK_CALL(vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &StagingBuffers[i], Uploads[i].Size, Uploads[i].Data));
+
+        VkBufferCopy BufferCopy {};
+        BufferCopy.size = Uploads[i].Size;
+        BufferCopy.dstOffset = Uploads[i].Offset;
+        vkCmdCopyBuffer(VulkanObjects.CopyCommand, StagingBuffers[i].VulkanObjects.Buffer, Uploads[i].Destination->VulkanObjects.Buffer, 1, &BufferCopy);
+    }
+    vulkanTools::FlushCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, VulkanObjects.CopyCommand, App->VulkanObjects.Queue, false);
+
+    for(size_t i=0; i<StagingBuffers.size(); i++)
+    {
+        StagingBuffers[i].Destroy();
+    }
+    Mesh->ReleaseTriangles();
+
+    UploadTLAS();
+    LightsChanged=true;
+}
+
+//Recreates the bvh buffer with the current node counts, and points the shader to it
+void pathTraceComputeRenderer::RepackBVHBuffer()
+{
+    TotalBVHNodes=0;
+    for(size_t i=0; i<Meshes.size(); i++)
+    {
+        IndexData[i].BVHNodeDataStartInx = TotalBVHNodes;
+        TotalBVHNodes += Meshes[i]->BVH->NodesUsed;
+    }
+
+    std::vector<uint8_t> AllBVHNodes(TotalBVHNodes * GetGPUNodeSize());
+    for(size_t i=0; i<Meshes.size(); i++)
+    {
+        memcpy((void*)(AllBVHNodes.data() + IndexData[i].BVHNodeDataStartInx * GetGPUNodeSize()), GetGPUNodes(Meshes[i]), Meshes[i]->BVH->NodesUsed * GetGPUNodeSize());
+    }
+
+    VulkanObjects.BVHBuffer.Destroy();
+    VulkanObjects.IndexDataBuffer.Destroy();
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, AllBVHNodes.data(), AllBVHNodes.size(), &VulkanObjects.BVHBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, IndexData.data(), IndexData.size() * sizeof(indexData), &VulkanObjects.IndexDataBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+
+    std::vector<VkWriteDescriptorSet> WriteDescriptorSets = 
+    {
+        vulkanTools::BuildWriteDescriptorSet(Resources.DescriptorSets->Get("Shadows"), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 3, &VulkanObjects.BVHBuffer.VulkanObjects.Descriptor),
+        vulkanTools::BuildWriteDescriptorSet(Resources.DescriptorSets->Get("Shadows"), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 5, &VulkanObjects.IndexDataBuffer.VulkanObjects.Descriptor),
+    };
+    vkUpdateDescriptorSets(VulkanDevice->Device, (uint32_t)WriteDescriptorSets.size(), WriteDescriptorSets.data(), 0, nullptr);
+}
+
+//Builds the light bvh from the current transforms and materials, and creates its buffers
+void pathTraceComputeRenderer::CreateLightBuffers()
+{
+    Lights.Build(App->Scene, Meshes);
+
+    //Buffers can't be empty : a zero node, and the light count in the header of the triangles
+    std::vector<lightBvhNode> Nodes = Lights.Nodes;
+    if(Nodes.empty()) Nodes.push_back({});
+
+    std::vector<uint32_t> TrianglesData(4 + Lights.Triangles.size() * sizeof(emissiveTriangle) / sizeof(uint32_t), 0);
+    TrianglesData[0] = (uint32_t)Lights.Triangles.size();
+    if(Lights.Triangles.size()) memcpy(TrianglesData.data() + 4, Lights.Triangles.data(), Lights.Triangles.size() * sizeof(emissiveTriangle));
+
+    std::vector<uint32_t> Indices = Lights.GetGPUIndices();
+    if(Indices.empty()) Indices.push_back(NO_LIGHT);
+
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, Nodes.data(), Nodes.size() * sizeof(lightBvhNode), &VulkanObjects.LightNodesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, TrianglesData.data(), TrianglesData.size() * sizeof(uint32_t), &VulkanObjects.LightTrianglesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+    vulkanTools::CreateAndFillBuffer(VulkanDevice, Indices.data(), Indices.size() * sizeof(uint32_t), &VulkanObjects.LightIndicesBuffer, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VulkanObjects.CopyCommand, App->VulkanObjects.Queue);
+}
+
+//Recreates the light buffers, and points the shader to them
+void pathTraceComputeRenderer::UploadLights()
+{
+    //Buffers are about to be destroyed, wait for the last dispatch to finish reading them
+    vkWaitForFences(VulkanDevice->Device, 1, &Compute.Fence, VK_TRUE, UINT64_MAX);
+
+    VulkanObjects.LightNodesBuffer.Destroy();
+    VulkanObjects.LightTrianglesBuffer.Destroy();
+    VulkanObjects.LightIndicesBuffer.Destroy();
+    CreateLightBuffers();
+
+    std::vector<VkWriteDescriptorSet> WriteDescriptorSets = 
+    {
+        vulkanTools::BuildWriteDescriptorSet(Resources.DescriptorSets->Get("Shadows"), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 15, &VulkanObjects.LightNodesBuffer.VulkanObjects.Descriptor),
+        vulkanTools::BuildWriteDescriptorSet(Resources.DescriptorSets->Get("Shadows"), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 16, &VulkanObjects.LightTrianglesBuffer.VulkanObjects.Descriptor),
+        vulkanTools::BuildWriteDescriptorSet(Resources.DescriptorSets->Get("Shadows"), VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 17, &VulkanObjects.LightIndicesBuffer.VulkanObjects.Descriptor),
+    };
+    vkUpdateDescriptorSets(VulkanDevice->Device, (uint32_t)WriteDescriptorSets.size(), WriteDescriptorSets.data(), 0, nullptr);
+    ResetAccumulation=true;
+}
+
+bool pathTraceComputeRenderer::PackTLASNodes()
+{
+    //Older binaries read both children in 16 bits, the right one in the high half
+    bool Children32 = PreviewShaderVersion >= PREVIEW_VERSION_TLAS_32;
+    if(!Children32 && TLAS.Nodes.size() > 0xffff)
+    {
+        std::cout << "Error : the tlas has " << TLAS.Nodes.size() << " nodes, the compiled pathTracePreview shader only addresses 65535. Rebuild the shaders with CompileShaders.bat" << std::endl;
+        return false;
+    }
+
+    GPUTLASNodes.resize(TLAS.Nodes.size());
+    for(size_t i=0; i<TLAS.Nodes.size(); i++)
+    {
+        GPUTLASNodes[i].AABBMin = TLAS.Nodes[i].AABBMin;
+        GPUTLASNodes[i].AABBMax = TLAS.Nodes[i].AABBMax;
+        GPUTLASNodes[i].BLAS = TLAS.Nodes[i].BLAS;
+        uint32_t Left = TLAS.Nodes[i].LeftChild;
+        GPUTLASNodes[i].LeftChild = (Children32 || Left==0) ? Left : Left | ((Left+1) << 16);
+    }
+    return true;
+}
+
+void pathTraceComputeRenderer::UploadTLAS()
+{
     VkCommandBufferBeginInfo CommandBufferInfo = vulkanTools::BuildCommandBufferBeginInfo();
     VK_CALL(vkBeginCommandBuffer(VulkanObjects.CopyCommand, &CommandBufferInfo));
     {
@@ -355,11 +648,12 @@ void pathTraceComputeRenderer::UpdateTLAS(uint32_t InstanceIndex)
     
     {
         VulkanObjects.TLASNodesStagingBuffer.Map();
-        VulkanObjects.TLASNodesStagingBuffer.CopyTo(TLAS.Nodes.data(), TLAS.Nodes.size() * sizeof(tlasNode));
+        TLASTooLarge = !PackTLASNodes();
+        VulkanObjects.TLASNodesStagingBuffer.CopyTo(GPUTLASNodes.data(), GPUTLASNodes.size() * sizeof(gpuTlasNode));
         VulkanObjects.TLASNodesStagingBuffer.Unmap();
         
         VkBufferCopy BufferCopy {};
-        BufferCopy.size = TLAS.Nodes.size() * sizeof(tlasNode);
+        BufferCopy.size = GPUTLASNodes.size() * sizeof(gpuTlasNode);
 
         vkCmdCopyBuffer(VulkanObjects.CopyCommand, VulkanObjects.TLASNodesStagingBuffer.VulkanObjects.Buffer, VulkanObjects.TLASNodesBuffer.VulkanObjects.Buffer, 1, &BufferCopy);
     }
@@ -395,14 +689,39 @@ void pathTraceComputeRenderer::CreateCommandBuffers()
 
 void pathTraceComputeRenderer::RenderGUI()
 {
+    if(TLASTooLarge)
+    {
+        ImGui::Text("The scene has %d tlas nodes, over the 65535 of the compiled shader. Rebuild the shaders with CompileShaders.bat", (int)TLAS.Nodes.size());
+    }
     if(ImGui::CollapsingHeader("Path Tracing Options"))
     {
         bool ShouldReset=false;
-        ShouldReset |= ImGui::SliderInt("Samples Per Pixel", &UniformData.SamplersPerFrame, 1, 32);
+        ShouldReset |= ImGui::SliderInt("Samples Per Pixel", &SamplesPerFrame, 1, 32);
         ShouldReset |= ImGui::SliderInt("Ray Bounces", &UniformData.RayBounces, 1, 32);
         ShouldReset |= ImGui::SliderInt("Max Samples", &UniformData.MaxSamples, 1, 16384);
+        ShouldReset |= ImGui::Combo("Sampler", &UniformData.SamplerType, "Random\0Sobol\0Blue Noise\0\0");
         ImGui::Text("Num Samples %d", UniformData.CurrentSampleCount);
 
+        bool AdaptiveSampling = UniformData.AdaptiveSampling>0;
+        if(PreviewShaderVersion < PREVIEW_VERSION_ACTIVE_PIXELS)
+        {
+            ImGui::TextDisabled("Adaptive sampling needs the shaders rebuilt by CompileShaders.bat");
+        }
+        else if(ImGui::Checkbox("Adaptive Sampling", &AdaptiveSampling))
+        {
+            UniformData.AdaptiveSampling = AdaptiveSampling ? 1 : 0;
+            ShouldReset=true;
+        }
+        if(AdaptiveSampling)
+        {
+            //Converged pixels are tested again against the new threshold, no need to restart
+            if(ImGui::SliderFloat("Noise Threshold", &UniformData.NoiseThreshold, 0.001f, 0.1f, "%.3f"))
+            {
+                ActivePixels = (App->Width - (uint32_t)App->Scene->ViewportStart) * App->Height;
+            }
+            ImGui::Text("Active Pixels %d", ActivePixels);
+        }
+
         // if(ImGui::Button("Denoise"))
         // {
         //     Denoise();
@@ -428,6 +747,14 @@ void pathTraceComputeRenderer::Destroy()
     
     
     VulkanObjects.FinalImage.Destroy();
+    VulkanObjects.AccumulationImage.Destroy();
+    VulkanObjects.VarianceImage.Destroy();
+    Resolve.Destroy();
+    VulkanObjects.ActivePixelsBuffer.Destroy();
+    VulkanObjects.EnvironmentBuffer.Destroy();
+    VulkanObjects.LightNodesBuffer.Destroy();
+    VulkanObjects.LightTrianglesBuffer.Destroy();
+    VulkanObjects.LightIndicesBuffer.Destroy();
     
     vkFreeCommandBuffers(Device, App->VulkanObjects.CommandPool, 1, &VulkanObjects.DrawCommandBuffer);
 
@@ -448,6 +775,9 @@ void pathTraceComputeRenderer::UpdateMaterial(size_t Index)
     VK_CALL(vkBeginCommandBuffer(VulkanObjects.CopyCommand, &CommandBufferInfo));
     vkCmdCopyBuffer(VulkanObjects.CopyCommand, VulkanObjects.MaterialStagingBuffer.VulkanObjects.Buffer, VulkanObjects.MaterialBuffer.VulkanObjects.Buffer, 1, &BufferCopy);
     vulkanTools::FlushCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, VulkanObjects.CopyCommand, App->VulkanObjects.Queue, false);
+
+    //The emission can have changed
+    LightsChanged=true;
 }
 
 
@@ -4,6 +4,9 @@
 #include "Scene.h"
 
 #include "../bvh.h"
+#include "../Lights.h"
+#include "../ResolvePass.h"
+#include "../Sampler.h"
 #include <chrono>
 
 class pathTraceComputeRenderer : public renderer    
@@ -21,7 +24,12 @@ public:
         VkCommandBuffer DrawCommandBuffer;
         VkSubmitInfo SubmitInfo;
         storageImage FinalImage;
+        //Float sum of the samples, and their count in alpha. Tonemapped into FinalImage by Resolve.
         storageImage AccumulationImage;
+        //Sum of the squared luminance and sample count of each pixel, for the adaptive sampling
+        storageImage VarianceImage;
+        //Host visible counter of the pixels that are not converged, written by the shader
+        buffer ActivePixelsBuffer;
 
         VkPipeline previewPipeline;
         VkDescriptorPool DescriptorPool;
@@ -45,6 +53,13 @@ public:
         
         buffer MaterialBuffer;
         buffer MaterialStagingBuffer;
+
+        //Radiance and CDFs of the panorama, see environmentMap::GetGPUData()
+        buffer EnvironmentBuffer;
+        //Light bvh and emissive triangles, see lightList. Recreated when the lights change.
+        buffer LightNodesBuffer;
+        buffer LightTrianglesBuffer;
+        buffer LightIndicesBuffer;
         VkCommandBuffer CopyCommand;
 
         buffer UBO;
@@ -61,6 +76,18 @@ public:
         uint32_t padding;
     };
     std::vector<indexData> IndexData;
+    uint32_t TotalBVHNodes=0;
+
+    //TLAS node read by the shader : the left child, the right one is LeftChild+1. 0 for leaves.
+    //Binaries older than PREVIEW_VERSION_TLAS_32 read both children in 16 bits instead, the right one in the high half.
+    struct gpuTlasNode
+    {
+        glm::vec3 AABBMin;
+        uint32_t LeftChild;
+        glm::vec3 AABBMax;
+        uint32_t BLAS;
+    };
+    std::vector<gpuTlasNode> GPUTLASNodes;
 
     struct 
     {
@@ -84,13 +111,24 @@ public:
 
         int MaxSamples = 8192;
         int ShouldAccumulate=1;
-        glm::ivec2 Padding;
+        int AdaptiveSampling=0;
+        float NoiseThreshold=0.02f;
+
+        //samplerType
+        int SamplerType=(int)samplerType::Sobol;
+        glm::ivec3 Padding;
     } UniformData;
     bool ResetAccumulation=true;
+
+    //Samples per pixel set in the ui. With adaptive sampling, the frames use more when only a few pixels are still sampled.
+    int SamplesPerFrame=1;
+    //Pixels sampled by the last finished dispatch
+    uint32_t ActivePixels=0;
     
 
     void UpdateCamera();
     void UpdateTLAS(uint32_t InstanceIndex);
+    void UpdateMesh(uint32_t MeshIndex);
     void UpdateMaterial(size_t Index);
 private:
 
@@ -98,9 +136,33 @@ private:
     std::vector<bvhInstance> Instances;
     tlas TLAS;
 
+    lightList Lights;
+    resolvePass Resolve;
+    //Uploads the compressed bvh nodes and compact triangles, and drops the full precision triangles of the meshes.
+    //Set when the -DCOMPRESSED_BVH variant of the preview shader is compiled.
+    bool CompressedBVH=false;
+    //SHADER_VERSION of the preview shader binary, see PREVIEW_VERSION_* in PathTraceComputeRenderer.cpp
+    uint32_t PreviewShaderVersion=0;
+    //The preview binary can't address all the tlas nodes, nothing is traced
+    bool TLASTooLarge=false;
+    //Set when an instance, a mesh or a material is edited, the light buffers are rebuilt before the next dispatch
+    bool LightsChanged=false;
+
     void CreateCommandBuffers();
     void SetupDescriptorPool();
     void FillCommandBuffer();
     void UpdateUniformBuffers();    
+    void UploadTLAS();
+    //Copies the tlas in the layout of the shader binary. False when it has more nodes than the binary can address.
+    bool PackTLASNodes();
+    void RepackBVHBuffer();
+    //Shader binary, and the bvh and triangle data in its format
+    const char *GetPreviewShader();
+    void *GetGPUNodes(mesh *Mesh);
+    void *GetGPUTriangles(mesh *Mesh);
+    size_t GetGPUNodeSize();
+    size_t GetGPUTriangleSize();
+    void CreateLightBuffers();
+    void UploadLights();
 
 };
\ No newline at end of file
@@ -5,8 +5,14 @@
 
 #include "../Swapchain.h"
 #include "../ImguiHelper.h"
+#include "../Shader.h"
 #include <glm/gtc/type_ptr.hpp>
 
+#define RAYGEN_SHADER "resources/shaders/spv/raygen.rgen.spv"
+//SHADER_VERSION of raygen.rgen from which each feature is there. Older binaries run without it.
+//1 : writes the sample count in the alpha of AccumulationImage and leaves StorageImage to the resolve pass
+#define RAYGEN_VERSION_RESOLVE 1
+
 pathTraceRTXRenderer::pathTraceRTXRenderer(vulkanApp *App) : renderer(App) {
     App->VulkanObjects.VulkanDevice->LoadRayTracingFuncs();
 }
@@ -67,14 +73,52 @@ void pathTraceRTXRenderer::Render()
     Result = App->VulkanObjects.Swapchain->QueuePresent(App->VulkanObjects.Queue, App->VulkanObjects.CurrentBuffer, App->VulkanObjects.Semaphores.RenderComplete);
     VK_CALL(vkQueueWaitIdle(App->VulkanObjects.Queue));
 
-    if(ShouldDenoise)
+    if(ShouldDenoise && Resolve.Available)
+    {
+        //Averages exported by the resolve of this frame, in hdr
+        Resolve.ReadExport(DenoiserInput);
+
+        oidn::DeviceRef device = oidn::newDevice();
+        device.commit();
+
+        oidn::FilterRef filter = device.newFilter("RT"); // generic ray tracing filter
+        filter.setImage("color", DenoiserInput.data(), oidn::Format::Float3, App->Width, App->Height, 0, 0, 0);
+        filter.setImage("output", DenoiserOutput.data(), oidn::Format::Float3, App->Width, App->Height, 0, 0, 0);
+        filter.set("hdr", true);
+        filter.commit();
+        filter.execute();
+
+        //Copy back to gpu, as an accumulation of 1 sample that the resolve tonemaps
+        DenoiseBuffer.Map();
+        glm::vec4 *DenoisedColors = (glm::vec4*)DenoiseBuffer.VulkanObjects.Mapped;
+        for(size_t i=0; i<DenoiserOutput.size(); i++)
+        {
+            DenoisedColors[i] = glm::vec4(DenoiserOutput[i], 1.0f);
+        }
+        DenoiseBuffer.Unmap();
+        
+
+        //Copy buffer back into the accumulation image
+        VkCommandBuffer CommandBuffer = vulkanTools::CreateCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
+        VkBufferImageCopy BufferImageCopy = GetDenoiseCopyRegion();
+        vulkanTools::TransitionImageLayout(CommandBuffer, AccumulationImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        vkCmdCopyBufferToImage(CommandBuffer, DenoiseBuffer.VulkanObjects.Buffer, AccumulationImage.Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &BufferImageCopy);
+        vulkanTools::TransitionImageLayout(CommandBuffer, AccumulationImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
+        
+        vulkanTools::FlushCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, CommandBuffer, App->VulkanObjects.Queue, true);
+
+        VK_CALL(vkQueueWaitIdle(App->VulkanObjects.Queue));
+
+        ShouldDenoise=false;
+        UniformData.ShouldAccumulate=0;
+    }
+    else if(ShouldDenoise)
     {
-        //Copy the content of the denoise buffer from gpu to cpu
+        //Tonemapped colors of this frame, copied from the storage image by the command buffer
         DenoiseBuffer.Map();
         memcpy(DenoiserInputUint.data(), DenoiseBuffer.VulkanObjects.Mapped, DenoiserInputUint.size() * sizeof(rgba));
         DenoiseBuffer.Unmap();
         
-        //Denoise
         for(size_t i=0; i<DenoiserInputUint.size(); i++)
         {
             DenoiserInput[i].r = std::max(0.0f, std::min(0.99f, (float)DenoiserInputUint[i].r / 255.0f));
@@ -88,49 +132,26 @@ void pathTraceRTXRenderer::Render()
         oidn::FilterRef filter = device.newFilter("RT"); // generic ray tracing filter
         filter.setImage("color", DenoiserInput.data(), oidn::Format::Float3, App->Width, App->Height, 0, 0, 0);
         filter.setImage("output", DenoiserOutput.data(), oidn::Format::Float3, App->Width, App->Height, 0, 0, 0);
-        filter.set("hdr", true);
         filter.commit();
         filter.execute();
 
         for(size_t i=0; i<DenoiserInputUint.size(); i++)
         {
-            DenoiserInputUint[i].r = (uint8_t)(DenoiserOutput[i].r * 255.0f);
-            DenoiserInputUint[i].g = (uint8_t)(DenoiserOutput[i].g * 255.0f);
-            DenoiserInputUint[i].b = (uint8_t)(DenoiserOutput[i].b * 255.0f);
+            DenoiserInputUint[i].r = (uint8_t)(std::max(0.0f, std::min(1.0f, DenoiserOutput[i].r)) * 255.0f);
+            DenoiserInputUint[i].g = (uint8_t)(std::max(0.0f, std::min(1.0f, DenoiserOutput[i].g)) * 255.0f);
+            DenoiserInputUint[i].b = (uint8_t)(std::max(0.0f, std::min(1.0f, DenoiserOutput[i].b)) * 255.0f);
         }
 
-        //Copy back to gpu
         DenoiseBuffer.Map();
         memcpy(DenoiseBuffer.VulkanObjects.Mapped, DenoiserInputUint.data(), DenoiserInputUint.size() * sizeof(rgba));
         DenoiseBuffer.Unmap();
-        
 
-        //Copy buffer back into storage buffer
+        //Copy buffer back into the storage image, that the tracer leaves as is while it does not accumulate
         VkCommandBuffer CommandBuffer = vulkanTools::CreateCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, true);
-        
-        VkImageSubresourceLayers ImageSubresource = {};
-        ImageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        ImageSubresource.baseArrayLayer=0;
-        ImageSubresource.layerCount=1;
-        ImageSubresource.mipLevel=0;
-
-        VkBufferImageCopy BufferImageCopy = {};
-        BufferImageCopy.imageExtent.depth=1;
-        BufferImageCopy.imageExtent.width = App->Width;
-        BufferImageCopy.imageExtent.height = App->Height;
-        BufferImageCopy.imageOffset = {0,0,0};
-        BufferImageCopy.imageSubresource = ImageSubresource;
-
-        BufferImageCopy.bufferOffset=0;
-        BufferImageCopy.bufferImageHeight = 0;
-        BufferImageCopy.bufferRowLength=0;
-        
-
-        // vkCmdCopyImageToBuffer(CopyCommand, StorageImage.Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, DenoiseBuffer.VulkanObjects.Buffer,1,  &BufferImageCopy);        
+        VkBufferImageCopy BufferImageCopy = GetDenoiseCopyRegion();
         vulkanTools::TransitionImageLayout(CommandBuffer, StorageImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
         vkCmdCopyBufferToImage(CommandBuffer, DenoiseBuffer.VulkanObjects.Buffer, StorageImage.Image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &BufferImageCopy);
         vulkanTools::TransitionImageLayout(CommandBuffer, StorageImage.Image, VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL);
-        
         vulkanTools::FlushCommandBuffer(VulkanDevice->Device, App->VulkanObjects.CommandPool, CommandBuffer, App->VulkanObjects.Queue, true);
 
         VK_CALL(vkQueueWaitIdle(App->VulkanObjects.Queue));
@@ -142,6 +163,27 @@ void pathTraceRTXRenderer::Render()
     UpdateUniformBuffers();
 }
 
+VkBufferImageCopy pathTraceRTXRenderer::GetDenoiseCopyRegion()
+{
+    VkImageSubresourceLayers ImageSubresource = {};
+    ImageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    ImageSubresource.baseArrayLayer=0;
+    ImageSubresource.layerCount=1;
+    ImageSubresource.mipLevel=0;
+
+    VkBufferImageCopy BufferImageCopy = {};
+    BufferImageCopy.imageExtent.depth=1;
+    BufferImageCopy.imageExtent.width = App->Width;
+    BufferImageCopy.imageExtent.height = App->Height;
+    BufferImageCopy.imageOffset = {0,0,0};
+    BufferImageCopy.imageSubresource = ImageSubresource;
+
+    BufferImageCopy.bufferOffset=0;
+    BufferImageCopy.bufferImageHeight = 0;
+    BufferImageCopy.bufferRowLength=0;
+    return BufferImageCopy;
+}
+
 void pathTraceRTXRenderer::CreateBottomLevelAccelarationStructure(scene *Scene)
 {
     for(size_t i=0; i<App->Scene->Meshes.size(); i++)
@@ -416,13 +458,14 @@ void pathTraceRTXRenderer::CreateTopLevelAccelerationStructure()
 
 void pathTraceRTXRenderer::CreateImages()
 {
-    //Contains the final image
+    //Contains the final image, tonemapped by the resolve pass
     StorageImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, App->VulkanObjects.Swapchain->ColorFormat, {App->Width, App->Height, 1});
     
-    //Contains the accumulated colors, not divided by the sample count
+    //Contains the accumulated colors, not divided by the sample count which is in alpha
     AccumulationImage.Create(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, VK_FORMAT_R32G32B32A32_SFLOAT, {App->Width, App->Height, 1});
+    Resolve.SetImages(&AccumulationImage, &StorageImage, App->Width, App->Height);
 
-    VK_CALL(vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &DenoiseBuffer, App->Width * App->Height * 4, nullptr));
+    VK_CALL(vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &DenoiseBuffer, App->Width * App->Height * sizeof(glm::vec4), nullptr));
     DenoiserInput.resize(App->Width * App->Height);
     DenoiserOutput.resize(App->Width * App->Height);
     DenoiserInputUint.resize(App->Width * App->Height);
@@ -476,7 +519,7 @@ void pathTraceRTXRenderer::CreateRayTracingPipeline()
     std::vector<VkPipelineShaderStageCreateInfo> ShaderStages;
     
     {
-        ShaderStages.push_back(LoadShader(VulkanDevice->Device, "resources/shaders/spv/raygen.rgen.spv", VK_SHADER_STAGE_RAYGEN_BIT_KHR));
+        ShaderStages.push_back(LoadShader(VulkanDevice->Device, RAYGEN_SHADER, VK_SHADER_STAGE_RAYGEN_BIT_KHR));
         ShaderModules.push_back(ShaderStages[ShaderStages.size()-1].module);
         VkRayTracingShaderGroupCreateInfoKHR ShaderGroup {VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR};
         ShaderGroup.type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
@@ -730,6 +773,8 @@ void pathTraceRTXRenderer::Setup()
     ));
 
 
+    RaygenShaderVersion = GetShaderVersion(RAYGEN_SHADER);
+    Resolve.Create(VulkanDevice, RaygenShaderVersion >= RAYGEN_VERSION_RESOLVE);
     CreateImages();
     BuildUniformBuffers();
     CreateRayTracingPipeline();
@@ -753,6 +798,7 @@ void pathTraceRTXRenderer::CreateCommandBuffers()
 
 void pathTraceRTXRenderer::Denoise()
 {
+    //The denoiser reads the hdr averages exported by the resolve pass, or the tonemapped storage image when the pass is not available
     ShouldDenoise=true;
     // vulkanTools::CopyImageToBuffer(VulkanDevice, App->VulkanObjects.CommandPool, App->VulkanObjects.Queue, StorageImage.Image, &DenoiseBuffer, App->Width, App->Height);
 }
@@ -765,6 +811,7 @@ void pathTraceRTXRenderer::RenderGUI()
         ShouldReset |= ImGui::SliderInt("Samples Per Pixel", &UniformData.SamplersPerFrame, 1, 32);
         ShouldReset |= ImGui::SliderInt("Ray Bounces", &UniformData.RayBounces, 1, 32);
         ShouldReset |= ImGui::SliderInt("Max Samples", &UniformData.MaxSamples, 1, 16384);
+        ShouldReset |= ImGui::Combo("Sampler", &UniformData.SamplerType, "Random\0Sobol\0Blue Noise\0\0");
         ImGui::Text("Num Samples %d", UniformData.CurrentSampleCount);
 
         if(ImGui::Button("Denoise"))
@@ -821,6 +868,9 @@ void pathTraceRTXRenderer::BuildCommandBuffers()
             App->Width - (int)App->Scene->ViewportStart, App->Height, 1
         );
 
+        //Average and tonemap into the storage image. The averages are only read back to denoise.
+        Resolve.Record(DrawCommandBuffers[i], VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, App->Width, App->Height, App->Scene->UBOSceneMatrices.Exposure, ShouldDenoise);
+
         vulkanTools::TransitionImageLayout(DrawCommandBuffers[i], App->VulkanObjects.Swapchain->Images[i], VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, SubresourceRange);
         vulkanTools::TransitionImageLayout(DrawCommandBuffers[i], StorageImage.Image, VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, SubresourceRange);
         
@@ -833,27 +883,11 @@ void pathTraceRTXRenderer::BuildCommandBuffers()
         CopyRegion.extent = {App->Width - (int)App->Scene->ViewportStart, App->Height, 1};
         vkCmdCopyImage(DrawCommandBuffers[i], StorageImage.Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, App->VulkanObjects.Swapchain->Images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &CopyRegion);
 
-        if(ShouldDenoise)
+        if(ShouldDenoise && !Resolve.Available)
         {
             //Copy result to the denoise buffer
-            VkImageSubresourceLayers ImageSubresource = {};
-            ImageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-            ImageSubresource.baseArrayLayer=0;
-            ImageSubresource.layerCount=1;
-            ImageSubresource.mipLevel=0;
-
-            VkBufferImageCopy BufferImageCopy = {};
-            BufferImageCopy.imageExtent.depth=1;
-            BufferImageCopy.imageExtent.width = App->Width;
-            BufferImageCopy.imageExtent.height = App->Height;
-            BufferImageCopy.imageOffset = {0,0,0};
-            BufferImageCopy.imageSubresource = ImageSubresource;
-
-            BufferImageCopy.bufferOffset=0;
-            BufferImageCopy.bufferImageHeight = 0;
-            BufferImageCopy.bufferRowLength=0;
-            
-            vkCmdCopyImageToBuffer(DrawCommandBuffers[i], StorageImage.Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, DenoiseBuffer.VulkanObjects.Buffer,1,  &BufferImageCopy);
+            VkBufferImageCopy BufferImageCopy = GetDenoiseCopyRegion();
+            vkCmdCopyImageToBuffer(DrawCommandBuffers[i], StorageImage.Image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, DenoiseBuffer.VulkanObjects.Buffer, 1, &BufferImageCopy);
         }
 
         vulkanTools::TransitionImageLayout(DrawCommandBuffers[i], App->VulkanObjects.Swapchain->Images[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, SubresourceRange);
@@ -907,6 +941,7 @@ void pathTraceRTXRenderer::Destroy()
     StorageImage.Destroy();
     AccumulationImage.Destroy();
     DenoiseBuffer.Destroy();
+    Resolve.Destroy();
     UBO.Destroy();
     
     vkDestroyDescriptorSetLayout(VulkanDevice->Device, DescriptorSetLayout, nullptr);
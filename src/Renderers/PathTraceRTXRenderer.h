@@ -5,6 +5,8 @@
 #include "RayTracingHelper.h"
 
 #include "Image.h"
+#include "ResolvePass.h"
+#include "Sampler.h"
 class pathTraceRTXRenderer : public renderer    
 {
 public:
@@ -44,6 +46,8 @@ private:
     buffer TransformMatricesBuffer;
     storageImage StorageImage;
     storageImage AccumulationImage; 
+    //Tonemaps AccumulationImage into StorageImage, and exports it for the denoiser
+    resolvePass Resolve;
     buffer UBO;
     VkDescriptorSetLayout DescriptorSetLayout;
     VkPipelineLayout PipelineLayout;
@@ -71,13 +75,22 @@ private:
         int MaxSamples = 8192;
         int ShouldAccumulate=1;
         glm::ivec2 Padding;
+
+        //samplerType
+        int SamplerType=(int)samplerType::Sobol;
+        glm::ivec3 Padding1;
     } UniformData;
     
 
 
 
+    //SHADER_VERSION of the raygen binary, see RAYGEN_VERSION_* in PathTraceRTXRenderer.cpp
+    uint32_t RaygenShaderVersion=0;
+
     //Denoiser
     bool ShouldDenoise=false;
+    //Denoised colors, copied into AccumulationImage with a sample count of 1.
+    //Without the resolve pass, the 8 bit colors of StorageImage copied in and out of it instead.
     buffer DenoiseBuffer;
     std::vector<glm::vec3> DenoiserInput;
     std::vector<glm::vec3> DenoiserOutput;
@@ -85,6 +98,7 @@ private:
     std::vector<rgba> DenoiserInputUint;
     
     void Denoise();
+    VkBufferImageCopy GetDenoiseCopyRegion();
 
     void CreateMaterialBuffer();
     void CreateBottomLevelAccelarationStructure(scene *Scene);
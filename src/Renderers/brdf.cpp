@@ -175,4 +175,57 @@ float GetBrdfProbability(rayPayload RayPayload, glm::vec3 V, glm::vec3 ShadingNo
 glm::vec3 EvalCombinedBRDF(glm::vec3 N, glm::vec3 L, glm::vec3 V, glm::vec3 Color, float Metallic) {
 	glm::vec3 diffuse = BaseColorToDiffuseReflectance(Color, Metallic);
 	return diffuse;
+}
+
+float GGXDistribution(float AlphaSquared, float NdotH) {
+	float b = NdotH * NdotH * (AlphaSquared - 1.0f) + 1.0f;
+	return AlphaSquared / (PI * b * b);
+}
+
+glm::vec3 EvalBRDF(glm::vec3 N, glm::vec3 L, glm::vec3 V, glm::vec3 Color, float Roughness, float Metallic) {
+	if (dot(N, L) <= 0.0f || dot(N, V) <= 0.0f) return glm::vec3(0);
+	float NdotL = std::min(1.0f, dot(N, L));
+	float NdotV = std::min(1.0f, dot(N, V));
+
+	// Lambert, with the same reflectance as SampleDiffuseBRDF
+	glm::vec3 Result = BaseColorToDiffuseReflectance(Color, Metallic) * ONE_OVER_PI * NdotL;
+
+	if (Roughness >= DELTA_SPECULAR_ROUGHNESS) {
+		float Alpha = Roughness * Roughness;
+		float AlphaSquared = Alpha * Alpha;
+		glm::vec3 H = glm::normalize(L + V);
+		float NdotH = std::max(0.00001f, std::min(1.0f, dot(N, H)));
+		float HdotL = std::max(0.00001f, std::min(1.0f, dot(H, L)));
+		glm::vec3 SpecularF0 = BaseColorToSpecularF0(Color, Metallic);
+		glm::vec3 F = EvalFresnelSchlick(SpecularF0, ShadowedF90(SpecularF0), HdotL);
+
+		// Height correlated Smith G2, so that EvalBRDF / BRDFPdf gives the weight of sampleSpecularMicrofacet
+		float G1V = SmithG1GGX(Alpha, NdotV, AlphaSquared, NdotV * NdotV);
+		float G1L = SmithG1GGX(Alpha, NdotL, AlphaSquared, NdotL * NdotL);
+		float G2 = (G1V * G1L) / (G1V + G1L - G1V * G1L);
+
+		// D * G2 * F / (4 * NdotL * NdotV), times NdotL
+		Result += F * GGXDistribution(AlphaSquared, NdotH) * G2 / (4.0f * NdotV);
+	}
+	return Result;
+}
+
+float BRDFPdf(glm::vec3 N, glm::vec3 L, glm::vec3 V, float Roughness, float SpecularProbability) {
+	if (dot(N, L) <= 0.0f || dot(N, V) <= 0.0f) return 0.0f;
+	float NdotL = std::min(1.0f, dot(N, L));
+	float NdotV = std::min(1.0f, dot(N, V));
+
+	// Cosine weighted hemisphere
+	float Pdf = (1.0f - SpecularProbability) * NdotL * ONE_OVER_PI;
+
+	if (Roughness >= DELTA_SPECULAR_ROUGHNESS) {
+		// Visible normals : G1(V) * D(H) / (4 * NdotV)
+		float Alpha = Roughness * Roughness;
+		float AlphaSquared = Alpha * Alpha;
+		glm::vec3 H = glm::normalize(L + V);
+		float NdotH = std::max(0.00001f, std::min(1.0f, dot(N, H)));
+		float G1V = SmithG1GGX(Alpha, NdotV, AlphaSquared, NdotV * NdotV);
+		Pdf += SpecularProbability * G1V * GGXDistribution(AlphaSquared, NdotH) / (4.0f * NdotV);
+	}
+	return Pdf;
 }
\ No newline at end of file
@@ -25,6 +25,8 @@ glm::vec3 SampleSpecularHalfVector(glm::vec3 Ve, glm::vec2 Alpha2D, glm::vec2 u)
 // Smith G1 term (masking function) further optimized for GGX distribution (by substituting G_a into G1_GGX)
 float SmithG1GGX(float Alpha, float NdotS, float AlphaSquared, float NdotSSquared);
 float DistributionGGX_GeometrySmith(float Alpha, float AlphaSquared, float NdotL, float NdotV);
+// GGX normal distribution D(H)
+float GGXDistribution(float AlphaSquared, float NdotH);
 glm::vec3 sampleSpecularMicrofacet(glm::vec3 Vlocal, float Alpha, float AlphaSquared, glm::vec3 SpecularF0, glm::vec2 u, glm::vec3& Weight);
 
 // This is an entry point for evaluation of all other BRDFs based on selected configuration (for indirect light)
@@ -34,4 +36,12 @@ float GetBrdfProbability(rayPayload RayPayload, glm::vec3 V, glm::vec3 ShadingNo
 
 
 // This is an entry point for evaluation of all other BRDFs based on selected configuration (for direct light)
-glm::vec3 EvalCombinedBRDF(glm::vec3 N, glm::vec3 L, glm::vec3 V, glm::vec3 Color, float Metallic);
\ No newline at end of file
+glm::vec3 EvalCombinedBRDF(glm::vec3 N, glm::vec3 L, glm::vec3 V, glm::vec3 Color, float Metallic);
+
+// Under that roughness the specular lobe is treated as a mirror : it can only be reached by SampleSpecularBRDF, and is left out of EvalBRDF and BRDFPdf
+#define DELTA_SPECULAR_ROUGHNESS 0.01f
+
+// Diffuse and specular brdfs times the cosine term, for light sampling
+glm::vec3 EvalBRDF(glm::vec3 N, glm::vec3 L, glm::vec3 V, glm::vec3 Color, float Roughness, float Metallic);
+// Solid angle pdf of L when the specular brdf is sampled with SpecularProbability and the diffuse one otherwise, for multiple importance sampling
+float BRDFPdf(glm::vec3 N, glm::vec3 L, glm::vec3 V, float Roughness, float SpecularProbability);
\ No newline at end of file
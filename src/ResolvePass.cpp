@@ -0,0 +1,121 @@
+#include "ResolvePass.h"
+#include "Tools.h"
+#include "Shader.h"
+
+#include <glm/gtc/packing.hpp>
+
+#define RESOLVE_SHADER "resources/shaders/spv/pathTraceResolve.comp.spv"
+//SHADER_VERSION of pathTraceResolve.comp that matches this pass
+#define RESOLVE_VERSION 1
+
+void resolvePass::Create(vulkanDevice *_VulkanDevice, bool TracerWritesCounts)
+{
+    this->VulkanDevice = _VulkanDevice;
+    Available = TracerWritesCounts && GetShaderVersion(RESOLVE_SHADER) >= RESOLVE_VERSION;
+    if(!Available) return;
+
+    std::vector<VkDescriptorSetLayoutBinding> SetLayoutBindings =
+    {
+        vulkanTools::BuildDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 0),
+        vulkanTools::BuildDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, VK_SHADER_STAGE_COMPUTE_BIT, 1),
+        vulkanTools::BuildDescriptorSetLayoutBinding(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, VK_SHADER_STAGE_COMPUTE_BIT, 2),
+    };
+    VkDescriptorSetLayoutCreateInfo DescriptorSetLayoutCreateInfo = vulkanTools::BuildDescriptorSetLayoutCreateInfo(SetLayoutBindings);
+    VK_CALL(vkCreateDescriptorSetLayout(VulkanDevice->Device, &DescriptorSetLayoutCreateInfo, nullptr, &DescriptorSetLayout));
+
+    VkPushConstantRange PushConstantRange = vulkanTools::BuildPushConstantRange(VK_SHADER_STAGE_COMPUTE_BIT, sizeof(pushConstants), 0);
+    VkPipelineLayoutCreateInfo PipelineLayoutCreateInfo = vulkanTools::BuildPipelineLayoutCreateInfo(&DescriptorSetLayout, 1);
+    PipelineLayoutCreateInfo.pushConstantRangeCount=1;
+    PipelineLayoutCreateInfo.pPushConstantRanges = &PushConstantRange;
+    VK_CALL(vkCreatePipelineLayout(VulkanDevice->Device, &PipelineLayoutCreateInfo, nullptr, &PipelineLayout));
+
+    std::vector<VkDescriptorPoolSize> PoolSizes =
+    {
+        {VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 2},
+        {VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 1}
+    };
+    VkDescriptorPoolCreateInfo DescriptorPoolCreateInfo = vulkanTools::BuildDescriptorPoolCreateInfo(PoolSizes, 1);
+    VK_CALL(vkCreateDescriptorPool(VulkanDevice->Device, &DescriptorPoolCreateInfo, nullptr, &DescriptorPool));
+
+    VkDescriptorSetAllocateInfo DescriptorSetAllocateInfo = vulkanTools::BuildDescriptorSetAllocateInfo(DescriptorPool, &DescriptorSetLayout, 1);
+    VK_CALL(vkAllocateDescriptorSets(VulkanDevice->Device, &DescriptorSetAllocateInfo, &DescriptorSet));
+
+    VkComputePipelineCreateInfo ComputePipelineCreateInfo = vulkanTools::BuildComputePipelineCreateInfo(PipelineLayout, 0);
+    ComputePipelineCreateInfo.stage = LoadShader(VulkanDevice->Device, RESOLVE_SHADER, VK_SHADER_STAGE_COMPUTE_BIT);
+    ShaderModule = ComputePipelineCreateInfo.stage.module;
+    VK_CALL(vkCreateComputePipelines(VulkanDevice->Device, nullptr, 1, &ComputePipelineCreateInfo, nullptr, &Pipeline));
+}
+
+void resolvePass::SetImages(storageImage *AccumulationImage, storageImage *OutputImage, uint32_t Width, uint32_t Height)
+{
+    if(!Available) return;
+
+    if(Width != ExportWidth || Height != ExportHeight)
+    {
+        ExportBuffer.Destroy();
+        VK_CALL(vulkanTools::CreateBuffer(VulkanDevice, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &ExportBuffer, (VkDeviceSize)Width * Height * 8, nullptr));
+        ExportWidth = Width;
+        ExportHeight = Height;
+    }
+
+    VkDescriptorImageInfo AccumulationDescriptor {VK_NULL_HANDLE, AccumulationImage->ImageView, VK_IMAGE_LAYOUT_GENERAL};
+    VkDescriptorImageInfo OutputDescriptor {VK_NULL_HANDLE, OutputImage->ImageView, VK_IMAGE_LAYOUT_GENERAL};
+    std::vector<VkWriteDescriptorSet> WriteDescriptorSets =
+    {
+        vulkanTools::BuildWriteDescriptorSet(DescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 0, &AccumulationDescriptor),
+        vulkanTools::BuildWriteDescriptorSet(DescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1, &OutputDescriptor),
+        vulkanTools::BuildWriteDescriptorSet(DescriptorSet, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2, &ExportBuffer.VulkanObjects.Descriptor),
+    };
+    vkUpdateDescriptorSets(VulkanDevice->Device, (uint32_t)WriteDescriptorSets.size(), WriteDescriptorSets.data(), 0, nullptr);
+}
+
+void resolvePass::Record(VkCommandBuffer CommandBuffer, VkPipelineStageFlags TraceStage, uint32_t Width, uint32_t Height, float Exposure, bool Export)
+{
+    if(!Available) return;
+
+    //The accumulation was just written by the tracing
+    VkMemoryBarrier MemoryBarrier = {};
+    MemoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    MemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    MemoryBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+    vkCmdPipelineBarrier(CommandBuffer, TraceStage, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &MemoryBarrier, 0, nullptr, 0, nullptr);
+
+    pushConstants PushConstants = {Exposure, Export ? 1u : 0u};
+    vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, Pipeline);
+    vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, PipelineLayout, 0, 1, &DescriptorSet, 0, nullptr);
+    vkCmdPushConstants(CommandBuffer, PipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &PushConstants);
+    vkCmdDispatch(CommandBuffer, (Width + 15) / 16, (Height + 15) / 16, 1);
+
+    if(Export)
+    {
+        MemoryBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        MemoryBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+        vkCmdPipelineBarrier(CommandBuffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &MemoryBarrier, 0, nullptr, 0, nullptr);
+    }
+}
+
+void resolvePass::ReadExport(std::vector<glm::vec3> &Output)
+{
+    Output.resize((size_t)ExportWidth * ExportHeight);
+    if(!Available) return;
+    VK_CALL(ExportBuffer.Map());
+    const uint32_t *Pixels = (const uint32_t*)ExportBuffer.VulkanObjects.Mapped;
+    for(size_t i=0; i<Output.size(); i++)
+    {
+        glm::vec2 RG = glm::unpackHalf2x16(Pixels[i * 2]);
+        glm::vec2 B = glm::unpackHalf2x16(Pixels[i * 2 + 1]);
+        Output[i] = glm::vec3(RG.x, RG.y, B.x);
+    }
+    ExportBuffer.Unmap();
+}
+
+void resolvePass::Destroy()
+{
+    if(!Available) return;
+    ExportBuffer.Destroy();
+    vkDestroyPipeline(VulkanDevice->Device, Pipeline, nullptr);
+    vkDestroyShaderModule(VulkanDevice->Device, ShaderModule, nullptr);
+    vkDestroyPipelineLayout(VulkanDevice->Device, PipelineLayout, nullptr);
+    vkDestroyDescriptorPool(VulkanDevice->Device, DescriptorPool, nullptr);
+    vkDestroyDescriptorSetLayout(VulkanDevice->Device, DescriptorSetLayout, nullptr);
+}
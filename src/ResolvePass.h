@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Device.h"
+#include "Buffer.h"
+#include "Image.h"
+
+#include <glm/vec3.hpp>
+#include <vector>
+#include <vulkan/vulkan.h>
+
+//Tonemaps the float accumulation of a path tracer into the 8 bit image that is shown, with pathTraceResolve.comp.
+//The accumulation holds the sum of the samples in rgb and their count in alpha, so pixels can have different sample counts.
+//The averages can also be exported as half floats, the only data read back, and only when it is needed (denoising, saving).
+struct resolvePass
+{
+    //TracerWritesCounts : the tracer binary writes the sample count in the alpha of the accumulation, instead of tonemapping into the output image itself.
+    //Nothing is created without it, or when pathTraceResolve.comp.spv is older than RESOLVE_VERSION. The calls below then do nothing.
+    void Create(vulkanDevice *VulkanDevice, bool TracerWritesCounts);
+    //Points the pass to the images, again each time they are recreated. Width and Height : size of the images.
+    void SetImages(storageImage *AccumulationImage, storageImage *OutputImage, uint32_t Width, uint32_t Height);
+    //Records the dispatch over Width * Height pixels, after the tracing that writes the accumulation in TraceStage.
+    //With Export, the averages are also written to ExportBuffer.
+    void Record(VkCommandBuffer CommandBuffer, VkPipelineStageFlags TraceStage, uint32_t Width, uint32_t Height, float Exposure, bool Export);
+    //Averages written by the last exporting dispatch, once it is finished. Width * Height of SetImages().
+    void ReadExport(std::vector<glm::vec3> &Output);
+    void Destroy();
+
+    //rgb of each pixel as 3 halves, padded to 8 bytes
+    buffer ExportBuffer;
+    uint32_t ExportWidth=0, ExportHeight=0;
+    //False when the pass can't be used with the compiled shaders, see Create()
+    bool Available=false;
+
+    VkDescriptorSetLayout DescriptorSetLayout = VK_NULL_HANDLE;
+    VkDescriptorPool DescriptorPool = VK_NULL_HANDLE;
+    VkDescriptorSet DescriptorSet = VK_NULL_HANDLE;
+    VkPipelineLayout PipelineLayout = VK_NULL_HANDLE;
+    VkPipeline Pipeline = VK_NULL_HANDLE;
+    VkShaderModule ShaderModule = VK_NULL_HANDLE;
+
+private:
+    struct pushConstants
+    {
+        float Exposure;
+        uint32_t Export;
+    };
+    vulkanDevice *VulkanDevice=nullptr;
+};
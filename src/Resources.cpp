@@ -1,4 +1,24 @@
 #include "Resources.h"
+#include "Shader.h"
+
+//SHADER_VERSION of the normal map shaders from which they rebuild z from x and y, so they can sample bc5 normal maps
+#define NORMAL_MAP_VERSION_TWO_CHANNELS 1
+
+bool textureList::ShadersReadTwoChannelNormals()
+{
+    const char *Shaders[] =
+    {
+        "resources/shaders/spv/forward.frag.spv",
+        "resources/shaders/spv/mrt.frag.spv",
+        "resources/shaders/spv/hybridGBuffer.frag.spv",
+        "resources/shaders/spv/closesthit.rchit.spv",
+    };
+    for(const char *Shader : Shaders)
+    {
+        if(GetShaderVersion(Shader) < NORMAL_MAP_VERSION_TWO_CHANNELS) return false;
+    }
+    return true;
+}
 
 void resources::AddDescriptorSet(vulkanDevice *VulkanDevice, std::string Name, std::vector<descriptor> &Descriptors, VkDescriptorPool DescriptorPool, std::vector<VkDescriptorSetLayout> AdditionalDescriptorSetLayouts)
 {
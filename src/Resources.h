@@ -166,10 +166,18 @@ class textureList : public vulkanResourceList<vulkanTexture>
 {
 public:
     textureLoader *Loader;
+    //The importers store the scene textures in block compressed formats, cached in TEXTURE_CACHE_DIRECTORY.
+    //Turned off by vulkanApp::CompressTextures, and on devices that can't sample bc textures.
+    bool CompressTextures=true;
+    //Normal maps are stored in bc5, with x and y only. Otherwise they are compressed like the color textures.
+    bool TwoChannelNormals=false;
 
     textureList(VkDevice &Device, textureLoader *Loader) : 
                 vulkanResourceList(Device),
                 Loader(Loader) {
+        //The device can't sample bc textures, they stay in rgba8. The headless renderer only decodes them for the cpu, and rebuilds z.
+        if(Loader->VulkanDevice != nullptr && !Loader->VulkanDevice->TextureCompressionBC) CompressTextures=false;
+        TwoChannelNormals = Loader->VulkanDevice == nullptr || ShadersReadTwoChannelNormals();
         // Loader->LoadTexture2D("resources/models/sponza/dummy.png", VK_FORMAT_R8G8B8A8_UNORM, &DummyDiffuse);
         // Loader->LoadTexture2D("resources/models/sponza/dummy_specular.png", VK_FORMAT_R8G8B8A8_UNORM, &DummyNormal);
         // Loader->LoadTexture2D("resources/models/sponza/dummy_ddn.png", VK_FORMAT_R8G8B8A8_UNORM, &DummySpecular);    
@@ -248,6 +256,20 @@ public:
         return Texture;
     }
 
+    //Creates a batch of textures with CreateTextures() of the loader, Names and Uploads are in the same order
+    void AddTextures2D(const std::vector<std::string> &Names, std::vector<textureUpload> &Uploads, threadPool &ThreadPool)
+    {
+        Loader->CreateTextures(Uploads, ThreadPool);
+        for(size_t i=0; i<Uploads.size(); i++)
+        {
+            Uploads[i].Texture->Index = (uint32_t)Resources.size();
+            Resources[Names[i]] = std::move(*Uploads[i].Texture);
+        }
+    }
+
+    //True when all the shaders that sample the normal maps are compiled to only read their x and y, see Resources.cpp
+    static bool ShadersReadTwoChannelNormals();
+
     vulkanTexture DummyDiffuse;
     vulkanTexture DummyNormal;
     vulkanTexture DummySpecular;
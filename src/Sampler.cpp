@@ -0,0 +1,140 @@
+#include "Sampler.h"
+
+#include <cmath>
+
+//Integer hash with a low bias (Wellons, lowbias32)
+static uint32_t Hash(uint32_t Value)
+{
+    Value ^= Value >> 16;
+    Value *= 0x7feb352du;
+    Value ^= Value >> 15;
+    Value *= 0x846ca68bu;
+    Value ^= Value >> 16;
+    return Value;
+}
+
+static uint32_t HashCombine(uint32_t Seed, uint32_t Value)
+{
+    return Seed ^ (Value + (Seed << 6) + (Seed >> 2));
+}
+
+static uint32_t WangHash(uint32_t &Seed)
+{
+    Seed = (Seed ^ 61u) ^ (Seed >> 16);
+    Seed *= 9u;
+    Seed = Seed ^ (Seed >> 4);
+    Seed *= 0x27d4eb2du;
+    Seed = Seed ^ (Seed >> 15);
+    return Seed;
+}
+
+//24 bits, so the float is always below 1
+static float ToUnitFloat(uint32_t Value)
+{
+    return (float)(Value >> 8) * (1.0f / 16777216.0f);
+}
+
+uint32_t ReverseBits(uint32_t Value)
+{
+    Value = ((Value >> 1) & 0x55555555u) | ((Value & 0x55555555u) << 1);
+    Value = ((Value >> 2) & 0x33333333u) | ((Value & 0x33333333u) << 2);
+    Value = ((Value >> 4) & 0x0f0f0f0fu) | ((Value & 0x0f0f0f0fu) << 4);
+    Value = ((Value >> 8) & 0x00ff00ffu) | ((Value & 0x00ff00ffu) << 8);
+    return (Value >> 16) | (Value << 16);
+}
+
+uint32_t NestedUniformScramble(uint32_t Value, uint32_t Seed)
+{
+    //Laine-Karras works from the least significant bit, each bit only changes the ones above it
+    Value = ReverseBits(Value);
+    Value += Seed;
+    Value ^= Value * 0x6c50b47cu;
+    Value ^= Value * 0xb82f1e52u;
+    Value ^= Value * 0xc7afe638u;
+    Value ^= Value * 0x8d22f6e6u;
+    return ReverseBits(Value);
+}
+
+//Second dimension of Sobol, from the primitive polynomial x + 1 : each direction number is the previous one xor itself shifted by one
+static uint32_t SobolDimension1(uint32_t Index)
+{
+    uint32_t Result = 0;
+    uint32_t Direction = 0x80000000u;
+    for(; Index != 0; Index >>= 1)
+    {
+        if(Index & 1) Result ^= Direction;
+        Direction ^= Direction >> 1;
+    }
+    return Result;
+}
+
+void pathSampler::Start(samplerType _Type, uint32_t _X, uint32_t _Y, uint32_t _SampleIndex)
+{
+    Type = _Type;
+    X = _X;
+    Y = _Y;
+    SampleIndex = _SampleIndex;
+    BaseDimension = 0;
+    PixelSeed = Type == samplerType::BlueNoise ? 0x9e3779b9u : Hash(X + Hash(Y));
+    RandomState = (X * 1973 + Y * 9277 + SampleIndex * 26699) | 1;
+}
+
+void pathSampler::StartBounce(uint32_t Bounce)
+{
+    BaseDimension = SAMPLER_CAMERA + 1 + Bounce * SAMPLER_BOUNCE_DIMENSIONS;
+}
+
+uint32_t pathSampler::SobolIndex(uint32_t Dimension, uint32_t &Seed)
+{
+    Seed = HashCombine(PixelSeed, Hash(Dimension));
+
+    //Shuffling the index keeps the samples of each power of 2 block together, and decorrelates the dimensions
+    return NestedUniformScramble(SampleIndex, Seed);
+}
+
+uint32_t pathSampler::BlueNoiseShift(uint32_t Dimension)
+{
+    //Interleaved gradient noise (Jimenez 2014), moved by the R1 step for each dimension
+    float PixelX = (float)X + 5.588238f * (float)Dimension;
+    float PixelY = (float)Y + 5.588238f * (float)Dimension;
+    float Gradient = 0.06711056f * PixelX + 0.00583715f * PixelY;
+    Gradient -= std::floor(Gradient);
+    float Noise = 52.9829189f * Gradient;
+    Noise -= std::floor(Noise);
+    return (uint32_t)(Noise * 16777216.0f) << 8;
+}
+
+float pathSampler::Get1D(uint32_t Dimension)
+{
+    if(Type == samplerType::Random) return ToUnitFloat(WangHash(RandomState));
+
+    Dimension += BaseDimension;
+    uint32_t Seed;
+    uint32_t Index = SobolIndex(Dimension, Seed);
+    uint32_t SampleX = NestedUniformScramble(ReverseBits(Index), HashCombine(Seed, 0));
+    if(Type == samplerType::BlueNoise) SampleX += BlueNoiseShift(Dimension * 2);
+    return ToUnitFloat(SampleX);
+}
+
+glm::vec2 pathSampler::Get2D(uint32_t Dimension)
+{
+    if(Type == samplerType::Random)
+    {
+        float Random0 = ToUnitFloat(WangHash(RandomState));
+        float Random1 = ToUnitFloat(WangHash(RandomState));
+        return glm::vec2(Random0, Random1);
+    }
+
+    Dimension += BaseDimension;
+    uint32_t Seed;
+    uint32_t Index = SobolIndex(Dimension, Seed);
+    uint32_t SampleX = NestedUniformScramble(ReverseBits(Index), HashCombine(Seed, 0));
+    uint32_t SampleY = NestedUniformScramble(SobolDimension1(Index), HashCombine(Seed, 1));
+    if(Type == samplerType::BlueNoise)
+    {
+        //Wraps around : a shift modulo 1
+        SampleX += BlueNoiseShift(Dimension * 2);
+        SampleY += BlueNoiseShift(Dimension * 2 + 1);
+    }
+    return glm::vec2(ToUnitFloat(SampleX), ToUnitFloat(SampleY));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <glm/vec2.hpp>
+#include <stdint.h>
+
+//Sequence used for the random numbers of the path tracers. Same values as SAMPLER_* in Common/sampler.glsl.
+enum class samplerType
+{
+    //wang_hash stream seeded from the pixel and the sample : white noise
+    Random=0,
+    //Sobol (0,2) sequence, shuffled and Owen scrambled with a different seed per pixel and per dimension (Burley 2020)
+    Sobol=1,
+    //Same sequence in all the pixels, shifted modulo 1 by an interleaved gradient noise of the pixel (Georgiev and Fajardo 2016).
+    //The error of neighbour pixels is anti-correlated, so it looks like blue noise at low sample counts. Sobol converges faster after that.
+    BlueNoise=2
+};
+
+//Dimensions of a sample. The camera jitter is first, then each bounce has SAMPLER_BOUNCE_DIMENSIONS dimensions,
+//so a decision always reads the same dimension whatever the other branches of the path used.
+#define SAMPLER_CAMERA 0
+//Dimensions of the bounce set by pathSampler::StartBounce()
+#define SAMPLER_LIGHT_PICK 0
+#define SAMPLER_LIGHT_POINT 1
+#define SAMPLER_LIGHT_TREE 2
+#define SAMPLER_SUN 3
+#define SAMPLER_ROULETTE 4
+#define SAMPLER_LOBE 5
+#define SAMPLER_BRDF 6
+#define SAMPLER_BOUNCE_DIMENSIONS 7
+
+//Random numbers of one sample of a pixel. Ported line by line to pathSampler in Common/sampler.glsl,
+//so the cpu gives the same numbers as the shaders for a pixel, sample and dimension (the blue noise shift is a float hash, it can differ in the last bits).
+//Deterministic : the same pixel and sample index always give the same path.
+struct pathSampler
+{
+    //Starts the sample SampleIndex of the pixel X, Y. The Sobol sequences need the samples of a pixel to have consecutive indices.
+    void Start(samplerType Type, uint32_t X, uint32_t Y, uint32_t SampleIndex);
+    //The next Get1D() and Get2D() read the dimensions of that bounce
+    void StartBounce(uint32_t Bounce);
+    float Get1D(uint32_t Dimension);
+    glm::vec2 Get2D(uint32_t Dimension);
+
+    samplerType Type = samplerType::Sobol;
+    uint32_t X=0, Y=0;
+    uint32_t SampleIndex=0;
+    //Scrambling seed of the pixel, the same for all the pixels with BlueNoise
+    uint32_t PixelSeed=0;
+    //First dimension of the current bounce
+    uint32_t BaseDimension=0;
+    uint32_t RandomState=1;
+
+private:
+    //Shuffled index of the sample in the sequence of that absolute dimension, and the seed of its scrambling
+    uint32_t SobolIndex(uint32_t Dimension, uint32_t &Seed);
+    //Shift of the pixel for the BlueNoise sampler, in [0, 2^32) so adding it wraps around 1
+    uint32_t BlueNoiseShift(uint32_t Dimension);
+};
+
+uint32_t ReverseBits(uint32_t Value);
+//Owen scrambling of the bits of Value, from the most significant (Burley 2020, with the Laine-Karras hash)
+uint32_t NestedUniformScramble(uint32_t Value, uint32_t Seed);
@@ -54,7 +54,7 @@ void cubemap::CreateDescriptorSet(vulkanDevice *VulkanDevice)
 
 void cubemap::Load(std::string FileName, textureLoader *TextureLoader, vulkanDevice *VulkanDevice, VkCommandBuffer CommandBuffer, VkQueue Queue)
 {
-    TextureLoader->LoadCubemap(FileName, &VulkanObjects.Texture);
+    TextureLoader->LoadCubemap(FileName, &VulkanObjects.Texture, &EnvironmentMap);
     GLTFImporter::LoadMesh("resources/models/Cube/Cube.gltf", Mesh, VulkanDevice, CommandBuffer, Queue);
 
     vulkanTools::CreateBuffer(VulkanDevice, 
@@ -89,20 +89,11 @@ scene::scene(vulkanApp *App) :
 void scene::Load(std::string FileName, float Size, VkCommandBuffer CopyCommand)
 {
     Resources.Init(App->VulkanObjects.VulkanDevice, VK_NULL_HANDLE, TextureLoader);       
+    if(!App->CompressTextures) Resources.Textures->CompressTextures=false;
     Cubemap.Load("resources/belfast_farmhouse_4k.hdr", TextureLoader, App->VulkanObjects.VulkanDevice, CopyCommand, Queue);
     
     { //Scene
-
-        std::string Extension = FileName.substr(FileName.find_last_of(".") + 1);
-        if(Extension == "gltf" || Extension == "glb")
-        {
-            GLTFImporter::Load(FileName, Instances, Meshes, Materials,GVertices, GIndices, Resources.Textures, Size);    
-        }
-        else
-        {
-            assimpImporter::Load(FileName, Instances, Meshes, Materials,GVertices, GIndices, Resources.Textures, Size);    
-        }
-
+        ImportModel(FileName, Size);
 
         for (size_t i = 0; i < Materials.size(); i++)
         {
@@ -114,25 +105,14 @@ void scene::Load(std::string FileName, float Size, VkCommandBuffer CopyCommand)
                                      &Materials[i].MaterialData);             
         }
         
-        NumInstances=0;
-        uint32_t InstanceInx=0;
-        for(auto &InstanceGroup : Instances)
+        for(size_t i=0; i<InstancesPointers.size(); i++)
         {
-            for (size_t i = 0; i < InstanceGroup.second.size(); i++)
-            {
-                InstanceGroup.second[i].InstanceData.InstanceID = (float)InstanceInx;
-                InstanceGroup.second[i].InstanceData.Normal = glm::inverseTranspose(InstanceGroup.second[i].InstanceData.Transform);
-     
-                vulkanTools::CreateBuffer(App->VulkanObjects.VulkanDevice,
-                                        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-                                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                                        &InstanceGroup.second[i].VulkanObjects.UniformBuffer,
-                                        sizeof(InstanceGroup.second[i].InstanceData),
-                                        &InstanceGroup.second[i].InstanceData);
-                InstancesPointers.push_back(&InstanceGroup.second[i]);
-                InstanceInx++;
-            }
-            NumInstances += InstanceGroup.second.size();
+            vulkanTools::CreateBuffer(App->VulkanObjects.VulkanDevice,
+                                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                                    &InstancesPointers[i]->VulkanObjects.UniformBuffer,
+                                    sizeof(InstancesPointers[i]->InstanceData),
+                                    &InstancesPointers[i]->InstanceData);
         }
 
         for(uint32_t i=0; i<Meshes.size(); i++)
@@ -209,6 +189,41 @@ void scene::Load(std::string FileName, float Size, VkCommandBuffer CopyCommand)
     Resources.DescriptorSets->DescriptorPool = DescriptorPool;
 }
 
+void scene::ImportModel(std::string FileName, float Size)
+{
+    std::string Extension = FileName.substr(FileName.find_last_of(".") + 1);
+    if(Extension == "gltf" || Extension == "glb")
+    {
+        GLTFImporter::Load(FileName, Instances, Meshes, Materials,GVertices, GIndices, Resources.Textures, Size);    
+    }
+    else
+    {
+        assimpImporter::Load(FileName, Instances, Meshes, Materials,GVertices, GIndices, Resources.Textures, Size);    
+    }
+
+    NumInstances=0;
+    uint32_t InstanceInx=0;
+    for(auto &InstanceGroup : Instances)
+    {
+        for (size_t i = 0; i < InstanceGroup.second.size(); i++)
+        {
+            InstanceGroup.second[i].InstanceData.InstanceID = (float)InstanceInx;
+            InstanceGroup.second[i].InstanceData.Normal = glm::inverseTranspose(InstanceGroup.second[i].InstanceData.Transform);
+            InstancesPointers.push_back(&InstanceGroup.second[i]);
+            InstanceInx++;
+        }
+        NumInstances += InstanceGroup.second.size();
+    }
+}
+
+void scene::LoadHeadless(std::string FileName, float Size)
+{
+    Resources.Textures = new textureList(Device, TextureLoader);
+    if(!App->CompressTextures) Resources.Textures->CompressTextures=false;
+    TextureLoader->LoadCubemap("resources/belfast_farmhouse_4k.hdr", &Cubemap.VulkanObjects.Texture, &Cubemap.EnvironmentMap);
+    ImportModel(FileName, Size);
+}
+
 void scene::UpdateUniformBufferMatrices()
 {
     Camera.SetAspectRatio((App->Width - ViewportStart) / App->Height);
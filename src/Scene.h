@@ -9,6 +9,7 @@
 #include "TextureLoader.h"
 #include "Camera.h"
 #include "Resources.h"
+#include "EnvironmentMap.h"
 
 #include <glm/gtc/matrix_inverse.hpp>
 
@@ -257,6 +258,8 @@ struct cubemap
         buffer UniformBuffer;
     } VulkanObjects;
     sceneMesh Mesh;
+    //Panorama and its luminance distribution, used by the path tracers to sample the sky
+    environmentMap EnvironmentMap;
 
 
     struct uniformData 
@@ -287,6 +290,8 @@ private:
     
     void LoadMaterials(VkCommandBuffer CommandBuffer);
     void LoadMeshes(VkCommandBuffer CommandBuffer);
+    //Shared by Load() and LoadHeadless() : runs the importer of the file extension, and numbers the instances into InstancesPointers
+    void ImportModel(std::string FileName, float Size);
 
 
 public:
@@ -340,6 +345,9 @@ public:
     scene(vulkanApp *App);
     
     void Load(std::string FileName, float Size, VkCommandBuffer CopyCommand);
+    //Loads the meshes, the materials with their cpu textures and the background distribution, without creating any vulkan object.
+    //Used by the headless renderer, where the vulkan handles of the App are null.
+    void LoadHeadless(std::string FileName, float Size);
     void CreateDescriptorSets();
     void Update();
 
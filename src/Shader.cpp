@@ -1,7 +1,13 @@
 #include "Shader.h"
 #include <string>
+#include <vector>
 #include <assert.h>
 
+#define SPIRV_MAGIC 0x07230203
+#define SPIRV_OP_SPEC_CONSTANT 50
+#define SPIRV_OP_DECORATE 71
+#define SPIRV_DECORATION_SPEC_ID 1
+
 
 #define VK_CALL(f)\
 {\
@@ -55,4 +61,40 @@ VkPipelineShaderStageCreateInfo LoadShader(VkDevice Device, std::string FileName
     Result.pName = "main";
     assert(Result.module != nullptr);
     return Result;
-}
\ No newline at end of file
+}
+
+uint32_t GetShaderVersion(std::string FileName)
+{
+    FILE *FP = nullptr;
+    fopen_s(&FP, FileName.c_str(), "rb");
+    if(!FP) return 0;
+
+    fseek(FP, 0L, SEEK_END);
+    size_t Size = ftell(FP);
+    fseek(FP, 0L, SEEK_SET);
+    std::vector<uint32_t> Code(Size / sizeof(uint32_t));
+    size_t RetVal = fread(Code.data(), sizeof(uint32_t), Code.size(), FP);
+    fclose(FP);
+    if(RetVal != Code.size() || Code.size() < 5 || Code[0] != SPIRV_MAGIC) return 0;
+
+    //Instructions follow the 5 words of the header, with their word count in the high half of their first word.
+    //The decorations come before the constants.
+    uint32_t VersionId = 0;
+    for(size_t i=5; i<Code.size();)
+    {
+        uint32_t WordCount = Code[i] >> 16;
+        uint32_t Opcode = Code[i] & 0xffff;
+        if(WordCount == 0 || i + WordCount > Code.size()) return 0;
+
+        if(Opcode == SPIRV_OP_DECORATE && WordCount == 4 && Code[i+2] == SPIRV_DECORATION_SPEC_ID && Code[i+3] == SHADER_VERSION_SPEC_ID)
+        {
+            VersionId = Code[i+1];
+        }
+        else if(Opcode == SPIRV_OP_SPEC_CONSTANT && WordCount == 4 && VersionId != 0 && Code[i+2] == VersionId)
+        {
+            return Code[i+3];
+        }
+        i += WordCount;
+    }
+    return 0;
+}
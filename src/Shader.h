@@ -3,6 +3,13 @@
 #include <vulkan/vulkan.h>
 #include <string>
 
+//Specialization constant the shaders declare their version with : layout(constant_id = 100) const uint SHADER_VERSION
+#define SHADER_VERSION_SPEC_ID 100
+
 VkShaderModule LoadShaderModule(std::string FileName, VkDevice Device, VkShaderStageFlagBits Stage);
 
-VkPipelineShaderStageCreateInfo LoadShader(VkDevice Device, std::string FileName, VkShaderStageFlagBits Stage);
\ No newline at end of file
+VkPipelineShaderStageCreateInfo LoadShader(VkDevice Device, std::string FileName, VkShaderStageFlagBits Stage);
+
+//Default value of the SHADER_VERSION constant of a spv file, so the renderers only use what the compiled binary does.
+//0 when the file is missing or was compiled before the shader declared its version.
+uint32_t GetShaderVersion(std::string FileName);
\ No newline at end of file
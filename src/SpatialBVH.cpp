@@ -0,0 +1,420 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+#define SPATIAL_BINS 16
+//Past that depth we only make leaves, so traversal stacks of 64 entries can't overflow
+#define SPATIAL_MAX_DEPTH 48
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+//A triangle, or the part of it that falls in Bounds when it was split
+struct bvhReference
+{
+    aabb Bounds;
+    uint32_t TriangleIndex;
+};
+
+struct objectSplit
+{
+    float Cost=1e30f;
+    int Axis=-1;
+    float Position=0;
+    aabb LeftBounds, RightBounds;
+};
+
+struct spatialSplit
+{
+    float Cost=1e30f;
+    int Axis=-1;
+    float Position=0;
+};
+
+static bool IsEmpty(aabb &AABB)
+{
+    return AABB.Min.x > AABB.Max.x || AABB.Min.y > AABB.Max.y || AABB.Min.z > AABB.Max.z;
+}
+
+//aabb::Area() is not usable on empty boxes
+static float Area(aabb &AABB)
+{
+    return IsEmpty(AABB) ? 0 : AABB.Area();
+}
+
+static aabb Intersection(aabb A, aabb &B)
+{
+    A.Min = glm::max(A.Min, B.Min);
+    A.Max = glm::min(A.Max, B.Max);
+    if(IsEmpty(A)) return aabb();
+    return A;
+}
+
+static float Centroid(bvhReference &Reference, int Axis)
+{
+    return (Reference.Bounds.Min[Axis] + Reference.Bounds.Max[Axis]) * 0.5f;
+}
+
+//Bounds of the part of the triangle between the planes Min and Max on that axis, inside the reference bounds
+static aabb ClipReference(triangle &Triangle, bvhReference &Reference, int Axis, float Min, float Max)
+{
+    glm::vec3 Vertices[3] = {Triangle.v0, Triangle.v1, Triangle.v2};
+    float Planes[2] = {Min, Max};
+    aabb Result;
+    for(int i=0; i<3; i++)
+    {
+        glm::vec3 &A = Vertices[i];
+        glm::vec3 &B = Vertices[(i+1) % 3];
+        if(A[Axis] >= Min && A[Axis] <= Max) Result.Grow(A);
+
+        //Points where the edge crosses the planes
+        for(int j=0; j<2; j++)
+        {
+            if((A[Axis] < Planes[j] && B[Axis] > Planes[j]) || (A[Axis] > Planes[j] && B[Axis] < Planes[j]))
+            {
+                float t = (Planes[j] - A[Axis]) / (B[Axis] - A[Axis]);
+                glm::vec3 Point = A + (B - A) * t;
+                Point[Axis] = Planes[j];
+                Result.Grow(Point);
+            }
+        }
+    }
+    if(Result.Min.x == 1e30f) return Result;
+    return Intersection(Result, Reference.Bounds);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+//Top down SBVH build (Stich et al. 2009). Each node tries a binned object split, and a binned spatial split
+//when the object split children overlap. Spatial splits clip the triangles that straddle the plane, and reference them on both sides.
+struct spatialBuilder
+{
+    bvh *BVH;
+    mesh *Mesh;
+    //Spatial splits are only tried when the object split children overlap by more than that area
+    float MinOverlapArea;
+    //Number of duplicated references that can still be created
+    int64_t ReferencesLeft;
+
+    void Subdivide(uint32_t NodeIndex, std::vector<bvhReference> &References, uint32_t Depth);
+    objectSplit FindObjectSplit(std::vector<bvhReference> &References);
+    spatialSplit FindSpatialSplit(std::vector<bvhReference> &References, aabb &Bounds);
+    void PartitionObject(std::vector<bvhReference> &References, objectSplit &Split, std::vector<bvhReference> &Left, std::vector<bvhReference> &Right);
+    void PartitionSpatial(std::vector<bvhReference> &References, spatialSplit &Split, std::vector<bvhReference> &Left, std::vector<bvhReference> &Right);
+    void MakeLeaf(uint32_t NodeIndex, std::vector<bvhReference> &References);
+};
+
+objectSplit spatialBuilder::FindObjectSplit(std::vector<bvhReference> &References)
+{
+    aabb CentroidBounds;
+    for(size_t i=0; i<References.size(); i++)
+    {
+        CentroidBounds.Grow((References[i].Bounds.Min + References[i].Bounds.Max) * 0.5f);
+    }
+
+    objectSplit Best;
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        float BoundsMin = CentroidBounds.Min[Axis];
+        float BoundsMax = CentroidBounds.Max[Axis];
+        if(BoundsMin == BoundsMax) continue;
+
+        bin Bins[BINS];
+        float Scale = BINS / (BoundsMax - BoundsMin);
+        for(size_t i=0; i<References.size(); i++)
+        {
+            int BinIndex = std::min(BINS - 1, (int)((Centroid(References[i], Axis) - BoundsMin) * Scale));
+            Bins[BinIndex].TrianglesCount++;
+            Bins[BinIndex].Bounds.Grow(References[i].Bounds);
+        }
+
+        aabb LeftBoxes[BINS-1], RightBoxes[BINS-1];
+        uint32_t LeftCount[BINS-1], RightCount[BINS-1];
+        aabb LeftBox, RightBox;
+        uint32_t LeftSum=0, RightSum=0;
+        for(int i=0; i<BINS-1; i++)
+        {
+            LeftSum += Bins[i].TrianglesCount;
+            LeftCount[i] = LeftSum;
+            LeftBox.Grow(Bins[i].Bounds);
+            LeftBoxes[i] = LeftBox;
+            RightSum += Bins[BINS-1-i].TrianglesCount;
+            RightCount[BINS-2-i] = RightSum;
+            RightBox.Grow(Bins[BINS-1-i].Bounds);
+            RightBoxes[BINS-2-i] = RightBox;
+        }
+
+        for(int i=0; i<BINS-1; i++)
+        {
+            if(LeftCount[i]==0 || RightCount[i]==0) continue;
+            float PlaneCost = LeftCount[i] * LeftBoxes[i].Area() + RightCount[i] * RightBoxes[i].Area();
+            if(PlaneCost < Best.Cost)
+            {
+                Best.Cost = PlaneCost;
+                Best.Axis = Axis;
+                Best.Position = BoundsMin + (i+1) / Scale;
+                Best.LeftBounds = LeftBoxes[i];
+                Best.RightBounds = RightBoxes[i];
+            }
+        }
+    }
+    return Best;
+}
+
+spatialSplit spatialBuilder::FindSpatialSplit(std::vector<bvhReference> &References, aabb &Bounds)
+{
+    spatialSplit Best;
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        float BoundsMin = Bounds.Min[Axis];
+        float BoundsMax = Bounds.Max[Axis];
+        if(BoundsMin == BoundsMax) continue;
+
+        //References are counted in the bin they start (Entries) and the bin they end (Exits),
+        //and the clipped part of the triangle grows every bin it covers.
+        aabb BinBounds[SPATIAL_BINS];
+        uint32_t Entries[SPATIAL_BINS] = {};
+        uint32_t Exits[SPATIAL_BINS] = {};
+        float BinWidth = (BoundsMax - BoundsMin) / SPATIAL_BINS;
+        float Scale = SPATIAL_BINS / (BoundsMax - BoundsMin);
+        for(size_t i=0; i<References.size(); i++)
+        {
+            bvhReference &Reference = References[i];
+            int FirstBin = std::max(0, std::min(SPATIAL_BINS - 1, (int)((Reference.Bounds.Min[Axis] - BoundsMin) * Scale)));
+            int LastBin = std::max(FirstBin, std::min(SPATIAL_BINS - 1, (int)((Reference.Bounds.Max[Axis] - BoundsMin) * Scale)));
+            triangle &Triangle = Mesh->Triangles[Reference.TriangleIndex];
+            for(int Bin=FirstBin; Bin<=LastBin; Bin++)
+            {
+                if(FirstBin == LastBin)
+                {
+                    BinBounds[Bin].Grow(Reference.Bounds);
+                    break;
+                }
+                aabb Clipped = ClipReference(Triangle, Reference, Axis, BoundsMin + Bin * BinWidth, BoundsMin + (Bin+1) * BinWidth);
+                BinBounds[Bin].Grow(Clipped);
+            }
+            Entries[FirstBin]++;
+            Exits[LastBin]++;
+        }
+
+        float LeftArea[SPATIAL_BINS-1], RightArea[SPATIAL_BINS-1];
+        uint32_t LeftCount[SPATIAL_BINS-1], RightCount[SPATIAL_BINS-1];
+        aabb LeftBox, RightBox;
+        uint32_t LeftSum=0, RightSum=0;
+        for(int i=0; i<SPATIAL_BINS-1; i++)
+        {
+            LeftSum += Entries[i];
+            LeftCount[i] = LeftSum;
+            LeftBox.Grow(BinBounds[i]);
+            LeftArea[i] = LeftBox.Area();
+            RightSum += Exits[SPATIAL_BINS-1-i];
+            RightCount[SPATIAL_BINS-2-i] = RightSum;
+            RightBox.Grow(BinBounds[SPATIAL_BINS-1-i]);
+            RightArea[SPATIAL_BINS-2-i] = RightBox.Area();
+        }
+
+        for(int i=0; i<SPATIAL_BINS-1; i++)
+        {
+            if(LeftCount[i]==0 || RightCount[i]==0) continue;
+            float PlaneCost = LeftCount[i] * LeftArea[i] + RightCount[i] * RightArea[i];
+            if(PlaneCost < Best.Cost)
+            {
+                Best.Cost = PlaneCost;
+                Best.Axis = Axis;
+                Best.Position = BoundsMin + (i+1) * BinWidth;
+            }
+        }
+    }
+    return Best;
+}
+
+void spatialBuilder::PartitionObject(std::vector<bvhReference> &References, objectSplit &Split, std::vector<bvhReference> &Left, std::vector<bvhReference> &Right)
+{
+    for(size_t i=0; i<References.size(); i++)
+    {
+        if(Centroid(References[i], Split.Axis) < Split.Position) Left.push_back(References[i]);
+        else Right.push_back(References[i]);
+    }
+}
+
+void spatialBuilder::PartitionSpatial(std::vector<bvhReference> &References, spatialSplit &Split, std::vector<bvhReference> &Left, std::vector<bvhReference> &Right)
+{
+    int Axis = Split.Axis;
+    float Position = Split.Position;
+
+    //Bounds and counts of both sides if every straddling reference was split
+    aabb LeftBounds, RightBounds;
+    uint32_t LeftCount=0, RightCount=0;
+    std::vector<uint32_t> Straddling;
+    for(uint32_t i=0; i<(uint32_t)References.size(); i++)
+    {
+        bvhReference &Reference = References[i];
+        if(Reference.Bounds.Max[Axis] <= Position)
+        {
+            LeftBounds.Grow(Reference.Bounds);
+            LeftCount++;
+        }
+        else if(Reference.Bounds.Min[Axis] >= Position)
+        {
+            RightBounds.Grow(Reference.Bounds);
+            RightCount++;
+        }
+        else
+        {
+            Straddling.push_back(i);
+            LeftCount++;
+            RightCount++;
+        }
+    }
+    for(size_t i=0; i<References.size(); i++)
+    {
+        bvhReference &Reference = References[i];
+        if(Reference.Bounds.Max[Axis] <= Position) Left.push_back(Reference);
+        else if(Reference.Bounds.Min[Axis] >= Position) Right.push_back(Reference);
+    }
+
+    for(size_t i=0; i<Straddling.size(); i++)
+    {
+        bvhReference &Reference = References[Straddling[i]];
+        triangle &Triangle = Mesh->Triangles[Reference.TriangleIndex];
+        aabb LeftPart = ClipReference(Triangle, Reference, Axis, -1e30f, Position);
+        aabb RightPart = ClipReference(Triangle, Reference, Axis, Position, 1e30f);
+
+        //Reference unsplitting : keep the whole triangle on one side when that is cheaper than duplicating it
+        aabb LeftWithReference = LeftBounds, RightWithReference = RightBounds;
+        LeftWithReference.Grow(Reference.Bounds);
+        RightWithReference.Grow(Reference.Bounds);
+        aabb LeftWithPart = LeftBounds, RightWithPart = RightBounds;
+        LeftWithPart.Grow(LeftPart);
+        RightWithPart.Grow(RightPart);
+
+        float SplitCost = Area(LeftWithPart) * LeftCount + Area(RightWithPart) * RightCount;
+        float LeftOnlyCost = Area(LeftWithReference) * LeftCount + Area(RightBounds) * (RightCount - 1);
+        float RightOnlyCost = Area(LeftBounds) * (LeftCount - 1) + Area(RightWithReference) * RightCount;
+
+        bool CanSplit = ReferencesLeft > 0 && LeftPart.Min.x != 1e30f && RightPart.Min.x != 1e30f;
+        if(!CanSplit || LeftOnlyCost < SplitCost || RightOnlyCost < SplitCost)
+        {
+            if(LeftOnlyCost < RightOnlyCost)
+            {
+                Left.push_back(Reference);
+                LeftBounds = LeftWithReference;
+                RightCount--;
+            }
+            else
+            {
+                Right.push_back(Reference);
+                RightBounds = RightWithReference;
+                LeftCount--;
+            }
+            continue;
+        }
+
+        Left.push_back({LeftPart, Reference.TriangleIndex});
+        Right.push_back({RightPart, Reference.TriangleIndex});
+        LeftBounds = LeftWithPart;
+        RightBounds = RightWithPart;
+        ReferencesLeft--;
+    }
+}
+
+void spatialBuilder::MakeLeaf(uint32_t NodeIndex, std::vector<bvhReference> &References)
+{
+    bvhNode &Node = BVH->BVHNodes[NodeIndex];
+    Node.LeftChildOrFirst = (uint32_t)BVH->TriangleIndices.size();
+    Node.TriangleCount = (uint32_t)References.size();
+    for(size_t i=0; i<References.size(); i++)
+    {
+        BVH->TriangleIndices.push_back(References[i].TriangleIndex);
+    }
+}
+
+void spatialBuilder::Subdivide(uint32_t NodeIndex, std::vector<bvhReference> &References, uint32_t Depth)
+{
+    aabb Bounds;
+    for(size_t i=0; i<References.size(); i++)
+    {
+        Bounds.Grow(References[i].Bounds);
+    }
+    BVH->BVHNodes[NodeIndex].AABBMin = Bounds.Min;
+    BVH->BVHNodes[NodeIndex].AABBMax = Bounds.Max;
+
+    float LeafCost = References.size() * Bounds.Area();
+    if(References.size() <= 1 || Depth >= SPATIAL_MAX_DEPTH)
+    {
+        MakeLeaf(NodeIndex, References);
+        return;
+    }
+
+    objectSplit ObjectSplit = FindObjectSplit(References);
+    spatialSplit SpatialSplit;
+    if(ReferencesLeft > 0)
+    {
+        aabb Overlap = ObjectSplit.Axis >= 0 ? Intersection(ObjectSplit.LeftBounds, ObjectSplit.RightBounds) : Bounds;
+        if(Area(Overlap) > MinOverlapArea)
+        {
+            SpatialSplit = FindSpatialSplit(References, Bounds);
+        }
+    }
+
+    if(std::min(ObjectSplit.Cost, SpatialSplit.Cost) >= LeafCost)
+    {
+        MakeLeaf(NodeIndex, References);
+        return;
+    }
+
+    std::vector<bvhReference> Left, Right;
+    if(SpatialSplit.Cost < ObjectSplit.Cost) PartitionSpatial(References, SpatialSplit, Left, Right);
+    else PartitionObject(References, ObjectSplit, Left, Right);
+
+    if(Left.empty() || Right.empty())
+    {
+        MakeLeaf(NodeIndex, References);
+        return;
+    }
+
+    //The references of this node are not needed anymore
+    std::vector<bvhReference>().swap(References);
+
+    //Children are allocated in pairs after their parent, like the binned builder
+    uint32_t LeftChildIndex = (uint32_t)BVH->BVHNodes.size();
+    BVH->BVHNodes.emplace_back();
+    BVH->BVHNodes.emplace_back();
+    BVH->BVHNodes[NodeIndex].LeftChildOrFirst = LeftChildIndex;
+    BVH->BVHNodes[NodeIndex].TriangleCount = 0;
+
+    Subdivide(LeftChildIndex, Left, Depth+1);
+    Subdivide(LeftChildIndex+1, Right, Depth+1);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+void bvh::BuildSpatial()
+{
+    uint32_t TriangleCount = (uint32_t)Mesh->Triangles.size();
+    std::vector<bvhReference> References(TriangleCount);
+    aabb RootBounds;
+    for(uint32_t i=0; i<TriangleCount; i++)
+    {
+        triangle &Triangle = Mesh->Triangles[i];
+        Triangle.Centroid = (Triangle.v0 + Triangle.v1 + Triangle.v2) * 0.33333f;
+        References[i].Bounds.Grow(Triangle.v0);
+        References[i].Bounds.Grow(Triangle.v1);
+        References[i].Bounds.Grow(Triangle.v2);
+        References[i].TriangleIndex = i;
+        RootBounds.Grow(References[i].Bounds);
+    }
+
+    spatialBuilder Builder;
+    Builder.BVH = this;
+    Builder.Mesh = Mesh;
+    Builder.MinOverlapArea = SpatialSplitAlpha * RootBounds.Area();
+    Builder.ReferencesLeft = (int64_t)(TriangleCount * SpatialSplitBudget);
+
+    TriangleIndices.clear();
+    TriangleIndices.reserve(TriangleCount + Builder.ReferencesLeft);
+    BVHNodes.clear();
+    BVHNodes.reserve(TriangleCount * 2);
+    BVHNodes.emplace_back();
+    Builder.Subdivide(RootNodeIndex, References, 0);
+    NodesUsed = (uint32_t)BVHNodes.size();
+}
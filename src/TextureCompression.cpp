@@ -0,0 +1,541 @@
+#include "TextureCompression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <filesystem>
+
+//Changing the encoder changes the version, so the old files miss the cache
+#define TEXTURE_CACHE_VERSION 1
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+#define BLOCK_TEXELS 16
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+static uint16_t PackColor565(const float Color[3])
+{
+    uint32_t R = (uint32_t)(std::min(std::max(Color[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    uint32_t G = (uint32_t)(std::min(std::max(Color[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    uint32_t B = (uint32_t)(std::min(std::max(Color[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return (uint16_t)((R << 11) | (G << 5) | B);
+}
+
+static void UnpackColor565(uint16_t Color, int Output[3])
+{
+    int R = (Color >> 11) & 31;
+    int G = (Color >> 5) & 63;
+    int B = Color & 31;
+    Output[0] = (R << 3) | (R >> 2);
+    Output[1] = (G << 2) | (G >> 4);
+    Output[2] = (B << 3) | (B >> 2);
+}
+
+//Colors of the 4 color mode : the endpoints, then 1/3 and 2/3 of the way
+static void GetPalette4(uint16_t Color0, uint16_t Color1, int Palette[4][3])
+{
+    UnpackColor565(Color0, Palette[0]);
+    UnpackColor565(Color1, Palette[1]);
+    for(int c=0; c<3; c++)
+    {
+        Palette[2][c] = (2 * Palette[0][c] + Palette[1][c]) / 3;
+        Palette[3][c] = (Palette[0][c] + 2 * Palette[1][c]) / 3;
+    }
+}
+
+//Closest palette color of each texel, returns the squared error of the block
+static uint32_t SelectColorIndices(const uint8_t *Texels, uint16_t Color0, uint16_t Color1, uint32_t &Indices)
+{
+    int Palette[4][3];
+    GetPalette4(Color0, Color1, Palette);
+
+    uint32_t Error = 0;
+    Indices = 0;
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        uint32_t BestError = UINT32_MAX;
+        uint32_t BestIndex = 0;
+        for(uint32_t j=0; j<4; j++)
+        {
+            int DR = Texels[i * 4 + 0] - Palette[j][0];
+            int DG = Texels[i * 4 + 1] - Palette[j][1];
+            int DB = Texels[i * 4 + 2] - Palette[j][2];
+            uint32_t TexelError = (uint32_t)(DR * DR + DG * DG + DB * DB);
+            if(TexelError < BestError)
+            {
+                BestError = TexelError;
+                BestIndex = j;
+            }
+        }
+        Indices |= BestIndex << (i * 2);
+        Error += BestError;
+    }
+    return Error;
+}
+
+//Least squares endpoints for the current indices, each texel is a known mix of the two endpoints
+static bool FitEndpoints(const uint8_t *Texels, uint32_t Indices, float Color0[3], float Color1[3])
+{
+    const float Weights[4] = {1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f};
+    float AA=0, AB=0, BB=0;
+    float AX[3]={}, BX[3]={};
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        float A = Weights[(Indices >> (i * 2)) & 3];
+        float B = 1.0f - A;
+        AA += A * A;
+        AB += A * B;
+        BB += B * B;
+        for(int c=0; c<3; c++)
+        {
+            AX[c] += A * Texels[i * 4 + c];
+            BX[c] += B * Texels[i * 4 + c];
+        }
+    }
+    float Determinant = AA * BB - AB * AB;
+    if(std::abs(Determinant) < 1e-6f) return false;
+    for(int c=0; c<3; c++)
+    {
+        Color0[c] = (AX[c] * BB - BX[c] * AB) / Determinant;
+        Color1[c] = (BX[c] * AA - AX[c] * AB) / Determinant;
+    }
+    return true;
+}
+
+//Endpoints on the principal axis of the colors, refined once by least squares. Always in 4 color mode (Color0 > Color1).
+static void EncodeColorBlock(const uint8_t *Texels, uint8_t *Output)
+{
+    float Mean[3]={};
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        for(int c=0; c<3; c++) Mean[c] += Texels[i * 4 + c];
+    }
+    for(int c=0; c<3; c++) Mean[c] /= BLOCK_TEXELS;
+
+    float Covariance[3][3]={};
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        float Delta[3] = {Texels[i * 4 + 0] - Mean[0], Texels[i * 4 + 1] - Mean[1], Texels[i * 4 + 2] - Mean[2]};
+        for(int a=0; a<3; a++)
+        {
+            for(int b=0; b<3; b++) Covariance[a][b] += Delta[a] * Delta[b];
+        }
+    }
+
+    //Power iteration
+    float Axis[3] = {1, 1, 1};
+    for(int Iteration=0; Iteration<8; Iteration++)
+    {
+        float Next[3];
+        for(int a=0; a<3; a++) Next[a] = Covariance[a][0] * Axis[0] + Covariance[a][1] * Axis[1] + Covariance[a][2] * Axis[2];
+        float Length = std::max(std::abs(Next[0]), std::max(std::abs(Next[1]), std::abs(Next[2])));
+        if(Length < 1e-6f) break;
+        for(int a=0; a<3; a++) Axis[a] = Next[a] / Length;
+    }
+    float AxisLength = std::sqrt(Axis[0] * Axis[0] + Axis[1] * Axis[1] + Axis[2] * Axis[2]);
+    for(int a=0; a<3; a++) Axis[a] /= AxisLength;
+
+    float MinT = 0, MaxT = 0;
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        float T = (Texels[i * 4 + 0] - Mean[0]) * Axis[0] + (Texels[i * 4 + 1] - Mean[1]) * Axis[1] + (Texels[i * 4 + 2] - Mean[2]) * Axis[2];
+        MinT = std::min(MinT, T);
+        MaxT = std::max(MaxT, T);
+    }
+    float Color0[3], Color1[3];
+    for(int c=0; c<3; c++)
+    {
+        Color0[c] = Mean[c] + Axis[c] * MaxT;
+        Color1[c] = Mean[c] + Axis[c] * MinT;
+    }
+
+    uint16_t Packed0 = PackColor565(Color0);
+    uint16_t Packed1 = PackColor565(Color1);
+    uint32_t Indices;
+    uint32_t Error = SelectColorIndices(Texels, Packed0, Packed1, Indices);
+
+    if(Error > 0 && FitEndpoints(Texels, Indices, Color0, Color1))
+    {
+        uint16_t Refined0 = PackColor565(Color0);
+        uint16_t Refined1 = PackColor565(Color1);
+        uint32_t RefinedIndices;
+        if(SelectColorIndices(Texels, Refined0, Refined1, RefinedIndices) < Error)
+        {
+            Packed0 = Refined0;
+            Packed1 = Refined1;
+            Indices = RefinedIndices;
+        }
+    }
+
+    //Swapping the endpoints swaps the indices 0 and 1, and 2 and 3
+    if(Packed0 < Packed1)
+    {
+        std::swap(Packed0, Packed1);
+        Indices ^= 0x55555555u;
+    }
+    //Same endpoints would be the 3 color mode : all the texels take the first one
+    else if(Packed0 == Packed1) Indices = 0;
+
+    memcpy(Output, &Packed0, 2);
+    memcpy(Output + 2, &Packed1, 2);
+    memcpy(Output + 4, &Indices, 4);
+}
+
+//8 values mode of BC4 between the min and the max of the channel
+static void EncodeChannelBlock(const uint8_t *Texels, int Channel, uint8_t *Output)
+{
+    int Min = 255, Max = 0;
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        Min = std::min(Min, (int)Texels[i * 4 + Channel]);
+        Max = std::max(Max, (int)Texels[i * 4 + Channel]);
+    }
+
+    int Palette[8];
+    Palette[0] = Max;
+    Palette[1] = Min;
+    for(int i=2; i<8; i++) Palette[i] = ((8 - i) * Max + (i - 1) * Min) / 7;
+
+    uint64_t Indices = 0;
+    if(Max != Min)
+    {
+        for(int i=0; i<BLOCK_TEXELS; i++)
+        {
+            int Value = Texels[i * 4 + Channel];
+            int BestError = INT32_MAX;
+            uint64_t BestIndex = 0;
+            for(int j=0; j<8; j++)
+            {
+                int Error = std::abs(Value - Palette[j]);
+                if(Error < BestError)
+                {
+                    BestError = Error;
+                    BestIndex = (uint64_t)j;
+                }
+            }
+            Indices |= BestIndex << (i * 3);
+        }
+    }
+
+    Output[0] = (uint8_t)Max;
+    Output[1] = (uint8_t)Min;
+    for(int i=0; i<6; i++) Output[2 + i] = (uint8_t)(Indices >> (i * 8));
+}
+
+static void DecodeColorBlock(const uint8_t *Block, bool Force4Colors, uint8_t *Texels)
+{
+    uint16_t Color0, Color1;
+    uint32_t Indices;
+    memcpy(&Color0, Block, 2);
+    memcpy(&Color1, Block + 2, 2);
+    memcpy(&Indices, Block + 4, 4);
+
+    int Palette[4][3];
+    int Alpha[4] = {255, 255, 255, 255};
+    GetPalette4(Color0, Color1, Palette);
+    if(Color0 <= Color1 && !Force4Colors)
+    {
+        //3 color mode : the middle color, and transparent black
+        for(int c=0; c<3; c++)
+        {
+            Palette[2][c] = (Palette[0][c] + Palette[1][c]) / 2;
+            Palette[3][c] = 0;
+        }
+        Alpha[3] = 0;
+    }
+
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        uint32_t Index = (Indices >> (i * 2)) & 3;
+        Texels[i * 4 + 0] = (uint8_t)Palette[Index][0];
+        Texels[i * 4 + 1] = (uint8_t)Palette[Index][1];
+        Texels[i * 4 + 2] = (uint8_t)Palette[Index][2];
+        Texels[i * 4 + 3] = (uint8_t)Alpha[Index];
+    }
+}
+
+static void DecodeChannelBlock(const uint8_t *Block, int Channel, uint8_t *Texels)
+{
+    int Value0 = Block[0], Value1 = Block[1];
+    int Palette[8] = {Value0, Value1};
+    if(Value0 > Value1)
+    {
+        for(int i=2; i<8; i++) Palette[i] = ((8 - i) * Value0 + (i - 1) * Value1) / 7;
+    }
+    else
+    {
+        for(int i=2; i<6; i++) Palette[i] = ((6 - i) * Value0 + (i - 1) * Value1) / 5;
+        Palette[6] = 0;
+        Palette[7] = 255;
+    }
+
+    uint64_t Indices = 0;
+    for(int i=0; i<6; i++) Indices |= (uint64_t)Block[2 + i] << (i * 8);
+    for(int i=0; i<BLOCK_TEXELS; i++)
+    {
+        Texels[i * 4 + Channel] = (uint8_t)Palette[(Indices >> (i * 3)) & 7];
+    }
+}
+
+static void EncodeBlock(const uint8_t *Texels, blockFormat Format, uint8_t *Output)
+{
+    switch(Format)
+    {
+    case blockFormat::BC1:
+        EncodeColorBlock(Texels, Output);
+        break;
+    case blockFormat::BC3:
+        EncodeChannelBlock(Texels, 3, Output);
+        EncodeColorBlock(Texels, Output + 8);
+        break;
+    case blockFormat::BC5:
+        EncodeChannelBlock(Texels, 0, Output);
+        EncodeChannelBlock(Texels, 1, Output + 8);
+        break;
+    }
+}
+
+static void DecodeBlock(const uint8_t *Block, blockFormat Format, uint8_t *Texels)
+{
+    switch(Format)
+    {
+    case blockFormat::BC1:
+        DecodeColorBlock(Block, false, Texels);
+        break;
+    case blockFormat::BC3:
+        //The colors of BC3 are always in 4 color mode
+        DecodeColorBlock(Block + 8, true, Texels);
+        DecodeChannelBlock(Block, 3, Texels);
+        break;
+    case blockFormat::BC5:
+        DecodeChannelBlock(Block, 0, Texels);
+        DecodeChannelBlock(Block + 8, 1, Texels);
+        for(int i=0; i<BLOCK_TEXELS; i++)
+        {
+            float X = Texels[i * 4 + 0] / 127.5f - 1.0f;
+            float Y = Texels[i * 4 + 1] / 127.5f - 1.0f;
+            float Z = std::sqrt(std::max(1.0f - X * X - Y * Y, 0.0f));
+            Texels[i * 4 + 2] = (uint8_t)((Z * 0.5f + 0.5f) * 255.0f + 0.5f);
+            Texels[i * 4 + 3] = 255;
+        }
+        break;
+    }
+}
+
+static size_t GetLevelSize(uint32_t Width, uint32_t Height, blockFormat Format)
+{
+    return (size_t)((Width + 3) / 4) * ((Height + 3) / 4) * textureCompression::GetBlockBytes(Format);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+uint32_t textureCompression::GetBlockBytes(blockFormat Format)
+{
+    return Format == blockFormat::BC1 ? 8 : 16;
+}
+
+VkFormat textureCompression::GetVulkanFormat(blockFormat Format)
+{
+    switch(Format)
+    {
+    case blockFormat::BC1: return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+    case blockFormat::BC3: return VK_FORMAT_BC3_UNORM_BLOCK;
+    default: return VK_FORMAT_BC5_UNORM_BLOCK;
+    }
+}
+
+gli::format textureCompression::GetGliFormat(blockFormat Format)
+{
+    switch(Format)
+    {
+    case blockFormat::BC1: return gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8;
+    case blockFormat::BC3: return gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16;
+    default: return gli::FORMAT_RG_ATI2N_UNORM_BLOCK16;
+    }
+}
+
+bool textureCompression::GetBlockFormat(gli::format GliFormat, blockFormat &Format)
+{
+    switch(GliFormat)
+    {
+    case gli::FORMAT_RGB_DXT1_UNORM_BLOCK8:
+    case gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8:
+        Format = blockFormat::BC1;
+        return true;
+    case gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16:
+        Format = blockFormat::BC3;
+        return true;
+    case gli::FORMAT_RG_ATI2N_UNORM_BLOCK16:
+        Format = blockFormat::BC5;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void textureCompression::Compress(const uint8_t *Pixels, uint32_t Width, uint32_t Height, blockFormat Format, compressedImage &Image)
+{
+    Image.Format = Format;
+    Image.Width = Width;
+    Image.Height = Height;
+    Image.Data.clear();
+    Image.MipOffsets.clear();
+
+    //Same levels as the mips generated on the gpu
+    std::vector<uint8_t> Level(Pixels, Pixels + (size_t)Width * Height * 4);
+    std::vector<uint8_t> NextLevel;
+    uint32_t LevelWidth = Width, LevelHeight = Height;
+    for(;;)
+    {
+        size_t Offset = Image.Data.size();
+        Image.MipOffsets.push_back(Offset);
+        Image.Data.resize(Offset + GetLevelSize(LevelWidth, LevelHeight, Format));
+
+        //Blocks over the border repeat the last row and column
+        uint8_t *Output = Image.Data.data() + Offset;
+        uint8_t Texels[BLOCK_TEXELS * 4];
+        for(uint32_t BlockY=0; BlockY<LevelHeight; BlockY+=4)
+        {
+            for(uint32_t BlockX=0; BlockX<LevelWidth; BlockX+=4)
+            {
+                for(uint32_t y=0; y<4; y++)
+                {
+                    for(uint32_t x=0; x<4; x++)
+                    {
+                        uint32_t TexelX = std::min(BlockX + x, LevelWidth - 1);
+                        uint32_t TexelY = std::min(BlockY + y, LevelHeight - 1);
+                        memcpy(Texels + (y * 4 + x) * 4, Level.data() + ((size_t)TexelY * LevelWidth + TexelX) * 4, 4);
+                    }
+                }
+                EncodeBlock(Texels, Format, Output);
+                Output += GetBlockBytes(Format);
+            }
+        }
+        if(LevelWidth == 1 && LevelHeight == 1) break;
+
+        //Box filter, odd sizes drop their last row or column
+        uint32_t NextWidth = std::max(LevelWidth / 2, 1u);
+        uint32_t NextHeight = std::max(LevelHeight / 2, 1u);
+        NextLevel.resize((size_t)NextWidth * NextHeight * 4);
+        for(uint32_t y=0; y<NextHeight; y++)
+        {
+            uint32_t y0 = std::min(y * 2, LevelHeight - 1);
+            uint32_t y1 = std::min(y * 2 + 1, LevelHeight - 1);
+            for(uint32_t x=0; x<NextWidth; x++)
+            {
+                uint32_t x0 = std::min(x * 2, LevelWidth - 1);
+                uint32_t x1 = std::min(x * 2 + 1, LevelWidth - 1);
+                for(int c=0; c<4; c++)
+                {
+                    uint32_t Sum = Level[((size_t)y0 * LevelWidth + x0) * 4 + c] + Level[((size_t)y0 * LevelWidth + x1) * 4 + c] +
+                                   Level[((size_t)y1 * LevelWidth + x0) * 4 + c] + Level[((size_t)y1 * LevelWidth + x1) * 4 + c];
+                    NextLevel[((size_t)y * NextWidth + x) * 4 + c] = (uint8_t)((Sum + 2) / 4);
+                }
+            }
+        }
+        Level.swap(NextLevel);
+        LevelWidth = NextWidth;
+        LevelHeight = NextHeight;
+    }
+}
+
+void textureCompression::Decompress(const uint8_t *Blocks, uint32_t Width, uint32_t Height, blockFormat Format, uint8_t *Pixels)
+{
+    uint8_t Texels[BLOCK_TEXELS * 4];
+    for(uint32_t BlockY=0; BlockY<Height; BlockY+=4)
+    {
+        for(uint32_t BlockX=0; BlockX<Width; BlockX+=4)
+        {
+            DecodeBlock(Blocks, Format, Texels);
+            Blocks += GetBlockBytes(Format);
+
+            uint32_t BlockWidth = std::min(Width - BlockX, 4u);
+            uint32_t BlockHeight = std::min(Height - BlockY, 4u);
+            for(uint32_t y=0; y<BlockHeight; y++)
+            {
+                memcpy(Pixels + ((size_t)(BlockY + y) * Width + BlockX) * 4, Texels + y * 16, BlockWidth * 4);
+            }
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+static std::string CacheFileName(uint64_t Hash)
+{
+    char Name[32];
+    snprintf(Name, sizeof(Name), "%016llx.dds", (unsigned long long)Hash);
+    return std::string(TEXTURE_CACHE_DIRECTORY) + Name;
+}
+
+uint64_t textureCache::Hash(const uint8_t *EncodedImage, size_t Size, bool NormalMap)
+{
+    uint64_t Result = FNV_OFFSET_BASIS;
+    for(size_t i=0; i<Size; i++)
+    {
+        Result ^= EncodedImage[i];
+        Result *= FNV_PRIME;
+    }
+    uint8_t Settings[2] = {(uint8_t)TEXTURE_CACHE_VERSION, (uint8_t)NormalMap};
+    for(int i=0; i<2; i++)
+    {
+        Result ^= Settings[i];
+        Result *= FNV_PRIME;
+    }
+    return Result;
+}
+
+bool textureCache::Load(uint64_t Hash, compressedImage &Image)
+{
+    std::string FileName = CacheFileName(Hash);
+    std::error_code Error;
+    if(!std::filesystem::exists(FileName, Error)) return false;
+
+    gli::texture2d Texture(gli::load(FileName));
+    if(Texture.empty() || !textureCompression::GetBlockFormat(Texture.format(), Image.Format)) return false;
+
+    Image.Width = (uint32_t)Texture.extent(0).x;
+    Image.Height = (uint32_t)Texture.extent(0).y;
+    Image.Data.clear();
+    Image.MipOffsets.clear();
+    for(size_t Level=0; Level<Texture.levels(); Level++)
+    {
+        const gli::image Mip = Texture[Level];
+        if(Mip.size() != GetLevelSize((uint32_t)Mip.extent().x, (uint32_t)Mip.extent().y, Image.Format)) return false;
+        Image.MipOffsets.push_back(Image.Data.size());
+        Image.Data.insert(Image.Data.end(), (const uint8_t*)Mip.data(), (const uint8_t*)Mip.data() + Mip.size());
+    }
+    return true;
+}
+
+void textureCache::Save(uint64_t Hash, const compressedImage &Image)
+{
+    std::error_code Error;
+    std::filesystem::create_directories(TEXTURE_CACHE_DIRECTORY, Error);
+
+    gli::texture2d Texture(textureCompression::GetGliFormat(Image.Format), gli::texture2d::extent_type(Image.Width, Image.Height), Image.MipOffsets.size());
+    for(size_t Level=0; Level<Image.MipOffsets.size(); Level++)
+    {
+        size_t End = Level + 1 < Image.MipOffsets.size() ? Image.MipOffsets[Level + 1] : Image.Data.size();
+        gli::image Mip = Texture[Level];
+        if(Mip.size() != End - Image.MipOffsets[Level]) return;
+        memcpy(Mip.data(), Image.Data.data() + Image.MipOffsets[Level], Mip.size());
+    }
+
+    //Written next to the final file and renamed, so a crash never leaves a truncated cache
+    std::string FileName = CacheFileName(Hash);
+    std::string TempFileName = FileName + ".tmp";
+    bool Written = gli::save_dds(Texture, TempFileName);
+    if(Written)
+    {
+        std::filesystem::rename(TempFileName, FileName, Error);
+    }
+    if(!Written || Error)
+    {
+        std::filesystem::remove(TempFileName, Error);
+    }
+}
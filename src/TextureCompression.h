@@ -0,0 +1,58 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+#include <stdint.h>
+#include <vector>
+
+#pragma warning ( disable : 4458; disable : 4996 )
+#include <gli/gli.hpp>
+#pragma warning ( default : 4458; default : 4996 )
+
+//Compressed scene textures are saved in that folder as dds files, one file per source image
+#define TEXTURE_CACHE_DIRECTORY "cache/textures/"
+
+//Block compressed formats of the scene textures, all in blocks of 4x4 texels
+enum class blockFormat
+{
+    //Opaque colors, 8 bytes per block
+    BC1,
+    //BC1 colors and a BC4 alpha, 16 bytes per block
+    BC3,
+    //Two BC4 channels, 16 bytes per block. Normal maps : x and y, z is rebuilt from them.
+    BC5
+};
+
+//All the mips of a block compressed image, tightly packed in Data. Level i starts at MipOffsets[i].
+struct compressedImage
+{
+    blockFormat Format;
+    uint32_t Width, Height;
+    std::vector<uint8_t> Data;
+    std::vector<size_t> MipOffsets;
+};
+
+namespace textureCompression
+{
+    uint32_t GetBlockBytes(blockFormat Format);
+    VkFormat GetVulkanFormat(blockFormat Format);
+    gli::format GetGliFormat(blockFormat Format);
+    //False if the gli format is not one of the block formats above
+    bool GetBlockFormat(gli::format GliFormat, blockFormat &Format);
+
+    //Box filters the mips of the rgba8 Pixels, and encodes all the levels
+    void Compress(const uint8_t *Pixels, uint32_t Width, uint32_t Height, blockFormat Format, compressedImage &Image);
+    //Decodes the blocks of one level into rgba8 rows. BC5 gets the z of the normal in blue and an opaque alpha.
+    void Decompress(const uint8_t *Blocks, uint32_t Width, uint32_t Height, blockFormat Format, uint8_t *Pixels);
+}
+
+//Dds cache of the compressed textures, same idea as bvhCache : files are named after a hash of the source image file
+//and of the encoder settings, so a changed image or encoder misses the cache.
+namespace textureCache
+{
+    //FNV-1a over the encoded source image (png, jpg...) and the kind of texture it's compressed for
+    uint64_t Hash(const uint8_t *EncodedImage, size_t Size, bool NormalMap);
+
+    //Loads the dds file through gli. Returns false if there is no valid file.
+    bool Load(uint64_t Hash, compressedImage &Image);
+    void Save(uint64_t Hash, const compressedImage &Image);
+}
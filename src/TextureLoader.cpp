@@ -1,54 +1,255 @@
 #include "TextureLoader.h"
 #include "Scene.h"
 #include "GLTFImporter.h"
+#include "EnvironmentMap.h"
+#include "ThreadPool.h"
+#include "TextureCompression.h"
 #include <gli/gli.hpp>
 #include <glm/gtc/type_ptr.hpp>
-glm::vec4 vulkanTexture::Sample(glm::vec2 UV, borderType BorderType)
-{ 	
-	// UV = glm::abs(UV);
-	// UV = glm::clamp(UV, glm::vec2(0), glm::vec2(1));
-	glm::vec2 IntPart;
-    glm::vec2 CorrectedUV = glm::modf(UV,IntPart);
-	if(UV.x > 1)
+#include <immintrin.h>
+#include <array>
+
+//Linear value of each 8 bit sRGB value, with the same gamma as the shaders
+static const std::array<float, 256> SRGBDecodeTable = []()
+{
+    std::array<float, 256> Table;
+    for(int i=0; i<256; i++) Table[i] = std::pow((float)i / 255.0f, TEXTURE_GAMMA);
+    return Table;
+}();
+
+static uint8_t EncodeSRGB(float Value)
+{
+    return (uint8_t)(std::pow(std::min(std::max(Value, 0.0f), 1.0f), 1.0f / TEXTURE_GAMMA) * 255.0f + 0.5f);
+}
+
+//Texel coordinate inside the mip for each border type, so the lookup doesn't branch on it
+template<borderType BorderType>
+static int WrapCoordinate(int Coordinate, int Size)
+{
+    if(BorderType == borderType::Clamp)
+    {
+        return std::min(std::max(Coordinate, 0), Size - 1);
+    }
+    else if(BorderType == borderType::Repeat)
     {
-        float d;
-		CorrectedUV.x = modf(CorrectedUV.x, &d);
+        int Wrapped = Coordinate % Size;
+        return Wrapped < 0 ? Wrapped + Size : Wrapped;
     }
-    if(UV.y > 1)
+    else
     {
-        float d;
-		CorrectedUV.y = modf(CorrectedUV.y, &d);
+        int Period = Size * 2;
+        int Wrapped = Coordinate % Period;
+        if(Wrapped < 0) Wrapped += Period;
+        return Wrapped < Size ? Wrapped : Period - 1 - Wrapped;
     }
+}
 
-    if(UV.x < 0)
+//Byte offset of a texel of the mip in Data
+template<bool Tiled>
+static size_t TexelOffset(const textureMip &Mip, uint32_t x, uint32_t y)
+{
+    if(Tiled)
     {
-		CorrectedUV.x = 1 + CorrectedUV.x;
+        size_t Block = (size_t)(y / TEXTURE_BLOCK_SIZE) * Mip.BlocksX + x / TEXTURE_BLOCK_SIZE;
+        uint32_t InBlock = (y % TEXTURE_BLOCK_SIZE) * TEXTURE_BLOCK_SIZE + x % TEXTURE_BLOCK_SIZE;
+        return Mip.Offset + (Block * TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE + InBlock) * 4;
     }
-    if(UV.y < 0)
+    return Mip.Offset + ((size_t)y * Mip.Width + x) * 4;
+}
+
+static size_t TexelOffset(bool Tiled, const textureMip &Mip, uint32_t x, uint32_t y)
+{
+    return Tiled ? TexelOffset<true>(Mip, x, y) : TexelOffset<false>(Mip, x, y);
+}
+
+//Linear rgba of the texel, ready to shade
+template<bool Tiled, colorSpace ColorSpace>
+static __m128 FetchTexel(const std::vector<uint8_t> &Data, const textureMip &Mip, int x, int y)
+{
+    const uint8_t *Texel = Data.data() + TexelOffset<Tiled>(Mip, (uint32_t)x, (uint32_t)y);
+    if(ColorSpace == colorSpace::SRGB)
     {
-		CorrectedUV.y = 1 + CorrectedUV.y;
+        return _mm_setr_ps(SRGBDecodeTable[Texel[0]], SRGBDecodeTable[Texel[1]], SRGBDecodeTable[Texel[2]], (float)Texel[3] * (1.0f / 255.0f));
     }
-    //if(BorderType == borderType::Clamp) 
-    // if(BorderType==borderType::Repeat) {
-    //     glm::vec2 i;
-    //     UV = glm::modf(UV, i);
-    // }
-    
-    glm::ivec2 TexCoords = glm::ivec2(CorrectedUV * glm::vec2(Width, Height));
-    uint32_t BaseInx = (uint32_t)(TexCoords.y * Width * 4) + (uint32_t)(TexCoords.x * 4);
-    glm::vec4 TextureColor(
-        (float)(Data[BaseInx + 0]) / 255.0f,
-        (float)(Data[BaseInx + 1]) / 255.0f,
-        (float)(Data[BaseInx + 2]) / 255.0f,
-        (float)(Data[BaseInx + 3]) / 255.0f
-    );       
-
-    return TextureColor;
+    int32_t Packed;
+    memcpy(&Packed, Texel, 4);
+    return _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(Packed))), _mm_set1_ps(1.0f / 255.0f));
+}
+
+static __m128 Lerp(__m128 A, __m128 B, float T)
+{
+    return _mm_add_ps(A, _mm_mul_ps(_mm_sub_ps(B, A), _mm_set1_ps(T)));
+}
+
+template<borderType BorderType, bool Tiled, colorSpace ColorSpace>
+static __m128 SampleBilinear(const std::vector<uint8_t> &Data, const textureMip &Mip, glm::vec2 UV)
+{
+    //Texel centers are at half integers
+    float x = UV.x * (float)Mip.Width - 0.5f;
+    float y = UV.y * (float)Mip.Height - 0.5f;
+    float FloorX = std::floor(x);
+    float FloorY = std::floor(y);
+    float FractX = x - FloorX;
+    float FractY = y - FloorY;
+
+    int x0 = WrapCoordinate<BorderType>((int)FloorX, (int)Mip.Width);
+    int x1 = WrapCoordinate<BorderType>((int)FloorX + 1, (int)Mip.Width);
+    int y0 = WrapCoordinate<BorderType>((int)FloorY, (int)Mip.Height);
+    int y1 = WrapCoordinate<BorderType>((int)FloorY + 1, (int)Mip.Height);
+
+    //Filtered after the decoding, so sRGB textures are filtered in linear
+    __m128 Top = Lerp(FetchTexel<Tiled, ColorSpace>(Data, Mip, x0, y0), FetchTexel<Tiled, ColorSpace>(Data, Mip, x1, y0), FractX);
+    __m128 Bottom = Lerp(FetchTexel<Tiled, ColorSpace>(Data, Mip, x0, y1), FetchTexel<Tiled, ColorSpace>(Data, Mip, x1, y1), FractX);
+    return Lerp(Top, Bottom, FractY);
+}
+
+template<borderType BorderType, bool Tiled, colorSpace ColorSpace>
+static glm::vec4 SampleTrilinear(const std::vector<uint8_t> &Data, const std::vector<textureMip> &Mips, glm::vec2 UV, float Lod)
+{
+    Lod = std::min(std::max(Lod, 0.0f), (float)(Mips.size() - 1));
+    uint32_t Level = (uint32_t)Lod;
+    float Blend = Lod - (float)Level;
+
+    __m128 Result = SampleBilinear<BorderType, Tiled, ColorSpace>(Data, Mips[Level], UV);
+    if(Blend > 0) Result = Lerp(Result, SampleBilinear<BorderType, Tiled, ColorSpace>(Data, Mips[Level + 1], UV), Blend);
+
+    glm::vec4 Color;
+    _mm_storeu_ps(&Color.x, Result);
+    return Color;
+}
+
+template<bool Tiled, colorSpace ColorSpace>
+static glm::vec4 SampleFormat(const std::vector<uint8_t> &Data, const std::vector<textureMip> &Mips, glm::vec2 UV, float Lod, borderType BorderType)
+{
+    switch(BorderType)
+    {
+    case borderType::Clamp:
+        return SampleTrilinear<borderType::Clamp, Tiled, ColorSpace>(Data, Mips, UV, Lod);
+    case borderType::Mirror:
+        return SampleTrilinear<borderType::Mirror, Tiled, ColorSpace>(Data, Mips, UV, Lod);
+    default:
+        return SampleTrilinear<borderType::Repeat, Tiled, ColorSpace>(Data, Mips, UV, Lod);
+    }
+}
+
+void vulkanTexture::BuildMips(bool _Tiled)
+{
+    Tiled = _Tiled;
+    std::vector<uint8_t> Texels(Data.begin(), Data.begin() + (size_t)Width * Height * 4);
+
+    //Tiled mips are padded to whole blocks
+    Mips.clear();
+    size_t Size = 0;
+    for(uint32_t MipWidth=Width, MipHeight=Height;; MipWidth = std::max(MipWidth / 2, 1u), MipHeight = std::max(MipHeight / 2, 1u))
+    {
+        uint32_t BlocksX = (MipWidth + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+        uint32_t BlocksY = (MipHeight + TEXTURE_BLOCK_SIZE - 1) / TEXTURE_BLOCK_SIZE;
+        Mips.push_back({(uint32_t)Size, MipWidth, MipHeight, BlocksX});
+        Size += Tiled ? (size_t)BlocksX * BlocksY * TEXTURE_BLOCK_SIZE * TEXTURE_BLOCK_SIZE * 4 : (size_t)MipWidth * MipHeight * 4;
+        if(MipWidth == 1 && MipHeight == 1) break;
+    }
+    Data.assign(Size, 0);
+
+    for(uint32_t y=0; y<Height; y++)
+    {
+        for(uint32_t x=0; x<Width; x++)
+        {
+            memcpy(Data.data() + TexelOffset(Tiled, Mips[0], x, y), Texels.data() + ((size_t)y * Width + x) * 4, 4);
+        }
+    }
+
+    for(size_t Level=1; Level<Mips.size(); Level++)
+    {
+        const textureMip &Source = Mips[Level - 1];
+        const textureMip &Mip = Mips[Level];
+
+        //Odd sizes drop their last row or column
+        for(uint32_t y=0; y<Mip.Height; y++)
+        {
+            uint32_t y0 = std::min(y * 2, Source.Height - 1);
+            uint32_t y1 = std::min(y * 2 + 1, Source.Height - 1);
+            for(uint32_t x=0; x<Mip.Width; x++)
+            {
+                uint32_t x0 = std::min(x * 2, Source.Width - 1);
+                uint32_t x1 = std::min(x * 2 + 1, Source.Width - 1);
+                const uint8_t *Texel00 = Data.data() + TexelOffset(Tiled, Source, x0, y0);
+                const uint8_t *Texel10 = Data.data() + TexelOffset(Tiled, Source, x1, y0);
+                const uint8_t *Texel01 = Data.data() + TexelOffset(Tiled, Source, x0, y1);
+                const uint8_t *Texel11 = Data.data() + TexelOffset(Tiled, Source, x1, y1);
+                uint8_t *Output = Data.data() + TexelOffset(Tiled, Mip, x, y);
+                for(uint32_t c=0; c<4; c++)
+                {
+                    //sRGB colors are averaged in linear
+                    if(ColorSpace == colorSpace::SRGB && c < 3)
+                    {
+                        float Sum = SRGBDecodeTable[Texel00[c]] + SRGBDecodeTable[Texel10[c]] + SRGBDecodeTable[Texel01[c]] + SRGBDecodeTable[Texel11[c]];
+                        Output[c] = EncodeSRGB(Sum * 0.25f);
+                        continue;
+                    }
+                    uint32_t Sum = Texel00[c] + Texel10[c] + Texel01[c] + Texel11[c];
+                    Output[c] = (uint8_t)((Sum + 2) / 4);
+                }
+            }
+        }
+    }
+}
+
+//The cpu mips and lookups only handle 4 bytes per texel, other formats keep the raw copy without mips
+static bool HasCPUMips(VkFormat Format)
+{
+    return Format == VK_FORMAT_R8G8B8A8_UNORM || Format == VK_FORMAT_R8G8B8A8_SRGB;
+}
+
+//First level of the cpu copy in rows, as it was loaded
+static std::vector<uint8_t> GetFirstLevel(const vulkanTexture &Texture)
+{
+    std::vector<uint8_t> Texels((size_t)Texture.Width * Texture.Height * 4);
+    for(uint32_t y=0; y<Texture.Height; y++)
+    {
+        for(uint32_t x=0; x<Texture.Width; x++)
+        {
+            memcpy(Texels.data() + ((size_t)y * Texture.Width + x) * 4, Texture.Data.data() + TexelOffset(Texture.Tiled, Texture.Mips[0], x, y), 4);
+        }
+    }
+    return Texels;
+}
+
+void vulkanTexture::SetTiled(bool _Tiled)
+{
+    if(Mips.empty() || Tiled == _Tiled) return;
+    Data = GetFirstLevel(*this);
+    BuildMips(_Tiled);
+}
+
+void vulkanTexture::SetColorSpace(colorSpace _ColorSpace)
+{
+    if(ColorSpace == _ColorSpace) return;
+    ColorSpace = _ColorSpace;
+    //The mips are averaged in the new color space
+    if(Mips.empty()) return;
+    Data = GetFirstLevel(*this);
+    BuildMips(Tiled);
+}
+
+float vulkanTexture::GetLod(float ConeLod) const
+{
+    return ConeLod + 0.5f * std::log2((float)Width * (float)Height);
+}
+
+glm::vec4 vulkanTexture::Sample(glm::vec2 UV, float Lod, borderType BorderType)
+{
+    if(ColorSpace == colorSpace::SRGB)
+    {
+        return Tiled ? SampleFormat<true, colorSpace::SRGB>(Data, Mips, UV, Lod, BorderType) : SampleFormat<false, colorSpace::SRGB>(Data, Mips, UV, Lod, BorderType);
+    }
+    return Tiled ? SampleFormat<true, colorSpace::Linear>(Data, Mips, UV, Lod, BorderType) : SampleFormat<false, colorSpace::Linear>(Data, Mips, UV, Lod, BorderType);
 }
 
 textureLoader::textureLoader(vulkanDevice *VulkanDevice, VkQueue Queue, VkCommandPool CommandPool) :
                   VulkanDevice(VulkanDevice), Queue(Queue), CommandPool(CommandPool)
 {
+    if(VulkanDevice == nullptr) return;
+
     VkCommandBufferAllocateInfo CommandBufferInfo {VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO};
     CommandBufferInfo.commandPool = CommandPool;
     CommandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
@@ -65,6 +266,19 @@ void textureLoader::LoadTexture2D(std::string Filename, VkFormat Format, vulkanT
     Texture->Height = static_cast<uint32_t>(GliTexture[0].extent().y);
     Texture->MipLevels = static_cast<uint32_t>(GliTexture.levels());
 
+    //Block compressed files (texture cache) keep their format, the cpu copy is decoded from them
+    blockFormat BlockFormat;
+    bool Compressed = textureCompression::GetBlockFormat(GliTexture.format(), BlockFormat);
+    Texture->Data.resize(Texture->Width * Texture->Height * 4);
+    if(Compressed)
+    {
+        Format = textureCompression::GetVulkanFormat(BlockFormat);
+        textureCompression::Decompress((const uint8_t*)GliTexture[0].data(), Texture->Width, Texture->Height, BlockFormat, Texture->Data.data());
+    }
+    else memcpy(Texture->Data.data(), GliTexture[0].data(), std::min(Texture->Data.size(), GliTexture[0].size()));
+    if(Compressed || HasCPUMips(Format)) Texture->BuildMips();
+    if(VulkanDevice == nullptr) return;
+
     VkFormatProperties FormatProperties;
     vkGetPhysicalDeviceFormatProperties(VulkanDevice->PhysicalDevice, Format, &FormatProperties);
 
@@ -98,9 +312,6 @@ void textureLoader::LoadTexture2D(std::string Filename, VkFormat Format, vulkanT
     std::vector<VkBufferImageCopy> BufferCopyRegions;
     uint32_t Offset = 0;
 
-    Texture->Data.resize(Texture->Width * Texture->Height * 4);
-    memcpy(Texture->Data.data(), GliTexture[0].data(), Texture->Data.size());
-
     for(uint32_t i=0; i<Texture->MipLevels; i++)
     {
         VkBufferImageCopy BufferCopyRegion = {};
@@ -223,13 +434,20 @@ void textureLoader::LoadTexture2D(std::string Filename, VkFormat Format, vulkanT
     Texture->Descriptor.sampler = Texture->Sampler;
 }
 
-void textureLoader::LoadCubemap(std::string PanoFileName, vulkanTexture *Output)
+void textureLoader::LoadCubemap(std::string PanoFileName, vulkanTexture *Output, environmentMap *EnvironmentMap)
 {
     if(Output==nullptr) return;
 
     float *Pixels;
     int Width, Height;
     Pixels = stbi_loadf(PanoFileName.c_str(), &Width, &Height, NULL, 4);
+    if(VulkanDevice == nullptr)
+    {
+        //Only the cpu path tracer needs it, there is no cubemap to render
+        if(EnvironmentMap && Pixels) EnvironmentMap->Build(Pixels, Width, Height);
+        stbi_image_free(Pixels);
+        return;
+    }
     vulkanTexture PanoTexture;
     CreateTexture(
         Pixels,
@@ -239,6 +457,8 @@ void textureLoader::LoadCubemap(std::string PanoFileName, vulkanTexture *Output)
         &PanoTexture,
         false
     );
+    if(EnvironmentMap) EnvironmentMap->Build(Pixels, Width, Height);
+    stbi_image_free(Pixels);
     
     bool DoGenerateMipmaps=true;
 
@@ -804,63 +1024,8 @@ void textureLoader::GenerateCubemapMipmaps(VkImage Image, uint32_t Width, uint32
 
 }
 
-void textureLoader::CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkFormat Format, uint32_t Width, uint32_t Height, vulkanTexture *Texture, bool DoGenerateMipmaps, VkFilter Filter, VkImageUsageFlags ImageUsageFlags)
+void textureLoader::CreateImage(vulkanTexture *Texture, VkFormat Format, VkImageUsageFlags ImageUsageFlags)
 {
-    assert(Buffer);
-    
-    //Save a copy of the data on the cpu (CPU Ray tracer / Rasterizer)
-    Texture->Data.resize(Width * Height * 4);
-    memcpy(Texture->Data.data(), Buffer, Width * Height * 4);
-
-    Texture->Width = Width;
-    Texture->Height = Height;
-    Texture->MipLevels = DoGenerateMipmaps ?  static_cast<uint32_t>(std::floor(std::log2(std::max(Width, Height)))) + 1 : 1;
-
-    VkMemoryAllocateInfo memAllocInfo = vulkanTools::BuildMemoryAllocateInfo();
-    VkMemoryRequirements memReqs;
-
-    // Use a separate command buffer for texture loading
-    VkCommandBufferBeginInfo cmdBufInfo = vulkanTools::BuildCommandBufferBeginInfo();
-    VK_CALL(vkBeginCommandBuffer(CommandBuffer, &cmdBufInfo));
-
-    // Create a host-visible staging buffer that contains the raw image data
-    VkBuffer stagingBuffer;
-    VkDeviceMemory stagingMemory;
-
-    VkBufferCreateInfo bufferCreateInfo = vulkanTools::BuildBufferCreateInfo();
-    bufferCreateInfo.size = BufferSize;
-    // This buffer is used as a transfer source for the buffer copy
-    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
-    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    VK_CALL(vkCreateBuffer(VulkanDevice->Device, &bufferCreateInfo, nullptr, &stagingBuffer));
-
-    // Get memory requirements for the staging buffer (alignment, memory type bits)
-    vkGetBufferMemoryRequirements(VulkanDevice->Device, stagingBuffer, &memReqs);
-
-    memAllocInfo.allocationSize = memReqs.size;
-    // Get memory type index for a host visible buffer
-    memAllocInfo.memoryTypeIndex = VulkanDevice->GetMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
-
-    VK_CALL(vkAllocateMemory(VulkanDevice->Device, &memAllocInfo, nullptr, &stagingMemory));
-    VK_CALL(vkBindBufferMemory(VulkanDevice->Device, stagingBuffer, stagingMemory, 0));
-
-    // Copy texture data into staging buffer
-    uint8_t *data;
-    VK_CALL(vkMapMemory(VulkanDevice->Device, stagingMemory, 0, memReqs.size, 0, (void **)&data));
-    memcpy(data, Buffer, BufferSize);
-    vkUnmapMemory(VulkanDevice->Device, stagingMemory);
-
-    VkBufferImageCopy bufferCopyRegion = {};
-    bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    bufferCopyRegion.imageSubresource.mipLevel = 0;
-    bufferCopyRegion.imageSubresource.baseArrayLayer = 0;
-    bufferCopyRegion.imageSubresource.layerCount = 1;
-    bufferCopyRegion.imageExtent.width = Width;
-    bufferCopyRegion.imageExtent.height = Height;
-    bufferCopyRegion.imageExtent.depth = 1;
-    bufferCopyRegion.bufferOffset = 0;
-
     // Create optimal tiled target image
     VkImageCreateInfo imageCreateInfo = vulkanTools::BuildImageCreateInfo();
     imageCreateInfo.imageType = VK_IMAGE_TYPE_2D;
@@ -880,13 +1045,34 @@ void textureLoader::CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkForma
     }
     VK_CALL(vkCreateImage(VulkanDevice->Device, &imageCreateInfo, nullptr, &Texture->Image));
 
+    VkMemoryRequirements memReqs;
     vkGetImageMemoryRequirements(VulkanDevice->Device, Texture->Image, &memReqs);
 
+    VkMemoryAllocateInfo memAllocInfo = vulkanTools::BuildMemoryAllocateInfo();
     memAllocInfo.allocationSize = memReqs.size;
-
     memAllocInfo.memoryTypeIndex = VulkanDevice->GetMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     VK_CALL(vkAllocateMemory(VulkanDevice->Device, &memAllocInfo, nullptr, &Texture->DeviceMemory));
     VK_CALL(vkBindImageMemory(VulkanDevice->Device, Texture->Image, Texture->DeviceMemory, 0));
+}
+
+void textureLoader::RecordUpload(VkBuffer StagingBuffer, VkDeviceSize Offset, vulkanTexture *Texture, bool DoGenerateMipmaps, const compressedImage *Compressed)
+{
+    //The first level, or all of them when they're compressed
+    std::vector<VkBufferImageCopy> bufferCopyRegions(Compressed ? Compressed->MipOffsets.size() : 1);
+    for(uint32_t i=0; i<bufferCopyRegions.size(); i++)
+    {
+        VkBufferImageCopy &bufferCopyRegion = bufferCopyRegions[i];
+        bufferCopyRegion = {};
+        bufferCopyRegion.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        bufferCopyRegion.imageSubresource.mipLevel = i;
+        bufferCopyRegion.imageSubresource.baseArrayLayer = 0;
+        bufferCopyRegion.imageSubresource.layerCount = 1;
+        bufferCopyRegion.imageExtent.width = std::max(Texture->Width >> i, 1u);
+        bufferCopyRegion.imageExtent.height = std::max(Texture->Height >> i, 1u);
+        bufferCopyRegion.imageExtent.depth = 1;
+        bufferCopyRegion.bufferOffset = Offset + (Compressed ? Compressed->MipOffsets[i] : 0);
+    }
+    if(Compressed) DoGenerateMipmaps = false;
 
     VkImageSubresourceRange subresourceRange = {};
     subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
@@ -904,53 +1090,33 @@ void textureLoader::CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkForma
         VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
         subresourceRange);
     
-        vkCmdCopyBufferToImage(
+    vkCmdCopyBufferToImage(
+        CommandBuffer,
+        StagingBuffer,
+        Texture->Image,
+        VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        static_cast<uint32_t>(bufferCopyRegions.size()),
+        bufferCopyRegions.data()
+    );
+
+    // Copy mip levels from staging buffer
+    if(DoGenerateMipmaps)GenerateMipmaps(Texture->Image, Texture->Width, Texture->Height, Texture->MipLevels);
+    else
+    {
+        // Change texture image layout to shader read after all mip levels have been copied
+        Texture->ImageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            vulkanTools::TransitionImageLayout(
             CommandBuffer,
-            stagingBuffer,
             Texture->Image,
+            VK_IMAGE_ASPECT_COLOR_BIT,
             VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            1,
-            &bufferCopyRegion
-        );
-    
-        // Copy mip levels from staging buffer
-        if(DoGenerateMipmaps)GenerateMipmaps(Texture->Image, Width, Height, Texture->MipLevels);
-        else
-        {
-            // Change texture image layout to shader read after all mip levels have been copied
-            Texture->ImageLayout = VK_IMAGE_LAYOUT_GENERAL;
-                vulkanTools::TransitionImageLayout(
-                CommandBuffer,
-                Texture->Image,
-                VK_IMAGE_ASPECT_COLOR_BIT,
-                VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                Texture->ImageLayout,
-                subresourceRange);
-        }
-
-
-    // Submit command buffer containing copy and image layout commands
-    VK_CALL(vkEndCommandBuffer(CommandBuffer));
-
-    // Create a fence to make sure that the copies have finished before continuing
-    VkFence copyFence;
-    VkFenceCreateInfo fenceCreateInfo = vulkanTools::BuildFenceCreateInfo(0);
-    VK_CALL(vkCreateFence(VulkanDevice->Device, &fenceCreateInfo, nullptr, &copyFence));
-
-    VkSubmitInfo submitInfo = vulkanTools::BuildSubmitInfo();
-    submitInfo.commandBufferCount = 1;
-    submitInfo.pCommandBuffers = &CommandBuffer;
-
-    VK_CALL(vkQueueSubmit(Queue, 1, &submitInfo, copyFence));
-
-    VK_CALL(vkWaitForFences(VulkanDevice->Device, 1, &copyFence, VK_TRUE, DEFAULT_FENCE_TIMEOUT));
-
-    vkDestroyFence(VulkanDevice->Device, copyFence, nullptr);
-
-    // Clean up staging resources
-    vkFreeMemory(VulkanDevice->Device, stagingMemory, nullptr);
-    vkDestroyBuffer(VulkanDevice->Device, stagingBuffer, nullptr);
+            Texture->ImageLayout,
+            subresourceRange);
+    }
+}
 
+void textureLoader::CreateSamplerAndView(vulkanTexture *Texture, VkFormat Format, VkFilter Filter)
+{
     // Create sampler
     VkSamplerCreateInfo sampler = {};
     sampler.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
@@ -985,6 +1151,149 @@ void textureLoader::CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkForma
     Texture->Descriptor.sampler = Texture->Sampler;
 }
 
+void textureLoader::CreateStagingBuffer(VkDeviceSize Size, VkBuffer *StagingBuffer, VkDeviceMemory *StagingMemory, uint8_t **Data)
+{
+    VkBufferCreateInfo bufferCreateInfo = vulkanTools::BuildBufferCreateInfo();
+    bufferCreateInfo.size = Size;
+    // This buffer is used as a transfer source for the buffer copy
+    bufferCreateInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    bufferCreateInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    VK_CALL(vkCreateBuffer(VulkanDevice->Device, &bufferCreateInfo, nullptr, StagingBuffer));
+
+    // Get memory requirements for the staging buffer (alignment, memory type bits)
+    VkMemoryRequirements memReqs;
+    vkGetBufferMemoryRequirements(VulkanDevice->Device, *StagingBuffer, &memReqs);
+
+    VkMemoryAllocateInfo memAllocInfo = vulkanTools::BuildMemoryAllocateInfo();
+    memAllocInfo.allocationSize = memReqs.size;
+    // Get memory type index for a host visible buffer
+    memAllocInfo.memoryTypeIndex = VulkanDevice->GetMemoryType(memReqs.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    VK_CALL(vkAllocateMemory(VulkanDevice->Device, &memAllocInfo, nullptr, StagingMemory));
+    VK_CALL(vkBindBufferMemory(VulkanDevice->Device, *StagingBuffer, *StagingMemory, 0));
+    VK_CALL(vkMapMemory(VulkanDevice->Device, *StagingMemory, 0, memReqs.size, 0, (void **)Data));
+}
+
+void textureLoader::SubmitAndWait(VkBuffer StagingBuffer, VkDeviceMemory StagingMemory)
+{
+    // Submit command buffer containing copy and image layout commands
+    VK_CALL(vkEndCommandBuffer(CommandBuffer));
+
+    // Create a fence to make sure that the copies have finished before continuing
+    VkFence copyFence;
+    VkFenceCreateInfo fenceCreateInfo = vulkanTools::BuildFenceCreateInfo(0);
+    VK_CALL(vkCreateFence(VulkanDevice->Device, &fenceCreateInfo, nullptr, &copyFence));
+
+    VkSubmitInfo submitInfo = vulkanTools::BuildSubmitInfo();
+    submitInfo.commandBufferCount = 1;
+    submitInfo.pCommandBuffers = &CommandBuffer;
+
+    VK_CALL(vkQueueSubmit(Queue, 1, &submitInfo, copyFence));
+
+    VK_CALL(vkWaitForFences(VulkanDevice->Device, 1, &copyFence, VK_TRUE, DEFAULT_FENCE_TIMEOUT));
+
+    vkDestroyFence(VulkanDevice->Device, copyFence, nullptr);
+
+    // Clean up staging resources
+    vkUnmapMemory(VulkanDevice->Device, StagingMemory);
+    vkFreeMemory(VulkanDevice->Device, StagingMemory, nullptr);
+    vkDestroyBuffer(VulkanDevice->Device, StagingBuffer, nullptr);
+}
+
+void textureLoader::CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkFormat Format, uint32_t Width, uint32_t Height, vulkanTexture *Texture, bool DoGenerateMipmaps, VkFilter Filter, VkImageUsageFlags ImageUsageFlags)
+{
+    assert(Buffer);
+    
+    //Save a copy of the data on the cpu (CPU Ray tracer / Rasterizer)
+    Texture->Data.resize(Width * Height * 4);
+    memcpy(Texture->Data.data(), Buffer, Width * Height * 4);
+
+    Texture->Width = Width;
+    Texture->Height = Height;
+    if(HasCPUMips(Format)) Texture->BuildMips();
+    Texture->MipLevels = DoGenerateMipmaps ?  static_cast<uint32_t>(std::floor(std::log2(std::max(Width, Height)))) + 1 : 1;
+    if(VulkanDevice == nullptr) return;
+
+    // Use a separate command buffer for texture loading
+    VkCommandBufferBeginInfo cmdBufInfo = vulkanTools::BuildCommandBufferBeginInfo();
+    VK_CALL(vkBeginCommandBuffer(CommandBuffer, &cmdBufInfo));
+
+    // Create a host-visible staging buffer that contains the raw image data
+    VkBuffer stagingBuffer;
+    VkDeviceMemory stagingMemory;
+    uint8_t *data;
+    CreateStagingBuffer(BufferSize, &stagingBuffer, &stagingMemory, &data);
+    memcpy(data, Buffer, BufferSize);
+
+    CreateImage(Texture, Format, ImageUsageFlags);
+    RecordUpload(stagingBuffer, 0, Texture, DoGenerateMipmaps);
+    SubmitAndWait(stagingBuffer, stagingMemory);
+
+    CreateSamplerAndView(Texture, Format, Filter);
+}
+
+void textureLoader::CreateTextures(std::vector<textureUpload> &Uploads, threadPool &ThreadPool)
+{
+    //All the images go in one staging buffer
+    std::vector<VkDeviceSize> Offsets(Uploads.size());
+    VkDeviceSize StagingSize = 0;
+    for(size_t i=0; i<Uploads.size(); i++)
+    {
+        Offsets[i] = StagingSize;
+        StagingSize += (Uploads[i].BufferSize + 15) & ~(VkDeviceSize)15;
+    }
+    if(StagingSize == 0) return;
+
+    VkBuffer StagingBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory StagingMemory = VK_NULL_HANDLE;
+    uint8_t *StagingData = nullptr;
+    if(VulkanDevice != nullptr) CreateStagingBuffer(StagingSize, &StagingBuffer, &StagingMemory, &StagingData);
+
+    //The cpu copies with their mips, and the copies to the staging buffer, on all the cores
+    ThreadPool.ParallelFor((uint32_t)Uploads.size(), 1, [&](uint32_t Start, uint32_t End)
+    {
+        for(uint32_t i=Start; i<End; i++)
+        {
+            textureUpload &Upload = Uploads[i];
+            vulkanTexture *Texture = Upload.Texture;
+            Texture->Width = Upload.Width;
+            Texture->Height = Upload.Height;
+            if(Upload.Compressed)
+            {
+                //The cpu renderers see the same texels as the gpu
+                Texture->Data.resize((size_t)Upload.Width * Upload.Height * 4);
+                textureCompression::Decompress((const uint8_t*)Upload.Buffer, Upload.Width, Upload.Height, Upload.Compressed->Format, Texture->Data.data());
+                Texture->MipLevels = (uint32_t)Upload.Compressed->MipOffsets.size();
+            }
+            else
+            {
+                Texture->Data.assign((uint8_t*)Upload.Buffer, (uint8_t*)Upload.Buffer + (size_t)Upload.Width * Upload.Height * 4);
+                Texture->MipLevels = static_cast<uint32_t>(std::floor(std::log2(std::max(Upload.Width, Upload.Height)))) + 1;
+            }
+            Texture->BuildMips();
+            if(StagingData != nullptr) memcpy(StagingData + Offsets[i], Upload.Buffer, Upload.BufferSize);
+        }
+    });
+    if(VulkanDevice == nullptr) return;
+
+    //One submission for the copies and the mip generations of all the images.
+    //Block compressed images can't be blit targets, they come with their mips.
+    VkCommandBufferBeginInfo CommandBufferInfo = vulkanTools::BuildCommandBufferBeginInfo();
+    VK_CALL(vkBeginCommandBuffer(CommandBuffer, &CommandBufferInfo));
+    for(size_t i=0; i<Uploads.size(); i++)
+    {
+        VkImageUsageFlags Usage = Uploads[i].Compressed ? VK_IMAGE_USAGE_SAMPLED_BIT : VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        CreateImage(Uploads[i].Texture, Uploads[i].Format, Usage);
+        RecordUpload(StagingBuffer, Offsets[i], Uploads[i].Texture, true, Uploads[i].Compressed);
+    }
+    SubmitAndWait(StagingBuffer, StagingMemory);
+
+    for(size_t i=0; i<Uploads.size(); i++)
+    {
+        CreateSamplerAndView(Uploads[i].Texture, Uploads[i].Format, VK_FILTER_LINEAR);
+    }
+}
+
 void textureLoader::CreateEmptyTexture(uint32_t Width, uint32_t Height, VkFormat Format, vulkanTexture *Texture, VkImageUsageFlags ImageUsage)
 {
     VkFormatProperties FormatProperties;
@@ -1063,6 +1372,7 @@ void textureLoader::CreateEmptyTexture(uint32_t Width, uint32_t Height, VkFormat
 
 void textureLoader::DestroyTexture(vulkanTexture Texture)
 {
+    if(VulkanDevice == nullptr) return;
     vkDestroyImageView(VulkanDevice->Device, Texture.View, nullptr);
     vkDestroyImage(VulkanDevice->Device, Texture.Image, nullptr);
     vkDestroySampler(VulkanDevice->Device, Texture.Sampler, nullptr);
@@ -1071,6 +1381,7 @@ void textureLoader::DestroyTexture(vulkanTexture Texture)
 
 void textureLoader::Destroy()
 {
+    if(VulkanDevice == nullptr) return;
     vkFreeCommandBuffers(VulkanDevice->Device, CommandPool, 1, &CommandBuffer);
 }
 
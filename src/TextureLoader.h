@@ -21,6 +21,8 @@
 #include <gli/gli.hpp>
 #pragma warning ( default : 4458; default : 4996 )
 
+struct environmentMap;
+
 enum class borderType
 {
     Clamp,
@@ -28,6 +30,28 @@ enum class borderType
     Mirror
 };
 
+//Encoding of the colors of a texture. The cpu copy stays in 8 bits, Sample() decodes it to linear.
+enum class colorSpace
+{
+    Linear,
+    //Gamma encoded colors (base color maps), alpha stays linear
+    SRGB
+};
+//The shaders decode base color maps with c * pow(c, 2.2), so c^3.2
+#define TEXTURE_GAMMA 3.2f
+
+//Tiled cpu copies are stored in blocks of TEXTURE_BLOCK_SIZE x TEXTURE_BLOCK_SIZE texels, 64 bytes in rgba8 : one cache line
+#define TEXTURE_BLOCK_SIZE 4
+
+//Level of the cpu copy of a texture, Offset is in bytes in vulkanTexture::Data
+struct textureMip
+{
+    uint32_t Offset;
+    uint32_t Width, Height;
+    //Blocks in a row of the tiled layout
+    uint32_t BlocksX;
+};
+
 struct vulkanTexture
 {
     VkSampler Sampler;
@@ -41,13 +65,43 @@ struct vulkanTexture
     VkDescriptorImageInfo Descriptor;
     uint32_t Index;
 
+    //Cpu copy in rgba8 for the cpu renderers : the full resolution image, then its mips.
+    //In blocks when Tiled is set, so the texels of a bilinear footprint or of a diagonal walk share cache lines. Only read through Sample().
     std::vector<uint8_t> Data;
+    std::vector<textureMip> Mips;
+    bool Tiled=false;
+    colorSpace ColorSpace=colorSpace::Linear;
 
     void Destroy(vulkanDevice *Device);
 
-    glm::vec4 Sample(glm::vec2 UV, borderType BorderType = borderType::Clamp);
+    //Box filters the mip chain of the cpu copy from its first level, Data only holds that level in rows when it's called
+    void BuildMips(bool Tiled=true);
+    //Lays the cpu copy out again in blocks or in rows (texture benchmark)
+    void SetTiled(bool Tiled);
+    //Tags the cpu copy with the encoding of its colors, set by the importers. Rebuilds the mips so they're averaged in linear.
+    void SetColorSpace(colorSpace ColorSpace);
+    //Mip level of a ray cone footprint, from the lod of the cone in uv space (see pathTraceCPURenderer::GetConeLod())
+    float GetLod(float ConeLod) const;
+    //Trilinear lookup of the cpu copy in linear colors, Lod 0 is a bilinear lookup of the full resolution image
+    glm::vec4 Sample(glm::vec2 UV, float Lod = 0, borderType BorderType = borderType::Repeat);
 };
 
+struct threadPool;
+struct compressedImage;
+
+//Texture of a batch of textureLoader::CreateTextures(), Buffer is rgba8.
+//With Compressed set, Buffer and Format are its blocks and its block format, and its mips are uploaded as they are.
+struct textureUpload
+{
+    void *Buffer;
+    VkDeviceSize BufferSize;
+    VkFormat Format;
+    uint32_t Width, Height;
+    vulkanTexture *Texture;
+    const compressedImage *Compressed = nullptr;
+};
+
+//Without a VulkanDevice (headless renderer), textures only get their cpu copy in Data and no vulkan object
 class textureLoader
 {
 public:
@@ -64,11 +118,28 @@ public:
 
     void CreateTexture(void *Buffer, VkDeviceSize BufferSize, VkFormat Format, uint32_t Width, uint32_t Height, vulkanTexture *Texture, bool DoGenerateMipmaps=false, VkFilter Filter = VK_FILTER_LINEAR, VkImageUsageFlags ImageUsageFlags = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT);
 
+    //CreateTexture() with mipmaps for a batch of textures. The cpu copies are built on ThreadPool,
+    //and all the images go through one staging buffer and one submission, with their mips generated on the gpu unless they're compressed.
+    void CreateTextures(std::vector<textureUpload> &Uploads, threadPool &ThreadPool);
+
     void CreateEmptyTexture(uint32_t Width, uint32_t Height, VkFormat Format, vulkanTexture *Texture, VkImageUsageFlags ImageUsage = 0);
 
     void DestroyTexture(vulkanTexture Texture);
 
     void Destroy();
 
-    void LoadCubemap(std::string FileName, vulkanTexture *Output);
+    //Also builds the importance sampling distribution of the panorama in EnvironmentMap when it's set
+    void LoadCubemap(std::string FileName, vulkanTexture *Output, environmentMap *EnvironmentMap=nullptr);
+
+private:
+    //Device local image of the size, format and mip levels of Texture
+    void CreateImage(vulkanTexture *Texture, VkFormat Format, VkImageUsageFlags ImageUsageFlags);
+    //Records the copy of the image from the staging buffer into CommandBuffer, and the generation of its mips.
+    //Compressed images copy all their mips instead.
+    void RecordUpload(VkBuffer StagingBuffer, VkDeviceSize Offset, vulkanTexture *Texture, bool DoGenerateMipmaps, const compressedImage *Compressed = nullptr);
+    void CreateSamplerAndView(vulkanTexture *Texture, VkFormat Format, VkFilter Filter);
+    //Host visible buffer, left mapped in Data
+    void CreateStagingBuffer(VkDeviceSize Size, VkBuffer *StagingBuffer, VkDeviceMemory *StagingMemory, uint8_t **Data);
+    //Submits CommandBuffer, waits for it, and frees the staging buffer
+    void SubmitAndWait(VkBuffer StagingBuffer, VkDeviceMemory StagingMemory);
 };
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include "ThreadPool.h"
 
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
 
 
 ////////////////////////////////////////////////////////////////////////////////////////
@@ -88,5 +92,43 @@ bool threadPool::Busy()
     return Busy;
 }
 
+void threadPool::ParallelFor(uint32_t Count, uint32_t ChunkSize, const std::function<void(uint32_t Start, uint32_t End)> &Body)
+{
+    if(Count == 0) return;
+
+    //Shared with the helper jobs, which may only start after this returns. They then find no chunk left and exit.
+    struct parallelForState
+    {
+        std::atomic<uint32_t> NextChunk{0};
+        std::atomic<uint32_t> DoneChunks{0};
+        uint32_t ChunkCount;
+        uint32_t ChunkSize;
+        uint32_t Count;
+        const std::function<void(uint32_t Start, uint32_t End)> *Body;
+    };
+    std::shared_ptr<parallelForState> State = std::make_shared<parallelForState>();
+    State->ChunkSize = ChunkSize;
+    State->Count = Count;
+    State->ChunkCount = (Count + ChunkSize - 1) / ChunkSize;
+    State->Body = &Body;
+
+    auto Work = [State]()
+    {
+        while(true)
+        {
+            uint32_t Chunk = State->NextChunk.fetch_add(1);
+            if(Chunk >= State->ChunkCount) break;
+            uint32_t Start = Chunk * State->ChunkSize;
+            (*State->Body)(Start, std::min(Start + State->ChunkSize, State->Count));
+            State->DoneChunks++;
+        }
+    };
+
+    uint32_t Helpers = std::min((uint32_t)Threads.size(), State->ChunkCount - 1);
+    for(uint32_t i=0; i<Helpers; i++) EnqueueJob(Work);
+    Work();
+    while(State->DoneChunks.load() < State->ChunkCount) std::this_thread::yield();
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////
 
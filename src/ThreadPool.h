@@ -5,6 +5,7 @@
 #include <functional>
 #include <vector>
 #include <queue>
+#include <stdint.h>
 
 struct threadPool
 {
@@ -12,6 +13,9 @@ struct threadPool
     void EnqueueJob(const std::function<void()>& Job);
     void Stop();
     bool Busy();
+    //Calls Body on chunks of [0, Count) from the calling thread and from the idle threads of the pool, and returns once all the chunks are done.
+    //Can be called from a job of the pool.
+    void ParallelFor(uint32_t Count, uint32_t ChunkSize, const std::function<void(uint32_t Start, uint32_t End)> &Body);
 
     bool ShouldTerminate=false;
     std::mutex QueueMutex;
@@ -0,0 +1,119 @@
+#include "TileScheduler.h"
+#include "ThreadPool.h"
+
+#include <algorithm>
+
+void tileScheduler::Reset(uint32_t StartX, uint32_t StartY, uint32_t Width, uint32_t Height, uint32_t TileSize, float FocusX, float FocusY)
+{
+    Tiles.clear();
+    for(uint32_t y=StartY; y<StartY+Height; y+=TileSize)
+    {
+        for(uint32_t x=StartX; x<StartX+Width; x+=TileSize)
+        {
+            Tiles.push_back({x, y, std::min(TileSize, StartX + Width - x), std::min(TileSize, StartY + Height - y)});
+        }
+    }
+
+    auto DistanceToFocus = [FocusX, FocusY](const tile &Tile)
+    {
+        float dx = (float)Tile.StartX + (float)Tile.Width * 0.5f - FocusX;
+        float dy = (float)Tile.StartY + (float)Tile.Height * 0.5f - FocusY;
+        return dx * dx + dy * dy;
+    };
+    std::stable_sort(Tiles.begin(), Tiles.end(), [&DistanceToFocus](const tile &a, const tile &b)
+    {
+        return DistanceToFocus(a) < DistanceToFocus(b);
+    });
+
+    Progress.reset(new std::atomic<uint32_t>[Tiles.size()]);
+    Rendered.reset(new std::atomic<uint32_t>[Tiles.size()]);
+    Done.reset(new std::atomic<bool>[Tiles.size()]);
+    for(size_t i=0; i<Tiles.size(); i++)
+    {
+        Progress[i] = 0;
+        Rendered[i] = 0;
+        Done[i] = false;
+    }
+    DoneTiles = 0;
+    NextTicket = 0;
+    Passes = 0;
+}
+
+void tileScheduler::Start(threadPool &ThreadPool, uint32_t _Passes, const renderTileFunction &_RenderTile, uint32_t Workers)
+{
+    this->Passes = _Passes;
+    this->RenderTile = _RenderTile;
+    ShouldStop = false;
+
+    if(Workers == 0) Workers = (uint32_t)ThreadPool.Threads.size();
+    ActiveWorkers += Workers;
+    for(uint32_t i=0; i<Workers; i++)
+    {
+        ThreadPool.EnqueueJob([this]() { Work(); });
+    }
+}
+
+void tileScheduler::Stop()
+{
+    ShouldStop = true;
+}
+
+void tileScheduler::Work()
+{
+    uint64_t TileCount = Tiles.size();
+    uint64_t TicketCount = TileCount * Passes;
+
+    //Checked before claiming a ticket, so a stopped render never skips a tile
+    while(!ShouldStop.load(std::memory_order_relaxed))
+    {
+        uint64_t Ticket = NextTicket.fetch_add(1);
+        if(Ticket >= TicketCount) break;
+
+        uint32_t TileIndex = (uint32_t)(Ticket % TileCount);
+        uint32_t Pass = (uint32_t)(Ticket / TileCount);
+
+        //Only happens with fewer tiles than threads : the previous pass of that tile is still being rendered
+        while(Progress[TileIndex].load(std::memory_order_acquire) < Pass) std::this_thread::yield();
+
+        if(!Done[TileIndex])
+        {
+            if(!RenderTile(Tiles[TileIndex], Pass))
+            {
+                Done[TileIndex] = true;
+                DoneTiles++;
+            }
+            Rendered[TileIndex].fetch_add(1, std::memory_order_release);
+        }
+        Progress[TileIndex].store(Pass + 1, std::memory_order_release);
+    }
+    ActiveWorkers--;
+}
+
+bool tileScheduler::Running() const
+{
+    return ActiveWorkers > 0;
+}
+
+bool tileScheduler::Finished() const
+{
+    if(Tiles.empty() || Passes == 0) return false;
+    return DoneTiles == Tiles.size() || CompletedPasses() >= Passes;
+}
+
+uint32_t tileScheduler::CompletedPasses() const
+{
+    if(Tiles.empty()) return 0;
+    uint32_t Result = Progress[0];
+    for(size_t i=1; i<Tiles.size(); i++) Result = std::min(Result, Progress[i].load(std::memory_order_relaxed));
+    return Result;
+}
+
+uint32_t tileScheduler::TilePasses(uint32_t TileIndex) const
+{
+    return Progress[TileIndex].load(std::memory_order_acquire);
+}
+
+uint32_t tileScheduler::TileRenderedPasses(uint32_t TileIndex) const
+{
+    return Rendered[TileIndex].load(std::memory_order_acquire);
+}
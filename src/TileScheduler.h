@@ -0,0 +1,60 @@
+#pragma once
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+struct threadPool;
+
+struct tile
+{
+    uint32_t StartX, StartY;
+    uint32_t Width, Height;
+};
+
+//Progressive tile rendering : one long running job per thread, which all claim (pass, tile) pairs from a single atomic counter.
+//There is no barrier between the passes, a thread that is done with the last tiles of a pass starts on the first tiles of the next one.
+//Within a pass, tiles are rendered nearest to the focus point first.
+struct tileScheduler
+{
+    //Pass is the number of passes already rendered in that tile. Returns false when the tile needs no more passes,
+    //its next tickets are then skipped, so the threads spend their time on the tiles that are left.
+    using renderTileFunction = std::function<bool(const tile &Tile, uint32_t Pass)>;
+
+    //Splits the area in tiles sorted by distance to the focus point, and clears the progress
+    void Reset(uint32_t StartX, uint32_t StartY, uint32_t Width, uint32_t Height, uint32_t TileSize, float FocusX, float FocusY);
+    //Starts a worker per thread of the pool, or Workers of them, from where the last Stop() left off
+    void Start(threadPool &ThreadPool, uint32_t Passes, const renderTileFunction &RenderTile, uint32_t Workers=0);
+    //Workers exit once their current tile is done. Returns immediately.
+    void Stop();
+
+    bool Running() const;
+    //All the passes are rendered, or all the tiles are done
+    bool Finished() const;
+    //Passes rendered in all the tiles
+    uint32_t CompletedPasses() const;
+    //Passes rendered or skipped in that tile, can be read while rendering
+    uint32_t TilePasses(uint32_t TileIndex) const;
+    //Passes actually rendered in that tile : the passes skipped once it is done are not counted
+    uint32_t TileRenderedPasses(uint32_t TileIndex) const;
+
+    std::vector<tile> Tiles;
+
+private:
+    void Work();
+
+    renderTileFunction RenderTile;
+    uint32_t Passes=0;
+    //Ticket i is the tile i % Tiles.size() of the pass i / Tiles.size()
+    std::atomic<uint64_t> NextTicket{0};
+    std::atomic<uint32_t> ActiveWorkers{0};
+    std::atomic<bool> ShouldStop{false};
+    //Passes rendered or skipped in each tile
+    std::unique_ptr<std::atomic<uint32_t>[]> Progress;
+    //Passes rendered in each tile
+    std::unique_ptr<std::atomic<uint32_t>[]> Rendered;
+    std::unique_ptr<std::atomic<bool>[]> Done;
+    std::atomic<uint32_t> DoneTiles{0};
+};
@@ -0,0 +1,169 @@
+#include "TriangleIntersection.h"
+#include "bvh.h"
+
+#include <immintrin.h>
+#include <cmath>
+
+watertightRay::watertightRay(const ray &Ray)
+{
+    Origin = Ray.Origin;
+    glm::vec3 AbsDirection = glm::abs(Ray.Direction);
+    kz = AbsDirection.x > AbsDirection.y ? (AbsDirection.x > AbsDirection.z ? 0 : 2) : (AbsDirection.y > AbsDirection.z ? 1 : 2);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if(Ray.Direction[kz] < 0) std::swap(kx, ky);
+
+    Sx = Ray.Direction[kx] / Ray.Direction[kz];
+    Sy = Ray.Direction[ky] / Ray.Direction[kz];
+    Sz = 1.0f / Ray.Direction[kz];
+}
+
+void leafTriangles::Build(bvh *BVH)
+{
+    size_t Count = BVH->TriangleIndices.size();
+    for(int Vertex=0; Vertex<3; Vertex++)
+    {
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            Vertices[Vertex][Axis].assign(Count + 3, 0.0f);
+        }
+    }
+
+    std::vector<triangle> &Triangles = BVH->Mesh->Triangles;
+    for(size_t i=0; i<Count; i++)
+    {
+        triangle &Triangle = Triangles[BVH->TriangleIndices[i]];
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            Vertices[0][Axis][i] = Triangle.v0[Axis];
+            Vertices[1][Axis][i] = Triangle.v1[Axis];
+            Vertices[2][Axis][i] = Triangle.v2[Axis];
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+void RayTriangleIntersectionWatertight(const watertightRay &Ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex)
+{
+    glm::vec3 A = v0 - Ray.Origin;
+    glm::vec3 B = v1 - Ray.Origin;
+    glm::vec3 C = v2 - Ray.Origin;
+
+    float Ax = A[Ray.kx] - Ray.Sx * A[Ray.kz];
+    float Ay = A[Ray.ky] - Ray.Sy * A[Ray.kz];
+    float Bx = B[Ray.kx] - Ray.Sx * B[Ray.kz];
+    float By = B[Ray.ky] - Ray.Sy * B[Ray.kz];
+    float Cx = C[Ray.kx] - Ray.Sx * C[Ray.kz];
+    float Cy = C[Ray.ky] - Ray.Sy * C[Ray.kz];
+
+    //Scaled barycentrics, the edge functions of the sheared triangle at the ray
+    float U = Cx * By - Cy * Bx;
+    float V = Ax * Cy - Ay * Cx;
+    float W = Bx * Ay - By * Ax;
+
+    //Exactly on an edge, or lost in rounding : the sign is decided in double precision
+    if(U == 0.0f || V == 0.0f || W == 0.0f)
+    {
+        U = (float)((double)Cx * (double)By - (double)Cy * (double)Bx);
+        V = (float)((double)Ax * (double)Cy - (double)Ay * (double)Cx);
+        W = (float)((double)Bx * (double)Ay - (double)By * (double)Ax);
+    }
+
+    if((U < 0 || V < 0 || W < 0) && (U > 0 || V > 0 || W > 0)) return;
+
+    float Det = U + V + W;
+    if(Det == 0.0f) return;
+
+    float Az = Ray.Sz * A[Ray.kz];
+    float Bz = Ray.Sz * B[Ray.kz];
+    float Cz = Ray.Sz * C[Ray.kz];
+    float InverseDet = 1.0f / Det;
+    float t = (U * Az + V * Bz + W * Cz) * InverseDet;
+    if(t > RAY_MIN_DISTANCE && t < RayPayload.Distance)
+    {
+        //Same convention as RayTriangleInteresection() : U weights v1, V weights v2
+        RayPayload.U = V * InverseDet;
+        RayPayload.V = W * InverseDet;
+        RayPayload.InstanceIndex = InstanceIndex;
+        RayPayload.Distance = t;
+        RayPayload.PrimitiveIndex = PrimitiveIndex;
+    }
+}
+
+void RayTriangle4IntersectionWatertight(const watertightRay &Ray, const leafTriangles &Triangles, const uint32_t *TriangleIndices, uint32_t First, uint32_t Count, rayPayload &RayPayload, uint32_t InstanceIndex)
+{
+    const int Axes[3] = {Ray.kx, Ray.ky, Ray.kz};
+    __m128 Origin[3] = {_mm_set1_ps(Ray.Origin[Ray.kx]), _mm_set1_ps(Ray.Origin[Ray.ky]), _mm_set1_ps(Ray.Origin[Ray.kz])};
+    __m128 Sx = _mm_set1_ps(Ray.Sx), Sy = _mm_set1_ps(Ray.Sy), Sz = _mm_set1_ps(Ray.Sz);
+    __m128 Zero = _mm_setzero_ps();
+    __m128i LaneIndices = _mm_setr_epi32(0, 1, 2, 3);
+
+    for(uint32_t Base=0; Base<Count; Base+=4)
+    {
+        //Sheared vertices : X, Y and Z of v0, v1 and v2 for 4 triangles
+        __m128 X[3], Y[3], Z[3];
+        for(int Vertex=0; Vertex<3; Vertex++)
+        {
+            __m128 Px = _mm_sub_ps(_mm_loadu_ps(&Triangles.Vertices[Vertex][Axes[0]][First + Base]), Origin[0]);
+            __m128 Py = _mm_sub_ps(_mm_loadu_ps(&Triangles.Vertices[Vertex][Axes[1]][First + Base]), Origin[1]);
+            __m128 Pz = _mm_sub_ps(_mm_loadu_ps(&Triangles.Vertices[Vertex][Axes[2]][First + Base]), Origin[2]);
+            X[Vertex] = _mm_sub_ps(Px, _mm_mul_ps(Sx, Pz));
+            Y[Vertex] = _mm_sub_ps(Py, _mm_mul_ps(Sy, Pz));
+            Z[Vertex] = _mm_mul_ps(Sz, Pz);
+        }
+
+        __m128 U = _mm_sub_ps(_mm_mul_ps(X[2], Y[1]), _mm_mul_ps(Y[2], X[1]));
+        __m128 V = _mm_sub_ps(_mm_mul_ps(X[0], Y[2]), _mm_mul_ps(Y[0], X[2]));
+        __m128 W = _mm_sub_ps(_mm_mul_ps(X[1], Y[0]), _mm_mul_ps(Y[1], X[0]));
+
+        //Lanes past the end of the leaf belong to other leaves, or to the padding
+        __m128 Valid = _mm_castsi128_ps(_mm_cmplt_epi32(LaneIndices, _mm_set1_epi32((int)(Count - Base))));
+
+        //Lanes with a zero edge function go through the scalar test and its double precision fallback
+        __m128 OnEdge = _mm_and_ps(Valid, _mm_or_ps(_mm_cmpeq_ps(U, Zero), _mm_or_ps(_mm_cmpeq_ps(V, Zero), _mm_cmpeq_ps(W, Zero))));
+        int OnEdgeMask = _mm_movemask_ps(OnEdge);
+        Valid = _mm_andnot_ps(OnEdge, Valid);
+
+        __m128 AnyNegative = _mm_or_ps(_mm_cmplt_ps(U, Zero), _mm_or_ps(_mm_cmplt_ps(V, Zero), _mm_cmplt_ps(W, Zero)));
+        __m128 AnyPositive = _mm_or_ps(_mm_cmpgt_ps(U, Zero), _mm_or_ps(_mm_cmpgt_ps(V, Zero), _mm_cmpgt_ps(W, Zero)));
+        Valid = _mm_andnot_ps(_mm_and_ps(AnyNegative, AnyPositive), Valid);
+
+        __m128 Det = _mm_add_ps(U, _mm_add_ps(V, W));
+        Valid = _mm_and_ps(Valid, _mm_cmpneq_ps(Det, Zero));
+
+        __m128 InverseDet = _mm_div_ps(_mm_set1_ps(1.0f), Det);
+        __m128 T = _mm_add_ps(_mm_mul_ps(U, Z[0]), _mm_add_ps(_mm_mul_ps(V, Z[1]), _mm_mul_ps(W, Z[2])));
+        T = _mm_mul_ps(T, InverseDet);
+        Valid = _mm_and_ps(Valid, _mm_cmpgt_ps(T, _mm_set1_ps(RAY_MIN_DISTANCE)));
+        Valid = _mm_and_ps(Valid, _mm_cmplt_ps(T, _mm_set1_ps(RayPayload.Distance)));
+
+        int HitMask = _mm_movemask_ps(Valid);
+        if(HitMask)
+        {
+            alignas(16) float Distances[4], Us[4], Vs[4];
+            _mm_store_ps(Distances, T);
+            _mm_store_ps(Us, _mm_mul_ps(V, InverseDet));
+            _mm_store_ps(Vs, _mm_mul_ps(W, InverseDet));
+            for(uint32_t Lane=0; Lane<4; Lane++)
+            {
+                if(!(HitMask & (1 << Lane)) || Distances[Lane] >= RayPayload.Distance) continue;
+                RayPayload.U = Us[Lane];
+                RayPayload.V = Vs[Lane];
+                RayPayload.InstanceIndex = InstanceIndex;
+                RayPayload.Distance = Distances[Lane];
+                RayPayload.PrimitiveIndex = TriangleIndices[First + Base + Lane];
+            }
+        }
+
+        for(uint32_t Lane=0; OnEdgeMask && Lane<4; Lane++)
+        {
+            if(!(OnEdgeMask & (1 << Lane))) continue;
+            uint32_t Index = First + Base + Lane;
+            glm::vec3 v0(Triangles.Vertices[0][0][Index], Triangles.Vertices[0][1][Index], Triangles.Vertices[0][2][Index]);
+            glm::vec3 v1(Triangles.Vertices[1][0][Index], Triangles.Vertices[1][1][Index], Triangles.Vertices[1][2][Index]);
+            glm::vec3 v2(Triangles.Vertices[2][0][Index], Triangles.Vertices[2][1][Index], Triangles.Vertices[2][2][Index]);
+            RayTriangleIntersectionWatertight(Ray, v0, v1, v2, RayPayload, InstanceIndex, TriangleIndices[Index]);
+        }
+    }
+}
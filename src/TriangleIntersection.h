@@ -0,0 +1,55 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+
+#include <vector>
+#include <stdint.h>
+#include <float.h>
+
+struct ray;
+struct rayPayload;
+struct bvh;
+
+//Hits closer than that are ignored, so rays starting on a surface don't hit it again
+#define RAY_MIN_DISTANCE 0.0001f
+//The far distance of the ray/box tests is scaled by 1 + 2 * gamma(3) (Ize 2013), so rounding never culls a box
+//that the ray only touches, like at a vertex shared by several leaves. Without it the watertight test is useless.
+//gamma(n) = n * u / (1 - n * u), with u = FLT_EPSILON / 2 the unit roundoff. About 1.00000036f.
+#define RAY_GAMMA(n) ((n) * (FLT_EPSILON * 0.5f) / (1.0f - (n) * (FLT_EPSILON * 0.5f)))
+#define RAY_AABB_FAR_SCALE (1.0f + 2.0f * RAY_GAMMA(3.0f))
+
+//Triangle test used in the bvh leaves, see bvh::IntersectLeaf()
+enum class triangleKernel
+{
+    //Moller-Trumbore with epsilons : rays hitting a shared edge can go through both triangles
+    MollerTrumbore=0,
+    //Woop et al. 2013 : a ray hitting a shared edge or vertex always hits at least one of the triangles
+    Watertight=1,
+    //Same as Watertight, testing 4 leaf triangles at once from leafTriangles
+    Watertight4=2
+};
+
+//Per ray setup of the watertight test : the ray is sheared and permuted so it goes along +Z from the origin.
+//kz is the axis where the direction is largest, kx and ky are swapped when it is negative to keep the winding.
+struct watertightRay
+{
+    watertightRay(const ray &Ray);
+
+    glm::vec3 Origin;
+    int kx, ky, kz;
+    float Sx, Sy, Sz;
+};
+
+//SoA copy of the triangle vertices in bvh::TriangleIndices order, so the triangles of a leaf are contiguous.
+//Padded with 3 degenerate triangles, so the last leaf can always load 4 lanes.
+struct leafTriangles
+{
+    void Build(bvh *BVH);
+
+    //[vertex][axis][index in bvh::TriangleIndices]
+    std::vector<float> Vertices[3][3];
+};
+
+void RayTriangleIntersectionWatertight(const watertightRay &Ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex);
+//Tests the Count triangles of Triangles starting at First, 4 at a time
+void RayTriangle4IntersectionWatertight(const watertightRay &Ray, const leafTriangles &Triangles, const uint32_t *TriangleIndices, uint32_t First, uint32_t Count, rayPayload &RayPayload, uint32_t InstanceIndex);
@@ -0,0 +1,284 @@
+#include "WideBVH.h"
+#include "bvh.h"
+
+#include <immintrin.h>
+
+#define WIDE_STACK_SIZE 256
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+struct wideRay
+{
+    float Origin[3];
+    float InverseDirection[3];
+    //Which of the min (0) or max (1) planes is entered first on each axis
+    uint32_t Near[3];
+};
+
+//Slab test of 4 boxes. Returns the mask of the boxes hit before MaxDistance, and writes their entry distance.
+static inline uint32_t SlabTest4(const float *NearX, const float *NearY, const float *NearZ, const float *FarX, const float *FarY, const float *FarZ,
+                                 const wideRay &Ray, float MaxDistance, float *Distances)
+{
+    __m128 OriginX = _mm_set1_ps(Ray.Origin[0]), InverseDirectionX = _mm_set1_ps(Ray.InverseDirection[0]);
+    __m128 OriginY = _mm_set1_ps(Ray.Origin[1]), InverseDirectionY = _mm_set1_ps(Ray.InverseDirection[1]);
+    __m128 OriginZ = _mm_set1_ps(Ray.Origin[2]), InverseDirectionZ = _mm_set1_ps(Ray.InverseDirection[2]);
+
+    __m128 TNear = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(NearX), OriginX), InverseDirectionX),
+                   _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(NearY), OriginY), InverseDirectionY),
+                              _mm_mul_ps(_mm_sub_ps(_mm_load_ps(NearZ), OriginZ), InverseDirectionZ)));
+    __m128 TFar = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(FarX), OriginX), InverseDirectionX),
+                  _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_load_ps(FarY), OriginY), InverseDirectionY),
+                             _mm_mul_ps(_mm_sub_ps(_mm_load_ps(FarZ), OriginZ), InverseDirectionZ)));
+
+    TFar = _mm_mul_ps(TFar, _mm_set1_ps(RAY_AABB_FAR_SCALE));
+    __m128 Hit = _mm_and_ps(_mm_cmpge_ps(TFar, TNear),
+                 _mm_and_ps(_mm_cmplt_ps(TNear, _mm_set1_ps(MaxDistance)), _mm_cmpgt_ps(TFar, _mm_setzero_ps())));
+    _mm_storeu_ps(Distances, TNear);
+    return (uint32_t)_mm_movemask_ps(Hit);
+}
+
+#ifdef __AVX__
+static inline uint32_t SlabTest8(const float *NearX, const float *NearY, const float *NearZ, const float *FarX, const float *FarY, const float *FarZ,
+                                 const wideRay &Ray, float MaxDistance, float *Distances)
+{
+    __m256 OriginX = _mm256_set1_ps(Ray.Origin[0]), InverseDirectionX = _mm256_set1_ps(Ray.InverseDirection[0]);
+    __m256 OriginY = _mm256_set1_ps(Ray.Origin[1]), InverseDirectionY = _mm256_set1_ps(Ray.InverseDirection[1]);
+    __m256 OriginZ = _mm256_set1_ps(Ray.Origin[2]), InverseDirectionZ = _mm256_set1_ps(Ray.InverseDirection[2]);
+
+    __m256 TNear = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(NearX), OriginX), InverseDirectionX),
+                   _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(NearY), OriginY), InverseDirectionY),
+                                 _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(NearZ), OriginZ), InverseDirectionZ)));
+    __m256 TFar = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(FarX), OriginX), InverseDirectionX),
+                  _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(FarY), OriginY), InverseDirectionY),
+                                _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(FarZ), OriginZ), InverseDirectionZ)));
+
+    TFar = _mm256_mul_ps(TFar, _mm256_set1_ps(RAY_AABB_FAR_SCALE));
+    __m256 Hit = _mm256_and_ps(_mm256_cmp_ps(TFar, TNear, _CMP_GE_OQ),
+                 _mm256_and_ps(_mm256_cmp_ps(TNear, _mm256_set1_ps(MaxDistance), _CMP_LT_OQ), _mm256_cmp_ps(TFar, _mm256_setzero_ps(), _CMP_GT_OQ)));
+    _mm256_storeu_ps(Distances, TNear);
+    return (uint32_t)_mm256_movemask_ps(Hit);
+}
+#endif
+
+//Near and far planes are picked from the ray direction sign, so empty slots (min=1e30, max=-1e30) are never hit.
+static inline uint32_t IntersectChildren(const wideBvhNode<4> &Node, const wideRay &Ray, float MaxDistance, float *Distances)
+{
+    return SlabTest4(Node.Bounds[Ray.Near[0]][0], Node.Bounds[Ray.Near[1]][1], Node.Bounds[Ray.Near[2]][2],
+                     Node.Bounds[1-Ray.Near[0]][0], Node.Bounds[1-Ray.Near[1]][1], Node.Bounds[1-Ray.Near[2]][2],
+                     Ray, MaxDistance, Distances);
+}
+
+static inline uint32_t IntersectChildren(const wideBvhNode<8> &Node, const wideRay &Ray, float MaxDistance, float *Distances)
+{
+#ifdef __AVX__
+    return SlabTest8(Node.Bounds[Ray.Near[0]][0], Node.Bounds[Ray.Near[1]][1], Node.Bounds[Ray.Near[2]][2],
+                     Node.Bounds[1-Ray.Near[0]][0], Node.Bounds[1-Ray.Near[1]][1], Node.Bounds[1-Ray.Near[2]][2],
+                     Ray, MaxDistance, Distances);
+#else
+    //No AVX : two SSE tests
+    uint32_t Mask = 0;
+    for(uint32_t Half=0; Half<2; Half++)
+    {
+        uint32_t Offset = Half * 4;
+        Mask |= SlabTest4(Node.Bounds[Ray.Near[0]][0] + Offset, Node.Bounds[Ray.Near[1]][1] + Offset, Node.Bounds[Ray.Near[2]][2] + Offset,
+                          Node.Bounds[1-Ray.Near[0]][0] + Offset, Node.Bounds[1-Ray.Near[1]][1] + Offset, Node.Bounds[1-Ray.Near[2]][2] + Offset,
+                          Ray, MaxDistance, Distances + Offset) << Offset;
+    }
+    return Mask;
+#endif
+}
+
+static float NodeArea(bvhNode &Node)
+{
+    glm::vec3 e = Node.AABBMax - Node.AABBMin;
+    return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////
+
+template<uint32_t Width>
+void wideBvh<Width>::Build(bvh *_BVH)
+{
+    this->BVH = _BVH;
+    Nodes.clear();
+    Nodes.reserve(BVH->NodesUsed / 2 + 1);
+    Nodes.emplace_back();
+    Collapse(0, BVH->RootNodeIndex);
+}
+
+template<uint32_t Width>
+void wideBvh<Width>::Collapse(uint32_t NodeIndex, uint32_t BinaryNodeIndex)
+{
+    std::vector<bvhNode> &BinaryNodes = BVH->BVHNodes;
+
+    //Start from the 2 children, and keep opening the interior child with the largest area until all the slots are used
+    uint32_t Children[Width];
+    uint32_t ChildCount=0;
+    if(BinaryNodes[BinaryNodeIndex].IsLeaf())
+    {
+        Children[ChildCount++] = BinaryNodeIndex;
+    }
+    else
+    {
+        Children[ChildCount++] = BinaryNodes[BinaryNodeIndex].LeftChildOrFirst;
+        Children[ChildCount++] = BinaryNodes[BinaryNodeIndex].LeftChildOrFirst + 1;
+        while(ChildCount < Width)
+        {
+            int BestChild=-1;
+            float BestArea=-1;
+            for(uint32_t i=0; i<ChildCount; i++)
+            {
+                bvhNode &Child = BinaryNodes[Children[i]];
+                if(!Child.IsLeaf() && NodeArea(Child) > BestArea)
+                {
+                    BestArea = NodeArea(Child);
+                    BestChild = i;
+                }
+            }
+            if(BestChild < 0) break;
+
+            uint32_t Left = BinaryNodes[Children[BestChild]].LeftChildOrFirst;
+            Children[BestChild] = Left;
+            Children[ChildCount++] = Left + 1;
+        }
+    }
+
+    wideBvhNode<Width> Node;
+    for(uint32_t i=0; i<Width; i++)
+    {
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            Node.Bounds[0][Axis][i] = 1e30f;
+            Node.Bounds[1][Axis][i] = -1e30f;
+        }
+        Node.Child[i] = 0;
+        Node.TriangleCount[i] = 0;
+    }
+
+    uint32_t InteriorChildren[Width];
+    uint32_t InteriorCount=0;
+    for(uint32_t i=0; i<ChildCount; i++)
+    {
+        bvhNode &Child = BinaryNodes[Children[i]];
+        for(int Axis=0; Axis<3; Axis++)
+        {
+            Node.Bounds[0][Axis][i] = Child.AABBMin[Axis];
+            Node.Bounds[1][Axis][i] = Child.AABBMax[Axis];
+        }
+        if(Child.IsLeaf())
+        {
+            Node.Child[i] = Child.LeftChildOrFirst;
+            Node.TriangleCount[i] = Child.TriangleCount;
+        }
+        else
+        {
+            Node.Child[i] = (uint32_t)Nodes.size();
+            Nodes.emplace_back();
+            InteriorChildren[InteriorCount++] = i;
+        }
+    }
+    Nodes[NodeIndex] = Node;
+
+    for(uint32_t i=0; i<InteriorCount; i++)
+    {
+        uint32_t Slot = InteriorChildren[i];
+        Collapse(Node.Child[Slot], Children[Slot]);
+    }
+}
+
+static wideRay BuildWideRay(const ray &Ray)
+{
+    wideRay WideRay;
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        WideRay.Origin[Axis] = Ray.Origin[Axis];
+        //0 * inf is NaN in the slab test when the ray starts on a box plane, and the SSE min/max don't skip NaNs like std::min/max
+        WideRay.InverseDirection[Axis] = glm::clamp(Ray.InverseDirection[Axis], -1e30f, 1e30f);
+        WideRay.Near[Axis] = Ray.InverseDirection[Axis] < 0 ? 1 : 0;
+    }
+    return WideRay;
+}
+
+template<uint32_t Width>
+void wideBvh<Width>::Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex)
+{
+    watertightRay WatertightRay(Ray);
+    wideRay WideRay = BuildWideRay(Ray);
+
+    struct stackEntry
+    {
+        uint32_t Child;
+        uint32_t TriangleCount;
+        float Distance;
+    };
+    stackEntry Stack[WIDE_STACK_SIZE];
+    uint32_t StackPointer=0;
+    Stack[StackPointer++] = {0, 0, 0};
+
+    while(StackPointer > 0)
+    {
+        stackEntry Entry = Stack[--StackPointer];
+
+        //A closer hit was found since this entry was pushed
+        if(Entry.Distance >= RayPayload.Distance) continue;
+
+        if(Entry.TriangleCount > 0)
+        {
+            BVH->IntersectLeaf(Ray, WatertightRay, Entry.Child, Entry.TriangleCount, RayPayload, InstanceIndex);
+            continue;
+        }
+
+        const wideBvhNode<Width> &Node = Nodes[Entry.Child];
+        float Distances[Width];
+        uint32_t HitMask = IntersectChildren(Node, WideRay, RayPayload.Distance, Distances);
+
+        //Insert the hit children sorted far to near, so the nearest one is popped first
+        uint32_t Base = StackPointer;
+        for(uint32_t i=0; i<Width; i++)
+        {
+            if(!(HitMask & (1u << i))) continue;
+
+            stackEntry NewEntry = {Node.Child[i], Node.TriangleCount[i], Distances[i]};
+            uint32_t j = StackPointer++;
+            while(j > Base && Stack[j-1].Distance < NewEntry.Distance)
+            {
+                Stack[j] = Stack[j-1];
+                j--;
+            }
+            Stack[j] = NewEntry;
+        }
+    }
+}
+
+template<uint32_t Width>
+bool wideBvh<Width>::Occluded(ray Ray, float MaxDistance)
+{
+    watertightRay WatertightRay(Ray);
+    wideRay WideRay = BuildWideRay(Ray);
+
+    uint32_t Stack[WIDE_STACK_SIZE];
+    uint32_t StackPointer=0;
+    Stack[StackPointer++] = 0;
+
+    while(StackPointer > 0)
+    {
+        const wideBvhNode<Width> &Node = Nodes[Stack[--StackPointer]];
+        float Distances[Width];
+        uint32_t HitMask = IntersectChildren(Node, WideRay, MaxDistance, Distances);
+
+        for(uint32_t i=0; i<Width; i++)
+        {
+            if(!(HitMask & (1u << i))) continue;
+
+            if(Node.TriangleCount[i] > 0)
+            {
+                if(BVH->OccludedLeaf(Ray, WatertightRay, Node.Child[i], Node.TriangleCount[i], MaxDistance)) return true;
+            }
+            else Stack[StackPointer++] = Node.Child[i];
+        }
+    }
+    return false;
+}
+
+template struct wideBvh<4>;
+template struct wideBvh<8>;
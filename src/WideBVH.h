@@ -0,0 +1,39 @@
+#pragma once
+
+#include <glm/vec3.hpp>
+
+#include <vector>
+#include <stdint.h>
+
+struct ray;
+struct rayPayload;
+struct bvh;
+
+//Collapsed bvh node with up to Width children.
+//Child bounds are stored as SoA so a single SSE/AVX slab test covers all the children.
+template<uint32_t Width>
+struct alignas(32) wideBvhNode
+{
+    //[0] is min, [1] is max, then axis, then child
+    float Bounds[2][3][Width];
+
+    //Interior child : index of the child node. Leaf child : first index in bvh::TriangleIndices.
+    uint32_t Child[Width];
+    //0 for interior children and empty slots
+    uint32_t TriangleCount[Width];
+};
+
+//BVH4 / BVH8 built by collapsing an existing binary bvh. Leaves reference the same triangle ranges.
+template<uint32_t Width>
+struct wideBvh
+{
+    void Build(bvh *BVH);
+    void Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex);
+    //Any hit : the hit children are pushed unsorted, and leaves are tested as soon as they are found
+    bool Occluded(ray Ray, float MaxDistance);
+
+    void Collapse(uint32_t NodeIndex, uint32_t BinaryNodeIndex);
+
+    bvh *BVH=nullptr;
+    std::vector<wideBvhNode<Width>> Nodes;
+};
@@ -1,11 +1,22 @@
 #include "bvh.h"
+#include "BVHCache.h"
 
-#define BINS 8
+#include <thread>
+#include <array>
+#include <algorithm>
+#include <cmath>
+
+#define TLAS_BINS 16
+
+//Meshes with more triangles than that are built in parallel, and nodes with more triangles are binned in parallel.
+#define PARALLEL_BUILD_THRESHOLD 16384
+#define PARALLEL_BINNING_THRESHOLD 131072
+#define PARALLEL_CHUNK_SIZE 32768
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
 
-bool bvhNode::IsLeaf()
+bool bvhNode::IsLeaf() const
 {
     return TriangleCount > 0;
 }
@@ -35,7 +46,39 @@ void aabb::Grow(aabb &AABB)
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
-mesh::mesh(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices, uint32_t MaterialIndex) : MaterialIndex(MaterialIndex)
+mesh::mesh(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices, uint32_t MaterialIndex, bool UseCache) : MaterialIndex(MaterialIndex)
+{
+    SetTriangles(Indices, Vertices);
+    IndicesHash = bvhCache::HashIndices(Indices);
+    BVH = new bvh(this, UseCache);
+}
+
+bool mesh::UpdateVertices(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices)
+{
+    SetTriangles(Indices, Vertices);
+    return BVH->Update();
+}
+
+void mesh::ReleaseTriangles()
+{
+    if(BVH->Layout != bvhLayout::Compressed) return;
+    Triangles.clear();
+    Triangles.shrink_to_fit();
+}
+
+void mesh::GetTriangle(uint32_t Index, glm::vec3 &v0, glm::vec3 &v1, glm::vec3 &v2) const
+{
+    if(Triangles.empty())
+    {
+        const compactTriangle &Triangle = BVH->Compressed.Triangles[Index];
+        v0 = Triangle.v0; v1 = Triangle.v1; v2 = Triangle.v2;
+        return;
+    }
+    const triangle &Triangle = Triangles[Index];
+    v0 = Triangle.v0; v1 = Triangle.v1; v2 = Triangle.v2;
+}
+
+void mesh::SetTriangles(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices)
 {
     uint32_t AddedTriangles=0;
 
@@ -69,34 +112,110 @@ mesh::mesh(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices, uint32
 
         AddedTriangles++;
     }
-
-    BVH = new bvh(this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
-bvh::bvh(mesh *_Mesh)
+bvh::bvh(mesh *_Mesh, bool UseCache)
 {
     this->Mesh = _Mesh;
-    Build();
+    if(UseCache) LoadOrBuild();
+    else Build();
 }
 
-void bvh::Build()
+void bvh::LoadOrBuild()
 {
-    BVHNodes.resize(Mesh->Triangles.size() * 2 - 1);
-    TriangleIndices.resize(Mesh->Triangles.size());
+    //Skip the build if this mesh was already built with the same settings
+    uint64_t Hash = bvhCache::Hash(this);
+    if(!bvhCache::Load(this, Hash))
+    {
+        Build();
+        bvhCache::Save(this, Hash);
+    }
+}
 
-    for(size_t i=0; i<Mesh->Triangles.size(); i++)
+//Runs Function(Chunk, Begin, End) over [0, Count) split in ChunkCount chunks, one thread per chunk.
+template<typename function>
+static void ParallelChunks(uint32_t Count, uint32_t ChunkCount, function Function)
+{
+    uint32_t ChunkSize = (Count + ChunkCount - 1) / ChunkCount;
+    std::vector<std::thread> Threads;
+    for(uint32_t i=1; i<ChunkCount; i++)
     {
-        Mesh->Triangles[i].Centroid = (Mesh->Triangles[i].v0 + Mesh->Triangles[i].v1 + Mesh->Triangles[i].v2) * 0.33333f;
-        TriangleIndices[i] = (uint32_t)i;
+        uint32_t Begin = std::min(Count, i * ChunkSize);
+        uint32_t End = std::min(Count, (i+1) * ChunkSize);
+        Threads.emplace_back(Function, i, Begin, End);
     }
+    Function(0, 0, std::min(Count, ChunkSize));
+    for(size_t i=0; i<Threads.size(); i++)
+    {
+        Threads[i].join();
+    }
+}
+
+static uint32_t NumThreads()
+{
+    static uint32_t Count = std::max(1u, std::thread::hardware_concurrency());
+    return Count;
+}
+
+static uint32_t ChunkCount(uint32_t Count, uint32_t MinChunkSize)
+{
+    return std::max(1u, std::min(NumThreads(), Count / MinChunkSize));
+}
+
+//Subtrees are only forked down to this depth, so we get a few tasks per core.
+static uint32_t MaxParallelDepth()
+{
+    static uint32_t MaxDepth = []()
+    {
+        if(NumThreads()==1) return 0u;
+        uint32_t Depth=0;
+        while((1u << Depth) < NumThreads()) Depth++;
+        return Depth + 2;
+    }();
+    return MaxDepth;
+}
+
+void bvh::Build()
+{
+    if(BuildMode == bvhBuildMode::Spatial) BuildSpatial();
+    else BuildBinned();
+    BuildSAHCost = CalculateSAHCost();
+}
+
+void bvh::BuildBinned()
+{
+    uint32_t TriangleCount = (uint32_t)Mesh->Triangles.size();
+    BVHNodes.resize(TriangleCount * 2 - 1);
+    TriangleIndices.resize(TriangleCount);
+    NodesUsed=1;
+
+    ParallelChunks(TriangleCount, ChunkCount(TriangleCount, PARALLEL_CHUNK_SIZE), [this](uint32_t Chunk, uint32_t Begin, uint32_t End)
+    {
+        for(uint32_t i=Begin; i<End; i++)
+        {
+            Mesh->Triangles[i].Centroid = (Mesh->Triangles[i].v0 + Mesh->Triangles[i].v1 + Mesh->Triangles[i].v2) * 0.33333f;
+            TriangleIndices[i] = i;
+        }
+    });
 
     bvhNode &Root = BVHNodes[RootNodeIndex];
     Root.LeftChildOrFirst = 0;
-    Root.TriangleCount = (uint32_t)Mesh->Triangles.size();
+    Root.TriangleCount = TriangleCount;
     UpdateNodeBounds(RootNodeIndex);
-    Subdivide(RootNodeIndex);
+
+    if(TriangleCount < PARALLEL_BUILD_THRESHOLD)
+    {
+        Subdivide(RootNodeIndex);
+    }
+    else
+    {
+        std::vector<bvhNode> Nodes(1, Root);
+        Nodes.reserve(BVHNodes.size());
+        BuildSubtree(Nodes, 0, 0);
+        EmitSubtree(Nodes, 0, RootNodeIndex);
+    }
 }
 
 
@@ -127,33 +246,80 @@ float bvh::EvaluateSAH(bvhNode &Node, int Axis, float Position)
 }
 
 
-float bvh::FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition)
+float bvh::FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition, bool Parallel)
 {
-    float BestCost = 1e30f;
-    for(int CurrentAxis=0; CurrentAxis<3; CurrentAxis++)
+    auto GrowCentroidBounds = [this, &Node](aabb &Bounds, uint32_t Begin, uint32_t End)
     {
-        float BoundsMin = 1e30f;
-        float BoundsMax = -1e30f;
-        for(uint32_t i=0; i<Node.TriangleCount; i++)
+        for(uint32_t i=Begin; i<End; i++)
         {
-            triangle &Triangle = Mesh->Triangles[TriangleIndices[Node.LeftChildOrFirst + i]];
-            BoundsMin = std::min(BoundsMin, Triangle.Centroid[CurrentAxis]);
-            BoundsMax = std::max(BoundsMax, Triangle.Centroid[CurrentAxis]);
+            Bounds.Grow(Mesh->Triangles[TriangleIndices[Node.LeftChildOrFirst + i]].Centroid);
         }
-        if(BoundsMin == BoundsMax) continue;
-        
-        
-        bin Bins[BINS];
-        float Scale = BINS / (BoundsMax - BoundsMin);
-        for(uint32_t i=0; i<Node.TriangleCount; i++)
+    };
+
+    //Bins the triangles on the 3 axis at once
+    auto BinTriangles = [this, &Node](aabb &CentroidBounds, bin *AllBins, uint32_t Begin, uint32_t End)
+    {
+        for(int CurrentAxis=0; CurrentAxis<3; CurrentAxis++)
         {
-            triangle &Triangle = Mesh->Triangles[TriangleIndices[Node.LeftChildOrFirst + i]];
-            int BinIndex = std::min(BINS - 1, (int)((Triangle.Centroid[CurrentAxis] - BoundsMin) * Scale));
-            Bins[BinIndex].TrianglesCount++;
-            Bins[BinIndex].Bounds.Grow(Triangle.v0);
-            Bins[BinIndex].Bounds.Grow(Triangle.v1);
-            Bins[BinIndex].Bounds.Grow(Triangle.v2);
+            float BoundsMin = CentroidBounds.Min[CurrentAxis];
+            float BoundsMax = CentroidBounds.Max[CurrentAxis];
+            if(BoundsMin == BoundsMax) continue;
+            
+            bin *Bins = &AllBins[CurrentAxis * BINS];
+            float Scale = BINS / (BoundsMax - BoundsMin);
+            for(uint32_t i=Begin; i<End; i++)
+            {
+                triangle &Triangle = Mesh->Triangles[TriangleIndices[Node.LeftChildOrFirst + i]];
+                int BinIndex = std::min(BINS - 1, (int)((Triangle.Centroid[CurrentAxis] - BoundsMin) * Scale));
+                Bins[BinIndex].TrianglesCount++;
+                Bins[BinIndex].Bounds.Grow(Triangle.v0);
+                Bins[BinIndex].Bounds.Grow(Triangle.v1);
+                Bins[BinIndex].Bounds.Grow(Triangle.v2);
+            }
+        }
+    };
+
+    aabb CentroidBounds;
+    std::array<bin, BINS * 3> AllBins;
+    uint32_t Chunks = Parallel ? ChunkCount(Node.TriangleCount, PARALLEL_CHUNK_SIZE) : 1;
+    if(Chunks == 1)
+    {
+        GrowCentroidBounds(CentroidBounds, 0, Node.TriangleCount);
+        BinTriangles(CentroidBounds, AllBins.data(), 0, Node.TriangleCount);
+    }
+    else
+    {
+        //Each chunk works on its own bounds and bins, that are merged afterwards. Min/Max are exact, so this gives the same result as the serial path.
+        std::vector<aabb> ChunkBounds(Chunks);
+        ParallelChunks(Node.TriangleCount, Chunks, [&](uint32_t Chunk, uint32_t Begin, uint32_t End)
+        {
+            GrowCentroidBounds(ChunkBounds[Chunk], Begin, End);
+        });
+        for(uint32_t i=0; i<Chunks; i++) CentroidBounds.Grow(ChunkBounds[i]);
+
+        std::vector<std::array<bin, BINS * 3>> ChunkBins(Chunks);
+        ParallelChunks(Node.TriangleCount, Chunks, [&](uint32_t Chunk, uint32_t Begin, uint32_t End)
+        {
+            BinTriangles(CentroidBounds, ChunkBins[Chunk].data(), Begin, End);
+        });
+        for(uint32_t i=0; i<Chunks; i++)
+        {
+            for(int j=0; j<BINS*3; j++)
+            {
+                AllBins[j].TrianglesCount += ChunkBins[i][j].TrianglesCount;
+                AllBins[j].Bounds.Grow(ChunkBins[i][j].Bounds);
+            }
         }
+    }
+
+    float BestCost = 1e30f;
+    for(int CurrentAxis=0; CurrentAxis<3; CurrentAxis++)
+    {
+        float BoundsMin = CentroidBounds.Min[CurrentAxis];
+        float BoundsMax = CentroidBounds.Max[CurrentAxis];
+        if(BoundsMin == BoundsMax) continue;
+        
+        bin *Bins = &AllBins[CurrentAxis * BINS];
 
         float LeftArea[BINS-1], RightArea[BINS-1];
         int LeftCount[BINS-1], RightCount[BINS-1];
@@ -176,7 +342,7 @@ float bvh::FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition)
             RightArea[BINS-2-i] = RightBox.Area(); //Area to the left of this plane
         }
 
-        Scale = (BoundsMax - BoundsMin) / BINS;
+        float Scale = (BoundsMax - BoundsMin) / BINS;
         for(int i=0; i<BINS-1; i++)
         {
             float PlaneCost = LeftCount[i] * LeftArea[i] + RightCount[i] * RightArea[i];
@@ -192,15 +358,13 @@ float bvh::FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition)
 
 }
 
-void bvh::Subdivide(uint32_t NodeIndex)
+bool bvh::Partition(bvhNode &Node, uint32_t &LeftCount, bool Parallel)
 {
-    bvhNode &Node = BVHNodes[NodeIndex];
-
     int Axis=-1;
     float SplitPosition = 0;
-    float SplitCost = FindBestSplitPlane(Node, Axis, SplitPosition);
+    float SplitCost = FindBestSplitPlane(Node, Axis, SplitPosition, Parallel);
     float NoSplitCost = CalculateNodeCost(Node);
-    if(SplitCost >= NoSplitCost) return;
+    if(SplitCost >= NoSplitCost) return false;
 
     int i=Node.LeftChildOrFirst;
     int j = i + Node.TriangleCount -1;
@@ -216,15 +380,23 @@ void bvh::Subdivide(uint32_t NodeIndex)
         }
     }
 
-    uint32_t LeftCount = i - Node.LeftChildOrFirst;
-    if(LeftCount==0 || LeftCount == Node.TriangleCount) return;
+    LeftCount = i - Node.LeftChildOrFirst;
+    return LeftCount != 0 && LeftCount != Node.TriangleCount;
+}
+
+void bvh::Subdivide(uint32_t NodeIndex)
+{
+    bvhNode &Node = BVHNodes[NodeIndex];
+
+    uint32_t LeftCount=0;
+    if(!Partition(Node, LeftCount)) return;
 
     int LeftChildIndex = NodesUsed++;
     int RightChildIndex = NodesUsed++;
     
     BVHNodes[LeftChildIndex].LeftChildOrFirst = Node.LeftChildOrFirst;
     BVHNodes[LeftChildIndex].TriangleCount = LeftCount;
-    BVHNodes[RightChildIndex].LeftChildOrFirst = i;
+    BVHNodes[RightChildIndex].LeftChildOrFirst = Node.LeftChildOrFirst + LeftCount;
     BVHNodes[RightChildIndex].TriangleCount = Node.TriangleCount - LeftCount;
     Node.LeftChildOrFirst = LeftChildIndex;
     Node.TriangleCount=0;
@@ -236,6 +408,73 @@ void bvh::Subdivide(uint32_t NodeIndex)
     Subdivide(RightChildIndex);
 }
 
+void bvh::BuildSubtree(std::vector<bvhNode> &Nodes, uint32_t NodeIndex, uint32_t Depth)
+{
+    //Copy, as Nodes may be reallocated by the recursion
+    bvhNode Node = Nodes[NodeIndex];
+
+    uint32_t LeftCount=0;
+    if(!Partition(Node, LeftCount, Node.TriangleCount >= PARALLEL_BINNING_THRESHOLD)) return;
+
+    bvhNode Left = {};
+    Left.LeftChildOrFirst = Node.LeftChildOrFirst;
+    Left.TriangleCount = LeftCount;
+    UpdateNodeBounds(Left);
+
+    bvhNode Right = {};
+    Right.LeftChildOrFirst = Node.LeftChildOrFirst + LeftCount;
+    Right.TriangleCount = Node.TriangleCount - LeftCount;
+    UpdateNodeBounds(Right);
+
+    //Children are stored by pair, indices are local to this node list
+    uint32_t LeftChildIndex = (uint32_t)Nodes.size();
+    Nodes[NodeIndex].LeftChildOrFirst = LeftChildIndex;
+    Nodes[NodeIndex].TriangleCount = 0;
+    Nodes.push_back(Left);
+    Nodes.push_back(Right);
+
+    if(Depth < MaxParallelDepth() && std::min(Left.TriangleCount, Right.TriangleCount) >= PARALLEL_BUILD_THRESHOLD)
+    {
+        //The right subtree goes into its own list on another thread. Triangle ranges are disjoint so they can be partitionned concurrently.
+        std::vector<bvhNode> RightNodes(1, Right);
+        std::thread RightThread([this, &RightNodes, Depth]()
+        {
+            BuildSubtree(RightNodes, 0, Depth+1);
+        });
+        BuildSubtree(Nodes, LeftChildIndex, Depth+1);
+        RightThread.join();
+
+        //Append the right subtree, offsetting its child indices. RightNodes[0] replaces the right child.
+        uint32_t Offset = (uint32_t)Nodes.size() - 1;
+        for(size_t i=0; i<RightNodes.size(); i++)
+        {
+            if(!RightNodes[i].IsLeaf()) RightNodes[i].LeftChildOrFirst += Offset;
+        }
+        Nodes[LeftChildIndex+1] = RightNodes[0];
+        Nodes.insert(Nodes.end(), RightNodes.begin() + 1, RightNodes.end());
+    }
+    else
+    {
+        BuildSubtree(Nodes, LeftChildIndex, Depth+1);
+        BuildSubtree(Nodes, LeftChildIndex+1, Depth+1);
+    }
+}
+
+void bvh::EmitSubtree(std::vector<bvhNode> &Nodes, uint32_t LocalIndex, uint32_t NodeIndex)
+{
+    bvhNode &Node = Nodes[LocalIndex];
+    BVHNodes[NodeIndex] = Node;
+    if(Node.IsLeaf()) return;
+
+    //Same allocation order as Subdivide() : both children, then the left subtree, then the right subtree
+    uint32_t LeftChildIndex = NodesUsed++;
+    uint32_t RightChildIndex = NodesUsed++;
+    BVHNodes[NodeIndex].LeftChildOrFirst = LeftChildIndex;
+
+    EmitSubtree(Nodes, Node.LeftChildOrFirst, LeftChildIndex);
+    EmitSubtree(Nodes, Node.LeftChildOrFirst + 1, RightChildIndex);
+}
+
 
 float bvh::CalculateNodeCost(bvhNode &Node)
 {
@@ -245,13 +484,109 @@ float bvh::CalculateNodeCost(bvhNode &Node)
     return NodeCost;
 }
 
+//Sum of the node costs, relative to the root area : 1 for the traversal of an interior node, 1 per triangle in leaves.
+float bvh::CalculateSAHCost()
+{
+    glm::vec3 e = BVHNodes[RootNodeIndex].AABBMax - BVHNodes[RootNodeIndex].AABBMin;
+    float RootArea = e.x * e.y + e.x * e.z + e.y * e.z;
+    if(RootArea <= 0) return 0;
+
+    float Cost=0;
+    for(uint32_t i=0; i<NodesUsed; i++)
+    {
+        bvhNode &Node = BVHNodes[i];
+        e = Node.AABBMax - Node.AABBMin;
+        float Area = e.x * e.y + e.x * e.z + e.y * e.z;
+        Cost += Area * (Node.IsLeaf() ? (float)Node.TriangleCount : 1.0f);
+    }
+    return Cost / RootArea;
+}
+
 void bvh::Refit()
 {
+    //Children are always allocated after their parent, so a reverse walk visits them first.
+    for(int i=(int)NodesUsed-1; i>=0; i--)
+    {
+        bvhNode &Node = BVHNodes[i];
+        if(Node.IsLeaf())
+        {
+            UpdateNodeBounds(Node);
+            continue;
+        }
+        bvhNode &Left = BVHNodes[Node.LeftChildOrFirst];
+        bvhNode &Right = BVHNodes[Node.LeftChildOrFirst+1];
+        Node.AABBMin = glm::min(Left.AABBMin, Right.AABBMin);
+        Node.AABBMax = glm::max(Left.AABBMax, Right.AABBMax);
+    }
+}
+
+bool bvh::Update()
+{
+    Refit();
+    bool Rebuilt = CalculateSAHCost() > BuildSAHCost * RebuildThreshold;
+    if(Rebuilt)
+    {
+        Build();
+    }
+    
+    //The collapsed nodes copy the binary bounds
+    SetLayout(Layout);
+    return Rebuilt;
+}
+
+void bvh::SetLayout(bvhLayout NewLayout)
+{
+    Layout = NewLayout;
+    if(Layout == bvhLayout::BVH4) BVH4.Build(this);
+    else if(Layout == bvhLayout::BVH8) BVH8.Build(this);
+    else if(Layout == bvhLayout::Compressed) Compressed.Build(this);
+
+    //Copies the triangles in the order of TriangleIndices, which the build may have changed
+    SetTriangleKernel(TriangleKernel);
+}
+
+void bvh::SetTriangleKernel(triangleKernel NewTriangleKernel)
+{
+    TriangleKernel = NewTriangleKernel;
+    if(TriangleKernel == triangleKernel::Watertight4) LeafTriangles.Build(this);
+}
+
+void bvh::IntersectLeaf(ray &Ray, const watertightRay &WatertightRay, uint32_t First, uint32_t Count, rayPayload &RayPayload, uint32_t InstanceIndex)
+{
+    if(TriangleKernel == triangleKernel::Watertight4)
+    {
+        RayTriangle4IntersectionWatertight(WatertightRay, LeafTriangles, TriangleIndices.data(), First, Count, RayPayload, InstanceIndex);
+        return;
+    }
 
+    for(uint32_t i=0; i<Count; i++)
+    {
+        uint32_t TriangleIndex = TriangleIndices[First + i];
+        triangle &Triangle = Mesh->Triangles[TriangleIndex];
+        if(TriangleKernel == triangleKernel::Watertight) RayTriangleIntersectionWatertight(WatertightRay, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, InstanceIndex, TriangleIndex);
+        else RayTriangleInteresection(Ray, Triangle, RayPayload, InstanceIndex, TriangleIndex);
+    }
 }
 
 void bvh::Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex)
 {
+    if(Layout == bvhLayout::BVH4)
+    {
+        BVH4.Intersect(Ray, RayPayload, InstanceIndex);
+        return;
+    }
+    if(Layout == bvhLayout::BVH8)
+    {
+        BVH8.Intersect(Ray, RayPayload, InstanceIndex);
+        return;
+    }
+    if(Layout == bvhLayout::Compressed)
+    {
+        Compressed.Intersect(Ray, RayPayload, InstanceIndex);
+        return;
+    }
+
+    watertightRay WatertightRay(Ray);
     bvhNode *Node = &BVHNodes[RootNodeIndex];
     bvhNode *Stack[64];
     uint32_t StackPointer=0;
@@ -259,10 +594,7 @@ void bvh::Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex)
     {
         if(Node->IsLeaf())
         {
-            for(uint32_t i=0; i<Node->TriangleCount; i++)
-            {
-                RayTriangleInteresection(Ray, Mesh->Triangles[TriangleIndices[Node->LeftChildOrFirst + i]], RayPayload, InstanceIndex, TriangleIndices[Node->LeftChildOrFirst + i]);
-            }
+            IntersectLeaf(Ray, WatertightRay, Node->LeftChildOrFirst, Node->TriangleCount, RayPayload, InstanceIndex);
             if(StackPointer==0) break;
             else Node = Stack[--StackPointer];
             continue;
@@ -294,9 +626,112 @@ void bvh::Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex)
     }
 }
 
+bool bvh::OccludedLeaf(ray &Ray, const watertightRay &WatertightRay, uint32_t First, uint32_t Count, float MaxDistance)
+{
+    //The triangle tests report their hit in a payload, only its distance is looked at
+    rayPayload RayPayload {};
+    RayPayload.Distance = MaxDistance;
+    if(TriangleKernel == triangleKernel::Watertight4)
+    {
+        RayTriangle4IntersectionWatertight(WatertightRay, LeafTriangles, TriangleIndices.data(), First, Count, RayPayload, 0);
+        return RayPayload.Distance < MaxDistance;
+    }
+
+    for(uint32_t i=0; i<Count; i++)
+    {
+        uint32_t TriangleIndex = TriangleIndices[First + i];
+        triangle &Triangle = Mesh->Triangles[TriangleIndex];
+        if(TriangleKernel == triangleKernel::Watertight) RayTriangleIntersectionWatertight(WatertightRay, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, 0, TriangleIndex);
+        else RayTriangleInteresection(Ray, Triangle, RayPayload, 0, TriangleIndex);
+        if(RayPayload.Distance < MaxDistance) return true;
+    }
+    return false;
+}
+
+bool bvh::Occluded(ray Ray, float MaxDistance)
+{
+    if(Layout == bvhLayout::BVH4) return BVH4.Occluded(Ray, MaxDistance);
+    if(Layout == bvhLayout::BVH8) return BVH8.Occluded(Ray, MaxDistance);
+    if(Layout == bvhLayout::Compressed) return Compressed.Occluded(Ray, MaxDistance);
+
+    watertightRay WatertightRay(Ray);
+    bvhNode *Node = &BVHNodes[RootNodeIndex];
+    bvhNode *Stack[64];
+    uint32_t StackPointer=0;
+    while(true)
+    {
+        if(Node->IsLeaf())
+        {
+            if(OccludedLeaf(Ray, WatertightRay, Node->LeftChildOrFirst, Node->TriangleCount, MaxDistance)) return true;
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+            continue;
+        }
+
+        bvhNode *Child1 = &BVHNodes[Node->LeftChildOrFirst];
+        bvhNode *Child2 = &BVHNodes[Node->LeftChildOrFirst+1];
+        bool Hit1 = RayAABBIntersection(Ray, Child1->AABBMin, Child1->AABBMax, MaxDistance) != 1e30f;
+        bool Hit2 = RayAABBIntersection(Ray, Child2->AABBMin, Child2->AABBMax, MaxDistance) != 1e30f;
+        if(Hit1 && Hit2)
+        {
+            Node = Child1;
+            Stack[StackPointer++] = Child2;
+        }
+        else if(Hit1) Node = Child1;
+        else if(Hit2) Node = Child2;
+        else if(StackPointer==0) break;
+        else Node = Stack[--StackPointer];
+    }
+    return false;
+}
+
+void bvh::IntersectStats(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex, traversalStats &Stats)
+{
+    watertightRay WatertightRay(Ray);
+    bvhNode *Node = &BVHNodes[RootNodeIndex];
+    bvhNode *Stack[64];
+    uint32_t StackPointer=0;
+    while(true)
+    {
+        Stats.NodeVisits++;
+        if(Node->IsLeaf())
+        {
+            Stats.TriangleTests += Node->TriangleCount;
+            IntersectLeaf(Ray, WatertightRay, Node->LeftChildOrFirst, Node->TriangleCount, RayPayload, InstanceIndex);
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+            continue;
+        }
+
+        bvhNode *Child1 = &BVHNodes[Node->LeftChildOrFirst];
+        bvhNode *Child2 = &BVHNodes[Node->LeftChildOrFirst+1];
+        float Dist1 = RayAABBIntersection(Ray, Child1->AABBMin, Child1->AABBMax, RayPayload);
+        float Dist2 = RayAABBIntersection(Ray, Child2->AABBMin, Child2->AABBMax, RayPayload);
+        if(Dist1 > Dist2) {
+            std::swap(Dist1, Dist2);
+            std::swap(Child1, Child2);
+        }
+
+        if(Dist1 == 1e30f)
+        {
+            if(StackPointer==0) break;
+            else Node = Stack[--StackPointer];
+        }
+        else
+        {
+            Node = Child1;
+            if(Dist2 != 1e30f) Stack[StackPointer++] = Child2;
+        }
+    }
+}
+
 void bvh::UpdateNodeBounds(uint32_t NodeIndex)
 {
-    bvhNode &Node = BVHNodes[NodeIndex];
+    UpdateNodeBounds(BVHNodes[NodeIndex]);
+}
+
+void bvh::UpdateNodeBounds(bvhNode &Node)
+{
     Node.AABBMin = glm::vec3(1e30f);
     Node.AABBMax = glm::vec3(-1e30f);
     for(uint32_t First=Node.LeftChildOrFirst, i=0; i<Node.TriangleCount; i++)
@@ -342,6 +777,16 @@ void bvhInstance::Intersect(ray Ray, rayPayload &RayPayload)
     BVH->Intersect(Ray, RayPayload, Index);
 }
 
+bool bvhInstance::Occluded(ray Ray, float MaxDistance)
+{
+    Ray.Origin = InverseTransform * glm::vec4(Ray.Origin, 1);
+    Ray.Direction = InverseTransform * glm::vec4(Ray.Direction, 0);
+    Ray.InverseDirection = 1.0f / Ray.Direction;
+
+    bvh *BVH = Meshes->at(MeshIndex)->BVH;
+    return BVH->Occluded(Ray, MaxDistance);
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////////////
 
@@ -357,82 +802,199 @@ tlas::tlas(std::vector<bvhInstance>* BVHList)
     NodesUsed=2;
 }
 
-int tlas::FindBestMatch(std::vector<int>& List, int N, int A)
+void tlas::Build()
 {
-    float Smallest = 1e30f;
-    int BestB = -1;
-    for(int B=0; B< N; B++)
+    uint32_t InstanceCount = (uint32_t)BLAS->size();
+    Nodes.resize(std::max(InstanceCount * 2, 2u));
+    Parents.resize(Nodes.size());
+    InstanceLeaves.resize(InstanceCount);
+    InstanceIndices.resize(InstanceCount);
+    for(uint32_t i=0; i<InstanceCount; i++)
     {
-        if(B != A)
-        {
-            glm::vec3 BMax = glm::max(Nodes[List[A]].AABBMax, Nodes[List[B]].AABBMax);
-            glm::vec3 BMin = glm::min(Nodes[List[A]].AABBMin, Nodes[List[B]].AABBMin);
-            glm::vec3 Diff = BMax - BMin;
-            float Area = Diff.x * Diff.y + Diff.y * Diff.z + Diff.x * Diff.z;
-            if(Area < Smallest) 
-            {
-                Smallest = Area;
-                BestB = B;
-            }
-        }
+        InstanceIndices[i] = i;
     }
 
-    return BestB;
+    NodesUsed=1;
+    Parents[0] = 0;
+    if(InstanceCount > 0) Subdivide(0, 0, InstanceCount);
+    Quantize();
 }
 
-void tlas::Build()
+void tlas::Subdivide(uint32_t NodeIndex, uint32_t First, uint32_t Count)
 {
-    std::vector<int> NodeIndex(BLAS->size());
-    int NodeIndices = (int)BLAS->size();
-    NodesUsed=1;
-    for(uint32_t i=0; i<BLAS->size(); i++)
+    tlasNode &Node = Nodes[NodeIndex];
+    Node.AABBMin = glm::vec3(1e30f);
+    Node.AABBMax = glm::vec3(-1e30f);
+    glm::vec3 CentroidMin(1e30f), CentroidMax(-1e30f);
+    for(uint32_t i=First; i<First+Count; i++)
     {
-        NodeIndex[i] = NodesUsed;
-        Nodes[NodesUsed].AABBMin = (*BLAS)[i].Bounds.Min;
-        Nodes[NodesUsed].AABBMax = (*BLAS)[i].Bounds.Max;
-        Nodes[NodesUsed].BLAS = i;
-        Nodes[NodesUsed].LeftRight = 0; //Makes it a leaf.
-        NodesUsed++;
+        aabb &Bounds = (*BLAS)[InstanceIndices[i]].Bounds;
+        glm::vec3 Centroid = (Bounds.Min + Bounds.Max) * 0.5f;
+        Node.AABBMin = glm::min(Node.AABBMin, Bounds.Min);
+        Node.AABBMax = glm::max(Node.AABBMax, Bounds.Max);
+        CentroidMin = glm::min(CentroidMin, Centroid);
+        CentroidMax = glm::max(CentroidMax, Centroid);
     }
 
+    if(Count==1)
+    {
+        Node.BLAS = InstanceIndices[First];
+        Node.LeftChild = 0; //Makes it a leaf.
+        InstanceLeaves[Node.BLAS] = NodeIndex;
+        return;
+    }
 
-    int A = 0;
-    int B= FindBestMatch(NodeIndex, NodeIndices, A); //Best match for A
-    while(NodeIndices >1)
+    //Binned SAH on the instance centroids
+    int BestAxis=-1;
+    float BestPosition=0;
+    float BestCost=1e30f;
+    for(int Axis=0; Axis<3; Axis++)
     {
-        int C = FindBestMatch(NodeIndex, NodeIndices, B); //Best match for B
-        if(A == C) //There is no better match --> Create a parent for them
+        float Extent = CentroidMax[Axis] - CentroidMin[Axis];
+        if(Extent <= 0) continue;
+
+        bin Bins[TLAS_BINS];
+        float Scale = TLAS_BINS / Extent;
+        for(uint32_t i=First; i<First+Count; i++)
         {
-            int NodeIndexA = NodeIndex[A];
-            int NodeIndexB = NodeIndex[B];
-            tlasNode &NodeA = Nodes[NodeIndexA];
-            tlasNode &NodeB = Nodes[NodeIndexB];
-            
-            tlasNode &NewNode = Nodes[NodesUsed];
-            NewNode.LeftRight = NodeIndexA + (NodeIndexB << 16);
-            NewNode.AABBMin = glm::min(NodeA.AABBMin, NodeB.AABBMin);
-            NewNode.AABBMax = glm::max(NodeA.AABBMax, NodeB.AABBMax);
-            
-            NodeIndex[A] = NodesUsed++;
-            NodeIndex[B] = NodeIndex[NodeIndices-1];
-            B = FindBestMatch(NodeIndex, --NodeIndices, A);
+            aabb &Bounds = (*BLAS)[InstanceIndices[i]].Bounds;
+            float Centroid = (Bounds.Min[Axis] + Bounds.Max[Axis]) * 0.5f;
+            int BinIndex = std::min(TLAS_BINS - 1, (int)((Centroid - CentroidMin[Axis]) * Scale));
+            Bins[BinIndex].TrianglesCount++;
+            Bins[BinIndex].Bounds.Grow(Bounds);
         }
-        else
+
+        float LeftArea[TLAS_BINS-1], RightArea[TLAS_BINS-1];
+        uint32_t LeftCount[TLAS_BINS-1], RightCount[TLAS_BINS-1];
+        aabb LeftBox, RightBox;
+        uint32_t LeftSum=0, RightSum=0;
+        for(int i=0; i<TLAS_BINS-1; i++)
         {
-            A = B;
-            B = C;
+            LeftSum += Bins[i].TrianglesCount;
+            LeftCount[i] = LeftSum;
+            LeftBox.Grow(Bins[i].Bounds);
+            LeftArea[i] = LeftBox.Area();
+            RightSum += Bins[TLAS_BINS-1-i].TrianglesCount;
+            RightCount[TLAS_BINS-2-i] = RightSum;
+            RightBox.Grow(Bins[TLAS_BINS-1-i].Bounds);
+            RightArea[TLAS_BINS-2-i] = RightBox.Area();
         }
+
+        for(int i=0; i<TLAS_BINS-1; i++)
+        {
+            if(LeftCount[i]==0 || RightCount[i]==0) continue;
+            float PlaneCost = LeftCount[i] * LeftArea[i] + RightCount[i] * RightArea[i];
+            if(PlaneCost < BestCost)
+            {
+                BestAxis = Axis;
+                BestPosition = CentroidMin[Axis] + (i+1) / Scale;
+                BestCost = PlaneCost;
+            }
+        }
+    }
+
+    uint32_t LeftCount=0;
+    if(BestAxis >= 0)
+    {
+        uint32_t *Begin = InstanceIndices.data() + First;
+        LeftCount = (uint32_t)(std::partition(Begin, Begin + Count, [this, BestAxis, BestPosition](uint32_t Instance)
+        {
+            aabb &Bounds = (*BLAS)[Instance].Bounds;
+            return (Bounds.Min[BestAxis] + Bounds.Max[BestAxis]) * 0.5f < BestPosition;
+        }) - Begin);
+    }
+    if(LeftCount==0 || LeftCount==Count)
+    {
+        //All the centroids are in the same spot
+        LeftCount = Count / 2;
     }
 
-    Nodes[0] = Nodes[NodeIndex[A]];
+    uint32_t LeftIndex = NodesUsed++;
+    uint32_t RightIndex = NodesUsed++;
+    Node.LeftChild = LeftIndex;
+    Parents[LeftIndex] = NodeIndex;
+    Parents[RightIndex] = NodeIndex;
 
+    Subdivide(LeftIndex, First, LeftCount);
+    Subdivide(RightIndex, First + LeftCount, Count - LeftCount);
+}
 
+void tlas::Refit(uint32_t InstanceIndex)
+{
+    uint32_t NodeIndex = InstanceLeaves[InstanceIndex];
+    Nodes[NodeIndex].AABBMin = (*BLAS)[InstanceIndex].Bounds.Min;
+    Nodes[NodeIndex].AABBMax = (*BLAS)[InstanceIndex].Bounds.Max;
+    uint32_t LeafIndex = NodeIndex;
+    while(NodeIndex != 0)
+    {
+        NodeIndex = Parents[NodeIndex];
+        tlasNode &Node = Nodes[NodeIndex];
+        tlasNode &Left = Nodes[Node.LeftChild];
+        tlasNode &Right = Nodes[Node.LeftChild + 1];
+        Node.AABBMin = glm::min(Left.AABBMin, Right.AABBMin);
+        Node.AABBMax = glm::max(Left.AABBMax, Right.AABBMax);
+    }
+
+    //The grid only needs to change when the root grew out of it
+    glm::vec3 GridMax = QuantizationOrigin + QuantizationScale * 65535.0f;
+    if(glm::any(glm::lessThan(Nodes[0].AABBMin, QuantizationOrigin)) || glm::any(glm::greaterThan(Nodes[0].AABBMax, GridMax)))
+    {
+        Quantize();
+        return;
+    }
+    NodeIndex = LeafIndex;
+    QuantizeNode(NodeIndex);
+    while(NodeIndex != 0)
+    {
+        NodeIndex = Parents[NodeIndex];
+        QuantizeNode(NodeIndex);
+    }
+}
 
+void tlas::Quantize()
+{
+    QuantizedNodes.resize(NodesUsed);
+    if(NodesUsed==0) return;
+
+    //Pad the grid so that instances moving around the edges don't requantize the whole tree on each refit
+    glm::vec3 Extent = glm::max(Nodes[0].AABBMax - Nodes[0].AABBMin, glm::vec3(1e-6f));
+    QuantizationOrigin = Nodes[0].AABBMin - Extent * 0.05f;
+    QuantizationScale = Extent * 1.1f / 65535.0f;
+    for(uint32_t i=0; i<NodesUsed; i++)
+    {
+        QuantizeNode(i);
+    }
+}
 
+void tlas::QuantizeNode(uint32_t NodeIndex)
+{
+    tlasNode &Node = Nodes[NodeIndex];
+    tlasNodeQuantized &QuantizedNode = QuantizedNodes[NodeIndex];
+    for(int Axis=0; Axis<3; Axis++)
+    {
+        float Origin = QuantizationOrigin[Axis];
+        float Scale = QuantizationScale[Axis];
+        int Min = (int)std::floor((Node.AABBMin[Axis] - Origin) / Scale);
+        int Max = (int)std::ceil((Node.AABBMax[Axis] - Origin) / Scale);
+        Min = std::max(0, std::min(65535, Min));
+        Max = std::max(0, std::min(65535, Max));
+        //Step outwards if the decoded value lost the bound to rounding
+        while(Min > 0 && Origin + Min * Scale > Node.AABBMin[Axis]) Min--;
+        while(Max < 65535 && Origin + Max * Scale < Node.AABBMax[Axis]) Max++;
+        QuantizedNode.AABBMin[Axis] = (uint16_t)Min;
+        QuantizedNode.AABBMax[Axis] = (uint16_t)Max;
+    }
+    QuantizedNode.ChildOrBLAS = Node.IsLeaf() ? (Node.BLAS | TLAS_LEAF_BIT) : Node.LeftChild;
 }
 
 void tlas::Intersect(ray Ray, rayPayload &RayPayload)
 {
+    if(UseQuantizedNodes)
+    {
+        IntersectQuantized(Ray, RayPayload);
+        return;
+    }
+
     Ray.InverseDirection = 1.0f / Ray.Direction;
     tlasNode *Node = &Nodes[0];
     tlasNode *Stack[64];
@@ -449,8 +1011,8 @@ void tlas::Intersect(ray Ray, rayPayload &RayPayload)
         }
 
         //Check if hit any of the children
-        tlasNode *Child1 = &Nodes[Node->LeftRight & 0xffff];
-        tlasNode *Child2 = &Nodes[Node->LeftRight >> 16];
+        tlasNode *Child1 = &Nodes[Node->LeftChild];
+        tlasNode *Child2 = &Nodes[Node->LeftChild + 1];
         float Dist1 = RayAABBIntersection(Ray, Child1->AABBMin, Child1->AABBMax, RayPayload);
         float Dist2 = RayAABBIntersection(Ray, Child2->AABBMin, Child2->AABBMax, RayPayload);
         if(Dist1 > Dist2) { //Swap if dist 2 is closer
@@ -472,10 +1034,130 @@ void tlas::Intersect(ray Ray, rayPayload &RayPayload)
     }
 }
 
+void tlas::IntersectQuantized(ray Ray, rayPayload &RayPayload)
+{
+    Ray.InverseDirection = 1.0f / Ray.Direction;
+    tlasNodeQuantized *Node = &QuantizedNodes[0];
+    tlasNodeQuantized *Stack[64];
+    uint32_t StackPtr=0;
+    while(1)
+    {
+        if(Node->IsLeaf())
+        {
+            (*BLAS)[Node->ChildOrBLAS & ~TLAS_LEAF_BIT].Intersect(Ray, RayPayload);
+            if(StackPtr == 0) break;
+            else Node = Stack[--StackPtr];
+            continue;
+        }
+
+        //Both children share a 32 byte pair, decode their bounds back to world space
+        tlasNodeQuantized *Child1 = &QuantizedNodes[Node->ChildOrBLAS];
+        tlasNodeQuantized *Child2 = Child1 + 1;
+        glm::vec3 Min1(Child1->AABBMin[0], Child1->AABBMin[1], Child1->AABBMin[2]);
+        glm::vec3 Max1(Child1->AABBMax[0], Child1->AABBMax[1], Child1->AABBMax[2]);
+        glm::vec3 Min2(Child2->AABBMin[0], Child2->AABBMin[1], Child2->AABBMin[2]);
+        glm::vec3 Max2(Child2->AABBMax[0], Child2->AABBMax[1], Child2->AABBMax[2]);
+        float Dist1 = RayAABBIntersection(Ray, QuantizationOrigin + Min1 * QuantizationScale, QuantizationOrigin + Max1 * QuantizationScale, RayPayload);
+        float Dist2 = RayAABBIntersection(Ray, QuantizationOrigin + Min2 * QuantizationScale, QuantizationOrigin + Max2 * QuantizationScale, RayPayload);
+        if(Dist1 > Dist2) {
+            std::swap(Dist1, Dist2);
+            std::swap(Child1, Child2);
+        }
+
+        if(Dist1 == 1e30f)
+        {
+            if(StackPtr == 0) break;
+            else Node = Stack[--StackPtr];
+        }
+        else
+        {
+            Node = Child1;
+            if(Dist2 != 1e30f) Stack[StackPtr++] = Child2;
+        }
+    }
+}
+
+bool tlas::Occluded(ray Ray, float MaxDistance)
+{
+    if(UseQuantizedNodes) return OccludedQuantized(Ray, MaxDistance);
+
+    Ray.InverseDirection = 1.0f / Ray.Direction;
+    tlasNode *Node = &Nodes[0];
+    tlasNode *Stack[64];
+    uint32_t StackPtr=0;
+    while(1)
+    {
+        if(Node->IsLeaf())
+        {
+            if((*BLAS)[Node->BLAS].Occluded(Ray, MaxDistance)) return true;
+            if(StackPtr == 0) break;
+            else Node = Stack[--StackPtr];
+            continue;
+        }
+
+        tlasNode *Child1 = &Nodes[Node->LeftChild];
+        tlasNode *Child2 = &Nodes[Node->LeftChild + 1];
+        bool Hit1 = RayAABBIntersection(Ray, Child1->AABBMin, Child1->AABBMax, MaxDistance) != 1e30f;
+        bool Hit2 = RayAABBIntersection(Ray, Child2->AABBMin, Child2->AABBMax, MaxDistance) != 1e30f;
+        if(Hit1 && Hit2)
+        {
+            Node = Child1;
+            Stack[StackPtr++] = Child2;
+        }
+        else if(Hit1) Node = Child1;
+        else if(Hit2) Node = Child2;
+        else if(StackPtr == 0) break;
+        else Node = Stack[--StackPtr];
+    }
+    return false;
+}
+
+bool tlas::OccludedQuantized(ray Ray, float MaxDistance)
+{
+    Ray.InverseDirection = 1.0f / Ray.Direction;
+    tlasNodeQuantized *Node = &QuantizedNodes[0];
+    tlasNodeQuantized *Stack[64];
+    uint32_t StackPtr=0;
+    while(1)
+    {
+        if(Node->IsLeaf())
+        {
+            if((*BLAS)[Node->ChildOrBLAS & ~TLAS_LEAF_BIT].Occluded(Ray, MaxDistance)) return true;
+            if(StackPtr == 0) break;
+            else Node = Stack[--StackPtr];
+            continue;
+        }
+
+        tlasNodeQuantized *Child1 = &QuantizedNodes[Node->ChildOrBLAS];
+        tlasNodeQuantized *Child2 = Child1 + 1;
+        glm::vec3 Min1(Child1->AABBMin[0], Child1->AABBMin[1], Child1->AABBMin[2]);
+        glm::vec3 Max1(Child1->AABBMax[0], Child1->AABBMax[1], Child1->AABBMax[2]);
+        glm::vec3 Min2(Child2->AABBMin[0], Child2->AABBMin[1], Child2->AABBMin[2]);
+        glm::vec3 Max2(Child2->AABBMax[0], Child2->AABBMax[1], Child2->AABBMax[2]);
+        bool Hit1 = RayAABBIntersection(Ray, QuantizationOrigin + Min1 * QuantizationScale, QuantizationOrigin + Max1 * QuantizationScale, MaxDistance) != 1e30f;
+        bool Hit2 = RayAABBIntersection(Ray, QuantizationOrigin + Min2 * QuantizationScale, QuantizationOrigin + Max2 * QuantizationScale, MaxDistance) != 1e30f;
+        if(Hit1 && Hit2)
+        {
+            Node = Child1;
+            Stack[StackPtr++] = Child2;
+        }
+        else if(Hit1) Node = Child1;
+        else if(Hit2) Node = Child2;
+        else if(StackPtr == 0) break;
+        else Node = Stack[--StackPtr];
+    }
+    return false;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////
 
 
 float RayAABBIntersection(ray Ray, glm::vec3 AABBMin,glm::vec3 AABBMax, rayPayload &RayPayload)
+{
+    return RayAABBIntersection(Ray, AABBMin, AABBMax, RayPayload.Distance);
+}
+
+float RayAABBIntersection(ray Ray, glm::vec3 AABBMin,glm::vec3 AABBMax, float MaxDistance)
 {
     float tx1 = (AABBMin.x - Ray.Origin.x) * Ray.InverseDirection.x, tx2 = (AABBMax.x - Ray.Origin.x) * Ray.InverseDirection.x;
     float tmin = std::min( tx1, tx2 ), tmax = std::max( tx1, tx2 );
@@ -483,21 +1165,27 @@ float RayAABBIntersection(ray Ray, glm::vec3 AABBMin,glm::vec3 AABBMax, rayPaylo
     tmin = std::max( tmin, std::min( ty1, ty2 ) ), tmax = std::min( tmax, std::max( ty1, ty2 ) );
     float tz1 = (AABBMin.z - Ray.Origin.z) * Ray.InverseDirection.z, tz2 = (AABBMax.z - Ray.Origin.z) * Ray.InverseDirection.z;
     tmin = std::max( tmin, std::min( tz1, tz2 ) ), tmax = std::min( tmax, std::max( tz1, tz2 ) );
-    if(tmax >= tmin && tmin < RayPayload.Distance && tmax > 0) return tmin;
+    tmax *= RAY_AABB_FAR_SCALE;
+    if(tmax >= tmin && tmin < MaxDistance && tmax > 0) return tmin;
     else return 1e30f;    
 }
 
 void RayTriangleInteresection(ray Ray, triangle &Triangle, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex)
 {
-    glm::vec3 Edge1 = Triangle.v1 - Triangle.v0;
-    glm::vec3 Edge2 = Triangle.v2 - Triangle.v0;
+    RayTriangleInteresection(Ray, Triangle.v0, Triangle.v1, Triangle.v2, RayPayload, InstanceIndex, PrimitiveIndex);
+}
+
+void RayTriangleInteresection(ray &Ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex)
+{
+    glm::vec3 Edge1 = v1 - v0;
+    glm::vec3 Edge2 = v2 - v0;
 
     glm::vec3 h = glm::cross(Ray.Direction, Edge2);
     float a = glm::dot(Edge1, h);
     if(a > -0.0001f && a < 0.0001f) return; //Ray is parallel to the triangle
     
     float f = 1 / a;
-    glm::vec3 s = Ray.Origin - Triangle.v0;
+    glm::vec3 s = Ray.Origin - v0;
     float u = f * glm::dot(s, h);
     if(u < 0 || u > 1) return;
 
@@ -506,7 +1194,7 @@ void RayTriangleInteresection(ray Ray, triangle &Triangle, rayPayload &RayPayloa
     if(v < 0 || u + v > 1) return;
     
     float t = f * glm::dot(Edge2, q);
-    if(t > 0.0001f && t < RayPayload.Distance) {
+    if(t > RAY_MIN_DISTANCE && t < RayPayload.Distance) {
         
 
 
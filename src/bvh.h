@@ -5,6 +5,9 @@
 
 #include <vector>
 #include "Scene.h"
+#include "WideBVH.h"
+#include "CompressedBVH.h"
+#include "TriangleIntersection.h"
 
 struct ray
 {
@@ -46,7 +49,7 @@ struct bvhNode
     uint32_t LeftChildOrFirst;
     uint32_t TriangleCount;
     glm::uvec2 padding2;
-    bool IsLeaf();
+    bool IsLeaf() const;
 };
 struct aabb
 {
@@ -58,6 +61,8 @@ struct aabb
     void Grow(glm::vec3 Position);
     void Grow(aabb &AABB);
 };
+//Bins of the SAH object splits
+#define BINS 8
 struct bin
 {
     aabb Bounds;
@@ -73,25 +78,82 @@ struct rayPayload
     uint32_t PrimitiveIndex;
     uint32_t RandomState;
     uint8_t Depth;
+    //Ray cone of the path (Akenine-Moller 2019) : width at the ray origin and spread angle, for the mip level of the textures it hits
+    float ConeWidth;
+    float ConeSpread;
     // uint32_t InstPrim;
 };
 
 
 struct mesh;
+struct rayPacket;
+
+enum class bvhLayout
+{
+    Binary=0,
+    BVH4=1,
+    BVH8=2,
+    //Binary tree with 8 bit child bounds and compact triangles (see CompressedBVH.h)
+    Compressed=3
+};
+
+enum class bvhBuildMode
+{
+    //Object splits on the triangle centroids
+    Binned=0,
+    //SBVH : object and spatial splits, triangles may be referenced by several leaves (see SpatialBVH.cpp)
+    Spatial=1
+};
+
+//Counters filled by bvh::IntersectStats()
+struct traversalStats
+{
+    uint64_t NodeVisits=0;
+    uint64_t TriangleTests=0;
+};
 
 struct bvh
 {
-    bvh(mesh *Mesh);
+    //Without UseCache the bvh is always built, and not saved to the cache
+    bvh(mesh *Mesh, bool UseCache=true);
+    //Builds with BuildMode
     void Build();
+    void BuildBinned();
+    void BuildSpatial();
+    //Loads the bvh from the disk cache (see BVHCache.h), or builds it and saves it
+    void LoadOrBuild();
     void Refit();
+    //Refits the bvh after the mesh triangles changed, and rebuilds it if the SAH cost degraded too much. Returns true if rebuilt.
+    bool Update();
+    //Builds the collapsed nodes if needed, Intersect() then traverses that layout
+    void SetLayout(bvhLayout NewLayout);
     void Intersect(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex);
+    //Tests the Count triangles of TriangleIndices starting at First, with TriangleKernel
+    void IntersectLeaf(ray &Ray, const watertightRay &WatertightRay, uint32_t First, uint32_t Count, rayPayload &RayPayload, uint32_t InstanceIndex);
+    //Any hit queries : true as soon as a triangle is hit closer than MaxDistance, in the current layout
+    bool Occluded(ray Ray, float MaxDistance);
+    bool OccludedLeaf(ray &Ray, const watertightRay &WatertightRay, uint32_t First, uint32_t Count, float MaxDistance);
+    //Builds the SoA leaf triangles if needed
+    void SetTriangleKernel(triangleKernel NewTriangleKernel);
+    //Traverses the binary nodes with the rays of Mask (see RayPacket.cpp)
+    void IntersectPacket(rayPacket &Packet, uint32_t Mask, uint32_t InstanceIndex);
+    //Same as the binary traversal of Intersect(), counting the nodes visited and the triangles tested
+    void IntersectStats(ray Ray, rayPayload &RayPayload, uint32_t InstanceIndex, traversalStats &Stats);
 
     void Subdivide(uint32_t NodeIndex);
     void UpdateNodeBounds(uint32_t NodeIndex);
-    float FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition);
+    void UpdateNodeBounds(bvhNode &Node);
+    float FindBestSplitPlane(bvhNode &Node, int &Axis, float &SplitPosition, bool Parallel=false);
+    bool Partition(bvhNode &Node, uint32_t &LeftCount, bool Parallel=false);
+
+    //Parallel build : subtrees are built on separate threads into local node lists, 
+    //and then emitted into BVHNodes in the same order as the serial Subdivide() would.
+    void BuildSubtree(std::vector<bvhNode> &Nodes, uint32_t NodeIndex, uint32_t Depth);
+    void EmitSubtree(std::vector<bvhNode> &Nodes, uint32_t LocalIndex, uint32_t NodeIndex);
 
     float EvaluateSAH(bvhNode &Node, int Axis, float Position);
     float CalculateNodeCost(bvhNode &Node);
+    float CalculateSAHCost();
 
     mesh *Mesh;
     
@@ -100,26 +162,71 @@ struct bvh
     std::vector<bvhNode> BVHNodes;
     uint32_t NodesUsed=1;
     uint32_t RootNodeIndex=0;
+
+    //SAH cost of the tree when it was last built. Update() rebuilds when the refitted cost exceeds it by that ratio.
+    float BuildSAHCost=0;
+    float RebuildThreshold=1.5f;
+
+    //Refit() grows the leaves to the whole triangles, so Update() on a spatial bvh usually ends up rebuilding it
+    bvhBuildMode BuildMode = bvhBuildMode::Binned;
+    //Spatial mode : extra references allowed, as a ratio of the triangle count
+    float SpatialSplitBudget = 0.3f;
+    //Spatial mode : spatial splits are only tried when the object split children overlap by more than that ratio of the root area
+    float SpatialSplitAlpha = 1e-5f;
+
+    bvhLayout Layout = bvhLayout::Binary;
+    wideBvh<4> BVH4;
+    wideBvh<8> BVH8;
+    compressedBvh Compressed;
+
+    triangleKernel TriangleKernel = triangleKernel::MollerTrumbore;
+    //Only built for triangleKernel::Watertight4
+    leafTriangles LeafTriangles;
 };
 
 struct mesh
 {
-    mesh(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices, uint32_t MaterialIndex);
+    mesh(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices, uint32_t MaterialIndex, bool UseCache=true);
+    void SetTriangles(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices);
+    //Vertices have moved, but the topology is the same. Returns true if the bvh was rebuilt rather than refitted.
+    //Also fills Triangles again after ReleaseTriangles().
+    bool UpdateVertices(std::vector<uint32_t> &Indices, std::vector<vertex> &Vertices);
+    //Frees Triangles when the bvh has the compact copy of bvhLayout::Compressed, for meshes only traced in that layout.
+    //The builds and refits need them, so they stay until UpdateVertices().
+    void ReleaseTriangles();
+    //Also valid after ReleaseTriangles()
+    uint32_t GetTriangleCount() const {return (uint32_t)TrianglesExtraData.size();}
+    void GetTriangle(uint32_t Index, glm::vec3 &v0, glm::vec3 &v1, glm::vec3 &v2) const;
     bvh *BVH;
     std::vector<triangle> Triangles;
     std::vector<triangleExtraData> TrianglesExtraData;
     uint32_t MaterialIndex;
+    //Hash of the indices the triangles were made from, for the bvh cache key
+    uint64_t IndicesHash=0;
 };
 
 
 
+//Children are allocated in pairs, the right child is LeftChild+1. 0 for leaves, as the root can't be a child.
 struct tlasNode
 {
     glm::vec3 AABBMin;
-    uint32_t LeftRight;
+    uint32_t LeftChild;
     glm::vec3 AABBMax;
     uint32_t BLAS;
-    bool IsLeaf() {return LeftRight==0;}
+    bool IsLeaf() {return LeftChild==0;}
+};
+
+//Half size tlasNode for the CPU traversal.
+//Bounds are 16 bit steps from the root min, rounded outwards so they always contain the full precision bounds.
+#define TLAS_LEAF_BIT 0x80000000u
+struct tlasNodeQuantized
+{
+    uint16_t AABBMin[3];
+    uint16_t AABBMax[3];
+    //Interior : left child index. Leaf : instance index with TLAS_LEAF_BIT set.
+    uint32_t ChildOrBLAS;
+    bool IsLeaf() {return (ChildOrBLAS & TLAS_LEAF_BIT) != 0;}
 };
 
 struct bvhInstance
@@ -130,6 +237,8 @@ struct bvhInstance
     }
     void SetTransform(glm::mat4 &Transform);
     void Intersect(ray Ray, rayPayload &RayPayload);
+    void IntersectPacket(rayPacket &Packet, uint32_t Mask);
+    bool Occluded(ray Ray, float MaxDistance);
 
     //Store the mesh index in the scene instead, and a pointer to the mesh array to access the bvh.
     glm::mat4 InverseTransform;
@@ -147,18 +256,43 @@ struct tlas
 {
     tlas(std::vector<bvhInstance>* Instances);
     tlas();
+    //Binned SAH build over the instance bounds, one instance per leaf
     void Build();
+    //Updates the bounds of the leaf of that instance and of its ancestors only
+    void Refit(uint32_t InstanceIndex);
     void Intersect(ray Ray, rayPayload &RayPayload);
+    void IntersectQuantized(ray Ray, rayPayload &RayPayload);
+    void IntersectPacket(rayPacket &Packet);
+    //Any hit query for shadow and visibility rays : true if something is hit closer than MaxDistance.
+    //Stops at the first hit, visits the children in any order, and has no payload to fill.
+    bool Occluded(ray Ray, float MaxDistance);
+    bool OccludedQuantized(ray Ray, float MaxDistance);
 
-    int FindBestMatch(std::vector<int>& List, int N, int A);
+    void Subdivide(uint32_t NodeIndex, uint32_t First, uint32_t Count);
+    //Rebuilds QuantizedNodes on a grid fitted to the root bounds
+    void Quantize();
+    void QuantizeNode(uint32_t NodeIndex);
 
     //Instances
     std::vector<bvhInstance>* BLAS;
     
     std::vector<tlasNode> Nodes;
 
+    //CPU side only : instance indices sorted by the build, parent of each node, and leaf of each instance
+    std::vector<uint32_t> InstanceIndices;
+    std::vector<uint32_t> Parents;
+    std::vector<uint32_t> InstanceLeaves;
+
+    //CPU side only : same tree as Nodes, used by Intersect() when UseQuantizedNodes is set
+    std::vector<tlasNodeQuantized> QuantizedNodes;
+    glm::vec3 QuantizationOrigin;
+    glm::vec3 QuantizationScale;
+    bool UseQuantizedNodes=false;
+
     uint32_t NodesUsed=0;
 };
 
 void RayTriangleInteresection(ray Ray, triangle &Triangle, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex);
+void RayTriangleInteresection(ray &Ray, const glm::vec3 &v0, const glm::vec3 &v1, const glm::vec3 &v2, rayPayload &RayPayload, uint32_t InstanceIndex, uint32_t PrimitiveIndex);
 float RayAABBIntersection(ray Ray, glm::vec3 AABBMin,glm::vec3 AABBMax, rayPayload &RayPayload);
+float RayAABBIntersection(ray Ray, glm::vec3 AABBMin,glm::vec3 AABBMax, float MaxDistance);